@@ -53,7 +53,7 @@ class RESTTest (BitcoinTestFramework):
         self.num_nodes = 3
 
     def setup_network(self, split=False):
-        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir)
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, [[], [], ["-addrindex"]])
         connect_nodes_bi(self.nodes,0,1)
         connect_nodes_bi(self.nodes,1,2)
         connect_nodes_bi(self.nodes,0,2)
@@ -324,6 +324,40 @@ class RESTTest (BitcoinTestFramework):
         for tx in txs:
             assert_equal(tx in json_obj['tx'], True)
 
+        # check the address index binary format on node 2: the chain height
+        # and tip it reports must match the block that holds the records
+        addr = self.nodes[2].getnewaddress()
+        self.nodes[0].sendtoaddress(addr, 11)
+        self.sync_all()
+        self.nodes[1].generate(1)
+        self.sync_all()
+
+        url2 = urllib.parse.urlparse(self.nodes[2].url)
+        response = http_get_call(url2.hostname, url2.port, '/rest/address/'+addr+'/balance'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 200)
+        bin_response = response.read()
+        output = BytesIO()
+        output.write(bin_response)
+        output.seek(0)
+        chainHeight = unpack("i", output.read(4))[0]
+        hashFromBinResponse = hex(deser_uint256(output))[2:].zfill(64)
+        balance, received = unpack("<qq", output.read(16))
+        assert_equal(chainHeight, self.nodes[2].getblockcount())
+        assert_equal(hashFromBinResponse, self.nodes[2].getbestblockhash())
+        assert_equal(balance, 11 * 100000000)
+        assert_equal(received, 11 * 100000000)
+
+        # the hex format carries the same bytes
+        hex_string = http_get_call(url2.hostname, url2.port, '/rest/address/'+addr+'/balance'+self.FORMAT_SEPARATOR+'hex')
+        assert_equal(hex_string.strip(), bytes_to_hex_str(bin_response))
+
+        txids_response = http_get_call(url2.hostname, url2.port, '/rest/address/'+addr+'/txids'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(txids_response.status, 200)
+        output = BytesIO(txids_response.read())
+        assert_equal(unpack("i", output.read(4))[0], chainHeight)
+        assert_equal(hex(deser_uint256(output))[2:].zfill(64), hashFromBinResponse)
+        assert_equal(output.read(1), b"\x01") # one txid
+
         #test rest bestblock
         bb_hash = self.nodes[0].getbestblockhash()
 
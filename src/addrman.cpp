@@ -69,9 +69,59 @@ double CAddrInfo::GetChance(int64_t nNow) const
     // deprioritize 66% after each failed attempt, but at most 1/28th to avoid the search taking forever or overly penalizing outages.
     fChance *= pow(0.66, std::min(nAttempts, 8));
 
+    // favor peers that served us well before
+    fChance *= perf.GetChanceFactor(nNow);
+
     return fChance;
 }
 
+void CAddrPerf::Update(const CAddrPerf& sample, int64_t nNow)
+{
+    if (sample.nPingUsec > 0)
+        nPingUsec = nPingUsec ? (nPingUsec * 3 + sample.nPingUsec) / 4 : sample.nPingUsec;
+    if (sample.nBlockBytesPerSec > 0)
+        nBlockBytesPerSec = nBlockBytesPerSec ? (nBlockBytesPerSec * 3 + sample.nBlockBytesPerSec) / 4 : sample.nBlockBytesPerSec;
+    if (sample.nStalls > 0)
+        nStalls = std::min(nStalls + sample.nStalls, 1000);
+    else if (sample.nBlockBytesPerSec > 0 && nStalls > 0)
+        nStalls--;
+    if (sample.nTipLag >= 0)
+        nTipLag = sample.nTipLag;
+    nLastUpdate = nNow;
+}
+
+double CAddrPerf::GetChanceFactor(int64_t nNow) const
+{
+    // stale measurements say little about the peer today
+    if (IsNull() || nNow - nLastUpdate > ADDRMAN_PERF_HORIZON_DAYS * 24 * 60 * 60)
+        return 1.0;
+
+    double fFactor = 1.0;
+
+    if (nPingUsec > 0) {
+        if (nPingUsec < 100 * 1000)
+            fFactor *= 1.5;
+        else if (nPingUsec > 1000 * 1000)
+            fFactor *= 0.5;
+    }
+
+    if (nBlockBytesPerSec > 0) {
+        if (nBlockBytesPerSec > 1000 * 1000)
+            fFactor *= 2.0;
+        else if (nBlockBytesPerSec < 20 * 1000)
+            fFactor *= 0.5;
+    }
+
+    // deprioritize 66% after each stall, bounded the same way as failed attempts
+    fFactor *= pow(0.66, std::min(nStalls, 8));
+
+    // a peer that was well behind our tip is unlikely to help us catch up
+    if (nTipLag > 6)
+        fFactor *= 0.5;
+
+    return fFactor;
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
     std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
@@ -520,6 +570,23 @@ void CAddrMan::SetServices_(const CService& addr, ServiceFlags nServices)
     info.nServices = nServices;
 }
 
+void CAddrMan::UpdatePerformance_(const CService& addr, const CAddrPerf& sample, int64_t nTime)
+{
+    CAddrInfo* pinfo = Find(addr);
+
+    // if not found, bail out
+    if (!pinfo)
+        return;
+
+    CAddrInfo& info = *pinfo;
+
+    // check whether we are talking about the exact same CService (including same port)
+    if (info != addr)
+        return;
+
+    info.perf.Update(sample, nTime);
+}
+
 int CAddrMan::RandomInt(int nMax){
     return GetRandInt(nMax);
 }
@@ -18,6 +18,66 @@
 #include <stdint.h>
 #include <vector>
 
+/**
+ * Connection quality we observed for an address in earlier sessions. A
+ * measurement of 0 (or -1 for nTipLag) means it was never taken; samples
+ * passed to Update() use the same convention for what they did not measure.
+ */
+class CAddrPerf
+{
+public:
+    //! smoothed minimum ping time in microseconds
+    int64_t nPingUsec;
+
+    //! smoothed rate in bytes per second at which the peer delivered the blocks we asked for
+    int64_t nBlockBytesPerSec;
+
+    //! block download stalls and timeouts, one of which is forgiven per session that delivers blocks cleanly
+    int nStalls;
+
+    //! how far the peer's best known block was behind our tip when we disconnected
+    int nTipLag;
+
+    //! last time any of the above was updated
+    int64_t nLastUpdate;
+
+    CAddrPerf()
+    {
+        SetNull();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nPingUsec);
+        READWRITE(nBlockBytesPerSec);
+        READWRITE(nStalls);
+        READWRITE(nTipLag);
+        READWRITE(nLastUpdate);
+    }
+
+    void SetNull()
+    {
+        nPingUsec = 0;
+        nBlockBytesPerSec = 0;
+        nStalls = 0;
+        nTipLag = -1;
+        nLastUpdate = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nLastUpdate == 0;
+    }
+
+    //! Merge the measurements of one session into the history
+    void Update(const CAddrPerf& sample, int64_t nNow);
+
+    //! Factor by which this history scales the chance of selecting the address
+    double GetChanceFactor(int64_t nNow) const;
+};
+
 /**
  * Extended statistics about a CAddress
  */
@@ -51,6 +111,9 @@ private:
     //! position in vRandom
     int nRandomPos;
 
+    //! observed connection quality (serialized separately by CAddrMan)
+    CAddrPerf perf;
+
     friend class CAddrMan;
 
 public:
@@ -74,6 +137,7 @@ public:
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
+        perf.SetNull();
     }
 
     CAddrInfo(const CAddress &addrIn, const CNetAddr &addrSource) : CAddress(addrIn), source(addrSource)
@@ -107,6 +171,9 @@ public:
     //! Calculate the relative chance this entry should be given when selecting nodes to connect to
     double GetChance(int64_t nNow = GetAdjustedTime()) const;
 
+    //! Observed connection quality of this entry
+    const CAddrPerf& GetPerf() const { return perf; }
+
 };
 
 /** Stochastic address manager
@@ -171,6 +238,9 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+//! after how many days without a new sample the observed connection quality is no longer used
+#define ADDRMAN_PERF_HORIZON_DAYS 30
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -259,10 +329,13 @@ protected:
     //! Update an entry's service bits.
     void SetServices_(const CService &addr, ServiceFlags nServices);
 
+    //! Merge a session's connection quality measurements into an entry.
+    void UpdatePerformance_(const CService &addr, const CAddrPerf &sample, int64_t nTime);
+
 public:
     /**
      * serialized format:
-     * * version byte (currently 1)
+     * * version byte (currently 2)
      * * 0x20 + nKey (serialized as if it were a vector, for backward compatibility)
      * * nNew
      * * nTried
@@ -272,6 +345,8 @@ public:
      * * for each bucket:
      *   * number of elements
      *   * for each element: index
+     * * (version 2 and later) number of entries with connection quality data
+     *   * for each such entry: index, CAddrPerf
      *
      * 2**30 is xorred with the number of buckets to make addrman deserializer v0 detect it
      * as incompatible. This is necessary because it did not check the version number on
@@ -294,7 +369,7 @@ public:
     {
         LOCK(cs);
 
-        unsigned char nVersion = 1;
+        unsigned char nVersion = 2;
         s << nVersion;
         s << ((unsigned char)32);
         s << nKey;
@@ -304,6 +379,7 @@ public:
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
         std::map<int, int> mapUnkIds;
+        std::vector<std::pair<int, const CAddrPerf*> > vPerf;
         int nIds = 0;
         for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             mapUnkIds[(*it).first] = nIds;
@@ -311,6 +387,8 @@ public:
             if (info.nRefCount) {
                 assert(nIds != nNew); // this means nNew was wrong, oh ow
                 s << info;
+                if (!info.perf.IsNull())
+                    vPerf.push_back(std::make_pair(nIds, &info.perf));
                 nIds++;
             }
         }
@@ -320,6 +398,8 @@ public:
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
                 s << info;
+                if (!info.perf.IsNull())
+                    vPerf.push_back(std::make_pair(nNew + nIds, &info.perf));
                 nIds++;
             }
         }
@@ -337,6 +417,12 @@ public:
                 }
             }
         }
+        int nPerf = vPerf.size();
+        s << nPerf;
+        for (size_t i = 0; i < vPerf.size(); i++) {
+            s << vPerf[i].first;
+            s << *vPerf[i].second;
+        }
     }
 
     template<typename Stream>
@@ -375,7 +461,7 @@ public:
             mapAddr[info] = n;
             info.nRandomPos = vRandom.size();
             vRandom.push_back(n);
-            if (nVersion != 1 || nUBuckets != ADDRMAN_NEW_BUCKET_COUNT) {
+            if (nVersion < 1 || nVersion > 2 || nUBuckets != ADDRMAN_NEW_BUCKET_COUNT) {
                 // In case the new table data cannot be used (nVersion unknown, or bucket count wrong),
                 // immediately try to give them a reference based on their primary source address.
                 int nUBucket = info.GetNewBucket(nKey);
@@ -388,7 +474,10 @@ public:
         }
         nIdCount = nNew;
 
-        // Deserialize entries from the tried table.
+        // Deserialize entries from the tried table, remembering which id each serialized index ended up at.
+        std::vector<int> vSerializedId(nNew + nTried, -1);
+        for (int n = 0; n < nNew; n++)
+            vSerializedId[n] = n;
         int nLost = 0;
         for (int n = 0; n < nTried; n++) {
             CAddrInfo info;
@@ -402,11 +491,13 @@ public:
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
                 vvTried[nKBucket][nKBucketPos] = nIdCount;
+                vSerializedId[nNew + n] = nIdCount;
                 nIdCount++;
             } else {
                 nLost++;
             }
         }
+        int nSerialized = nNew + nTried;
         nTried -= nLost;
 
         // Deserialize positions in the new table (if possible).
@@ -419,7 +510,7 @@ public:
                 if (nIndex >= 0 && nIndex < nNew) {
                     CAddrInfo &info = mapInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
-                    if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
+                    if (nVersion >= 1 && nVersion <= 2 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
                         vvNew[bucket][nUBucketPos] = nIndex;
                     }
@@ -427,6 +518,22 @@ public:
             }
         }
 
+        // Deserialize connection quality data.
+        if (nVersion >= 2) {
+            int nPerf = 0;
+            s >> nPerf;
+            if (nPerf < 0 || nPerf > nSerialized)
+                throw std::ios_base::failure("Corrupt CAddrMan serialization, connection quality count exceeds entries.");
+            for (int n = 0; n < nPerf; n++) {
+                int nIndex = 0;
+                CAddrPerf perf;
+                s >> nIndex;
+                s >> perf;
+                if (nIndex >= 0 && nIndex < nSerialized && vSerializedId[nIndex] != -1)
+                    mapInfo[vSerializedId[nIndex]].perf = perf;
+            }
+        }
+
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
         for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
@@ -600,6 +707,15 @@ public:
         Check();
     }
 
+    //! Record the connection quality measured during a session with an entry.
+    void UpdatePerformance(const CService &addr, const CAddrPerf &sample, int64_t nTime = GetAdjustedTime())
+    {
+        LOCK(cs);
+        Check();
+        UpdatePerformance_(addr, sample, nTime);
+        Check();
+    }
+
 };
 
 #endif // BITCOIN_ADDRMAN_H
@@ -0,0 +1,141 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "checkqueue.h"
+#include "key.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+#include "script/standard.h"
+
+#include <assert.h>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+/** Transactions in the synthetic block */
+static const int BENCH_TRANSACTIONS = 100;
+/** Inputs per transaction, alternating between P2PKH and P2SH */
+static const int BENCH_INPUTS = 10;
+
+namespace {
+
+/** A script check without the signature cache, which would turn repeats into lookups */
+struct CBenchScriptCheck
+{
+    const CTransaction* ptx;
+    unsigned int nIn;
+    const CScript* pscriptPubKey;
+    CAmount amount;
+
+    CBenchScriptCheck() : ptx(NULL), nIn(0), pscriptPubKey(NULL), amount(0) {}
+    CBenchScriptCheck(const CTransaction* ptxIn, unsigned int nInIn, const CScript* pscriptPubKeyIn, CAmount amountIn) :
+        ptx(ptxIn), nIn(nInIn), pscriptPubKey(pscriptPubKeyIn), amount(amountIn) {}
+
+    bool operator()()
+    {
+        return VerifyScript(ptx->vin[nIn].scriptSig, *pscriptPubKey, NULL, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, TransactionSignatureChecker(ptx, nIn, amount));
+    }
+
+    void swap(CBenchScriptCheck& check)
+    {
+        std::swap(ptx, check.ptx);
+        std::swap(nIn, check.nIn);
+        std::swap(pscriptPubKey, check.pscriptPubKey);
+        std::swap(amount, check.amount);
+    }
+};
+
+/** Signed transactions and the outputs they spend */
+struct CBenchBlock
+{
+    std::vector<CTransaction> vtx;
+    //! The scriptPubKey spent by each input, per transaction
+    std::vector<std::vector<CScript> > vScriptPubKeys;
+    CAmount amount;
+
+    CBenchBlock() : amount(50 * COIN)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        CPubKey pubkey = key.GetPubKey();
+        CScript scriptP2PKH = GetScriptForDestination(pubkey.GetID());
+        CScript scriptP2SH = GetScriptForDestination(CScriptID(scriptP2PKH));
+
+        for (int i = 0; i < BENCH_TRANSACTIONS; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(BENCH_INPUTS);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = amount;
+            tx.vout[0].scriptPubKey = scriptP2PKH;
+            std::vector<CScript> vSpent;
+            for (int j = 0; j < BENCH_INPUTS; j++) {
+                tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+                vSpent.push_back(j % 2 ? scriptP2SH : scriptP2PKH);
+            }
+            for (int j = 0; j < BENCH_INPUTS; j++) {
+                // The P2SH outputs wrap a P2PKH script, which is what gets signed
+                std::vector<unsigned char> vchSig;
+                uint256 hash = SignatureHash(scriptP2PKH, tx, j, SIGHASH_ALL, amount, SIGVERSION_BASE);
+                bool fSigned = key.Sign(hash, vchSig);
+                assert(fSigned);
+                vchSig.push_back((unsigned char)SIGHASH_ALL);
+                tx.vin[j].scriptSig = CScript() << vchSig << ToByteVector(pubkey);
+                if (j % 2)
+                    tx.vin[j].scriptSig << std::vector<unsigned char>(scriptP2PKH.begin(), scriptP2PKH.end());
+            }
+            vtx.push_back(CTransaction(tx));
+            vScriptPubKeys.push_back(vSpent);
+        }
+    }
+};
+
+}
+
+/** Verify the inputs of the block with nThreads threads, as with -par=nThreads */
+static void RunScriptChecks(benchmark::State& state, int nThreads)
+{
+    // ECC_Start only sets up signing; verification needs its own context
+    const ECCVerifyHandle verifyHandle;
+    static CBenchBlock block;
+    CCheckQueue<CBenchScriptCheck> queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CBenchScriptCheck>::Thread, &queue));
+
+    while (state.KeepRunning()) {
+        CCheckQueueControl<CBenchScriptCheck> control(&queue);
+        for (size_t i = 0; i < block.vtx.size(); i++) {
+            std::vector<CBenchScriptCheck> vChecks;
+            for (unsigned int j = 0; j < block.vtx[i].vin.size(); j++)
+                vChecks.push_back(CBenchScriptCheck(&block.vtx[i], j, &block.vScriptPubKeys[i][j], block.amount));
+            control.Add(vChecks);
+        }
+        bool fOk = control.Wait();
+        assert(fOk);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+static void CheckQueueBlock_par01(benchmark::State& state) { RunScriptChecks(state, 1); }
+static void CheckQueueBlock_par02(benchmark::State& state) { RunScriptChecks(state, 2); }
+static void CheckQueueBlock_par04(benchmark::State& state) { RunScriptChecks(state, 4); }
+static void CheckQueueBlock_par08(benchmark::State& state) { RunScriptChecks(state, 8); }
+static void CheckQueueBlock_par16(benchmark::State& state) { RunScriptChecks(state, 16); }
+static void CheckQueueBlock_par32(benchmark::State& state) { RunScriptChecks(state, 32); }
+static void CheckQueueBlock_par64(benchmark::State& state) { RunScriptChecks(state, 64); }
+
+BENCHMARK(CheckQueueBlock_par01);
+BENCHMARK(CheckQueueBlock_par02);
+BENCHMARK(CheckQueueBlock_par04);
+BENCHMARK(CheckQueueBlock_par08);
+BENCHMARK(CheckQueueBlock_par16);
+BENCHMARK(CheckQueueBlock_par32);
+BENCHMARK(CheckQueueBlock_par64);
@@ -0,0 +1,99 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "cuckoocache.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+/** Number of threads checking signatures at once, as with -par=8 */
+static const int BENCH_THREADS = 8;
+/** Operations per thread per benchmark iteration */
+static const int BENCH_OPS = 4096;
+
+namespace {
+
+class CBenchHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+/** The cache and lock as used by the signature cache */
+struct CBenchCache
+{
+    CuckooCache::cache<uint256, CBenchHasher> cache;
+    boost::shared_mutex mutex;
+    std::vector<uint256> vKnown;
+};
+
+}
+
+/**
+ * Look up BENCH_OPS entries, half of them cached. With nInsertEvery, every
+ * nInsertEvery-th operation inserts a new entry under the exclusive lock.
+ */
+static void CacheWorker(CBenchCache* pbench, int nThread, int nInsertEvery)
+{
+    uint256 entry;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        if (nInsertEvery && i % nInsertEvery == 0) {
+            entry = GetRandHash();
+            boost::unique_lock<boost::shared_mutex> lock(pbench->mutex);
+            pbench->cache.insert(entry);
+        } else if (i % 2 == 0) {
+            boost::shared_lock<boost::shared_mutex> lock(pbench->mutex);
+            pbench->cache.contains(pbench->vKnown[(nThread * BENCH_OPS + i) % pbench->vKnown.size()], false);
+        } else {
+            // A miss; the entry differs from the known ones in its last word
+            entry = pbench->vKnown[i % pbench->vKnown.size()];
+            entry.begin()[31] ^= 1;
+            boost::shared_lock<boost::shared_mutex> lock(pbench->mutex);
+            pbench->cache.contains(entry, false);
+        }
+    }
+}
+
+static void RunCacheThreads(benchmark::State& state, int nInsertEvery)
+{
+    CBenchCache bench;
+    bench.cache.setup_bytes(40 << 20);
+    for (int i = 0; i < 500000; i++) {
+        bench.vKnown.push_back(GetRandHash());
+        bench.cache.insert(bench.vKnown.back());
+    }
+    while (state.KeepRunning()) {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < BENCH_THREADS; i++)
+            threadGroup.create_thread(boost::bind(&CacheWorker, &bench, i, nInsertEvery));
+        threadGroup.join_all();
+    }
+}
+
+// 8 threads doing BENCH_OPS lookups each, as when checking a block's signatures
+static void CuckooCacheContains(benchmark::State& state)
+{
+    RunCacheThreads(state, 0);
+}
+
+// The same with one insert every 16 operations, as when accepting transactions
+static void CuckooCacheContainsInsert(benchmark::State& state)
+{
+    RunCacheThreads(state, 16);
+}
+
+BENCHMARK(CuckooCacheContains);
+BENCHMARK(CuckooCacheContainsInsert);
@@ -0,0 +1,80 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "primitives/transaction.h"
+#include "txmempool.h"
+
+#include <assert.h>
+#include <list>
+#include <vector>
+
+/** Chains of transactions spending each other in the disconnected block */
+static const int BENCH_BLOCK_CHAINS = 50;
+static const int BENCH_BLOCK_CHAIN_LENGTH = 4;
+/** Length of the in-mempool chain spending each transaction of the block */
+static const int BENCH_DESCENDANT_CHAIN_LENGTH = 3;
+
+static CMutableTransaction SpendingTx(const COutPoint& prevout, int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[i].nValue = COIN;
+    }
+    return tx;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, 0, 10.0, 1, false, 0, false, 4, LockPoints()));
+}
+
+// Disconnect a block whose transactions have descendants in the mempool, as
+// in a reorg, and connect it again: the block's transactions are added back,
+// UpdateTransactionsFromBlock links them to their descendants, and
+// removeForBlock takes them out again.
+static void MempoolReorg(benchmark::State& state)
+{
+    std::vector<CTransaction> vBlock;
+    std::vector<CTransaction> vDescendants;
+    for (int c = 0; c < BENCH_BLOCK_CHAINS; c++) {
+        COutPoint prevout(uint256S("01"), c);
+        for (int i = 0; i < BENCH_BLOCK_CHAIN_LENGTH; i++) {
+            CTransaction tx(SpendingTx(prevout, 2));
+            vBlock.push_back(tx);
+            prevout = COutPoint(tx.GetHash(), 0);
+            COutPoint spent(tx.GetHash(), 1);
+            for (int j = 0; j < BENCH_DESCENDANT_CHAIN_LENGTH; j++) {
+                CTransaction descendant(SpendingTx(spent, 1));
+                vDescendants.push_back(descendant);
+                spent = COutPoint(descendant.GetHash(), 0);
+            }
+        }
+    }
+
+    CTxMemPool pool(CFeeRate(1000));
+    LOCK(pool.cs);
+    for (size_t i = 0; i < vDescendants.size(); i++)
+        AddTx(pool, vDescendants[i]);
+
+    while (state.KeepRunning()) {
+        std::vector<uint256> vHashUpdate;
+        for (size_t i = 0; i < vBlock.size(); i++) {
+            AddTx(pool, vBlock[i]);
+            vHashUpdate.push_back(vBlock[i].GetHash());
+        }
+        pool.UpdateTransactionsFromBlock(vHashUpdate);
+
+        std::list<CTransaction> conflicts;
+        pool.removeForBlock(vBlock, 1, conflicts);
+        assert(pool.size() == vDescendants.size());
+    }
+}
+
+BENCHMARK(MempoolReorg);
@@ -0,0 +1,123 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "compat.h"
+#include "socketevents.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+
+#include <vector>
+
+// Cost of delivering one event to the socket handler, with nPeers connections
+// of which only one has data. With select() every wait rebuilds and scans the
+// descriptor sets of all peers; with epoll it only sees the ready one.
+
+/** nPeers connected socket pairs: the local end is watched, the remote end sends */
+class PeerSockets
+{
+public:
+    std::vector<int> vLocal;
+    std::vector<int> vRemote;
+
+    PeerSockets(int nPeers)
+    {
+        RaiseFileDescriptorLimit(2 * nPeers + 64);
+        for (int i = 0; i < nPeers; i++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                break;
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            vLocal.push_back(fds[0]);
+            vRemote.push_back(fds[1]);
+        }
+    }
+
+    ~PeerSockets()
+    {
+        for (size_t i = 0; i < vLocal.size(); i++) {
+            close(vLocal[i]);
+            close(vRemote[i]);
+        }
+    }
+
+    // Make one peer readable, spreading the traffic over all of them
+    int Send(uint64_t nRound)
+    {
+        int n = (nRound * 7919) % vLocal.size();
+        char c = 0;
+        if (send(vRemote[n], &c, 1, 0) != 1)
+            return -1;
+        return n;
+    }
+};
+
+static void SocketEventsSelect(benchmark::State& state, int nPeers)
+{
+    PeerSockets peers(nPeers);
+    char buf[16];
+    uint64_t nRound = 0;
+    while (state.KeepRunning()) {
+        if (peers.vLocal.empty() || peers.Send(nRound++) < 0)
+            continue;
+
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        int hSocketMax = 0;
+        for (size_t i = 0; i < peers.vLocal.size(); i++) {
+            FD_SET(peers.vLocal[i], &fdsetRecv);
+            hSocketMax = std::max(hSocketMax, peers.vLocal[i]);
+        }
+        if (select(hSocketMax + 1, &fdsetRecv, NULL, NULL, NULL) <= 0)
+            continue;
+        for (size_t i = 0; i < peers.vLocal.size(); i++)
+            if (FD_ISSET(peers.vLocal[i], &fdsetRecv))
+                recv(peers.vLocal[i], buf, sizeof(buf), MSG_DONTWAIT);
+    }
+}
+
+static void SocketEventsEpoll(benchmark::State& state, int nPeers)
+{
+    PeerSockets peers(nPeers);
+    CSocketEvents events;
+    std::vector<CSocketEvents::Event> vEvents;
+    if (events.Open()) {
+        for (size_t i = 0; i < peers.vLocal.size(); i++)
+            events.Add(peers.vLocal[i], (void*)i, true);
+        // Swallow the initial writability edges
+        while (events.Wait(vEvents, 0) > 0) {}
+    }
+
+    char buf[16];
+    uint64_t nRound = 0;
+    while (state.KeepRunning()) {
+        if (!events.IsOpen() || peers.vLocal.empty() || peers.Send(nRound++) < 0)
+            continue;
+
+        if (events.Wait(vEvents, -1) <= 0)
+            continue;
+        for (size_t i = 0; i < vEvents.size(); i++)
+            if (vEvents[i].flags & SOCKET_EVENT_RECV)
+                recv(peers.vLocal[(size_t)vEvents[i].ptr], buf, sizeof(buf), MSG_DONTWAIT);
+    }
+}
+
+static void SocketEventsSelect100(benchmark::State& state) { SocketEventsSelect(state, 100); }
+static void SocketEventsSelect500(benchmark::State& state) { SocketEventsSelect(state, 500); }
+static void SocketEventsEpoll100(benchmark::State& state) { SocketEventsEpoll(state, 100); }
+static void SocketEventsEpoll1000(benchmark::State& state) { SocketEventsEpoll(state, 1000); }
+static void SocketEventsEpoll10000(benchmark::State& state) { SocketEventsEpoll(state, 10000); }
+
+// select() cannot go beyond FD_SETSIZE descriptors, hence the smaller peer counts
+BENCHMARK(SocketEventsSelect100);
+BENCHMARK(SocketEventsSelect500);
+#ifdef HAVE_SYS_EPOLL_H
+BENCHMARK(SocketEventsEpoll100);
+BENCHMARK(SocketEventsEpoll1000);
+BENCHMARK(SocketEventsEpoll10000);
+#endif
+
+#endif // WIN32
@@ -17,15 +17,23 @@
 
 #define MIN_TRANSACTION_BASE_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS))
 
-CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+/** Transactions that can never be in a peer's mempool: the coinbase, and the coinstake of a proof-of-stake block */
+static size_t GetPrefilledCount(const CBlock& block) {
+    return block.IsProofOfStake() ? 2 : 1;
+}
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
-        shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block) {
+        shorttxids(block.vtx.size() - GetPrefilledCount(block)), prefilledtxn(GetPrefilledCount(block)),
+        header(block.GetBlockHeader()) {
     FillShortTxIDSelector();
-    //TODO: Use our mempool prior to block acceptance to predictively fill more than just the coinbase
-    prefilledtxn[0] = {0, block.vtx[0]};
-    for (size_t i = 1; i < block.vtx.size(); i++) {
+    //TODO: Use our mempool prior to block acceptance to predictively fill more than just the coinbase and coinstake
+    // Prefilled indexes are differentially encoded, so the coinstake right after the coinbase is sent as 0
+    for (size_t i = 0; i < prefilledtxn.size(); i++)
+        prefilledtxn[i] = {0, block.vtx[i]};
+    for (size_t i = prefilledtxn.size(); i < block.vtx.size(); i++) {
         const CTransaction& tx = block.vtx[i];
-        shorttxids[i - 1] = GetShortID(tx.GetHash());
+        shorttxids[i - prefilledtxn.size()] = GetShortID(fUseWTXID ? tx.GetWitnessHash() : tx.GetHash());
     }
 }
 
@@ -75,6 +83,23 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     }
     prefilled_count = cmpctblock.prefilledtxn.size();
 
+    // A proof-of-stake block is checked against its prefilled coinstake before
+    // we spend a round-trip fetching the rest of it
+    if (header.IsProofOfStake()) {
+        if (txn_available.size() < 2 || !txn_available[1] || !txn_available[1]->IsCoinStake())
+            return READ_STATUS_INVALID;
+        const CTransaction& txCoinStake = *txn_available[1];
+        if (txCoinStake.vin[0].prevout != header.PrevoutStake() || txCoinStake.nTime != header.StakeTime())
+            return READ_STATUS_INVALID;
+
+        CBlock blockStake(header);
+        blockStake.vtx.push_back(txn_available[0] ? *txn_available[0] : CTransaction());
+        blockStake.vtx.push_back(txCoinStake);
+        if (!CheckBlockSignature(blockStake))
+            return READ_STATUS_INVALID;
+    } else if (txn_available.size() > 1 && txn_available[1] && txn_available[1]->IsCoinStake())
+        return READ_STATUS_INVALID;
+
     // Calculate map of txids -> positions and check mempool to see what we have (or dont)
     // Because well-formed cmpctblock messages will have a (relatively) uniform distribution
     // of short IDs, any highly-uneven distribution of elements can be safely treated as a
@@ -0,0 +1,240 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexsnapshot.h"
+
+#include "arith_uint256.h"
+#include "chain.h"
+#include "util.h"
+
+#include <string.h>
+#include <unordered_map>
+
+#include <boost/filesystem.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char BLOCKINDEX_SNAPSHOT_MAGIC[8] = {'b', 'l', 'k', 'i', 'n', 'd', 'e', 'x'};
+static const uint32_t BLOCKINDEX_SNAPSHOT_VERSION = 2;
+
+static_assert(sizeof(BlockIndexSnapshotRecord) == 272, "BlockIndexSnapshotRecord must not contain padding");
+static_assert(sizeof(BlockIndexSnapshotHeader) == 72, "BlockIndexSnapshotHeader must not contain padding");
+
+CBlockIndexSnapshot::CBlockIndexSnapshot() : pdata(NULL), nDataSize(0), fMapped(false), header(NULL), precords(NULL), nRecords(0), psigs(NULL), nSigSize(0)
+{
+}
+
+CBlockIndexSnapshot::~CBlockIndexSnapshot()
+{
+    Close();
+}
+
+bool CBlockIndexSnapshot::Write(const boost::filesystem::path& path, const std::vector<const CBlockIndex*>& vIndex, uint64_t nNonce, const uint256& hashBestBlock)
+{
+    std::unordered_map<const CBlockIndex*, int32_t> mapRecord(vIndex.size());
+    std::vector<BlockIndexSnapshotRecord> vRecords(vIndex.size());
+    uint64_t nSigSize = 0;
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        const CBlockIndex* pindex = vIndex[i];
+        BlockIndexSnapshotRecord& rec = vRecords[i];
+        memset(&rec, 0, sizeof(rec));
+        mapRecord[pindex] = i;
+
+        // Parents must precede their children, which sorting by height guarantees
+        rec.nPrev = -1;
+        rec.nSkip = -1;
+        if (pindex->pprev) {
+            std::unordered_map<const CBlockIndex*, int32_t>::const_iterator it = mapRecord.find(pindex->pprev);
+            if (it == mapRecord.end())
+                return error("%s: block index entries not sorted by height", __func__);
+            rec.nPrev = it->second;
+        }
+        if (pindex->pskip) {
+            std::unordered_map<const CBlockIndex*, int32_t>::const_iterator it = mapRecord.find(pindex->pskip);
+            if (it == mapRecord.end())
+                return error("%s: block index entries not sorted by height", __func__);
+            rec.nSkip = it->second;
+        }
+
+        uint256 hash = pindex->GetBlockHash();
+        memcpy(rec.hashBlock, hash.begin(), 32);
+        memcpy(rec.hashMerkleRoot, pindex->pcold->hashMerkleRoot.begin(), 32);
+        uint256 nChainWork = ArithToUint256(pindex->nChainWork);
+        memcpy(rec.nChainWork, nChainWork.begin(), 32);
+        memcpy(rec.bnStakeModifierV2, pindex->pcold->bnStakeModifierV2.begin(), 32);
+        memcpy(rec.hashPrevoutStake, pindex->pcold->prevoutStake.hash.begin(), 32);
+        memcpy(rec.hashProof, pindex->pcold->hashProof.begin(), 32);
+        rec.nStakeModifier = pindex->nStakeModifier;
+        rec.nHeight = pindex->nHeight;
+        rec.nFile = pindex->nFile;
+        rec.nDataPos = pindex->nDataPos;
+        rec.nUndoPos = pindex->nUndoPos;
+        rec.nTx = pindex->nTx;
+        rec.nStatus = pindex->nStatus;
+        rec.nVersion = pindex->nVersion;
+        rec.nTime = pindex->nTime;
+        rec.nBits = pindex->nBits;
+        rec.nNonce = pindex->pcold->nNonce;
+        rec.nFlags = pindex->nFlags & ~CBlockIndex::BLOCK_STAKE_CHECKED; // memory only
+        rec.nPrevoutStakeN = pindex->pcold->prevoutStake.n;
+        rec.nStakeTime = pindex->pcold->nStakeTime;
+        rec.nBlockSigPos = nSigSize;
+        rec.nBlockSigSize = pindex->pcold->vchBlockSig.size();
+        nSigSize += pindex->pcold->vchBlockSig.size();
+    }
+
+    BlockIndexSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.pchMagic, BLOCKINDEX_SNAPSHOT_MAGIC, sizeof(header.pchMagic));
+    header.nVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(BlockIndexSnapshotRecord);
+    header.nNonce = nNonce;
+    header.nRecords = vRecords.size();
+    header.nSigSize = nSigSize;
+    memcpy(header.hashBestBlock, hashBestBlock.begin(), 32);
+
+    boost::filesystem::path pathTmp = path.string() + ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s: failed to open %s", __func__, pathTmp.string());
+    bool fOk = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fOk && !vRecords.empty())
+        fOk = fwrite(&vRecords[0], sizeof(BlockIndexSnapshotRecord), vRecords.size(), file) == vRecords.size();
+    for (size_t i = 0; fOk && i < vIndex.size(); i++) {
+        const std::vector<unsigned char>& vchSig = vIndex[i]->pcold->vchBlockSig;
+        if (!vchSig.empty())
+            fOk = fwrite(&vchSig[0], 1, vchSig.size(), file) == vchSig.size();
+    }
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: failed to write %s", __func__, path.string());
+    }
+    return true;
+}
+
+bool CBlockIndexSnapshot::Open(const boost::filesystem::path& path)
+{
+    Close();
+
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            // The records are read front to back exactly once
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            pdata = (const unsigned char*)p;
+            nDataSize = st.st_size;
+            fMapped = true;
+        }
+    }
+    close(fd);
+#else
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    unsigned char buf[65536];
+    size_t nRead;
+    while ((nRead = fread(buf, 1, sizeof(buf), file)) > 0)
+        vBuffer.insert(vBuffer.end(), buf, buf + nRead);
+    fclose(file);
+    if (!vBuffer.empty()) {
+        pdata = &vBuffer[0];
+        nDataSize = vBuffer.size();
+    }
+#endif
+
+    if (nDataSize < sizeof(BlockIndexSnapshotHeader)) {
+        Close();
+        return error("%s: %s is truncated", __func__, path.string());
+    }
+    header = (const BlockIndexSnapshotHeader*)pdata;
+    if (memcmp(header->pchMagic, BLOCKINDEX_SNAPSHOT_MAGIC, sizeof(header->pchMagic)) != 0 ||
+        header->nVersion != BLOCKINDEX_SNAPSHOT_VERSION || header->nRecordSize != sizeof(BlockIndexSnapshotRecord)) {
+        Close();
+        return error("%s: %s has an unknown format", __func__, path.string());
+    }
+    uint64_t nPayload = nDataSize - sizeof(BlockIndexSnapshotHeader);
+    if (header->nRecords > nPayload / sizeof(BlockIndexSnapshotRecord) ||
+        header->nSigSize != nPayload - header->nRecords * sizeof(BlockIndexSnapshotRecord)) {
+        Close();
+        return error("%s: %s is truncated", __func__, path.string());
+    }
+
+    precords = (const BlockIndexSnapshotRecord*)(pdata + sizeof(BlockIndexSnapshotHeader));
+    nRecords = header->nRecords;
+    psigs = (const unsigned char*)(precords + nRecords);
+    nSigSize = header->nSigSize;
+    return true;
+}
+
+void CBlockIndexSnapshot::Close()
+{
+#ifndef WIN32
+    if (fMapped)
+        munmap((void*)pdata, nDataSize);
+#endif
+    std::vector<unsigned char>().swap(vBuffer);
+    pdata = NULL;
+    nDataSize = 0;
+    fMapped = false;
+    header = NULL;
+    precords = NULL;
+    nRecords = 0;
+    psigs = NULL;
+    nSigSize = 0;
+}
+
+uint256 CBlockIndexSnapshot::GetBestBlock() const
+{
+    uint256 hash;
+    memcpy(hash.begin(), header->hashBestBlock, 32);
+    return hash;
+}
+
+bool CBlockIndexSnapshot::GetBlockSig(const BlockIndexSnapshotRecord& rec, std::vector<unsigned char>& vchSig) const
+{
+    if (rec.nBlockSigPos > nSigSize || rec.nBlockSigSize > nSigSize - rec.nBlockSigPos)
+        return false;
+    vchSig.assign(psigs + rec.nBlockSigPos, psigs + rec.nBlockSigPos + rec.nBlockSigSize);
+    return true;
+}
+
+bool CBlockIndexSnapshot::GetBlockIndex(const BlockIndexSnapshotRecord& rec, CBlockIndex& index) const
+{
+    index.nHeight = rec.nHeight;
+    index.nFile = rec.nFile;
+    index.nDataPos = rec.nDataPos;
+    index.nUndoPos = rec.nUndoPos;
+    index.nVersion = rec.nVersion;
+    memcpy(index.pcold->hashMerkleRoot.begin(), rec.hashMerkleRoot, 32);
+    index.nTime = rec.nTime;
+    index.nBits = rec.nBits;
+    index.pcold->nNonce = rec.nNonce;
+    index.nStatus = rec.nStatus;
+    index.nTx = rec.nTx;
+    uint256 nChainWork;
+    memcpy(nChainWork.begin(), rec.nChainWork, 32);
+    index.nChainWork = UintToArith256(nChainWork);
+
+    index.nFlags = rec.nFlags & ~CBlockIndex::BLOCK_STAKE_CHECKED;
+    index.nStakeModifier = rec.nStakeModifier;
+    memcpy(index.pcold->bnStakeModifierV2.begin(), rec.bnStakeModifierV2, 32);
+    memcpy(index.pcold->prevoutStake.hash.begin(), rec.hashPrevoutStake, 32);
+    index.pcold->prevoutStake.n = rec.nPrevoutStakeN;
+    index.pcold->nStakeTime = rec.nStakeTime;
+    memcpy(index.pcold->hashProof.begin(), rec.hashProof, 32);
+    return GetBlockSig(rec, index.pcold->vchBlockSig);
+}
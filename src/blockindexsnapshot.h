@@ -0,0 +1,119 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKINDEXSNAPSHOT_H
+#define BITCOIN_BLOCKINDEXSNAPSHOT_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+class CBlockIndex;
+
+/**
+ * One block index entry in a snapshot. The layout is fixed so records can be
+ * used straight from the mapped file; pointers to other entries are replaced
+ * by their record numbers.
+ */
+struct BlockIndexSnapshotRecord
+{
+    unsigned char hashBlock[32];
+    unsigned char hashMerkleRoot[32];
+    unsigned char nChainWork[32];
+    unsigned char bnStakeModifierV2[32];
+    unsigned char hashPrevoutStake[32];
+    unsigned char hashProof[32];
+    uint64_t nStakeModifier;
+    //! Offset of the block signature in the signature area
+    uint64_t nBlockSigPos;
+    //! Record number of pprev, or -1
+    int32_t nPrev;
+    //! Record number of pskip, or -1
+    int32_t nSkip;
+    int32_t nHeight;
+    int32_t nFile;
+    uint32_t nDataPos;
+    uint32_t nUndoPos;
+    uint32_t nTx;
+    uint32_t nStatus;
+    int32_t nVersion;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+    uint32_t nFlags;
+    uint32_t nPrevoutStakeN;
+    uint32_t nStakeTime;
+    uint32_t nBlockSigSize;
+};
+
+/** File header of a block index snapshot */
+struct BlockIndexSnapshotHeader
+{
+    char pchMagic[8];
+    uint32_t nVersion;
+    //! sizeof(BlockIndexSnapshotRecord); also catches files written with a different byte order
+    uint32_t nRecordSize;
+    //! Matches the value stored in the block tree database while the snapshot is current
+    uint64_t nNonce;
+    uint64_t nRecords;
+    uint64_t nSigSize;
+    unsigned char hashBestBlock[32];
+};
+
+/**
+ * Read-only view of a block index snapshot file: a header, the records sorted
+ * by height so that every entry's parent and skip entry come before it, and
+ * the variable-length block signatures. The file is mapped into memory where
+ * the platform allows it, and read into a buffer otherwise.
+ */
+class CBlockIndexSnapshot
+{
+public:
+    CBlockIndexSnapshot();
+    ~CBlockIndexSnapshot();
+
+    /**
+     * Write vIndex, which must be sorted by height, to path. The file is
+     * written next to path and renamed over it once complete.
+     */
+    static bool Write(const boost::filesystem::path& path, const std::vector<const CBlockIndex*>& vIndex, uint64_t nNonce, const uint256& hashBestBlock);
+
+    //! Open the snapshot at path, checking that its layout is consistent
+    bool Open(const boost::filesystem::path& path);
+    void Close();
+
+    uint64_t GetNonce() const { return header->nNonce; }
+    uint256 GetBestBlock() const;
+    size_t size() const { return nRecords; }
+    const BlockIndexSnapshotRecord& operator[](size_t i) const { return precords[i]; }
+
+    //! Copy the block signature of rec, returning false if it lies outside the file
+    bool GetBlockSig(const BlockIndexSnapshotRecord& rec, std::vector<unsigned char>& vchSig) const;
+    /**
+     * Fill in the fields of index stored in rec. The block hash, pprev and
+     * pskip are left to the caller. Returns false if the block signature lies
+     * outside the file.
+     */
+    bool GetBlockIndex(const BlockIndexSnapshotRecord& rec, CBlockIndex& index) const;
+
+private:
+    const unsigned char* pdata;
+    size_t nDataSize;
+    bool fMapped;
+    std::vector<unsigned char> vBuffer;
+
+    const BlockIndexSnapshotHeader* header;
+    const BlockIndexSnapshotRecord* precords;
+    size_t nRecords;
+    const unsigned char* psigs;
+    uint64_t nSigSize;
+
+    CBlockIndexSnapshot(const CBlockIndexSnapshot&);
+    CBlockIndexSnapshot& operator=(const CBlockIndexSnapshot&);
+};
+
+#endif // BITCOIN_BLOCKINDEXSNAPSHOT_H
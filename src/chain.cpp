@@ -5,6 +5,8 @@
 
 #include "chain.h"
 
+#include <new>
+
 using namespace std;
 
 /**
@@ -112,6 +114,94 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+/** Cache line size; every arena entry starts a cache line */
+static const size_t BLOCKINDEX_ARENA_ALIGNMENT = 64;
+/** Distance between arena entries, the entry size rounded up to whole cache lines */
+static const size_t BLOCKINDEX_ARENA_STRIDE = (sizeof(CBlockIndex) + BLOCKINDEX_ARENA_ALIGNMENT - 1) / BLOCKINDEX_ARENA_ALIGNMENT * BLOCKINDEX_ARENA_ALIGNMENT;
+
+static_assert(sizeof(void*) != 8 || BLOCKINDEX_ARENA_STRIDE == sizeof(CBlockIndex),
+              "CBlockIndex should fill whole cache lines without padding; move rarely read fields to CBlockIndexCold");
+static_assert(sizeof(void*) != 8 || sizeof(CBlockIndex) <= 2 * BLOCKINDEX_ARENA_ALIGNMENT,
+              "CBlockIndex should fit in two cache lines; move rarely read fields to CBlockIndexCold");
+
+CBlockIndexArena::CBlockIndexArena(size_t nChunkEntriesIn) : nChunkEntries(nChunkEntriesIn), nEntries(0)
+{
+}
+
+CBlockIndexArena::~CBlockIndexArena()
+{
+    Clear();
+}
+
+CBlockIndex* CBlockIndexArena::GetEntry(size_t nPos) const
+{
+    return (CBlockIndex*)(vChunkEntries[nPos / nChunkEntries] + (nPos % nChunkEntries) * BLOCKINDEX_ARENA_STRIDE);
+}
+
+CBlockIndexCold* CBlockIndexArena::GetCold(size_t nPos) const
+{
+    return (CBlockIndexCold*)vColdChunks[nPos / nChunkEntries] + nPos % nChunkEntries;
+}
+
+CBlockIndex* CBlockIndexArena::Allocate()
+{
+    if (nEntries % nChunkEntries == 0 && nEntries / nChunkEntries == vChunks.size()) {
+        char* pchunk = new char[nChunkEntries * BLOCKINDEX_ARENA_STRIDE + BLOCKINDEX_ARENA_ALIGNMENT];
+        size_t nMisalign = (size_t)pchunk % BLOCKINDEX_ARENA_ALIGNMENT;
+        vChunks.push_back(pchunk);
+        vChunkEntries.push_back(pchunk + (nMisalign ? BLOCKINDEX_ARENA_ALIGNMENT - nMisalign : 0));
+        vColdChunks.push_back(new char[nChunkEntries * sizeof(CBlockIndexCold)]);
+    }
+    CBlockIndexCold* pcold = new (GetCold(nEntries)) CBlockIndexCold();
+    CBlockIndex* pindex = new (GetEntry(nEntries)) CBlockIndex(pcold);
+    nEntries++;
+    return pindex;
+}
+
+CBlockIndex* CBlockIndexArena::Allocate(const CBlockHeader& block)
+{
+    CBlockIndex* pindex = Allocate();
+    pindex->SetBlockHeader(block);
+    return pindex;
+}
+
+CBlockIndex* CBlockIndexArena::Allocate(const CBlockIndex& index)
+{
+    CBlockIndex* pindex = Allocate();
+    *pindex = index;
+    return pindex;
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t i = 0; i < nEntries; i++) {
+        GetEntry(i)->~CBlockIndex();
+        GetCold(i)->~CBlockIndexCold();
+    }
+    for (size_t i = 0; i < vChunks.size(); i++) {
+        delete[] vChunks[i];
+        delete[] vColdChunks[i];
+    }
+    vChunks.clear();
+    vChunkEntries.clear();
+    vColdChunks.clear();
+    nEntries = 0;
+}
+
+void CBlockIndexArena::swap(CBlockIndexArena& other)
+{
+    std::swap(nChunkEntries, other.nChunkEntries);
+    vChunks.swap(other.vChunks);
+    vChunkEntries.swap(other.vChunkEntries);
+    vColdChunks.swap(other.vColdChunks);
+    std::swap(nEntries, other.nEntries);
+}
+
+size_t CBlockIndexArena::DynamicMemoryUsage() const
+{
+    return vChunks.size() * (nChunkEntries * (BLOCKINDEX_ARENA_STRIDE + sizeof(CBlockIndexCold)) + BLOCKINDEX_ARENA_ALIGNMENT);
+}
+
 arith_uint256 GetBlockProof(const CBlockIndex& block)
 {
     arith_uint256 bnTarget;
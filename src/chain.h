@@ -148,6 +148,81 @@ enum BlockStatus: uint32_t {
     BLOCK_OPT_WITNESS       =   128, //! block data in blk*.data was received with a witness-enforcing client
 };
 
+class CBlockIndex;
+
+/** Fields of a block index entry that chain walks never read: the rest of
+ * the header and the proof-of-stake data. They are kept out of line, see
+ * CBlockIndex::pcold.
+ */
+struct CBlockIndexCold
+{
+    uint256 hashMerkleRoot;
+
+    uint256 hashProof;
+
+    uint256 bnStakeModifierV2;
+
+    // proof-of-stake specific fields
+    COutPoint prevoutStake;
+
+    unsigned int nStakeTime;
+
+    unsigned int nNonce;
+
+    // block signature - proof-of-stake protect the block by signing the block using a stake holder private key
+    std::vector<unsigned char> vchBlockSig;
+
+    //! pointer to the index of the successor of this block
+    CBlockIndex* pnext;
+
+    CBlockIndexCold()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        hashMerkleRoot = uint256();
+        hashProof = uint256();
+        bnStakeModifierV2 = uint256();
+        prevoutStake.SetNull();
+        nStakeTime = 0;
+        nNonce = 0;
+        vchBlockSig.clear();
+        pnext = NULL;
+    }
+};
+
+/** Pointer to the cold fields of a CBlockIndex. Entries allocated by
+ * CBlockIndexArena point into the arena; all others own a heap copy. Copying
+ * copies the fields, never the pointer.
+ */
+class CBlockIndexColdPtr
+{
+public:
+    CBlockIndexColdPtr() : pcold(new CBlockIndexCold()), fOwned(true) {}
+    explicit CBlockIndexColdPtr(CBlockIndexCold* pcoldIn) : pcold(pcoldIn), fOwned(false) {}
+    CBlockIndexColdPtr(const CBlockIndexColdPtr& other) : pcold(new CBlockIndexCold(*other.pcold)), fOwned(true) {}
+    ~CBlockIndexColdPtr()
+    {
+        if (fOwned)
+            delete pcold;
+    }
+
+    CBlockIndexColdPtr& operator=(const CBlockIndexColdPtr& other)
+    {
+        *pcold = *other.pcold;
+        return *this;
+    }
+
+    CBlockIndexCold* operator->() const { return pcold; }
+    CBlockIndexCold& operator*() const { return *pcold; }
+
+private:
+    CBlockIndexCold* pcold;
+    bool fOwned;
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
@@ -156,16 +231,14 @@ enum BlockStatus: uint32_t {
 class CBlockIndex
 {
 public:
-    //! pointer to the hash of the block, if any. Memory is owned by this CBlockIndex
-    const uint256* phashBlock;
+    // The fields are ordered by how often chain walks read them. The first
+    // 32 bytes serve GetAncestor, the stake confirmation depth check and the
+    // stake modifier selection loop. On 64-bit platforms an entry takes up
+    // exactly two cache lines, which CBlockIndexArena aligns; the rarely read
+    // header and proof-of-stake fields live in CBlockIndexCold.
 
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
-	
-    
-    //! pointer to the index of the successor of this block
-    CBlockIndex* pnext;
-    
 
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
@@ -173,69 +246,63 @@ public:
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
+    //! block header time
+    unsigned int nTime;
+
+    unsigned int nFlags;  // ppcoin: block index flags
+    enum  
+    {
+        BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
+        BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
+        BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
+        BLOCK_STAKE_CHECKED  = (1 << 3), // (memory only) stake kernel verified on the header, before the block arrived
+    };
+
     //! Which # file this block is stored in (blk?????.dat)
     int nFile;
 
+    //! pointer to the hash of the block, if any. Memory is owned by this CBlockIndex
+    const uint256* phashBlock;
+
+    uint64_t nStakeModifier; // hash modifier for proof-of-stake
+
     //! Byte offset within blk?????.dat where this block's data is stored
     unsigned int nDataPos;
 
-    //! Byte offset within rev?????.dat where this block's undo data is stored
-    unsigned int nUndoPos;
+    //! Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
 
-    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    arith_uint256 nChainWork;
+    //! block header difficulty target
+    unsigned int nBits;
 
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
 
+    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    arith_uint256 nChainWork;
+
     //! (memory only) Number of transactions in the chain up to and including this block.
     //! This value will be non-zero only if and only if transactions for this block and all its parents are available.
     //! Change to 64-bit type when necessary; won't happen before 2030
     unsigned int nChainTx;
 
-    //! Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
-
-    //! block header
-    int nVersion;
-    uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
-    unsigned int nNonce;
-
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
-    
-    // block signature - proof-of-stake protect the block by signing the block using a stake holder private key
-    std::vector<unsigned char> vchBlockSig;
-
-    unsigned int nFlags;  // ppcoin: block index flags
-    enum  
-    {
-        BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
-        BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
-        BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
-    };
+    //! Byte offset within rev?????.dat where this block's undo data is stored
+    unsigned int nUndoPos;
 
-    uint64_t nStakeModifier; // hash modifier for proof-of-stake
-    uint256 bnStakeModifierV2;
+    //! block header version
+    int nVersion;
 
-    // proof-of-stake specific fields
-    COutPoint prevoutStake;
-    unsigned int nStakeTime;
+    //! rest of the block header and the proof-of-stake data
+    CBlockIndexColdPtr pcold;
 
-    uint256 hashProof;
-   
-	
     void SetNull()
     {
         phashBlock = NULL;
         pprev = NULL;
-        
-        pnext = NULL;
-        
         pskip = NULL;
         nHeight = 0;
         nFile = 0;
@@ -247,20 +314,14 @@ public:
         nStatus = 0;
         nSequenceId = 0;
         
-        vchBlockSig.clear();
         nFlags = 0;
         nStakeModifier = 0;
-        bnStakeModifierV2 = uint256();
-        hashProof = uint256();
-        prevoutStake.SetNull();
-        nStakeTime = 0;
-        
 
         nVersion       = 0;
-        hashMerkleRoot = uint256();
         nTime          = 0;
         nBits          = 0;
-        nNonce         = 0;
+
+        pcold->SetNull();
     }
 
     CBlockIndex()
@@ -271,31 +332,31 @@ public:
     CBlockIndex(const CBlockHeader& block)
     {
         SetNull();
+        SetBlockHeader(block);
+    }
 
-        
-        nFlags = 0;
-        nStakeModifier = 0;
-        bnStakeModifierV2 = uint256();
-        hashProof = uint256(); 
+    //! Construct an entry whose cold fields are stored at pcoldIn
+    explicit CBlockIndex(CBlockIndexCold* pcoldIn) : pcold(pcoldIn)
+    {
+        SetNull();
+    }
+
+    void SetBlockHeader(const CBlockHeader& block)
+    {
         if (block.IsProofOfStake())
         {
             SetProofOfStake();
-            prevoutStake = block.PrevoutStake();
-            nStakeTime = block.StakeTime();
-        }
-        else
-        {
-            prevoutStake.SetNull();
-            nStakeTime = 0;
+            pcold->prevoutStake = block.PrevoutStake();
+            pcold->nStakeTime = block.StakeTime();
         }
 
-        vchBlockSig    = block.vchBlockSig;
+        pcold->vchBlockSig    = block.vchBlockSig;
         
         nVersion       = block.nVersion;
-        hashMerkleRoot = block.hashMerkleRoot;
+        pcold->hashMerkleRoot = block.hashMerkleRoot;
         nTime          = block.nTime;
         nBits          = block.nBits;
-        nNonce         = block.nNonce;
+        pcold->nNonce  = block.nNonce;
     }
 
     CDiskBlockPos GetBlockPos() const {
@@ -322,15 +383,15 @@ public:
         block.nVersion       = nVersion;
         if (pprev)
             block.hashPrevBlock = pprev->GetBlockHash();
-        block.hashMerkleRoot = hashMerkleRoot;
+        block.hashMerkleRoot = pcold->hashMerkleRoot;
         block.nTime          = nTime;
         block.nBits          = nBits;
-        block.nNonce         = nNonce;
+        block.nNonce         = pcold->nNonce;
         
-        block.vchBlockSig    = vchBlockSig;
+        block.vchBlockSig    = pcold->vchBlockSig;
         block.fStake         = IsProofOfStake();
-        block.prevoutStake   = prevoutStake;
-        block.nStakeTime     = nStakeTime;
+        block.prevoutStake   = pcold->prevoutStake;
+        block.nStakeTime     = pcold->nStakeTime;
         
         return block;
     }
@@ -377,6 +438,16 @@ public:
         nFlags |= BLOCK_PROOF_OF_STAKE;
     }
 
+    bool StakeCheckedOnHeader() const
+    {
+        return (nFlags & BLOCK_STAKE_CHECKED);
+    }
+
+    void SetStakeCheckedOnHeader()
+    {
+        nFlags |= BLOCK_STAKE_CHECKED;
+    }
+
     unsigned int GetStakeEntropyBit() const
     {
         return ((nFlags & BLOCK_STAKE_ENTROPY) >> 1);
@@ -407,13 +478,13 @@ public:
     {
         
         return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, nFlags=(%s)(%d)(%s), nStakeModifier=%016x, hashProof=%s, prevoutStake=(%s), nStakeTime=%d, merkle=%s, hashBlock=%s)",
-            pprev, pnext, nHeight,
+            pprev, pcold->pnext, nHeight,
             GeneratedStakeModifier() ? "MOD" : "-", GetStakeEntropyBit(), IsProofOfStake()? "PoS" : "PoW",
             nStakeModifier,
-            hashProof.ToString(),
-            prevoutStake.ToString(), nStakeTime,
+            pcold->hashProof.ToString(),
+            pcold->prevoutStake.ToString(), pcold->nStakeTime,
         
-            hashMerkleRoot.ToString(),
+            pcold->hashMerkleRoot.ToString(),
             GetBlockHash().ToString());
     }
 
@@ -448,6 +519,50 @@ public:
     const CBlockIndex* GetAncestor(int height) const;
 };
 
+/**
+ * Storage for block index entries. Entries are placed back to back in large
+ * chunks instead of being allocated one by one, so entries created in height
+ * order, as at startup and during headers sync, are adjacent in memory and no
+ * per-allocation overhead is paid. The cold part of each entry goes to
+ * separate chunks, so walks over the hot parts skip it. Entries are only
+ * freed all at once.
+ * Not thread safe; the block index is protected by cs_main.
+ */
+class CBlockIndexArena
+{
+public:
+    CBlockIndexArena(size_t nChunkEntriesIn = 4096);
+    ~CBlockIndexArena();
+
+    CBlockIndex* Allocate();
+    CBlockIndex* Allocate(const CBlockHeader& block);
+    CBlockIndex* Allocate(const CBlockIndex& index);
+
+    //! Destroy all entries
+    void Clear();
+
+    void swap(CBlockIndexArena& other);
+
+    size_t size() const { return nEntries; }
+    size_t DynamicMemoryUsage() const;
+
+private:
+    //! Entries per chunk
+    size_t nChunkEntries;
+    //! Chunks of hot entries as returned by the allocator, and their cache line aligned start
+    std::vector<char*> vChunks;
+    std::vector<char*> vChunkEntries;
+    //! Chunks of the matching cold parts
+    std::vector<char*> vColdChunks;
+    size_t nEntries;
+
+    CBlockIndex* GetEntry(size_t nPos) const;
+    CBlockIndexCold* GetCold(size_t nPos) const;
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+};
+
 arith_uint256 GetBlockProof(const CBlockIndex& block);
 /** Return the time it would take to redo the work difference between from and to, assuming the current hashrate corresponds to the difficulty at tip, in seconds. */
 int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip, const Consensus::Params&);
@@ -483,29 +598,33 @@ public:
         if (nStatus & BLOCK_HAVE_UNDO)
             READWRITE(VARINT(nUndoPos));
         
-        READWRITE(nFlags);
+        // BLOCK_STAKE_CHECKED only records what this run checked
+        unsigned int nDiskFlags = nFlags & ~BLOCK_STAKE_CHECKED;
+        READWRITE(nDiskFlags);
+        if (ser_action.ForRead())
+            nFlags = nDiskFlags & ~BLOCK_STAKE_CHECKED;
         READWRITE(nStakeModifier);
-        READWRITE(bnStakeModifierV2);
+        READWRITE(pcold->bnStakeModifierV2);
         if (IsProofOfStake())
         {
-            READWRITE(prevoutStake);
-            READWRITE(nStakeTime);
+            READWRITE(pcold->prevoutStake);
+            READWRITE(pcold->nStakeTime);
         }
         else if (ser_action.ForRead())
         {
-            const_cast<CDiskBlockIndex*>(this)->prevoutStake.SetNull();
-            const_cast<CDiskBlockIndex*>(this)->nStakeTime = 0;
+            pcold->prevoutStake.SetNull();
+            pcold->nStakeTime = 0;
         }
-        READWRITE(hashProof);
-        READWRITE(vchBlockSig);
+        READWRITE(pcold->hashProof);
+        READWRITE(pcold->vchBlockSig);
         
         // block header
         READWRITE(this->nVersion);
         READWRITE(hashPrev);
-        READWRITE(hashMerkleRoot);
+        READWRITE(pcold->hashMerkleRoot);
         READWRITE(nTime);
         READWRITE(nBits);
-        READWRITE(nNonce);
+        READWRITE(pcold->nNonce);
     }
 
     uint256 GetBlockHash() const
@@ -513,10 +632,10 @@ public:
         CBlockHeader block;
         block.nVersion        = nVersion;
         block.hashPrevBlock   = hashPrev;
-        block.hashMerkleRoot  = hashMerkleRoot;
+        block.hashMerkleRoot  = pcold->hashMerkleRoot;
         block.nTime           = nTime;
         block.nBits           = nBits;
-        block.nNonce          = nNonce;
+        block.nNonce          = pcold->nNonce;
         
         return block.GetHash();
     }
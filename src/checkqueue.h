@@ -6,6 +6,9 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -25,136 +28,211 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker has its own queue, and the master spreads the checks it adds
+  * over them in chunks. Workers take small batches from the back of their
+  * own queue, and when it is empty steal half of another queue from the
+  * front. Each queue has its own lock, so threads only meet on the same lock
+  * when stealing; the shared counters are atomic, and the sleep lock is only
+  * taken by threads that are out of work and by Add when one of them has to
+  * be woken.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
-
-    //! Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+    /** The checks of one worker; the owner takes from the back, thieves from the front */
+    struct WorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<T> checks;
+        //! checks.size(), readable without the lock so empty queues can be skipped
+        std::atomic<size_t> nSize;
 
-    //! Master thread blocks on this when out of work
-    boost::condition_variable condMaster;
+        WorkerQueue() : nSize(0) {}
+    };
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The queue of the master is at index 0, those of the workers follow
+    std::vector<std::unique_ptr<WorkerQueue> > vQueues;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of worker threads that have started (not including the master)
+    std::atomic<int> nWorkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The queue Add puts its next chunk into (only used by the master)
+    size_t nNextQueue;
 
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! Number of checks waiting in any of the queues
+    std::atomic<unsigned int> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
+
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
+
+    //! The number of workers (including the master) that are sleeping or about to.
+    std::atomic<int> nIdle;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! Protects sleeping on the condition variables below, nothing else
+    boost::mutex mutexSleep;
+
+    //! Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    //! Master thread blocks on this while the last checks are being finished
+    boost::condition_variable condMaster;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Move up to nMax checks from the back (fOwn) or front of queue into vChecks
+    size_t Take(WorkerQueue& queue, std::vector<T>& vChecks, bool fOwn)
+    {
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        size_t nSize = queue.checks.size();
+        if (nSize == 0)
+            return 0;
+        // The owner takes small batches so that little work is out of reach of
+        // thieves near the end; a thief takes half, so it does not return soon.
+        size_t nNow = fOwn ? std::max((size_t)1, std::min((size_t)nBatchSize, nSize / (nWorkers + 2))) :
+                             std::max((size_t)1, std::min((size_t)nBatchSize, nSize / 2));
+        vChecks.resize(nNow);
+        for (size_t i = 0; i < nNow; i++) {
+            if (fOwn) {
+                vChecks[i].swap(queue.checks.back());
+                queue.checks.pop_back();
+            } else {
+                vChecks[i].swap(queue.checks.front());
+                queue.checks.pop_front();
+            }
+        }
+        queue.nSize = queue.checks.size();
+        nQueued -= nNow;
+        return nNow;
+    }
+
+    //! Fill vChecks from the queue at nIndex, or else from the first other queue with work
+    size_t TakeOrSteal(size_t nIndex, std::vector<T>& vChecks)
+    {
+        if (vQueues[nIndex]->nSize > 0) {
+            size_t nNow = Take(*vQueues[nIndex], vChecks, true);
+            if (nNow)
+                return nNow;
+        }
+        for (size_t i = 1; i < vQueues.size(); i++) {
+            WorkerQueue& victim = *vQueues[(nIndex + i) % vQueues.size()];
+            if (victim.nSize == 0)
+                continue;
+            size_t nNow = Take(victim, vChecks, false);
+            if (nNow)
+                return nNow;
+        }
+        return 0;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(size_t nIndex, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
+            size_t nNow = TakeOrSteal(nIndex, vChecks);
+            if (nNow == 0) {
+                boost::unique_lock<boost::mutex> lock(mutexSleep);
+                if (fMaster) {
+                    // Nothing left to take; wait for the checks other threads are running
+                    while (nTodo != 0 && nQueued == 0)
+                        condMaster.wait(lock);
+                    if (nTodo == 0) {
                         bool fRet = fAllOk;
                         // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
+                        fAllOk = true;
                         // return the current status
                         return fRet;
                     }
+                } else {
+                    // Add checks nIdle after raising nQueued, so either it
+                    // sees this thread idle or this thread sees the work
                     nIdle++;
-                    cond.wait(lock); // wait
+                    while (nQueued == 0)
+                        condWorker.wait(lock);
                     nIdle--;
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
             }
-            // execute work
+
+            // execute work, unless another check has failed already
+            bool fOk = fAllOk;
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
                     fOk = check();
             vChecks.clear();
+            if (!fOk)
+                fAllOk = false;
+            if ((nTodo -= nNow) == 0 && !fMaster) {
+                // We processed the last element; inform the master it can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutexSleep);
+                condMaster.notify_one();
+            }
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue with room for nMaxWorkersIn worker threads of their own
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkersIn = 64) : nWorkers(0), nNextQueue(0), nQueued(0), nTodo(0), fAllOk(true), nIdle(0), nBatchSize(nBatchSizeIn)
+    {
+        for (unsigned int i = 0; i < nMaxWorkersIn + 1; i++)
+            vQueues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        // Threads beyond nMaxWorkersIn share queues
+        int nWorker = nWorkers++;
+        Loop(1 + nWorker % (vQueues.size() - 1));
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
+        // Spread the checks over the queues of the running threads, in chunks
+        // of at most nBatchSize
+        size_t nQueues = std::min(vQueues.size(), (size_t)nWorkers + 1);
+        size_t nChunk = std::max((size_t)1, std::min((size_t)nBatchSize, (vChecks.size() + nQueues - 1) / nQueues));
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        for (size_t nStart = 0; nStart < vChecks.size(); nStart += nChunk) {
+            WorkerQueue& queue = *vQueues[nNextQueue++ % nQueues];
+            size_t nEnd = std::min(vChecks.size(), nStart + nChunk);
+            {
+                boost::unique_lock<boost::mutex> lock(queue.mutex);
+                for (size_t i = nStart; i < nEnd; i++) {
+                    queue.checks.push_back(T());
+                    vChecks[i].swap(queue.checks.back());
+                }
+                queue.nSize = queue.checks.size();
+            }
+            nQueued += nEnd - nStart;
+        }
+        if (nIdle > 0) {
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
@@ -163,8 +241,7 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nQueued == 0 && nTodo == 0 && fAllOk == true);
     }
 
 };
@@ -4,11 +4,19 @@
 
 #include "coins.h"
 
+#include "checkqueue.h"
+#include "clientversion.h"
 #include "memusage.h"
 #include "random.h"
+#include "streams.h"
+#include "util.h"
 
+#include <algorithm>
 #include <assert.h>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -45,11 +53,76 @@ bool CCoins::Spend(uint32_t nPos)
     return true;
 }
 
+void CCoinsStats::UpdateOutput(const uint256 &txid, unsigned int n, const CCoins &coins, bool fAdd)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txid << VARINT(n) << VARINT(coins.nHeight * 4 + (coins.fCoinStake ? 2 : 0) + (coins.fCoinBase ? 1 : 0)) << VARINT(coins.nVersion) << coins.vout[n];
+    std::vector<unsigned char> vch(ss.begin(), ss.end());
+    if (fAdd) {
+        nTransactionOutputs++;
+        nTotalAmount += coins.vout[n].nValue;
+        muhash.Insert(vch);
+    } else {
+        nTransactionOutputs--;
+        nTotalAmount -= coins.vout[n].nValue;
+        muhash.Remove(vch);
+    }
+}
+
+void CCoinsStats::UpdateRecord(const uint256 &txid, const CCoins &coins, bool fAdd)
+{
+    if (coins.IsPruned())
+        return;
+    // The database key is a one byte record type followed by the txid
+    uint64_t nSize = 1 + ::GetSerializeSize(txid, SER_DISK, CLIENT_VERSION) + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+    if (fAdd) {
+        nTransactions++;
+        nSerializedSize += nSize;
+    } else {
+        nTransactions--;
+        nSerializedSize -= nSize;
+    }
+}
+
+void CCoinsStats::UpdateCoins(const uint256 &txid, const CCoins &coinsOld, const CCoins &coinsNew)
+{
+    bool fSameMetadata = coinsOld.fCoinBase == coinsNew.fCoinBase && coinsOld.fCoinStake == coinsNew.fCoinStake &&
+                         coinsOld.nHeight == coinsNew.nHeight && coinsOld.nVersion == coinsNew.nVersion;
+    for (unsigned int i = 0; i < std::max(coinsOld.vout.size(), coinsNew.vout.size()); i++) {
+        bool fOld = coinsOld.IsAvailable(i);
+        bool fNew = coinsNew.IsAvailable(i);
+        if (fOld && fNew && fSameMetadata && coinsOld.vout[i] == coinsNew.vout[i])
+            continue;
+        if (fOld)
+            UpdateOutput(txid, i, coinsOld, false);
+        if (fNew)
+            UpdateOutput(txid, i, coinsNew, true);
+    }
+    UpdateRecord(txid, coinsOld, false);
+    UpdateRecord(txid, coinsNew, true);
+}
+
+CCoinsStats& CCoinsStats::operator+=(const CCoinsStats &delta)
+{
+    // The counters wrap around, so adding a delta that went below zero works
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nSerializedSize += delta.nSerializedSize;
+    nTotalAmount += delta.nTotalAmount;
+    muhash *= delta.muhash;
+    return *this;
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
+void CCoinsView::GetCoinsBatch(const uint256 *ptxid, size_t nCount, CCoins *pcoins, char *pfFound) const {
+    for (size_t i = 0; i < nCount; i++)
+        pfFound[i] = GetCoins(ptxid[i], pcoins[i]);
+}
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
-bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta) { return false; }
 CCoinsViewCursor *CCoinsView::Cursor() const { return 0; }
+bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
@@ -57,12 +130,122 @@ bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) const { retu
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveCoins(txid); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta) { return base->BatchWrite(mapCoins, hashBlock, pstatsDelta); }
 CCoinsViewCursor *CCoinsViewBacked::Cursor() const { return base->Cursor(); }
+bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
+
+CCoinsViewBackgroundWriter::CCoinsViewBackgroundWriter(CCoinsView *baseIn, bool fBackgroundIn) : CCoinsViewBacked(baseIn), fBackground(fBackgroundIn), fStatsWriting(false), nWritingUsage(0), pthread(NULL), fWriteDone(false), fWriteOk(true) { }
+
+CCoinsViewBackgroundWriter::~CCoinsViewBackgroundWriter()
+{
+    WaitForWrite();
+}
+
+bool CCoinsViewBackgroundWriter::GetCoins(const uint256 &txid, CCoins &coins) const {
+    CCoinsMap::const_iterator it = mapWriting.find(txid);
+    if (it != mapWriting.end()) {
+        coins = it->second.coins;
+        return true;
+    }
+    return base->GetCoins(txid, coins);
+}
+
+void CCoinsViewBackgroundWriter::GetCoinsBatch(const uint256 *ptxid, size_t nCount, CCoins *pcoins, char *pfFound) const {
+    // Pass on the runs of txids that are not being written
+    size_t nStart = 0;
+    for (size_t i = 0; i < nCount && !mapWriting.empty(); i++) {
+        CCoinsMap::const_iterator it = mapWriting.find(ptxid[i]);
+        if (it == mapWriting.end())
+            continue;
+        if (i > nStart)
+            base->GetCoinsBatch(ptxid + nStart, i - nStart, pcoins + nStart, pfFound + nStart);
+        pcoins[i] = it->second.coins;
+        pfFound[i] = true;
+        nStart = i + 1;
+    }
+    if (nCount > nStart)
+        base->GetCoinsBatch(ptxid + nStart, nCount - nStart, pcoins + nStart, pfFound + nStart);
+}
+
+bool CCoinsViewBackgroundWriter::HaveCoins(const uint256 &txid) const {
+    CCoinsMap::const_iterator it = mapWriting.find(txid);
+    if (it != mapWriting.end())
+        return !it->second.coins.vout.empty();
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewBackgroundWriter::GetBestBlock() const {
+    if (pthread && !hashBlockWriting.IsNull())
+        return hashBlockWriting;
+    return base->GetBestBlock();
+}
+
+void CCoinsViewBackgroundWriter::ThreadWrite()
+{
+    RenameThread("atbcoin-coinsflush");
+    int64_t nStart = GetTimeMicros();
+    try {
+        fWriteOk = base->BatchWrite(mapWriting, hashBlockWriting, fStatsWriting ? &statsWriting : NULL);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        fWriteOk = false;
+    }
+    LogPrint("bench", "    - Background coins write: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+    fWriteDone = true;
+}
+
+bool CCoinsViewBackgroundWriter::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta) {
+    if (!WaitForWrite())
+        return false;
+    if (!fBackground)
+        return base->BatchWrite(mapCoins, hashBlock, pstatsDelta);
+
+    // Only the modified entries need writing; the rest are already in base
+    mapWriting.swap(mapCoins);
+    nWritingUsage = 0;
+    for (CCoinsMap::iterator it = mapWriting.begin(); it != mapWriting.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            nWritingUsage += it->second.coins.DynamicMemoryUsage();
+            it++;
+        } else {
+            mapWriting.erase(it++);
+        }
+    }
+    nWritingUsage += memusage::DynamicUsage(mapWriting);
+    hashBlockWriting = hashBlock;
+    fStatsWriting = pstatsDelta != NULL;
+    statsWriting = fStatsWriting ? *pstatsDelta : CCoinsStats();
+    fWriteDone = false;
+    pthread = new boost::thread(boost::bind(&CCoinsViewBackgroundWriter::ThreadWrite, this));
+    return true;
+}
+
+bool CCoinsViewBackgroundWriter::GetStats(CCoinsStats &stats) const {
+    // The write result is left for WaitForWrite to collect
+    if (pthread && pthread->joinable())
+        pthread->join();
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewBackgroundWriter::WaitForWrite() {
+    if (!pthread)
+        return true;
+    if (pthread->joinable())
+        pthread->join();
+    delete pthread;
+    pthread = NULL;
+    CCoinsMap().swap(mapWriting);
+    hashBlockWriting.SetNull();
+    fStatsWriting = false;
+    nWritingUsage = 0;
+    bool fOk = fWriteOk;
+    fWriteOk = true;
+    return fOk;
+}
 
 SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0), fStatsDeltaComplete(true) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -70,7 +253,14 @@ CCoinsViewCache::~CCoinsViewCache()
 }
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
-    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+    return memusage::DynamicUsage(cacheCoins) + memusage::DynamicUsage(vDirty) + cachedCoinsUsage;
+}
+
+void CCoinsViewCache::MarkDirty(CCoinsMap::iterator it) {
+    if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        vDirty.push_back(it->first);
+    }
 }
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
@@ -91,6 +281,45 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
     return ret;
 }
 
+void CCoinsViewCache::Prefetch(const std::vector<uint256> &vTxid, CCheckQueue<CCoinsPrefetch> *pqueue) {
+    assert(!hasModifier);
+    std::vector<uint256> vMissing;
+    vMissing.reserve(vTxid.size());
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        if (!cacheCoins.count(txid))
+            vMissing.push_back(txid);
+    }
+    std::sort(vMissing.begin(), vMissing.end());
+    vMissing.erase(std::unique(vMissing.begin(), vMissing.end()), vMissing.end());
+
+    std::vector<CCoins> vCoins(vMissing.size());
+    std::vector<char> vFound(vMissing.size(), 0);
+    std::vector<CCoinsPrefetch> vChecks;
+    vChecks.reserve(vMissing.size() / PREFETCH_BATCH_SIZE + 1);
+    for (size_t i = 0; i < vMissing.size(); i += PREFETCH_BATCH_SIZE) {
+        size_t nCount = std::min(PREFETCH_BATCH_SIZE, vMissing.size() - i);
+        vChecks.push_back(CCoinsPrefetch(base, &vMissing[i], nCount, &vCoins[i], &vFound[i]));
+    }
+    if (pqueue) {
+        CCheckQueueControl<CCoinsPrefetch> control(pqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        BOOST_FOREACH(CCoinsPrefetch &check, vChecks)
+            check();
+    }
+
+    for (size_t i = 0; i < vMissing.size(); i++) {
+        if (!vFound[i])
+            continue;
+        CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(vMissing[i], CCoinsCacheEntry())).first;
+        vCoins[i].swap(ret->second.coins);
+        if (ret->second.coins.IsPruned())
+            ret->second.flags = CCoinsCacheEntry::FRESH;
+        cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
+    }
+}
+
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     CCoinsMap::const_iterator it = FetchCoins(txid);
     if (it != cacheCoins.end()) {
@@ -117,7 +346,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
         cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    MarkDirty(ret.first);
     return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
@@ -132,7 +361,7 @@ CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid, bool coinbas
     if (!coinbase) {
         ret.first->second.flags = CCoinsCacheEntry::FRESH;
     }
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    MarkDirty(ret.first);
     return CCoinsModifier(*this, ret.first, 0);
 }
 
@@ -169,8 +398,12 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn, const CCoinsStats *pstatsDelta) {
     assert(!hasModifier);
+    if (pstatsDelta)
+        statsDelta += *pstatsDelta;
+    else
+        fStatsDeltaComplete = false;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
@@ -180,15 +413,15 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                 if (!(it->second.flags & CCoinsCacheEntry::FRESH && it->second.coins.IsPruned())) {
                     // Otherwise we will need to create it in the parent
                     // and move the data up and mark it as dirty
-                    CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
-                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
-                    entry.flags = CCoinsCacheEntry::DIRTY;
+                    itUs = cacheCoins.insert(std::make_pair(it->first, CCoinsCacheEntry())).first;
+                    itUs->second.coins.swap(it->second.coins);
+                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
+                    MarkDirty(itUs);
                     // We can mark it FRESH in the parent if it was FRESH in the child
                     // Otherwise it might have just been flushed from the parent's cache
                     // and already exist in the grandparent
                     if (it->second.flags & CCoinsCacheEntry::FRESH)
-                        entry.flags |= CCoinsCacheEntry::FRESH;
+                        itUs->second.flags |= CCoinsCacheEntry::FRESH;
                 }
             } else {
                 // Found the entry in the parent cache
@@ -203,7 +436,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
-                    itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    MarkDirty(itUs);
                 }
             }
         }
@@ -214,13 +447,52 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
     return true;
 }
 
+bool CCoinsViewCache::GetStats(CCoinsStats &stats) const {
+    if (!fStatsDeltaComplete || !base->GetStats(stats))
+        return false;
+    stats += statsDelta;
+    stats.hashBlock = GetBestBlock();
+    return true;
+}
+
 bool CCoinsViewCache::Flush() {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, fStatsDeltaComplete ? &statsDelta : NULL);
     cacheCoins.clear();
     cachedCoinsUsage = 0;
+    std::vector<uint256>().swap(vDirty);
+    statsDelta = CCoinsStats();
+    fStatsDeltaComplete = true;
     return fOk;
 }
 
+bool CCoinsViewCache::Sync() {
+    assert(!hasModifier);
+    CCoinsMap mapDirty;
+    BOOST_FOREACH(const uint256 &txid, vDirty) {
+        CCoinsMap::iterator it = cacheCoins.find(txid);
+        if (it == cacheCoins.end() || !(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // The base gets a copy, and the entry stays cached as an unmodified
+        // one, as recently modified coins are the likeliest to be read again.
+        // Spent entries have nothing left to read.
+        CCoinsCacheEntry &entry = mapDirty[txid];
+        entry.coins = it->second.coins;
+        entry.flags = it->second.flags;
+        if (it->second.coins.IsPruned()) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it);
+        } else {
+            it->second.flags = 0;
+        }
+    }
+    std::vector<uint256>().swap(vDirty);
+    CCoinsStats statsDirty;
+    std::swap(statsDirty, statsDelta);
+    bool fStatsDirty = fStatsDeltaComplete;
+    fStatsDeltaComplete = true;
+    return base->BatchWrite(mapDirty, hashBlock, fStatsDirty ? &statsDirty : NULL);
+}
+
 void CCoinsViewCache::Uncache(const uint256& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
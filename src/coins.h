@@ -10,15 +10,21 @@
 #include "core_memusage.h"
 #include "hash.h"
 #include "memusage.h"
+#include "muhash.h"
 #include "serialize.h"
 #include "uint256.h"
 
 #include <assert.h>
+#include <atomic>
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
 #include <boost/unordered_map.hpp>
 
+namespace boost {
+class thread;
+} // namespace boost
+
 struct CSpentIndexKey {
     uint256 txid;
     unsigned int outputIndex;
@@ -92,6 +98,69 @@ struct CSpentIndexValue {
     }
 };
 
+struct CAddressIndexKey {
+    unsigned int type;
+    uint160 hashBytes;
+    int blockHeight;
+    unsigned int txindex;
+    uint256 txhash;
+    size_t index;
+    bool spending;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return 66;
+    }
+    template<typename Stream>
+   void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s, nType, nVersion);
+        // Heights are stored big-endian for key sorting in LevelDB
+        ser_writedata32be(s, blockHeight);
+        ser_writedata32be(s, txindex);
+        txhash.Serialize(s, nType, nVersion);
+        ser_writedata32(s, index);
+        char f = spending;
+        ser_writedata8(s, f);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        type = ser_readdata8(s);
+        hashBytes.Unserialize(s, nType, nVersion);
+        blockHeight = ser_readdata32be(s);
+        txindex = ser_readdata32be(s);
+        txhash.Unserialize(s, nType, nVersion);
+        index = ser_readdata32(s);
+        char f = ser_readdata8(s);
+        spending = f;
+    }
+
+    CAddressIndexKey(unsigned int addressType, uint160 addressHash, int height, int blockindex,
+                     uint256 txid, size_t indexValue, bool isSpending) {
+        type = addressType;
+        hashBytes = addressHash;
+        blockHeight = height;
+        txindex = blockindex;
+        txhash = txid;
+        index = indexValue;
+        spending = isSpending;
+    }
+
+    CAddressIndexKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        type = 0;
+        hashBytes.SetNull();
+        blockHeight = 0;
+        txindex = 0;
+        txhash.SetNull();
+        index = 0;
+        spending = false;
+    }
+
+};
+
 
 /** 
  * Pruned version of CTransaction: only retains metadata and unspent transaction outputs
@@ -413,6 +482,47 @@ struct CCoinsCacheEntry
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
 
+/**
+ * Statistics about the unspent transaction outputs of a view, kept up to date
+ * as outputs are added and spent rather than computed by scanning them.
+ * ConnectBlock and DisconnectBlock collect how a block changes them, and the
+ * change travels with the modified coins through BatchWrite.
+ */
+struct CCoinsStats
+{
+    //! The block whose state the statistics describe; not serialized
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    //! Size of the keys and values of the coin database records
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    //! Order-independent hash of the set of unspent outputs
+    MuHash3072 muhash;
+
+    CCoinsStats() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    //! Add or remove output n of coins, the outputs of txid
+    void UpdateOutput(const uint256 &txid, unsigned int n, const CCoins &coins, bool fAdd);
+    //! Add or remove the database record of coins, unless it is pruned, leaving its outputs alone
+    void UpdateRecord(const uint256 &txid, const CCoins &coins, bool fAdd);
+    //! Account for replacing the coins of txid, coinsOld, by coinsNew
+    void UpdateCoins(const uint256 &txid, const CCoins &coinsOld, const CCoins &coinsNew);
+    //! Add the changes collected in delta, which started out as empty statistics
+    CCoinsStats& operator+=(const CCoinsStats &delta);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    }
+};
+
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
 {
@@ -441,6 +551,10 @@ public:
     //! Retrieve the CCoins (unspent transaction outputs) for a given txid
     virtual bool GetCoins(const uint256 &txid, CCoins &coins) const;
 
+    //! Retrieve the CCoins of nCount distinct txids, sorted in ascending order, into
+    //! pcoins[i], setting pfFound[i] to what GetCoins would return for each
+    virtual void GetCoinsBatch(const uint256 *ptxid, size_t nCount, CCoins *pcoins, char *pfFound) const;
+
     //! Just check whether we have data for a given txid.
     //! This may (but cannot always) return true for fully spent transactions
     virtual bool HaveCoins(const uint256 &txid) const;
@@ -449,12 +563,20 @@ public:
     virtual uint256 GetBestBlock() const;
 
     //! Do a bulk modification (multiple CCoins changes + BestBlock change).
-    //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Only DIRTY entries are written. Implementations may take entries out of
+    //! mapCoins (CCoinsViewCache erases all of them, CCoinsViewBackgroundWriter
+    //! takes the whole map) or leave it unchanged (CCoinsViewDB), so callers
+    //! must not rely on its contents afterwards: Flush clears its own map and
+    //! Sync passes a copy. pstatsDelta is how the entries change the
+    //! statistics, or NULL if that is not known.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta);
 
     //! Get a cursor to iterate over the whole state
     virtual CCoinsViewCursor *Cursor() const;
 
+    //! Get the statistics of the whole state, if this view maintains them
+    virtual bool GetStats(CCoinsStats &stats) const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -472,8 +594,66 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta);
     CCoinsViewCursor *Cursor() const;
+    bool GetStats(CCoinsStats &stats) const;
+};
+
+
+/**
+ * CCoinsView that can write to its base view from a background thread.
+ * BatchWrite takes over the modified entries and returns at once, and lookups
+ * are answered from those entries until the write is done. Only one write runs
+ * at a time; BatchWrite waits for the previous one. The base view must leave
+ * the map it writes unchanged and allow lookups while writing, as CCoinsViewDB
+ * does. Without fBackground, writes are passed on directly.
+ */
+class CCoinsViewBackgroundWriter : public CCoinsViewBacked
+{
+private:
+    bool fBackground;
+
+    //! The entries being written; not modified while pthread runs
+    CCoinsMap mapWriting;
+    uint256 hashBlockWriting;
+    CCoinsStats statsWriting;
+    bool fStatsWriting;
+    size_t nWritingUsage;
+
+    boost::thread *pthread;
+    std::atomic<bool> fWriteDone;
+    //! Result of the background write, read after joining pthread
+    bool fWriteOk;
+
+    void ThreadWrite();
+
+public:
+    CCoinsViewBackgroundWriter(CCoinsView *baseIn, bool fBackgroundIn);
+    ~CCoinsViewBackgroundWriter();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    void GetCoinsBatch(const uint256 *ptxid, size_t nCount, CCoins *pcoins, char *pfFound) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta);
+    //! Waits for a background write, as the base only counts its entries once it is done
+    bool GetStats(CCoinsStats &stats) const;
+
+    //! Whether a background write has not finished yet
+    bool IsWriting() const { return pthread && !fWriteDone; }
+
+    /**
+     * Wait for the background write to finish and release its entries.
+     * Returns false if the write failed.
+     */
+    bool WaitForWrite();
+
+    //! Memory held by the entries being written (in bytes)
+    size_t DynamicMemoryUsage() const { return nWritingUsage; }
+
+private:
+    CCoinsViewBackgroundWriter(const CCoinsViewBackgroundWriter &);
+    CCoinsViewBackgroundWriter& operator=(const CCoinsViewBackgroundWriter &);
 };
 
 
@@ -499,6 +679,41 @@ public:
     friend class CCoinsViewCache;
 };
 
+template <typename T>
+class CCheckQueue;
+
+/** Number of sorted txids one CCoinsPrefetch looks up together */
+static const size_t PREFETCH_BATCH_SIZE = 16;
+
+/** A lookup of the coins of a run of sorted txids, for Prefetch to run on a CCheckQueue */
+class CCoinsPrefetch
+{
+private:
+    const CCoinsView *base;
+    const uint256 *ptxid;
+    size_t nCount;
+    CCoins *pcoins;
+    char *pfFound;
+
+public:
+    CCoinsPrefetch() : base(NULL), ptxid(NULL), nCount(0), pcoins(NULL), pfFound(NULL) {}
+    CCoinsPrefetch(const CCoinsView *baseIn, const uint256 *ptxidIn, size_t nCountIn, CCoins *pcoinsIn, char *pfFoundIn) :
+        base(baseIn), ptxid(ptxidIn), nCount(nCountIn), pcoins(pcoinsIn), pfFound(pfFoundIn) {}
+
+    bool operator()() {
+        base->GetCoinsBatch(ptxid, nCount, pcoins, pfFound);
+        return true;
+    }
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(base, check.base);
+        std::swap(ptxid, check.ptxid);
+        std::swap(nCount, check.nCount);
+        std::swap(pcoins, check.pcoins);
+        std::swap(pfFound, check.pfFound);
+    }
+};
+
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
@@ -517,6 +732,24 @@ protected:
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /**
+     * How the changes made since the last flush change the statistics of the
+     * base view, as passed to AddStatsDelta and BatchWrite, so GetStats can
+     * describe this view without flushing it. A BatchWrite without a delta
+     * makes fStatsDeltaComplete false until the next flush.
+     */
+    CCoinsStats statsDelta;
+    bool fStatsDeltaComplete;
+
+    /**
+     * Txids of the entries marked DIRTY since the last flush, so Sync does not
+     * have to scan the whole cache. Entries may since have been erased or
+     * listed twice.
+     */
+    std::vector<uint256> vDirty;
+
+    void MarkDirty(CCoinsMap::iterator it);
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -526,7 +759,16 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta);
+    //! The statistics of the base view plus the changes made since the last flush
+    bool GetStats(CCoinsStats &stats) const;
+
+    /**
+     * Account for how changes made to this cache change the statistics.
+     * Whoever modifies the coins is responsible for this: ConnectBlock and
+     * DisconnectBlock do it for the blocks they apply.
+     */
+    void AddStatsDelta(const CCoinsStats &delta) { statsDelta += delta; }
 
     /**
      * Check if we have the given tx already loaded in this cache.
@@ -560,6 +802,14 @@ public:
      */
     CCoinsModifier ModifyNewCoins(const uint256 &txid, bool coinbase);
 
+    /**
+     * Load the coins of every txid in vTxid that is not cached yet, looking
+     * them up in the base view from the threads of pqueue, or from this
+     * thread if it is NULL. The base view must allow concurrent GetCoins
+     * calls when a queue is used.
+     */
+    void Prefetch(const std::vector<uint256> &vTxid, CCheckQueue<CCoinsPrefetch> *pqueue);
+
     /**
      * Push the modifications applied to this cache to its base.
      * Failure to call this method before destruction will cause the changes to be forgotten.
@@ -567,6 +817,14 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push only the modified entries to the base. They stay cached as
+     * unmodified entries, except for fully spent ones, so this is cheaper
+     * than Flush when the cache does not need to shrink. The same failure
+     * semantics as Flush apply.
+     */
+    bool Sync();
+
     /**
      * Removes the transaction with the given hash from the cache, if it is
      * not modified.
@@ -0,0 +1,242 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * A fixed-size set of elements which forgets old entries to make room for new
+ * ones. Elements are kept in a flat table, so there is no per-entry allocation.
+ */
+namespace CuckooCache
+{
+
+/** A bit per table slot, stored in atomic bytes so bits can be flipped from several threads */
+class bit_packed_atomic_flags
+{
+private:
+    std::unique_ptr<std::atomic<uint8_t>[]> mem;
+
+public:
+    //! Create room for at least nBits flags, all set
+    explicit bit_packed_atomic_flags(uint32_t nBits)
+    {
+        // Round up to whole bytes
+        uint32_t nBytes = (nBits + 7) / 8;
+        mem.reset(new std::atomic<uint8_t>[nBytes]);
+        for (uint32_t i = 0; i < nBytes; i++)
+            mem[i].store(0xff, std::memory_order_relaxed);
+    }
+
+    //! Replace the flags by nBits set ones. Not thread safe.
+    void setup(uint32_t nBits)
+    {
+        bit_packed_atomic_flags fresh(nBits);
+        mem.swap(fresh.mem);
+    }
+
+    void bit_set(uint32_t s)
+    {
+        mem[s >> 3].fetch_or(1 << (s & 7), std::memory_order_relaxed);
+    }
+
+    void bit_unset(uint32_t s)
+    {
+        mem[s >> 3].fetch_and(~(1 << (s & 7)), std::memory_order_relaxed);
+    }
+
+    bool bit_is_set(uint32_t s) const
+    {
+        return (1 << (s & 7)) & mem[s >> 3].load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Cuckoo hash set with a fixed table. Every element has eight possible slots,
+ * given by the eight 32-bit hashes Hash produces for it; the element is found
+ * by checking those slots only, so lookups need no locks and do not allocate.
+ *
+ * Each slot has a collection flag. A set flag marks the slot as free to be
+ * overwritten: contains() can set it to erase an element, and it is set for
+ * every element of an epoch once the epoch is old. Epochs are tracked with one
+ * more bit per slot: when enough elements have been inserted since the last
+ * epoch change, the elements of the previous epoch become collectable, and
+ * the current ones become the previous epoch. Inserting into a full table
+ * moves elements between their slots for at most log2(size) rounds, after
+ * which the last displaced element is dropped.
+ *
+ * setup() or setup_bytes() must be called before anything else. A table of
+ * size zero stores nothing. contains() may be called from several threads at
+ * once, also with fErase; insert() and setup() must exclude all other calls.
+ */
+template <typename Element, typename Hash>
+class cache
+{
+private:
+    std::vector<Element> table;
+    //! Number of slots in table
+    uint32_t size;
+    mutable bit_packed_atomic_flags collection_flags;
+    //! Whether each slot was inserted in the current epoch
+    std::vector<bool> epoch_flags;
+    //! Inserts left before epoch_check counts the elements of the current epoch again
+    uint32_t epoch_heuristic_counter;
+    //! Number of current epoch elements after which a new epoch starts
+    uint32_t epoch_size;
+    //! Maximum number of displacements per insert
+    uint8_t depth_limit;
+    const Hash hash_function;
+
+    /** Map each hash onto [0, size) by taking the high half of hash * size */
+    std::array<uint32_t, 8> compute_hashes(const Element& e) const
+    {
+        std::array<uint32_t, 8> locs = {{
+            (uint32_t)(((uint64_t)hash_function.template operator()<0>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<1>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<2>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<3>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<4>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<5>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<6>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<7>(e) * (uint64_t)size) >> 32)}};
+        return locs;
+    }
+
+    static uint32_t invalid() { return ~(uint32_t)0; }
+
+    void allow_erase(uint32_t n) const { collection_flags.bit_set(n); }
+    void please_keep(uint32_t n) const { collection_flags.bit_unset(n); }
+
+    /**
+     * Start a new epoch if the current one holds epoch_size live elements.
+     * Counting them scans the table, so the next count is put off by at least
+     * the number of inserts that could fill the epoch.
+     */
+    void epoch_check()
+    {
+        if (epoch_heuristic_counter != 0) {
+            --epoch_heuristic_counter;
+            return;
+        }
+        uint32_t epoch_unused_count = 0;
+        for (uint32_t i = 0; i < size; ++i)
+            epoch_unused_count += epoch_flags[i] && !collection_flags.bit_is_set(i);
+        if (epoch_unused_count >= epoch_size) {
+            for (uint32_t i = 0; i < size; ++i) {
+                if (epoch_flags[i])
+                    epoch_flags[i] = false;
+                else
+                    allow_erase(i);
+            }
+            epoch_heuristic_counter = epoch_size;
+        } else {
+            epoch_heuristic_counter = std::max(1u, std::max(epoch_size / 16, epoch_size - epoch_unused_count));
+        }
+    }
+
+public:
+    cache() : table(), size(), collection_flags(0), epoch_flags(), epoch_heuristic_counter(), epoch_size(), depth_limit(0), hash_function()
+    {
+    }
+
+    /**
+     * Size the table to nNewSize slots, dropping all elements. Zero disables
+     * the cache; any other size is at least two. Returns the number of slots.
+     */
+    uint32_t setup(uint32_t nNewSize)
+    {
+        // Enough displacements to visit a good part of the table
+        depth_limit = 0;
+        while (((uint32_t)1 << depth_limit) < std::max((uint32_t)2, nNewSize))
+            depth_limit++;
+        size = nNewSize == 0 ? 0 : std::max((uint32_t)2, nNewSize);
+        table.assign(size, Element());
+        collection_flags.setup(size);
+        epoch_flags.assign(size, false);
+        // An epoch is 45% of the table, so two epochs fit with room to spare
+        epoch_size = std::max((uint32_t)1, (uint32_t)((45 * (uint64_t)size) / 100));
+        epoch_heuristic_counter = epoch_size;
+        return size;
+    }
+
+    /** Size the table to fit in nBytes (none for zero, otherwise at least two slots); returns the number of slots */
+    uint32_t setup_bytes(size_t nBytes)
+    {
+        if (nBytes == 0)
+            return setup(0);
+        return setup((uint32_t)std::max((size_t)1, std::min(nBytes / sizeof(Element), (size_t)invalid() - 1)));
+    }
+
+    /**
+     * Insert e. An equal element already present is refreshed into the
+     * current epoch instead. The oldest or collectable elements are
+     * overwritten when there is no room.
+     */
+    void insert(Element e)
+    {
+        if (size == 0)
+            return;
+        epoch_check();
+        uint32_t last_loc = invalid();
+        bool last_epoch = true;
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        for (size_t i = 0; i < locs.size(); i++) {
+            if (table[locs[i]] == e) {
+                please_keep(locs[i]);
+                epoch_flags[locs[i]] = last_epoch;
+                return;
+            }
+        }
+        for (uint8_t depth = 0; depth < depth_limit; ++depth) {
+            for (size_t i = 0; i < locs.size(); i++) {
+                if (!collection_flags.bit_is_set(locs[i]))
+                    continue;
+                std::swap(table[locs[i]], e);
+                please_keep(locs[i]);
+                epoch_flags[locs[i]] = last_epoch;
+                return;
+            }
+            // No free slot: take the slot after the one the displaced element
+            // came from, so elements do not keep trading the same two slots
+            size_t nNext = (std::find(locs.begin(), locs.end(), last_loc) - locs.begin() + 1) & 7;
+            last_loc = locs[nNext];
+            std::swap(table[last_loc], e);
+            // The displaced element keeps its epoch
+            bool epoch = last_epoch;
+            last_epoch = epoch_flags[last_loc];
+            epoch_flags[last_loc] = epoch;
+            locs = compute_hashes(e);
+        }
+    }
+
+    /**
+     * Check whether e is present. With fErase, its slot is marked as free to
+     * be overwritten; the element stays findable until that happens.
+     */
+    bool contains(const Element& e, bool fErase) const
+    {
+        if (size == 0)
+            return false;
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        for (size_t i = 0; i < locs.size(); i++) {
+            if (table[locs[i]] == e) {
+                if (fErase)
+                    allow_erase(locs[i]);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+} // namespace CuckooCache
+
+#endif // BITCOIN_CUCKOOCACHE_H
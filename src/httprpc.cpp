@@ -24,6 +24,37 @@
 /** WWW-Authenticate to present with 401 Unauthorized response */
 static const char* WWW_AUTH_HEADER_DATA = "Basic realm=\"jsonrpc\"";
 
+/** Default work classes of RPC methods, anything not listed is HTTP_WORK_NORMAL */
+static const struct {
+    const char* method;
+    HTTPWorkClass cls;
+} rpcWorkClasses[] = {
+      {"getbestblockhash", HTTP_WORK_HIGH},
+      {"getblockcount", HTTP_WORK_HIGH},
+      {"getblockhash", HTTP_WORK_HIGH},
+      {"getconnectioncount", HTTP_WORK_HIGH},
+      {"getdifficulty", HTTP_WORK_HIGH},
+      {"getinfo", HTTP_WORK_HIGH},
+      {"getmempoolinfo", HTTP_WORK_HIGH},
+      {"getnetworkinfo", HTTP_WORK_HIGH},
+      {"estimatefee", HTTP_WORK_HIGH},
+      {"estimatesmartfee", HTTP_WORK_HIGH},
+      {"ping", HTTP_WORK_HIGH},
+      {"sendrawtransaction", HTTP_WORK_HIGH},
+      {"getaddressbalance", HTTP_WORK_LOW},
+      {"getaddressdeltas", HTTP_WORK_LOW},
+      {"getaddressmempool", HTTP_WORK_LOW},
+      {"getaddresstxids", HTTP_WORK_LOW},
+      {"getaddressutxos", HTTP_WORK_LOW},
+      {"getblockhashes", HTTP_WORK_LOW},
+      {"gettxoutproof", HTTP_WORK_LOW},
+      {"gettxoutsetinfo", HTTP_WORK_LOW},
+      {"verifychain", HTTP_WORK_LOW},
+};
+
+/** Work class per RPC method, initialized from rpcWorkClasses and -rpcworkclass */
+static std::map<std::string, HTTPWorkClass> mapRPCWorkClass;
+
 /** Simple one-shot callback timer to be used by the RPC mechanism to e.g.
  * re-lock the wellet.
  */
@@ -207,6 +238,75 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
     return true;
 }
 
+/** Bytes at the start of a JSON-RPC request body read to classify it */
+static const size_t MAX_CLASSIFY_BODY_SIZE = 16 * 1024;
+
+/** Classify a JSON-RPC request by the methods it calls.
+ * This runs on the event loop thread, so it only copies the first
+ * MAX_CLASSIFY_BODY_SIZE bytes of the body and walks them with the UniValue
+ * tokenizer, which decodes escaped method names, without building a tree.
+ * For a batch the lowest priority class of the methods found is used. A batch
+ * too long to be seen whole may hold anything further on, and a long single
+ * request may name its method after the params, so both are HTTP_WORK_LOW
+ * unless a single method was found. Other requests whose method cannot be
+ * found are HTTP_WORK_NORMAL.
+ */
+static HTTPWorkClass JSONRPCWorkClass(HTTPRequest* req, const std::string &)
+{
+    const std::string strBody = req->PeekBody(MAX_CLASSIFY_BODY_SIZE + 1);
+    const bool fTruncated = strBody.size() > MAX_CLASSIFY_BODY_SIZE;
+    const char* raw = strBody.c_str();
+    bool fBatch = false;
+    bool fFound = false;
+    int cls = HTTP_WORK_HIGH;
+    int nDepth = 0;
+    bool fMethodKey = false; //!< Last token was the string "method" at call depth
+    bool fMethodValue = false; //!< Last tokens were "method" and a colon
+    std::string tokenVal;
+    unsigned int consumed;
+    enum jtokentype tok;
+    while ((tok = getJsonToken(tokenVal, consumed, raw)) != JTOK_NONE && tok != JTOK_ERR) {
+        raw += consumed;
+        if (fMethodValue && tok == JTOK_STRING) {
+            std::map<std::string, HTTPWorkClass>::const_iterator it = mapRPCWorkClass.find(tokenVal);
+            cls = std::max(cls, (int)(it == mapRPCWorkClass.end() ? HTTP_WORK_NORMAL : it->second));
+            fFound = true;
+        }
+        fMethodValue = fMethodKey && tok == JTOK_COLON;
+        fMethodKey = tok == JTOK_STRING && nDepth == (fBatch ? 2 : 1) && tokenVal == "method";
+        if (tok == JTOK_ARR_OPEN && nDepth == 0)
+            fBatch = true;
+        if (tok == JTOK_OBJ_OPEN || tok == JTOK_ARR_OPEN)
+            nDepth++;
+        else if (tok == JTOK_OBJ_CLOSE || tok == JTOK_ARR_CLOSE)
+            nDepth--;
+    }
+    if (fTruncated && (fBatch || !fFound))
+        return HTTP_WORK_LOW;
+    return fFound ? (HTTPWorkClass)cls : HTTP_WORK_NORMAL;
+}
+
+static bool InitRPCWorkClasses()
+{
+    mapRPCWorkClass.clear();
+    for (unsigned int i = 0; i < ARRAYLEN(rpcWorkClasses); i++)
+        mapRPCWorkClass[rpcWorkClasses[i].method] = rpcWorkClasses[i].cls;
+    if (mapMultiArgs.count("-rpcworkclass")) {
+        BOOST_FOREACH (const std::string& strClass, mapMultiArgs["-rpcworkclass"]) {
+            size_t pos = strClass.find(':');
+            HTTPWorkClass cls;
+            if (pos == std::string::npos || !ParseHTTPWorkClass(strClass.substr(pos + 1), cls)) {
+                uiInterface.ThreadSafeMessageBox(
+                    strprintf("Invalid -rpcworkclass specification: %s. Valid is <method>:<class> with class one of high, normal, low.", strClass),
+                    "", CClientUIInterface::MSG_ERROR);
+                return false;
+            }
+            mapRPCWorkClass[strClass.substr(0, pos)] = cls;
+        }
+    }
+    return true;
+}
+
 static bool InitRPCAuthentication()
 {
     if (mapArgs["-rpcpassword"] == "")
@@ -230,8 +330,10 @@ bool StartHTTPRPC()
     LogPrint("rpc", "Starting HTTP RPC server\n");
     if (!InitRPCAuthentication())
         return false;
+    if (!InitRPCWorkClasses())
+        return false;
 
-    RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    RegisterHTTPHandler("/", true, HTTPReq_JSONRPC, &JSONRPCWorkClass);
 
     assert(EventBase());
     httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "httpserver.h"
+#include "httpworkqueue.h"
 
 #include "chainparamsbase.h"
 #include "compat.h"
@@ -11,6 +12,7 @@
 #include "rpc/protocol.h" // For HTTP status codes
 #include "sync.h"
 #include "ui_interface.h"
+#include "utilstrencodings.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +37,7 @@
 #endif
 
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
 /** Maximum size of http request (request line + headers) */
@@ -60,113 +63,27 @@ private:
     HTTPRequestHandler func;
 };
 
-/** Simple work queue for distributing work over multiple threads.
- * Work items are simply callable objects.
- */
-template <typename WorkItem>
-class WorkQueue
-{
-private:
-    /** Mutex protects entire object */
-    CWaitableCriticalSection cs;
-    CConditionVariable cond;
-    std::deque<std::unique_ptr<WorkItem>> queue;
-    bool running;
-    size_t maxDepth;
-    int numThreads;
-
-    /** RAII object to keep track of number of running worker threads */
-    class ThreadCounter
-    {
-    public:
-        WorkQueue &wq;
-        ThreadCounter(WorkQueue &w): wq(w)
-        {
-            boost::lock_guard<boost::mutex> lock(wq.cs);
-            wq.numThreads += 1;
-        }
-        ~ThreadCounter()
-        {
-            boost::lock_guard<boost::mutex> lock(wq.cs);
-            wq.numThreads -= 1;
-            wq.cond.notify_all();
-        }
-    };
-
-public:
-    WorkQueue(size_t maxDepth) : running(true),
-                                 maxDepth(maxDepth),
-                                 numThreads(0)
-    {
-    }
-    /** Precondition: worker threads have all stopped
-     * (call WaitExit)
-     */
-    ~WorkQueue()
-    {
-    }
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
-    {
-        boost::unique_lock<boost::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
-            return false;
-        }
-        queue.emplace_back(std::unique_ptr<WorkItem>(item));
-        cond.notify_one();
-        return true;
-    }
-    /** Thread function */
-    void Run()
-    {
-        ThreadCounter count(*this);
-        while (running) {
-            std::unique_ptr<WorkItem> i;
-            {
-                boost::unique_lock<boost::mutex> lock(cs);
-                while (running && queue.empty())
-                    cond.wait(lock);
-                if (!running)
-                    break;
-                i = std::move(queue.front());
-                queue.pop_front();
-            }
-            (*i)();
-        }
-    }
-    /** Interrupt and exit loops */
-    void Interrupt()
-    {
-        boost::unique_lock<boost::mutex> lock(cs);
-        running = false;
-        cond.notify_all();
-    }
-    /** Wait for worker threads to exit */
-    void WaitExit()
-    {
-        boost::unique_lock<boost::mutex> lock(cs);
-        while (numThreads > 0)
-            cond.wait(lock);
-    }
-
-    /** Return current depth of queue */
-    size_t Depth()
-    {
-        boost::unique_lock<boost::mutex> lock(cs);
-        return queue.size();
-    }
-};
-
 struct HTTPPathHandler
 {
     HTTPPathHandler() {}
-    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler):
-        prefix(prefix), exactMatch(exactMatch), handler(handler)
+    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler, HTTPRequestClassifier classifier):
+        prefix(prefix), exactMatch(exactMatch), handler(handler), classifier(classifier)
     {
     }
     std::string prefix;
     bool exactMatch;
     HTTPRequestHandler handler;
+    HTTPRequestClassifier classifier;
+};
+
+static const struct {
+    HTTPWorkClass cls;
+    const char* name;
+    int defaultWeight;
+} workClassInfo[] = {
+      {HTTP_WORK_HIGH, "high", DEFAULT_HTTP_WEIGHT_HIGH},
+      {HTTP_WORK_NORMAL, "normal", DEFAULT_HTTP_WEIGHT_NORMAL},
+      {HTTP_WORK_LOW, "low", DEFAULT_HTTP_WEIGHT_LOW},
 };
 
 /** HTTP module state */
@@ -281,12 +198,14 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
 
     // Dispatch to worker thread
     if (i != iend) {
+        HTTPWorkClass cls = i->classifier(hreq.get(), path);
+        std::string client = hreq->GetPeer().ToStringIP();
         std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(std::move(hreq), path, i->handler));
         assert(workQueue);
-        if (workQueue->Enqueue(item.get()))
+        if (workQueue->Enqueue(item.get(), cls, client))
             item.release(); /* if true, queue took ownership */
         else {
-            LogPrintf("WARNING: request rejected because http work queue depth exceeded, it can be increased with the -rpcworkqueue= setting\n");
+            LogPrintf("WARNING: request rejected because http work queue depth for class %s exceeded, it can be increased with the -rpcworkqueue= setting\n", GetHTTPWorkClassName(cls));
             item->req->WriteReply(HTTP_INTERNAL, "Work queue depth exceeded");
         }
     } else {
@@ -432,6 +351,28 @@ bool InitHTTPServer()
     LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
 
     workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
+    for (unsigned int i = 0; i < ARRAYLEN(workClassInfo); i++)
+        workQueue->SetWeight(workClassInfo[i].cls, workClassInfo[i].defaultWeight);
+    if (mapMultiArgs.count("-rpcworkweight")) {
+        BOOST_FOREACH (const std::string& strWeight, mapMultiArgs["-rpcworkweight"]) {
+            size_t pos = strWeight.find(':');
+            HTTPWorkClass cls;
+            int weight = 0;
+            if (pos == std::string::npos || !ParseHTTPWorkClass(strWeight.substr(0, pos), cls) ||
+                !ParseInt32(strWeight.substr(pos + 1), &weight) || weight < 1) {
+                uiInterface.ThreadSafeMessageBox(
+                    strprintf("Invalid -rpcworkweight specification: %s. Valid is <class>:<weight> with class one of high, normal, low and a positive weight.", strWeight),
+                    "", CClientUIInterface::MSG_ERROR);
+                delete workQueue;
+                workQueue = 0;
+                evhttp_free(http);
+                event_base_free(base);
+                return false;
+            }
+            workQueue->SetWeight(cls, weight);
+        }
+    }
+    workQueue->SetMaxPerClient(GetArg("-rpcclientconcurrency", DEFAULT_HTTP_CLIENT_CONCURRENCY));
     eventBase = base;
     eventHTTP = http;
     return true;
@@ -444,6 +385,9 @@ bool StartHTTPServer()
     LogPrint("http", "Starting HTTP server\n");
     int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
     LogPrintf("HTTP: starting %d worker threads\n", rpcThreads);
+    // Keep one worker free of low priority work so cheap calls are never
+    // stuck behind a set of long running index scans.
+    workQueue->SetMaxRunning(HTTP_WORK_LOW, std::max(rpcThreads - 1, 1));
     threadHTTP = boost::thread(boost::bind(&ThreadHTTP, eventBase, eventHTTP));
 
     for (int i = 0; i < rpcThreads; i++)
@@ -559,6 +503,19 @@ std::pair<bool, std::string> HTTPRequest::GetHeader(const std::string& hdr)
         return std::make_pair(false, "");
 }
 
+std::string HTTPRequest::PeekBody(size_t maxSize)
+{
+    struct evbuffer* buf = evhttp_request_get_input_buffer(req);
+    if (!buf)
+        return "";
+    std::string rv(std::min(evbuffer_get_length(buf), maxSize), '\0');
+    if (rv.empty())
+        return rv;
+    ev_ssize_t n = evbuffer_copyout(buf, &rv[0], rv.size());
+    rv.resize(std::max(n, (ev_ssize_t)0));
+    return rv;
+}
+
 std::string HTTPRequest::ReadBody()
 {
     struct evbuffer* buf = evhttp_request_get_input_buffer(req);
@@ -645,10 +602,39 @@ HTTPRequest::RequestMethod HTTPRequest::GetRequestMethod()
     }
 }
 
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler)
+bool ParseHTTPWorkClass(const std::string& name, HTTPWorkClass& cls)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(workClassInfo); i++) {
+        if (name == workClassInfo[i].name) {
+            cls = workClassInfo[i].cls;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string GetHTTPWorkClassName(HTTPWorkClass cls)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(workClassInfo); i++)
+        if (workClassInfo[i].cls == cls)
+            return workClassInfo[i].name;
+    return "unknown";
+}
+
+static HTTPWorkClass FixedWorkClass(HTTPWorkClass cls, HTTPRequest*, const std::string&)
+{
+    return cls;
+}
+
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler, HTTPWorkClass cls)
+{
+    RegisterHTTPHandler(prefix, exactMatch, handler, boost::bind(&FixedWorkClass, cls, _1, _2));
+}
+
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler, const HTTPRequestClassifier &classifier)
 {
     LogPrint("http", "Registering HTTP handler for %s (exactmatch %d)\n", prefix, exactMatch);
-    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler));
+    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler, classifier));
 }
 
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch)
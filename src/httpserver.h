@@ -14,6 +14,10 @@
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+static const int DEFAULT_HTTP_CLIENT_CONCURRENCY=0;
+static const int DEFAULT_HTTP_WEIGHT_HIGH=8;
+static const int DEFAULT_HTTP_WEIGHT_NORMAL=4;
+static const int DEFAULT_HTTP_WEIGHT_LOW=1;
 
 struct evhttp_request;
 struct event_base;
@@ -34,13 +38,35 @@ void InterruptHTTPServer();
 /** Stop HTTP server */
 void StopHTTPServer();
 
+/** Scheduling class of a queued HTTP request.
+ * Each class has its own work queue; workers serve the queues by weighted
+ * round robin in this order (see -rpcworkweight).
+ */
+enum HTTPWorkClass {
+    HTTP_WORK_HIGH,   //!< Cheap, latency-sensitive calls
+    HTTP_WORK_NORMAL, //!< Everything not classified otherwise
+    HTTP_WORK_LOW,    //!< Expensive scans, e.g. address index queries
+    HTTP_WORK_CLASS_COUNT
+};
+/** Parse a work class name ("high", "normal" or "low") */
+bool ParseHTTPWorkClass(const std::string& name, HTTPWorkClass& cls);
+/** Return the name of a work class */
+std::string GetHTTPWorkClassName(HTTPWorkClass cls);
+
 /** Handler for requests to a certain HTTP path */
 typedef boost::function<void(HTTPRequest* req, const std::string &)> HTTPRequestHandler;
+/** Classifier deciding the work class of a request to a certain HTTP path.
+ * This runs on the event loop thread before the request is queued, so it
+ * must be cheap and must not consume the request body.
+ */
+typedef boost::function<HTTPWorkClass(HTTPRequest* req, const std::string &)> HTTPRequestClassifier;
 /** Register handler for prefix.
  * If multiple handlers match a prefix, the first-registered one will
- * be invoked.
+ * be invoked. Requests are queued in the given work class.
  */
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler);
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler, HTTPWorkClass cls = HTTP_WORK_NORMAL);
+/** Register handler for prefix, deciding the work class per request */
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler, const HTTPRequestClassifier &classifier);
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
 
@@ -88,6 +114,12 @@ public:
      */
     std::pair<bool, std::string> GetHeader(const std::string& hdr);
 
+    /**
+     * Return a copy of up to maxSize bytes from the start of the request
+     * body, without consuming it.
+     */
+    std::string PeekBody(size_t maxSize);
+
     /**
      * Read request body.
      *
@@ -0,0 +1,216 @@
+// Copyright (c) 2015 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPWORKQUEUE_H
+#define BITCOIN_HTTPWORKQUEUE_H
+
+#include "httpserver.h"
+#include "sync.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+
+/** Work queue for distributing work over multiple threads.
+ * Work items are simply callable objects, tagged with a work class and the
+ * client that submitted them.
+ *
+ * Every work class has its own bounded queue. Workers pick the next item by
+ * weighted round robin over the classes (highest priority first), so a burst
+ * of expensive requests in one class cannot starve the others. Optionally the
+ * number of concurrently running items per class and per client is capped;
+ * queued items beyond a cap are skipped until a running one finishes.
+ */
+template <typename WorkItem>
+class WorkQueue
+{
+private:
+    struct Entry
+    {
+        Entry(WorkItem* item, const std::string& client): item(item), client(client) {}
+        std::unique_ptr<WorkItem> item;
+        std::string client;
+    };
+    typedef std::deque<std::unique_ptr<Entry>> EntryQueue;
+
+    struct ClassState
+    {
+        ClassState(): weight(1), credit(0), running(0), maxRunning(0) {}
+        EntryQueue queue;
+        int weight;      //!< Items served per scheduling round
+        int credit;      //!< Items left in the current round
+        int running;     //!< Items currently being executed
+        int maxRunning;  //!< Cap on running, 0 = unlimited
+    };
+
+    /** Mutex protects entire object */
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    ClassState classes[HTTP_WORK_CLASS_COUNT];
+    /** Number of running items per client, entries are erased when they drop to zero */
+    std::map<std::string, int> clientRunning;
+    bool running;
+    size_t maxDepth;
+    int maxPerClient;
+    int numThreads;
+
+    /** RAII object to keep track of number of running worker threads */
+    class ThreadCounter
+    {
+    public:
+        WorkQueue &wq;
+        ThreadCounter(WorkQueue &w): wq(w)
+        {
+            boost::lock_guard<boost::mutex> lock(wq.cs);
+            wq.numThreads += 1;
+        }
+        ~ThreadCounter()
+        {
+            boost::lock_guard<boost::mutex> lock(wq.cs);
+            wq.numThreads -= 1;
+            wq.cond.notify_all();
+        }
+    };
+
+    /** Find the first item of a class that may start now. Caller must hold cs. */
+    bool FindRunnable(ClassState& c, typename EntryQueue::iterator& it)
+    {
+        if (c.maxRunning > 0 && c.running >= c.maxRunning)
+            return false;
+        for (it = c.queue.begin(); it != c.queue.end(); ++it) {
+            if (maxPerClient <= 0)
+                return true;
+            std::map<std::string, int>::const_iterator mi = clientRunning.find((*it)->client);
+            if (mi == clientRunning.end() || mi->second < maxPerClient)
+                return true;
+        }
+        return false;
+    }
+
+    /** Pick the class to serve next, or -1 if nothing can run. Caller must hold cs. */
+    int Select(typename EntryQueue::iterator& it)
+    {
+        for (int pass = 0; pass < 2; pass++) {
+            bool fRunnable = false;
+            for (int c = 0; c < HTTP_WORK_CLASS_COUNT; c++) {
+                if (!FindRunnable(classes[c], it))
+                    continue;
+                if (classes[c].credit > 0)
+                    return c;
+                fRunnable = true;
+            }
+            if (!fRunnable)
+                return -1;
+            // All classes with runnable work used up their share: start a new round
+            for (int c = 0; c < HTTP_WORK_CLASS_COUNT; c++)
+                classes[c].credit = classes[c].weight;
+        }
+        return -1;
+    }
+
+public:
+    WorkQueue(size_t maxDepth) : running(true),
+                                 maxDepth(maxDepth),
+                                 maxPerClient(0),
+                                 numThreads(0)
+    {
+    }
+    /** Precondition: worker threads have all stopped
+     * (call WaitExit)
+     */
+    ~WorkQueue()
+    {
+    }
+    /** Set the scheduling weight of a work class */
+    void SetWeight(HTTPWorkClass cls, int weight)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        classes[cls].weight = std::max(weight, 1);
+    }
+    /** Limit the number of items of a work class running at once (0 = unlimited) */
+    void SetMaxRunning(HTTPWorkClass cls, int n)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        classes[cls].maxRunning = std::max(n, 0);
+    }
+    /** Limit the number of items of a single client running at once (0 = unlimited) */
+    void SetMaxPerClient(int n)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        maxPerClient = std::max(n, 0);
+    }
+    /** Enqueue a work item */
+    bool Enqueue(WorkItem* item, HTTPWorkClass cls, const std::string& client)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        EntryQueue& queue = classes[cls].queue;
+        if (queue.size() >= maxDepth) {
+            return false;
+        }
+        queue.emplace_back(std::unique_ptr<Entry>(new Entry(item, client)));
+        cond.notify_one();
+        return true;
+    }
+    /** Thread function */
+    void Run()
+    {
+        ThreadCounter count(*this);
+        while (running) {
+            std::unique_ptr<Entry> i;
+            int cls = -1;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                typename EntryQueue::iterator it;
+                while (running && (cls = Select(it)) < 0)
+                    cond.wait(lock);
+                if (!running)
+                    break;
+                ClassState& c = classes[cls];
+                i = std::move(*it);
+                c.queue.erase(it);
+                c.credit -= 1;
+                c.running += 1;
+                clientRunning[i->client] += 1;
+            }
+            (*i->item)();
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                classes[cls].running -= 1;
+                std::map<std::string, int>::iterator mi = clientRunning.find(i->client);
+                if (--mi->second == 0)
+                    clientRunning.erase(mi);
+                // Finishing may unblock items held back by a class or client cap
+                cond.notify_all();
+            }
+        }
+    }
+    /** Interrupt and exit loops */
+    void Interrupt()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        running = false;
+        cond.notify_all();
+    }
+    /** Wait for worker threads to exit */
+    void WaitExit()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (numThreads > 0)
+            cond.wait(lock);
+    }
+
+    /** Return current depth of all queues */
+    size_t Depth()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        size_t depth = 0;
+        for (int c = 0; c < HTTP_WORK_CLASS_COUNT; c++)
+            depth += classes[c].queue.size();
+        return depth;
+    }
+};
+
+#endif // BITCOIN_HTTPWORKQUEUE_H
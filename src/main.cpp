@@ -7,11 +7,13 @@
 
 #include "addrman.h"
 #include "arith_uint256.h"
+#include "blockindexsnapshot.h"
 #include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/consensus.h"
+#include "cuckoocache.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "hash.h"
@@ -26,12 +28,14 @@
 
 #include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "responsecache.h"
 #include "random.h"
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
 
 #include "script/interpreter.h"
+#include "shortinv.h"
 
 #include "tinyformat.h"
 #include "txdb.h"
@@ -51,6 +55,7 @@
 
 #include <atomic>
 #include <sstream>
+#include <unordered_map>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
@@ -72,6 +77,8 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+/** Storage of the entries in mapBlockIndex */
+CBlockIndexArena blockIndexArena;
 CChain chainActive;
 
 
@@ -86,6 +93,7 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = DEFAULT_PREFETCH_THREADS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
@@ -145,6 +153,7 @@ void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
  * in the last Consensus::Params::nMajorityWindow blocks, starting at pstart and going backwards.
  */
 static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams);
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev, int32_t nVersion, int64_t nBlockTime, const Consensus::Params& consensusParams);
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
 
 /** Constant stuff for coinbase transactions we create: */
@@ -269,6 +278,39 @@ namespace {
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
 } // anon namespace
 
+/** Whether the stake of a block is known to be good: proof-of-work, a kernel checked on
+ *  the header, or the block itself accepted. Requires cs_main. */
+static bool IsStakeChecked(const CBlockIndex* pindex)
+{
+    return pindex->IsProofOfWork() || pindex->StakeCheckedOnHeader() || pindex->IsValid(BLOCK_VALID_TRANSACTIONS);
+}
+
+/** Number of blocks, up to nMax, ending at pindex whose stake has not been verified. Requires cs_main. */
+int CountUncheckedStakeHeaders(const CBlockIndex* pindex, int nMax)
+{
+    int nCount = 0;
+    for (; pindex && nCount < nMax && !IsStakeChecked(pindex); pindex = pindex->pprev)
+        nCount++;
+    return nCount;
+}
+
+/** Fold the time a peer took to deliver a block into its moving average (0: none measured yet). */
+int64_t AverageBlockDeliveryTime(int64_t nAvgBlockDeliveryTime, int64_t nDeliveryTime)
+{
+    if (nAvgBlockDeliveryTime == 0)
+        return nDeliveryTime;
+    return (nAvgBlockDeliveryTime * 7 + nDeliveryTime) / 8;
+}
+
+/** Number of blocks that may be in flight from a peer with the given average delivery time. */
+int BlocksInTransitForDeliveryTime(int64_t nAvgBlockDeliveryTime)
+{
+    if (nAvgBlockDeliveryTime <= 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nLimit = BLOCK_DOWNLOAD_QUEUE_TIME / nAvgBlockDeliveryTime;
+    return (int)std::max((int64_t)MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min((int64_t)MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER, nLimit));
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -320,6 +362,13 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Moving average of the time (in microseconds) this peer takes to deliver a block we asked for, 0 until measured.
+    int64_t nAvgBlockDeliveryTime;
+    //! Total size and delivery time (in microseconds) of the blocks that went into nAvgBlockDeliveryTime.
+    int64_t nBlockBytesDelivered;
+    int64_t nBlockDeliveryTime;
+    //! Number of times this peer stalled or timed out our block download.
+    int nStalls;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -330,6 +379,20 @@ struct CNodeState {
     bool fProvidesHeaderAndIDs;
     //! Whether this peer can give us witnesses
     bool fHaveWitness;
+    //! Whether this peer wants witnesses in cmpctblocks/blocktxns
+    bool fWantsCmpctWitness;
+    /**
+     * If we've announced NODE_WITNESS to this peer: whether the peer sends witnesses in cmpctblocks/blocktxns,
+     * otherwise: whether this peer sends non-witnesses in cmpctblocks/blocktxns.
+     */
+    bool fSupportsDesiredCmpctVersion;
+    //! Resolves the shortinv batches this peer sends us, under a salt no other peer learns
+    std::unique_ptr<CShortInvIndex> pShortInvIndex;
+    //! The salt before the current one, whose batches may still be in flight
+    uint64_t nShortInvPrevSalt;
+    int64_t nShortInvSaltTime;
+    //! Mempool entry time from which pShortInvIndex still needs to be filled in
+    int64_t nShortInvIndexTime;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -345,11 +408,20 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nAvgBlockDeliveryTime = 0;
+        nBlockBytesDelivered = 0;
+        nBlockDeliveryTime = 0;
+        nStalls = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
         fProvidesHeaderAndIDs = false;
         fHaveWitness = true;
+        fWantsCmpctWitness = false;
+        fSupportsDesiredCmpctVersion = false;
+        nShortInvPrevSalt = 0;
+        nShortInvSaltTime = 0;
+        nShortInvIndexTime = 0;
     }
 };
 
@@ -398,6 +470,16 @@ void FinalizeNode(NodeId nodeid) {
         AddressCurrentlyConnected(state->address);
     }
 
+    if (state->fCurrentlyConnected) {
+        CAddrPerf sample;
+        if (state->nBlockDeliveryTime > 0)
+            sample.nBlockBytesPerSec = state->nBlockBytesDelivered * 1000000 / state->nBlockDeliveryTime;
+        sample.nStalls = state->nStalls;
+        if (state->pindexBestKnownBlock)
+            sample.nTipLag = std::max(0, chainActive.Height() - state->pindexBestKnownBlock->nHeight);
+        addrman.UpdatePerformance(state->address, sample);
+    }
+
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
@@ -419,7 +501,8 @@ void FinalizeNode(NodeId nodeid) {
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
 // Also used if a block was /not/ received and timed out or started with another peer
-bool MarkBlockAsReceived(const uint256& hash) {
+// nodeFrom is the peer that delivered the block, if it was delivered, and nBlockSize its serialized size.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nBlockSize = 0) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
@@ -430,7 +513,16 @@ bool MarkBlockAsReceived(const uint256& hash) {
         }
         if (state->vBlocksInFlight.begin() == itInFlight->second.second) {
             // First block on the queue was received, update the start download time for the next one
-            state->nDownloadingSince = std::max(state->nDownloadingSince, GetTimeMicros());
+            int64_t nNow = GetTimeMicros();
+            if (itInFlight->second.first == nodeFrom && nNow > state->nDownloadingSince) {
+                // Blocks arrive in the order they were asked for, so this is how long the peer
+                // needed for this one
+                int64_t nDeliveryTime = nNow - state->nDownloadingSince;
+                state->nAvgBlockDeliveryTime = AverageBlockDeliveryTime(state->nAvgBlockDeliveryTime, nDeliveryTime);
+                state->nBlockBytesDelivered += nBlockSize;
+                state->nBlockDeliveryTime += nDeliveryTime;
+            }
+            state->nDownloadingSince = std::max(state->nDownloadingSince, nNow);
         }
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
@@ -475,6 +567,12 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     return true;
 }
 
+// Requires cs_main.
+/** Number of blocks that may be in flight from a peer, following its measured delivery rate. */
+int GetBlocksInTransitLimit(const CNodeState* state) {
+    return BlocksInTransitForDeliveryTime(state->nAvgBlockDeliveryTime);
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -509,8 +607,8 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
 }
 
 void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
-    if (nLocalServices & NODE_WITNESS) {
-        // Don't ever request compact blocks when segwit is enabled.
+    if (!nodestate->fSupportsDesiredCmpctVersion) {
+        // Never ask from peers who can't provide witnesses.
         return;
     }
     if (nodestate->fProvidesHeaderAndIDs) {
@@ -518,7 +616,7 @@ void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pf
             if (nodeid == pfrom->GetId())
                 return;
         bool fAnnounceUsingCMPCTBLOCK = false;
-        uint64_t nCMPCTBLOCKVersion = 1;
+        uint64_t nCMPCTBLOCKVersion = (nLocalServices & NODE_WITNESS) ? 2 : 1;
         if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
             // As per BIP152, we only get 3 of our peers to announce
             // blocks using compact encodings.
@@ -537,7 +635,6 @@ void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pf
 // Requires cs_main
 bool CanDirectFetch(const Consensus::Params &consensusParams)
 {
-    return true;
     return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nTargetSpacing * 20;
 }
 
@@ -608,6 +705,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    // Nor more than MAX_UNCHECKED_STAKE_HEADERS past the last block whose stake we verified,
+    // so that a peer cannot have us download a chain of made-up proof-of-stake headers
+    int nUncheckedStake = CountUncheckedStakeHeaders(state->pindexLastCommonBlock, MAX_UNCHECKED_STAKE_HEADERS);
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -629,6 +729,15 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
+            if (IsStakeChecked(pindex)) {
+                nUncheckedStake = 0;
+            } else if (++nUncheckedStake > MAX_UNCHECKED_STAKE_HEADERS) {
+                // Wait for the blocks before it to vouch for the stake
+                if (vBlocks.size() == 0 && waitingfor != nodeid) {
+                    nodeStaller = waitingfor;
+                }
+                return;
+            }
             if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
@@ -708,6 +817,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewBackgroundWriter *pcoinsWriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -737,6 +847,10 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
 
     auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
     assert(ret.second);
+    for (map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it) {
+        if (it->second.pShortInvIndex)
+            it->second.pShortInvIndex->Add(hash);
+    }
     BOOST_FOREACH(const CTxIn& txin, tx.vin) {
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
@@ -816,6 +930,52 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
     return nEvicted;
 }
 
+/**
+ * The salt we hand out to a peer for its shortinv batches, replaced every
+ * SHORTINV_SALT_INTERVAL. Each peer gets its own, so no peer can grind short
+ * IDs that collide with what another peer announces: a colliding short ID
+ * would resolve to the wrong transaction and the real one would never be
+ * requested.
+ */
+static uint64_t GetShortInvSalt(CNodeState& state) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    int64_t nNow = GetTime();
+    if (!state.pShortInvIndex || nNow - state.nShortInvSaltTime >= SHORTINV_SALT_INTERVAL) {
+        uint64_t nSalt = 0;
+        while (nSalt == 0)
+            nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+        if (state.pShortInvIndex)
+            state.nShortInvPrevSalt = state.pShortInvIndex->GetSalt();
+        // Rebuilt from scratch, which also drops what left the mempool. As
+        // there is one per peer, it only covers transactions that arrived
+        // within the last interval; peers announce what they just relayed,
+        // and short IDs that are not found are asked for by full hash.
+        state.pShortInvIndex.reset(new CShortInvIndex(nSalt));
+        for (map<uint256, COrphanTx>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+            state.pShortInvIndex->Add(mi->first);
+        state.nShortInvSaltTime = nNow;
+        state.nShortInvIndexTime = nNow - SHORTINV_SALT_INTERVAL;
+    }
+    return state.pShortInvIndex->GetSalt();
+}
+
+/** The shortinv index under the peer's current salt, with the recent mempool entries added so far */
+static const CShortInvIndex& GetShortInvIndex(CNodeState& state) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    GetShortInvSalt(state);
+    CShortInvIndex* pShortInvIndex = state.pShortInvIndex.get();
+    int64_t nNow = GetTime();
+    LOCK(mempool.cs);
+    // Only entries since the last call, and those of its second again, as
+    // entry times are whole seconds
+    typedef CTxMemPool::indexed_transaction_set::index<entry_time>::type::const_reverse_iterator byentrytime_iterator;
+    const CTxMemPool::indexed_transaction_set::index<entry_time>::type& byentrytime = mempool.mapTx.get<entry_time>();
+    for (byentrytime_iterator it = byentrytime.rbegin(); it != byentrytime.rend() && it->GetTime() >= state.nShortInvIndexTime; ++it)
+        pShortInvIndex->Add(it->GetTx().GetHash());
+    state.nShortInvIndexTime = nNow;
+    return *pShortInvIndex;
+}
+
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
     if (tx.nLockTime == 0)
@@ -1567,30 +1727,36 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true)) {
+        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true)) {
+            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false)) {
                 // Only the witness is wrong, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
             return false;
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
+        // Check again against the script verification flags of the next
+        // block, in case of bugs in the standard flags that cause
         // transactions to pass as valid when they're actually invalid. For
         // instance the STRICTENC flag was incorrectly allowing certain
         // CHECKSIG NOT scripts to pass, even though they were invalid.
+        // These flags include the consensus-critical mandatory ones.
         //
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        //
+        // The result is cached, so that ConnectBlock does not execute the
+        // scripts again when the transaction is mined with these flags.
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+        unsigned int nextBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), ComputeBlockVersion(chainActive.Tip(), consensusParams), GetAdjustedTime(), consensusParams);
+        if (!CheckInputs(tx, state, view, true, nextBlockScriptVerifyFlags, true, true))
         {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against block but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
         }
 
@@ -1603,18 +1769,30 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                     FormatMoney(nModifiedFees - nConflictingFees),
                     (int)nSize - (int)nConflictingSize);
         }
-        pool.RemoveStaged(allConflicting, false);
+        pool.RemoveStaged(allConflicting, false, MEMPOOL_REMOVE_REPLACED);
 
         // Add memory address index
+        CMempoolAddressDeltaVector vMempoolDeltas;
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vMempoolSpent;
         if (fAddressIndex)
         {
-            pool.addAddressIndex(entry, view);
-            pool.addSpentIndex(entry, view);
+            pool.addAddressIndex(entry, view, &vMempoolDeltas);
+            pool.addSpentIndex(entry, view, &vMempoolSpent);
         }
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
 
+        // Announced before trimming, which announces the removal if the
+        // transaction does not stay
+        if (fAddressIndex)
+        {
+            std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressDeltas;
+            GetMempoolAddressIndexDeltas(vMempoolDeltas, vAddressDeltas);
+            GetMainSignals().AddressIndexUpdated(NULL, vAddressDeltas, INDEX_UPDATE_MEMPOOL);
+            GetMainSignals().SpentIndexUpdated(NULL, vMempoolSpent, INDEX_UPDATE_MEMPOOL);
+        }
+
         // trim mempool and check if tx was trimmed
         if (!fOverrideMempoolLimit) {
             LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
@@ -1908,15 +2086,6 @@ uint256 static GetOrphanRoot(const uint256& hash)
     } while(true);
 }
 
-// ppcoin: find block wanted by given orphan block
-uint256 WantedByOrphan(const COrphanBlock* pblockOrphan)
-{
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblockOrphan->hashPrev))
-        pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrev];
-    return pblockOrphan->hashPrev;
-}
-
 // Remove a random orphan block (which does not have any dependent orphans).
 void static PruneOrphanBlocks()
 {
@@ -2160,7 +2329,8 @@ void static InvalidBlockFound(CBlockIndex *pindex, const CValidationState &state
     }
 }
 
-void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txundo, int nHeight)
+/** Apply a transaction to the coins, accounting the change to the UTXO set statistics in pstatsDelta unless NULL */
+static void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txundo, int nHeight, CCoinsStats* pstatsDelta)
 {
     // mark inputs spent
     if (!tx.IsCoinBase()) {
@@ -2171,9 +2341,15 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
 
             if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
                 assert(false);
+            if (pstatsDelta) {
+                pstatsDelta->UpdateRecord(txin.prevout.hash, *coins, false);
+                pstatsDelta->UpdateOutput(txin.prevout.hash, nPos, *coins, false);
+            }
             // mark an outpoint spent, and construct undo information
             txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
             coins->Spend(nPos);
+            if (pstatsDelta)
+                pstatsDelta->UpdateRecord(txin.prevout.hash, *coins, true);
             if (coins->vout.size() == 0) {
                 CTxInUndo& undo = txundo.vprevout.back();
                 undo.nHeight = coins->nHeight;
@@ -2186,13 +2362,16 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    CCoinsModifier outs = inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase());
+    outs->FromTx(tx, nHeight);
+    if (pstatsDelta)
+        pstatsDelta->UpdateCoins(tx.GetHash(), CCoins(), *outs);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
 {
     CTxUndo txundo;
-    UpdateCoins(tx, inputs, txundo, nHeight);
+    UpdateCoins(tx, inputs, txundo, nHeight, NULL);
 }
 
 bool CScriptCheck::operator()() {
@@ -2264,17 +2443,95 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+/**
+ * Transactions whose scripts all passed, keyed by SHA256(nonce || wtxid ||
+ * flags). The witness hash covers the scripts and, through the prevouts, the
+ * outputs they spend. Protected by cs_main.
+ */
+static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+static uint256 scriptExecutionCacheNonce(GetRandHash());
+
+void InitScriptExecutionCache() {
+    // The other half of -maxsigcachesize goes to the signature cache. Zero
+    // disables the cache.
+    size_t nMaxCacheSize = (std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)) * ((size_t) 1 << 20)) / 2;
+    size_t nElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %zu elements\n",
+              (nElems * sizeof(uint256)) >> 20, nMaxCacheSize >> 20, nElems);
+}
+
+/**
+ * The script part of CheckInputs, for a transaction whose inputs already
+ * passed Consensus::CheckTxInputs.
+ */
+static bool CheckInputScripts(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, std::vector<CScriptCheck> *pvChecks)
+{
+    if (tx.IsCoinBase())
+        return true;
+
+    if (pvChecks)
+        pvChecks->reserve(tx.vin.size());
+
+    // Skip the scripts entirely if they passed with the same flags
+    // before. A block only needs the entry once, so connecting it
+    // frees the slot for reuse.
+    uint256 hashCacheEntry;
+    uint256 hashWitness = tx.GetWitnessHash();
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(hashWitness.begin(), 32).Write((const unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    AssertLockHeld(cs_main);
+    if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore))
+        return true;
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const COutPoint &prevout = tx.vin[i].prevout;
+        const CCoins* coins = inputs.AccessCoins(prevout.hash);
+        assert(coins);
+
+        // Verify signature
+        CScriptCheck check(*coins, tx, i, flags, cacheSigStore);
+        if (pvChecks) {
+            pvChecks->push_back(CScriptCheck());
+            check.swap(pvChecks->back());
+        } else if (!check()) {
+            if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+                // Check whether the failure was caused by a
+                // non-mandatory script verification check, such as
+                // non-standard DER encodings or non-null dummy
+                // arguments; if so, don't trigger DoS protection to
+                // avoid splitting the network between upgraded and
+                // non-upgraded nodes.
+                CScriptCheck check2(*coins, tx, i,
+                        flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore);
+                if (check2())
+                    return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+            }
+            // Failures of other flags indicate a transaction that is
+            // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+            // such nodes as they are not following the protocol. That
+            // said during an upgrade careful thought should be taken
+            // as to the correct behavior - we may want to continue
+            // peering with non-upgraded nodes even after soft-fork
+            // super-majority signaling has occurred.
+            return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+        }
+    }
+
+    // Only cache scripts that were all executed here; deferred checks
+    // have not run yet
+    if (cacheFullScriptStore && !pvChecks)
+        scriptExecutionCache.insert(hashCacheEntry);
+
+    return true;
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
         if (!Consensus::CheckTxInputs(tx, state, inputs, GetSpendHeight(inputs)))
             return false;
 
-        if (pvChecks)
-            pvChecks->reserve(tx.vin.size());
-
-        // The first loop above does all the inexpensive checks.
+        // CheckTxInputs does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
 
@@ -2284,41 +2541,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // and any change will be caught at the next checkpoint. Of course, if
         // the checkpoint is for a chain that's invalid due to false scriptSigs
         // this optimisation would allow an invalid chain to be accepted.
-        if (fScriptChecks) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++) {
-                const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
-
-                // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
-                if (pvChecks) {
-                    pvChecks->push_back(CScriptCheck());
-                    check.swap(pvChecks->back());
-                } else if (!check()) {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-standard DER encodings or non-null dummy
-                        // arguments; if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
-                        if (check2())
-                            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after soft-fork
-                    // super-majority signaling has occurred.
-                    return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
-                }
-            }
-        }
+        if (fScriptChecks)
+            return CheckInputScripts(tx, state, inputs, flags, cacheSigStore, cacheFullScriptStore, pvChecks);
     }
 
     return true;
@@ -2405,17 +2629,23 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
  * @param undo The undo object.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
+ * @param statsDelta Statistics the change to the UTXO set is added to.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out, CCoinsStats& statsDelta)
 {
     bool fClean = true;
 
     CCoinsModifier coins = view.ModifyCoins(out.hash);
+    statsDelta.UpdateRecord(out.hash, *coins, false);
     if (undo.nHeight != 0) {
         // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
+        if (!coins->IsPruned()) {
             fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
+            for (unsigned int i = 0; i < coins->vout.size(); i++)
+                if (coins->IsAvailable(i))
+                    statsDelta.UpdateOutput(out.hash, i, *coins, false);
+        }
         coins->Clear();
         coins->fCoinBase = undo.fCoinBase;
         
@@ -2427,16 +2657,21 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
         if (coins->IsPruned())
             fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
     }
-    if (coins->IsAvailable(out.n))
+    if (coins->IsAvailable(out.n)) {
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
+        statsDelta.UpdateOutput(out.hash, out.n, *coins, false);
+    }
     if (coins->vout.size() < out.n+1)
         coins->vout.resize(out.n+1);
     coins->vout[out.n] = undo.txout;
+    if (coins->IsAvailable(out.n))
+        statsDelta.UpdateOutput(out.hash, out.n, *coins, true);
+    statsDelta.UpdateRecord(out.hash, *coins, true);
 
     return fClean;
 }
 
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CBlockIndexUpdates* pupdates)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -2458,6 +2693,8 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    // How undoing the block changes the UTXO set statistics
+    CCoinsStats statsDelta;
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
@@ -2521,6 +2758,7 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
             fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
 
         // remove outputs
+        statsDelta.UpdateCoins(hash, *outs, CCoins());
         outs->Clear();
         }
 
@@ -2572,13 +2810,14 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                     }
                 }
 
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(undo, view, out, statsDelta))
                     fClean = false;
             }
         }
     }
 
     // move best block pointer to prevout block
+    view.AddStatsDelta(statsDelta);
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
     
@@ -2599,6 +2838,11 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
         if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
             return AbortNode(state, "Failed to write address unspent index");
         }
+
+        if (pupdates) {
+            pupdates->vAddressDeltas.swap(addressIndex);
+            pupdates->vSpent.swap(spentIndex);
+        }
     }
 
     return fClean;
@@ -2629,13 +2873,226 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** What ConnectBlock needs to know about a transaction beyond its scripts */
+struct CTxConnectInfo
+{
+    //! Whether PrecheckTransaction has filled in the fields below
+    bool fPrechecked;
+    bool fSequenceLocksOk;
+    //! Whether Consensus::CheckTxInputs passed; state holds the reason if not
+    bool fInputsOk;
+    CValidationState state;
+    int64_t nSigOpsCost;
+    CAmount nValueIn;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    //! Copies of the coins spent by the transaction, for a precheck on another
+    //! thread; lookups in the block's view may insert into it, so it is not shared
+    std::unique_ptr<CCoinsViewCache> pinputs;
+
+    CTxConnectInfo() : fPrechecked(false), fSequenceLocksOk(false), fInputsOk(false), nSigOpsCost(0), nValueIn(0) {}
+};
+
+/**
+ * Check the inputs of the nTx-th transaction of the block at pindex, apart from
+ * its scripts, and build all of its address and spent index entries, those of
+ * its inputs and of its outputs. The inputs must be in view. Only reads view
+ * and the block index.
+ */
+static void PrecheckTransaction(const CTransaction& tx, unsigned int nTx, const CCoinsViewCache& view, const CBlockIndex& block,
+                                unsigned int flags, int nLockTimeFlags, CTxConnectInfo& info)
+{
+    if (!tx.IsCoinBase())
+    {
+        // Check that transaction is BIP68 final
+        // BIP68 lock checks (as opposed to nLockTime checks) must
+        // be in ConnectBlock because they require the UTXO set
+        std::vector<int> prevheights(tx.vin.size());
+        for (size_t j = 0; j < tx.vin.size(); j++) {
+            prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+        }
+        info.fSequenceLocksOk = SequenceLocks(tx, nLockTimeFlags, &prevheights, block);
+
+        if (fAddressIndex)
+        {
+            for (size_t j = 0; j < tx.vin.size(); j++) {
+
+                const CTxIn input = tx.vin[j];
+                const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
+                uint160 hashBytes;
+                int addressType;
+
+                if (prevout.scriptPubKey.IsPayToScriptHash()) {
+                    hashBytes = uint160(std::vector <unsigned char>(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
+                    addressType = 2;
+                } else if (prevout.scriptPubKey.IsPayToPubkeyHash()) {
+                    hashBytes = uint160(std::vector <unsigned char>(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
+                    addressType = 1;
+                } else if (prevout.scriptPubKey.IsPayToPubkey()) {
+                    std::vector<unsigned char> pubkeyBytes(prevout.scriptPubKey.begin() + 1, prevout.scriptPubKey.end() - 1);
+                    hashBytes = Hash160(pubkeyBytes);
+                    addressType = 1;
+                } else {
+                    hashBytes.SetNull();
+                    addressType = 0;
+                }
+                if (addressType > 0) {
+                    // record spending activity
+                    info.addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, block.nHeight, nTx, tx.GetHash(), j, true), prevout.nValue * -1));
+
+                    // remove address from unspent index
+                    info.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
+                }
+
+                info.spentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(tx.GetHash(), j, block.nHeight, prevout.nValue, addressType, hashBytes)));
+            }
+        }
+
+        info.nValueIn = view.GetValueIn(tx);
+        // The view is at the previous block, so the spend height is this block's
+        info.fInputsOk = Consensus::CheckTxInputs(tx, info.state, view, block.nHeight);
+    }
+
+    // GetTransactionSigOpCost counts 3 types of sigops:
+    // * legacy (always)
+    // * p2sh (when P2SH enabled in flags and excludes coinbase)
+    // * witness (when witness enabled in flags and excludes coinbase)
+    info.nSigOpsCost = GetTransactionSigOpCost(tx, view, flags);
+
+    if (fAddressIndex) {
+        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+            const CTxOut &out = tx.vout[k];
+
+            if (out.scriptPubKey.IsPayToScriptHash()) {
+                std::vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
+
+                // record receiving activity
+                info.addressIndex.push_back(std::make_pair(CAddressIndexKey(2, uint160(hashBytes), block.nHeight, nTx, tx.GetHash(), k, false), out.nValue));
+
+                // record unspent output
+                info.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(2, uint160(hashBytes), tx.GetHash(), k), CAddressUnspentValue(out.nValue, out.scriptPubKey, block.nHeight)));
+
+            } else if (out.scriptPubKey.IsPayToPubkeyHash()) {
+                std::vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
+
+                // record receiving activity
+                info.addressIndex.push_back(std::make_pair(CAddressIndexKey(1, uint160(hashBytes), block.nHeight, nTx, tx.GetHash(), k, false), out.nValue));
+
+                // record unspent output
+                info.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(1, uint160(hashBytes), tx.GetHash(), k), CAddressUnspentValue(out.nValue, out.scriptPubKey, block.nHeight)));
+
+            } else if (out.scriptPubKey.IsPayToPubkey()) {
+                std::vector<unsigned char> pubkeyBytes(out.scriptPubKey.begin() + 1, out.scriptPubKey.end()-1);
+                auto tmp(Hash160(pubkeyBytes));
+                std::vector<unsigned char> hashBytes(tmp.begin(), tmp.end());
+
+                // record receiving activity
+                info.addressIndex.push_back(std::make_pair(CAddressIndexKey(1, uint160(hashBytes), block.nHeight, nTx, tx.GetHash(), k, false), out.nValue));
+
+                // record unspent output
+                info.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(1, uint160(hashBytes), tx.GetHash(), k), CAddressUnspentValue(out.nValue, out.scriptPubKey, block.nHeight)));
+            } else {
+                continue;
+            }
+
+        }
+    }
+
+    info.fPrechecked = true;
+}
+
+/** Runs PrecheckTransaction on the script check queue, against the copied inputs of the transaction */
+class CTxPrecheck
+{
+private:
+    const CTransaction *ptx;
+    unsigned int nTx;
+    const CCoinsViewCache *pview;
+    const CBlockIndex *pindex;
+    unsigned int nFlags;
+    int nLockTimeFlags;
+    CTxConnectInfo *pinfo;
+
+public:
+    CTxPrecheck(): ptx(0), nTx(0), pview(0), pindex(0), nFlags(0), nLockTimeFlags(0), pinfo(0) {}
+    CTxPrecheck(const CTransaction& txIn, unsigned int nTxIn, const CCoinsViewCache& viewIn, const CBlockIndex& blockIn,
+                unsigned int nFlagsIn, int nLockTimeFlagsIn, CTxConnectInfo& infoIn) :
+        ptx(&txIn), nTx(nTxIn), pview(&viewIn), pindex(&blockIn), nFlags(nFlagsIn), nLockTimeFlags(nLockTimeFlagsIn), pinfo(&infoIn) {}
+
+    //! Failures are left in the CTxConnectInfo for ConnectBlock to report in block order
+    bool operator()() {
+        PrecheckTransaction(*ptx, nTx, *pview, *pindex, nFlags, nLockTimeFlags, *pinfo);
+        return true;
+    }
+
+    void swap(CTxPrecheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(nTx, check.nTx);
+        std::swap(pview, check.pview);
+        std::swap(pindex, check.pindex);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nLockTimeFlags, check.nLockTimeFlags);
+        std::swap(pinfo, check.pinfo);
+    }
+};
+
+/**
+ * A check run on the script check queue: a script verification, or a
+ * transaction precheck. ConnectBlock finishes the prechecks before it queues
+ * scripts, so both share the -par threads.
+ */
+class CBlockCheck
+{
+private:
+    boost::variant<CScriptCheck, CTxPrecheck> check;
+
+    class CRunVisitor : public boost::static_visitor<bool>
+    {
+    public:
+        template <typename T>
+        bool operator()(T& check) const { return check(); }
+    };
+
+public:
+    CBlockCheck() {}
+    explicit CBlockCheck(const CTxPrecheck& precheck) : check(precheck) {}
+
+    //! Take over scriptCheck, leaving it empty
+    void SetScriptCheck(CScriptCheck& scriptCheck) {
+        check = CScriptCheck();
+        boost::get<CScriptCheck>(check).swap(scriptCheck);
+    }
+
+    bool operator()() {
+        return boost::apply_visitor(CRunVisitor(), check);
+    }
+
+    void swap(CBlockCheck &other) {
+        // Script checks are swapped in place, as copying them copies their scripts
+        CScriptCheck *pscript = boost::get<CScriptCheck>(&check);
+        CScriptCheck *pscriptOther = boost::get<CScriptCheck>(&other.check);
+        if (pscript && pscriptOther)
+            pscript->swap(*pscriptOther);
+        else
+            check.swap(other.check);
+    }
+};
+
+static CCheckQueue<CBlockCheck> scriptcheckqueue(128);
 
 void ThreadScriptCheck() {
     RenameThread("atbcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(8);
+
+void ThreadPrefetch() {
+    RenameThread("atbcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2689,8 +3146,44 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/** The script verification flags of a block with version nVersion and time nBlockTime on top of pindexPrev */
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev, int32_t nVersion, int64_t nBlockTime, const Consensus::Params& consensusParams)
+{
+    AssertLockHeld(cs_main);
+
+    // BIP16 didn't become active until Apr 1 2012
+    int64_t nBIP16SwitchTime = 1333238400;
+    bool fStrictPayToScriptHash = (nBlockTime >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
+    // when 75% of the network has upgraded:
+    if (nVersion >= 3 && IsSuperMajority(3, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams)) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
+    // blocks, when 75% of the network has upgraded:
+    if (nVersion >= 4 && IsSuperMajority(4, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams)) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindexPrev, consensusParams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    // Start enforcing WITNESS rules using versionbits logic.
+    if (IsWitnessEnabled(pindexPrev, consensusParams)) {
+        flags |= SCRIPT_VERIFY_WITNESS;
+    }
+
+    return flags;
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck, CBlockIndexUpdates* pupdates)
 {
     AssertLockHeld(cs_main);
 
@@ -2759,45 +3252,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    // BIP16 didn't become active until Apr 1 2012
-    int64_t nBIP16SwitchTime = 1333238400;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
-    // when 75% of the network has upgraded:
-    if (block.nVersion >= 3 && IsSuperMajority(3, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
-    // blocks, when 75% of the network has upgraded:
-    if (block.nVersion >= 4 && IsSuperMajority(4, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
+    unsigned int flags = GetBlockScriptFlags(pindex->pprev, block.nVersion, pindex->GetBlockTime(), chainparams.GetConsensus());
 
-    // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    // BIP68 (sequence locks) is enforced together with BIP112 (CHECKSEQUENCEVERIFY)
     int nLockTimeFlags = 0;
-    if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    if (flags & SCRIPT_VERIFY_CHECKSEQUENCEVERIFY) {
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
-    // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_WITNESS;
-    }
-
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
     CBlockUndo blockundo;
+    // How the block changes the UTXO set statistics
+    CCoinsStats statsDelta;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CBlockCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     std::vector<uint256> vOrphanErase;
-    std::vector<int> prevheights;
     CAmount nFees = 0;
     
     CAmount nActualStakeReward = 0;
@@ -2813,26 +3285,76 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
     
+    // Everything but the scripts and the coins update only reads the view.
+    // Transactions that spend outputs of earlier transactions in the block
+    // need those connected first; the others are checked here, in parallel,
+    // against the view as it was before the block. Each transaction's results
+    // are applied in block order below, so the first failure reported is the
+    // same as when checking one transaction at a time.
+    std::vector<CTxConnectInfo> vInfo(block.vtx.size());
+    {
+        std::set<uint256> setBlockTxids;
+        CCoinsView viewNoInputs;
+        std::vector<CBlockCheck> vPrechecks;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction &tx = block.vtx[i];
+            bool fDependent = false;
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    if (setBlockTxids.count(txin.prevout.hash)) {
+                        fDependent = true;
+                        break;
+                    }
+                }
+            }
+            setBlockTxids.insert(tx.GetHash());
+            if (fDependent || !view.HaveInputs(tx))
+                continue;
+            // The checks run on other threads, so each gets copies of its
+            // inputs instead of looking them up in view
+            CCoinsViewCache *pinputs = new CCoinsViewCache(&viewNoInputs);
+            vInfo[i].pinputs.reset(pinputs);
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    if (!pinputs->HaveCoinsInCache(txin.prevout.hash))
+                        *pinputs->ModifyCoins(txin.prevout.hash) = *view.AccessCoins(txin.prevout.hash);
+                }
+            }
+            vPrechecks.push_back(CBlockCheck(CTxPrecheck(tx, i, *pinputs, *pindex, flags, nLockTimeFlags, vInfo[i])));
+        }
+        unsigned int nPrechecks = vPrechecks.size();
+        if (nScriptCheckThreads) {
+            CCheckQueueControl<CBlockCheck> precheckControl(&scriptcheckqueue);
+            precheckControl.Add(vPrechecks);
+            precheckControl.Wait();
+        } else {
+            BOOST_FOREACH(CBlockCheck& check, vPrechecks)
+                check();
+        }
+        BOOST_FOREACH(CTxConnectInfo& info, vInfo)
+            info.pinputs.reset();
+        LogPrint("bench", "      - Precheck %u of %u transactions: %.2fms\n", nPrechecks, (unsigned)block.vtx.size(), 0.001 * (GetTimeMicros() - nTime2));
+    }
+
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
+        CTxConnectInfo &info = vInfo[i];
 
         nInputs += tx.vin.size();
 
+        // Also catches inputs that were there when prechecked but have since
+        // been spent by an earlier transaction of the block
+        if (!view.HaveInputs(tx))
+            return state.DoS(100, error("ConnectBlock(): inputs missing/spent"),
+                             REJECT_INVALID, "bad-txns-inputs-missingorspent");
+
+        if (!info.fPrechecked)
+            PrecheckTransaction(tx, i, view, *pindex, flags, nLockTimeFlags, info);
+
         if (!tx.IsCoinBase())
         {
-            if (!view.HaveInputs(tx))
-                return state.DoS(100, error("ConnectBlock(): inputs missing/spent"),
-                                 REJECT_INVALID, "bad-txns-inputs-missingorspent");
-
-            // Check that transaction is BIP68 final
-            // BIP68 lock checks (as opposed to nLockTime checks) must
-            // be in ConnectBlock because they require the UTXO set
-            prevheights.resize(tx.vin.size());
-            for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
-            }
-
             // Which orphan pool entries must we evict?
             for (size_t j = 0; j < tx.vin.size(); j++) {
                 auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
@@ -2844,52 +3366,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 }
             }
 
-            if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, *pindex)) {
+            if (!info.fSequenceLocksOk) {
                 return state.DoS(100, error("%s: contains a non-BIP68-final transaction", __func__),
                                  REJECT_INVALID, "bad-txns-nonfinal");
             }
-
-            if (fAddressIndex)
-            {
-                for (size_t j = 0; j < tx.vin.size(); j++) {
-
-                    const CTxIn input = tx.vin[j];
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    uint160 hashBytes;
-                    int addressType;
-
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        hashBytes = uint160(std::vector <unsigned char>(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-                        addressType = 2;
-                    } else if (prevout.scriptPubKey.IsPayToPubkeyHash()) {
-                        hashBytes = uint160(std::vector <unsigned char>(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-                        addressType = 1;
-                    } else if (prevout.scriptPubKey.IsPayToPubkey()) {
-                        std::vector<unsigned char> pubkeyBytes(prevout.scriptPubKey.begin() + 1, prevout.scriptPubKey.end() - 1);
-                        hashBytes = Hash160(pubkeyBytes);
-                        addressType = 1;
-                    } else {
-                        hashBytes.SetNull();
-                        addressType = 0;
-                    }
-                    if (fAddressIndex && addressType > 0) {
-                        // record spending activity
-                        addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, tx.GetHash(), j, true), prevout.nValue * -1));
-
-                        // remove address from unspent index
-                        addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
-                    }
-
-                    spentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(tx.GetHash(), j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
-                }
-            }
         }
 
-        // GetTransactionSigOpCost counts 3 types of sigops:
-        // * legacy (always)
-        // * p2sh (when P2SH enabled in flags and excludes coinbase)
-        // * witness (when witness enabled in flags and excludes coinbase)
-        nSigOpsCost += GetTransactionSigOpCost(tx, view, flags);
+        nSigOpsCost += info.nSigOpsCost;
         if (nSigOpsCost > MAX_BLOCK_SIGOPS_COST)
             return state.DoS(100, error("ConnectBlock(): too many sigops"),
                              REJECT_INVALID, "bad-blk-sigops");
@@ -2897,63 +3380,36 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         {
             
             if (tx.IsCoinStake())
-                nActualStakeReward = tx.GetValueOut()-view.GetValueIn(tx);
+                nActualStakeReward = tx.GetValueOut()-info.nValueIn;
             else
-                nFees += view.GetValueIn(tx)-tx.GetValueOut();
+                nFees += info.nValueIn-tx.GetValueOut();
                     
+            if (!info.fInputsOk) {
+                state = info.state;
+                return error("ConnectBlock(): CheckInputs on %s failed with %s",
+                    tx.GetHash().ToString(), FormatStateMessage(state));
+            }
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, nScriptCheckThreads ? &vChecks : NULL))
+            if (fScriptChecks && !CheckInputScripts(tx, state, view, flags, fCacheResults, fCacheResults, nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
-            control.Add(vChecks);
+            std::vector<CBlockCheck> vBlockChecks(vChecks.size());
+            for (size_t j = 0; j < vChecks.size(); j++)
+                vBlockChecks[j].SetScriptCheck(vChecks[j]);
+            control.Add(vBlockChecks);
             
         }
 
-        if (fAddressIndex) {
-            for (unsigned int k = 0; k < tx.vout.size(); k++) {
-                const CTxOut &out = tx.vout[k];
-
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    std::vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-
-                    // record receiving activity
-                    addressIndex.push_back(std::make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, tx.GetHash(), k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(2, uint160(hashBytes), tx.GetHash(), k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else if (out.scriptPubKey.IsPayToPubkeyHash()) {
-                    std::vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-
-                    // record receiving activity
-                    addressIndex.push_back(std::make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, tx.GetHash(), k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(1, uint160(hashBytes), tx.GetHash(), k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else if (out.scriptPubKey.IsPayToPubkey()) {
-                    std::vector<unsigned char> pubkeyBytes(out.scriptPubKey.begin() + 1, out.scriptPubKey.end()-1);
-                    auto tmp(Hash160(pubkeyBytes));
-                    std::vector<unsigned char> hashBytes(tmp.begin(), tmp.end());
-
-                    // record receiving activity
-                    addressIndex.push_back(std::make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, tx.GetHash(), k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(1, uint160(hashBytes), tx.GetHash(), k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-                } else {
-                    continue;
-                }
-
-            }
-        }
+        addressIndex.insert(addressIndex.end(), info.addressIndex.begin(), info.addressIndex.end());
+        addressUnspentIndex.insert(addressUnspentIndex.end(), info.addressUnspentIndex.begin(), info.addressUnspentIndex.end());
+        spentIndex.insert(spentIndex.end(), info.spentIndex.begin(), info.spentIndex.end());
 
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
-        UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
+        UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight, &statsDelta);
 
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
@@ -3028,6 +3484,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->UpdateSpentIndex(spentIndex))
             return AbortNode(state, "Failed to write transaction index");
 
+        if (pupdates) {
+            pupdates->vAddressDeltas.swap(addressIndex);
+            pupdates->vSpent.swap(spentIndex);
+        }
+
         unsigned int logicalTS = pindex->nTime;
         unsigned int prevLogicalTS = 0;
  
@@ -3049,6 +3510,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     // add this block to the view's block chain
+    view.AddStatsDelta(statsDelta);
     view.SetBestBlock(pindex->GetBlockHash());
 
     int64_t nTime5 = GetTimeMicros(); nTimeIndex += nTime5 - nTime4;
@@ -3118,7 +3580,11 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // Release the entries of a finished background write of the coins
+    if (pcoinsWriter && !pcoinsWriter->IsWriting() && !pcoinsWriter->WaitForWrite())
+        return AbortNode(state, "Failed to write to coin database");
+    // Entries still being written in the background count towards the cache
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() + (pcoinsWriter ? pcoinsWriter->DynamicMemoryUsage() : 0);
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
@@ -3169,7 +3635,13 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Unless the cache has to shrink, only the modified entries are
+        // written, so the unmodified ones stay cached.
+        bool fOk = (fCacheLarge || fCacheCritical) ? pcoinsTip->Flush() : pcoinsTip->Sync();
+        // Explicit flushes and pruning need the coins on disk before returning
+        if (fOk && pcoinsWriter && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune))
+            fOk = pcoinsWriter->WaitForWrite();
+        if (!fOk)
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
@@ -3268,13 +3740,17 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
         return AbortNode(state, "Failed to read block");
     // Apply the block atomically to the chain state.
     int64_t nStart = GetTimeMicros();
+    CBlockIndexUpdates updates;
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, &updates))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+    // Cached RPC responses about the block and its transactions are no longer valid
+    if (pResponseCache)
+        pResponseCache->EraseBlock(pindexDelete->GetBlockHash());
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
@@ -3289,7 +3765,7 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
             
             if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
             
-                mempool.removeRecursive(tx, removed);
+                mempool.removeRecursive(tx, removed, MEMPOOL_REMOVE_REORG);
             } else if (mempool.exists(tx.GetHash())) {
                 vHashUpdate.push_back(tx.GetHash());
             }
@@ -3309,15 +3785,42 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         SyncWithWallets(tx, pindexDelete->pprev, NULL);
     }
+    // Announce the index records once the block is off the tip
+    if (fAddressIndex) {
+        GetMainSignals().AddressIndexUpdated(pindexDelete, updates.vAddressDeltas, INDEX_UPDATE_DISCONNECT);
+        GetMainSignals().SpentIndexUpdated(pindexDelete, updates.vSpent, INDEX_UPDATE_DISCONNECT);
+    }
     return true;
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
+/**
+ * Load the coins spent by block into pcoinsTip, so that ConnectBlock does not
+ * wait for the database lookups one at a time. Outputs created within the
+ * block are skipped.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    std::set<uint256> setBlockTxids;
+    std::vector<uint256> vTxid;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        setBlockTxids.insert(tx.GetHash());
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!setBlockTxids.count(txin.prevout.hash))
+                vTxid.push_back(txin.prevout.hash);
+        }
+    }
+    pcoinsTip->Prefetch(vTxid, nPrefetchThreads > 1 ? &prefetchqueue : NULL);
+}
+
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
@@ -3337,9 +3840,16 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    if (nPrefetchThreads) {
+        PrefetchBlockInputs(*pblock);
+        int64_t nTimePrefetched = GetTimeMicros(); nTimePrefetch += nTimePrefetched - nTime2;
+        LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTimePrefetched - nTime2) * 0.001, nTimePrefetch * 0.000001);
+        nTime2 = nTimePrefetched;
+    }
+    CBlockIndexUpdates updates;
     {
         CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams, false, &updates);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -3372,6 +3882,11 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
         SyncWithWallets(tx, pindexNew, pblock);
     }
+    // Announce the index records once the block is the tip
+    if (fAddressIndex) {
+        GetMainSignals().AddressIndexUpdated(pindexNew, updates.vAddressDeltas, INDEX_UPDATE_CONNECT);
+        GetMainSignals().SpentIndexUpdated(pindexNew, updates.vSpent, INDEX_UPDATE_CONNECT);
+    }
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
@@ -3762,7 +4277,7 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(block);
     assert(pindexNew);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
@@ -3771,7 +4286,7 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     
     if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        setStakeSeen.insert(make_pair(pindexNew->pcold->prevoutStake, pindexNew->pcold->nStakeTime));
     
     pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
@@ -3800,7 +4315,7 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return 0;
     }
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-    pindexNew->bnStakeModifierV2 = ComputeStakeModifierV2(pindexNew->pprev, block.IsProofOfWork() ? hash : block.PrevoutStake().hash);
+    pindexNew->pcold->bnStakeModifierV2 = ComputeStakeModifierV2(pindexNew->pprev, block.IsProofOfWork() ? hash : block.PrevoutStake().hash);
     
     
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -4061,6 +4576,15 @@ bool CheckBlockSignature(const CBlock& block)
 
 
 
+bool static IsCanonicalBlockSignature(const CBlockHeader* pblock, bool checkLowS)
+{
+    if (pblock->IsProofOfWork()) {
+        return pblock->vchBlockSig.empty();
+    }
+
+    return checkLowS ? IsLowDERSignature(pblock->vchBlockSig, NULL, false) : IsDERSignature(pblock->vchBlockSig, NULL, false);
+}
+
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     
@@ -4384,18 +4908,48 @@ static bool UpdateHashProof(const CBlock& block, CValidationState& state, CBlock
     }
     
     // Record proof hash value
-    pindex->hashProof = hashProof;
+    pindex->pcold->hashProof = hashProof;
     return true;
 }
 
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/** Proof-of-stake checks that only need the header, so headers can be accepted, and
+ *  their blocks fetched from many peers, well ahead of the blocks being connected.
+ *  fKernelChecked tells whether the staked output could be found to check the kernel,
+ *  see CheckProofOfStakeHeader. */
+static bool CheckBlockHeaderStake(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev, bool fCheckKernel, bool& fKernelChecked)
+{
+    fKernelChecked = false;
+    const int nHeight = pindexPrev->nHeight + 1;
+    if (block.IsProofOfWork() && nHeight > Params().LastPOWBlock())
+        return state.DoS(100, false, REJECT_INVALID, "bad-pow-height", false, strprintf("proof-of-work at height %d", nHeight));
+
+    if (!IsCanonicalBlockSignature(&block, false))
+        return state.DoS(0, false, REJECT_INVALID, "bad-blk-sig-encoding", false, "non-canonical block signature");
+
+    if (block.IsProofOfWork())
+        return true;
+
+    if (block.PrevoutStake().IsNull())
+        return state.DoS(100, false, REJECT_INVALID, "bad-stake-prevout", false, "proof-of-stake header without stake");
+
+    if (!CheckCoinStakeTimestamp(block.GetBlockTime(), block.StakeTime()))
+        return state.DoS(50, false, REJECT_INVALID, "bad-stake-time", false, "coinstake timestamp violation");
+
+    if (fCheckKernel && !fReindex && !CheckProofOfStakeHeader(pindexPrev, state, block, fKernelChecked))
+        return false;
+
+    return true;
+}
+
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckStakeKernel=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
     uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
+    bool fStakeChecked = false;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
 
         if (miSelf != mapBlockIndex.end()) {
@@ -4426,6 +4980,9 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
 
         if (!ContextualCheckBlockHeader(block, state, chainparams.GetConsensus(), pindexPrev, GetAdjustedTime()))
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
+
+        if (!CheckBlockHeaderStake(block, state, pindexPrev, fCheckStakeKernel, fStakeChecked))
+            return error("%s: CheckBlockHeaderStake: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
     
     if (pindex == NULL)
@@ -4435,6 +4992,8 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         {
             return error("%s: AddToBlockIndex(): %s", __func__, state.GetRejectReason().c_str());
         }
+        if (fStakeChecked)
+            pindex->SetStakeCheckedOnHeader();
     }
     
 
@@ -4453,7 +5012,8 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     CBlockIndex *pindexDummy = NULL;
     CBlockIndex *&pindex = ppindex ? *ppindex : pindexDummy;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex))
+    // The kernel is checked along with the coinstake signature below
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, false))
         return false;
 
     
@@ -4543,25 +5103,12 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 }
 
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
-{
-    pnode->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(pindexBegin), hashEnd);
-}
-
-bool static IsCanonicalBlockSignature(const CBlock* pblock, bool checkLowS)
-{
-    if (pblock->IsProofOfWork()) {
-        return pblock->vchBlockSig.empty();
-    }
-
-    return checkLowS ? IsLowDERSignature(pblock->vchBlockSig, NULL, false) : IsDERSignature(pblock->vchBlockSig, NULL, false);
-}
-
 bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, CNode* pfrom, const CBlock* pblock, bool fForceProcessing, const CDiskBlockPos* dbp)
 {
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1,
+                                              pfrom ? ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION) : 0);
         fRequested |= fForceProcessing;
 
         // Check for duplicate
@@ -4640,12 +5187,9 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, C
                 if (pblock->IsProofOfStake())
                     setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-                // Ask this guy to fill in what we're missing
-                PushGetBlocks(pfrom, pindexBestHeader, GetOrphanRoot(hash));
-                // ppcoin: getblocks may not obtain the ancestor block rejected
-                // earlier by duplicate-stake check so we ask for it again directly
-                if (!IsInitialBlockDownload())
-                    pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+                // Ask this guy for the headers we're missing; the blocks
+                // themselves are then fetched from all peers that have them
+                pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), GetOrphanRoot(hash));
             }
             return true;
         }
@@ -4893,36 +5437,167 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex(): new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+static boost::filesystem::path GetBlockIndexSnapshotPath()
 {
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+    return GetDataDir() / "blocks" / "indexsnapshot.dat";
+}
+
+static void DiscardBlockIndexSnapshotEntries()
+{
+    mapBlockIndex.clear();
+    blockIndexArena.Clear();
+    setStakeSeen.clear();
+}
+
+/**
+ * Load the block index from the snapshot written at the last clean shutdown,
+ * if the block tree database has not changed since. The records come sorted
+ * by height with nChainWork and pskip already filled in.
+ */
+static bool LoadBlockIndexSnapshot(vector<CBlockIndex*>& vSortedByHeight)
+{
+    uint64_t nNonce = 0;
+    if (!pblocktree->ReadBlockIndexSnapshotNonce(nNonce))
+        return false;
+    // Whichever way the index gets loaded, any write to the database from now on makes the snapshot stale
+    if (!pblocktree->EraseBlockIndexSnapshotNonce())
+        return false;
+    if (!GetBoolArg("-blockindexsnapshot", DEFAULT_BLOCKINDEX_SNAPSHOT))
         return false;
 
-    boost::this_thread::interruption_point();
+    int64_t nStart = GetTimeMillis();
+    CBlockIndexSnapshot snapshot;
+    if (!snapshot.Open(GetBlockIndexSnapshotPath()) || snapshot.GetNonce() != nNonce || snapshot.GetBestBlock() != pcoinsTip->GetBestBlock()) {
+        LogPrintf("%s: block index snapshot missing or stale, loading the block index from the database\n", __func__);
+        return false;
+    }
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    vSortedByHeight.reserve(snapshot.size());
+    mapBlockIndex.reserve(snapshot.size());
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        const BlockIndexSnapshotRecord& rec = snapshot[i];
+        uint256 hash;
+        memcpy(hash.begin(), rec.hashBlock, 32);
+        if (rec.nPrev < -1 || rec.nPrev >= (int64_t)i || rec.nSkip < -1 || rec.nSkip >= (int64_t)i ||
+            (rec.nPrev == -1 ? rec.nHeight != 0 : rec.nHeight != vSortedByHeight[rec.nPrev]->nHeight + 1) ||
+            mapBlockIndex.count(hash)) {
+            DiscardBlockIndexSnapshotEntries();
+            vSortedByHeight.clear();
+            return error("%s: block index snapshot is inconsistent at record %u", __func__, i);
+        }
+
+        CBlockIndex* pindex = InsertBlockIndex(hash);
+        pindex->pprev = rec.nPrev == -1 ? NULL : vSortedByHeight[rec.nPrev];
+        pindex->pskip = rec.nSkip == -1 ? NULL : vSortedByHeight[rec.nSkip];
+        if (!snapshot.GetBlockIndex(rec, *pindex) ||
+            (pindex->IsProofOfWork() && !CheckProofOfWork(pindex->GetBlockHash(), pindex->nBits, consensusParams))) {
+            DiscardBlockIndexSnapshotEntries();
+            vSortedByHeight.clear();
+            return error("%s: block index snapshot is inconsistent at record %u", __func__, i);
+        }
+
+        // NovaCoin: build setStakeSeen
+        if (pindex->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindex->pcold->prevoutStake, pindex->pcold->nStakeTime));
+
+        vSortedByHeight.push_back(pindex);
+    }
+
+    LogPrintf("%s: loaded %u block index entries from snapshot in %dms\n", __func__, vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    if (!GetBoolArg("-blockindexsnapshot", DEFAULT_BLOCKINDEX_SNAPSHOT) || pblocktree == NULL || pcoinsTip == NULL)
+        return false;
+    // Entries that did not make it to the database would be lost on the next start without a snapshot
+    if (!setDirtyBlockIndex.empty())
+        return error("%s: block index not flushed, not writing a snapshot", __func__);
+
+    int64_t nStart = GetTimeMillis();
+    vector<pair<int, const CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    vector<const CBlockIndex*> vIndex;
+    vIndex.reserve(vSortedByHeight.size());
+    BOOST_FOREACH(const PAIRTYPE(int, const CBlockIndex*)& item, vSortedByHeight)
+        vIndex.push_back(item.second);
+
+    uint64_t nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+    if (!CBlockIndexSnapshot::Write(GetBlockIndexSnapshotPath(), vIndex, nNonce, pcoinsTip->GetBestBlock()))
+        return false;
+    if (!pblocktree->WriteBlockIndexSnapshotNonce(nNonce))
+        return error("%s: failed to record the block index snapshot", __func__);
+    LogPrintf("%s: wrote %u block index entries in %dms\n", __func__, vIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/**
+ * The database returns the entries in hash order. Move them into a new arena
+ * in height order, so that walks back along a chain visit adjacent entries.
+ */
+static void ArrangeBlockIndexByHeight(vector<CBlockIndex*>& vSortedByHeight)
+{
+    CBlockIndexArena arena;
+    std::unordered_map<const CBlockIndex*, CBlockIndex*> mapMoved(vSortedByHeight.size());
+    BOOST_FOREACH(CBlockIndex*& pindex, vSortedByHeight) {
+        CBlockIndex* pindexNew = arena.Allocate(*pindex);
+        mapMoved[pindex] = pindexNew;
+        mapBlockIndex[pindex->GetBlockHash()] = pindexNew;
+        pindex = pindexNew;
+    }
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight) {
+        if (pindex->pprev)
+            pindex->pprev = mapMoved[pindex->pprev];
+        if (pindex->pskip)
+            pindex->pskip = mapMoved[pindex->pskip];
+    }
+    // The old entries go away with arena
+    blockIndexArena.swap(arena);
+}
+
+bool static LoadBlockIndexDB()
+{
+    const CChainParams& chainparams = Params();
+    vector<CBlockIndex*> vSortedByHeight;
+    bool fFromSnapshot = LoadBlockIndexSnapshot(vSortedByHeight);
+    if (!fFromSnapshot) {
+        if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        vector<pair<int, CBlockIndex*> > vHeightAndIndex;
+        vHeightAndIndex.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vHeightAndIndex.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vHeightAndIndex.begin(), vHeightAndIndex.end());
+        vSortedByHeight.reserve(vHeightAndIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vHeightAndIndex)
+            vSortedByHeight.push_back(item.second);
+        ArrangeBlockIndexByHeight(vSortedByHeight);
+    }
+
+    // Calculate nChainWork
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        if (!fFromSnapshot)
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
         if (pindex->nTx > 0) {
@@ -4941,7 +5616,7 @@ bool static LoadBlockIndexDB()
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
+        if (pindex->pprev && !fFromSnapshot)
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || (pindex->IsProofOfWork() && CBlockIndexWorkComparator()(pindexBestHeader, pindex) )))
             pindexBestHeader = pindex;
@@ -5229,10 +5904,8 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
 }
 
@@ -5277,7 +5950,7 @@ bool InitBlockIndex(const CChainParams& chainparams)
                 return error("LoadBlockIndex(): writing genesis block to disk failed");
             CBlockIndex *pindex = AddToBlockIndex(block);
             
-            pindex->hashProof = chainparams.GetConsensus().hashGenesisBlock;
+            pindex->pcold->hashProof = chainparams.GetConsensus().hashGenesisBlock;
             
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
                 return error("LoadBlockIndex(): genesis block not accepted");
@@ -5728,17 +6401,19 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     CBlock block;
                     if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
+                    // Everything sent for a block shares its send queue, so it stays in order
+                    int nSendClass = mi->second->nHeight < chainActive.Height() - HISTORIC_BLOCK_DEPTH ? SEND_CLASS_HISTORIC_BLOCK : SEND_CLASS_BLOCK;
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+                        pfrom->PushMessageWithClass(nSendClass, SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
                     else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
+                        pfrom->PushMessageWithClass(nSendClass, 0, NetMsgType::BLOCK, block);
                     else if (inv.type == MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                            pfrom->PushMessageWithClass(nSendClass, 0, NetMsgType::MERKLEBLOCK, merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
                             // Note that there is currently no way for a node to request any single transactions we didn't send here -
@@ -5747,7 +6422,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                                pfrom->PushMessageWithClass(nSendClass, SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
                         }
                         // else
                             // no response
@@ -5758,11 +6433,13 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // they wont have a useful mempool to match against a compact block,
                         // and we dont feel like constructing the object for them, so
                         // instead we respond with the full, non-compact block.
+                        bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+                        int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
                         if (mi->second->nHeight >= chainActive.Height() - 10) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block);
-                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+                            CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
+                            pfrom->PushMessageWithFlag(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock);
                         } else
-                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+                            pfrom->PushMessageWithClass(nSendClass, nSendFlags, NetMsgType::BLOCK, block);
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -5770,10 +6447,11 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
-                        // wait for other stuff first.
+                        // wait for other stuff first. Block invs are never queued
+                        // behind bulk traffic, even when the block is historic.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage(NetMsgType::INV, vInv);
+                        pfrom->PushMessageWithClass(SEND_CLASS_BLOCK, 0, NetMsgType::INV, vInv);
                         pfrom->hashContinue.SetNull();
                     }
                 }
@@ -6028,13 +6706,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage(NetMsgType::SENDHEADERS);
         }
         if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
-            // Tell our peer we are willing to provide version-1 cmpctblocks
+            // Tell our peer we are willing to provide version 1 or 2 cmpctblocks
             // However, we do not request new block announcements using
             // cmpctblock messages.
             // We send this to non-NODE NETWORK peers as well, because
             // they may wish to request compact blocks from us
             bool fAnnounceUsingCMPCTBLOCK = false;
-            uint64_t nCMPCTBLOCKVersion = 1;
+            uint64_t nCMPCTBLOCKVersion = 2;
+            if (nLocalServices & NODE_WITNESS)
+                pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+            nCMPCTBLOCKVersion = 1;
             pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
         }
     }
@@ -6116,10 +6797,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         bool fAnnounceUsingCMPCTBLOCK = false;
         uint64_t nCMPCTBLOCKVersion = 1;
         vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
-        if (nCMPCTBLOCKVersion == 1) {
+        if (nCMPCTBLOCKVersion == 1 || ((nLocalServices & NODE_WITNESS) && nCMPCTBLOCKVersion == 2)) {
             LOCK(cs_main);
-            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
-            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+            CNodeState* nodestate = State(pfrom->GetId());
+            // fProvidesHeaderAndIDs is used to "lock in" the version of compact blocks we send (fWantsCmpctWitness)
+            if (!nodestate->fProvidesHeaderAndIDs) {
+                nodestate->fProvidesHeaderAndIDs = true;
+                nodestate->fWantsCmpctWitness = nCMPCTBLOCKVersion == 2;
+            }
+            if (nodestate->fWantsCmpctWitness == (nCMPCTBLOCKVersion == 2)) // ignore later version announces
+                nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+            if (!nodestate->fSupportsDesiredCmpctVersion) {
+                if (nLocalServices & NODE_WITNESS)
+                    nodestate->fSupportsDesiredCmpctVersion = (nCMPCTBLOCKVersion == 2);
+                else
+                    nodestate->fSupportsDesiredCmpctVersion = (nCMPCTBLOCKVersion == 1);
+            }
         }
     }
 
@@ -6174,10 +6867,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (CanDirectFetch(chainparams.GetConsensus()) &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER &&
+                        nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate) &&
                         (!IsWitnessEnabled(chainActive.Tip(), chainparams.GetConsensus()) || State(pfrom->GetId())->fHaveWitness)) {
                         inv.type |= nFetchFlags;
-                        if (nodestate->fProvidesHeaderAndIDs && !(nLocalServices & NODE_WITNESS))
+                        if (nodestate->fProvidesHeaderAndIDs && nodestate->fSupportsDesiredCmpctVersion)
                             vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
                         else
                             vToFetch.push_back(inv);
@@ -6211,6 +6904,108 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == NetMsgType::SHORTINV)
+    {
+        CShortInv shortinv;
+        vRecv >> shortinv;
+        if (shortinv.shortids.size() > MAX_INV_SZ)
+        {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message shortinv size() = %u", shortinv.shortids.size());
+        }
+
+        bool fBlocksOnly = !fRelayTxes;
+
+        // Allow whitelisted peers to send data other than blocks in blocks only mode if whitelistrelay is true
+        if (pfrom->fWhitelisted && GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))
+            fBlocksOnly = false;
+
+        if (fBlocksOnly) {
+            LogPrint("net", "shortinv sent in violation of protocol peer=%d\n", pfrom->id);
+            return true;
+        }
+
+        LOCK(cs_main);
+
+        // Batches are keyed by our salt, so they are only expected once we sent one
+        if (pfrom->nShortInvSaltSent == 0) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("unsolicited shortinv peer=%d", pfrom->id);
+        }
+
+        if (fImporting || fReindex || IsInitialBlockDownload())
+            return true;
+
+        // Short IDs matching a transaction we hold need no round trip; ask for
+        // the full hashes of the rest and handle them as a regular inv
+        CNodeState* nodestate = State(pfrom->GetId());
+        CShortInvRequest req;
+        req.nBatch = shortinv.nBatch;
+        if (shortinv.nonce == GetShortInvSalt(*nodestate)) {
+            const CShortInvIndex& index = GetShortInvIndex(*nodestate);
+            for (size_t i = 0; i < shortinv.shortids.size(); i++) {
+                const uint256* phash = index.Find(shortinv.shortids[i]);
+                // The index keeps transactions that since left the mempool
+                if (phash && mempool.exists(*phash))
+                    pfrom->AddInventoryKnown(CInv(MSG_TX, *phash));
+                else if (!phash || !mapOrphanTransactions.count(*phash))
+                    req.indexes.push_back(i);
+            }
+        } else if (shortinv.nonce == nodestate->nShortInvPrevSalt) {
+            // Sent before the peer had our new salt; there is no index for the old one
+            for (size_t i = 0; i < shortinv.shortids.size(); i++)
+                req.indexes.push_back(i);
+        } else {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("shortinv with unknown salt peer=%d", pfrom->id);
+        }
+        std::sort(req.indexes.begin(), req.indexes.end());
+        LogPrint("net", "got shortinv of %u txn, %u unknown peer=%d\n", shortinv.shortids.size(), req.indexes.size(), pfrom->id);
+        if (!req.indexes.empty())
+            pfrom->PushMessage(NetMsgType::GETSHORTINV, req);
+    }
+
+
+    else if (strCommand == NetMsgType::SHORTINVSALT)
+    {
+        uint64_t nSalt = 0;
+        vRecv >> nSalt;
+        LOCK(pfrom->cs_inventory);
+        pfrom->nShortInvSalt = nSalt;
+    }
+
+
+    else if (strCommand == NetMsgType::GETSHORTINV)
+    {
+        CShortInvRequest req;
+        vRecv >> req;
+
+        vector<CInv> vInv;
+        {
+            LOCK(pfrom->cs_inventory);
+            std::deque<std::pair<uint32_t, std::vector<uint256> > >::const_iterator it = pfrom->vShortInvSent.begin();
+            while (it != pfrom->vShortInvSent.end() && it->first != req.nBatch)
+                it++;
+            if (it == pfrom->vShortInvSent.end()) {
+                LogPrint("net", "Peer %d sent us a getshortinv for an unknown or expired batch\n", pfrom->id);
+                return true;
+            }
+            for (size_t i = 0; i < req.indexes.size(); i++) {
+                if (req.indexes[i] >= it->second.size()) {
+                    LOCK(cs_main);
+                    Misbehaving(pfrom->GetId(), 100);
+                    return error("getshortinv with out-of-bounds index peer=%d", pfrom->id);
+                }
+                vInv.push_back(CInv(MSG_TX, it->second[req.indexes[i]]));
+            }
+        }
+        CNode::RecordShortInvFallback(vInv.size(), vInv.size() * ::GetSerializeSize(CInv(), SER_NETWORK, PROTOCOL_VERSION));
+        if (!vInv.empty())
+            pfrom->PushMessage(NetMsgType::INV, vInv);
+    }
+
+
     else if (strCommand == NetMsgType::GETDATA)
     {
         vector<CInv> vInv;
@@ -6284,6 +7079,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         BlockTransactionsRequest req;
         vRecv >> req;
 
+        LOCK(cs_main);
+
         BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
         if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
             LogPrintf("Peer %d sent us a getblocktxn for a block we don't have", pfrom->id);
@@ -6307,7 +7104,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
             resp.txn[i] = block.vtx[req.indexes[i]];
         }
-        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCKTXN, resp);
+        pfrom->PushMessageWithFlag(State(pfrom->GetId())->fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCKTXN, resp);
     }
 
 
@@ -6579,10 +7376,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         CNodeState *nodestate = State(pfrom->GetId());
 
+        if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus()) && !nodestate->fSupportsDesiredCmpctVersion) {
+            // Don't bother trying to process compact blocks from v1 peers
+            // after segwit activates.
+            return true;
+        }
+
         // We want to be a bit conservative just to be extra careful about DoS
         // possibilities in compact block processing...
         if (pindex->nHeight <= chainActive.Height() + 2) {
-            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate)) ||
                  (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
                 list<QueuedBlock>::iterator *queuedBlockIt = NULL;
                 if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
@@ -6780,14 +7583,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexLast), uint256());
         }
 
-        bool fCanDirectFetch = true;//CanDirectFetch(chainparams.GetConsensus());
+        // Far behind, the blocks are fetched from all peers in parallel by
+        // FindNextBlocksToDownload instead.
+        bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
+        int nMaxInFlight = GetBlocksInTransitLimit(nodestate);
         // If this set of headers is valid and ends in a block with at least as
         // much work as our tip, download as much as possible.
         if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
             vector<CBlockIndex *> vToFetch;
             CBlockIndex *pindexWalk = pindexLast;
             // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
-            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (unsigned int)nMaxInFlight) {
                 if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
                         !mapBlocksInFlight.count(pindexWalk->GetBlockHash()) &&
                         (!IsWitnessEnabled(pindexWalk->pprev, chainparams.GetConsensus()) || State(pfrom->GetId())->fHaveWitness)) {
@@ -6808,7 +7614,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 vector<CInv> vGetData;
                 // Download as much as possible, from earliest to latest.
                 BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
-                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    if (nodestate->nBlocksInFlight >= nMaxInFlight) {
                         // Can't download any more from this peer
                         break;
                     }
@@ -6823,7 +7629,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                             pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
                 }
                 if (vGetData.size() > 0) {
-                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN) && !(nLocalServices & NODE_WITNESS)) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
                         // We seem to be rather well-synced, so it appears pfrom was the first to provide us
                         // with this block! Let's get them to announce using compact blocks in the future.
                         MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
@@ -6889,7 +7695,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -7224,6 +8033,38 @@ bool ProcessMessages(CNode* pfrom)
     return fOk;
 }
 
+/**
+ * Announce a trickle batch of transactions to pto as short IDs. Hashes whose
+ * short IDs collide within the batch are announced with a regular inv instead,
+ * so every short ID the peer receives resolves to one transaction.
+ */
+static void PushShortInv(CNode* pto, const std::vector<uint256>& vHashes, std::vector<CInv>& vInv)
+{
+    CShortInv shortinv(pto->nShortInvSalt, std::vector<uint256>());
+    std::vector<uint256> vBatch;
+    std::set<uint64_t> setShortIDs;
+    BOOST_FOREACH(const uint256& hash, vHashes) {
+        uint64_t shortid = shortinv.GetShortID(hash);
+        if (!setShortIDs.insert(shortid).second) {
+            vInv.push_back(CInv(MSG_TX, hash));
+            continue;
+        }
+        shortinv.shortids.push_back(shortid);
+        vBatch.push_back(hash);
+    }
+    if (vBatch.empty())
+        return;
+
+    shortinv.nBatch = ++pto->nShortInvBatch;
+    pto->vShortInvSent.push_back(std::make_pair(shortinv.nBatch, vBatch));
+    while (pto->vShortInvSent.size() > MAX_SHORTINV_BATCHES)
+        pto->vShortInvSent.pop_front();
+
+    unsigned int nInvSize = GetSizeOfCompactSize(vBatch.size()) + vBatch.size() * ::GetSerializeSize(CInv(), SER_NETWORK, PROTOCOL_VERSION);
+    CNode::RecordShortInvSent(vBatch.size(), (int64_t)nInvSize - (int64_t)::GetSerializeSize(shortinv, SER_NETWORK, PROTOCOL_VERSION));
+    pto->PushMessage(NetMsgType::SHORTINV, shortinv);
+}
+
 class CompareInvMempoolOrder
 {
     CTxMemPool *mp;
@@ -7278,46 +8119,53 @@ bool SendMessages(CNode* pto)
             }
         }
 
-        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
-        if (!lockMain)
-            return true;
-
-        // Address refresh broadcast
         int64_t nNow = GetTimeMicros();
-        if (!IsInitialBlockDownload() && pto->nNextLocalAddrSend < nNow) {
-            AdvertiseLocal(pto);
-            pto->nNextLocalAddrSend = PoissonNextSend(nNow, AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL);
+
+        // Address refresh broadcast, ahead of the addr message so that our
+        // address goes out with it
+        if (pto->nNextLocalAddrSend < nNow) {
+            TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload()
+            if (lockMain && !IsInitialBlockDownload()) {
+                AdvertiseLocal(pto);
+                pto->nNextLocalAddrSend = PoissonNextSend(nNow, AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL);
+            }
         }
 
         //
         // Message: addr
         //
+        // Address relay needs no chain state, so it does not wait for cs_main
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage(NetMsgType::ADDR, vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+                // we only send the big addr message once
+                if (pto->vAddrToSend.capacity() > 40)
+                    pto->vAddrToSend.shrink_to_fit();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000)
+            {
+                vector<CAddress> vAddrMsg(vAddr.begin() + i, vAddr.begin() + std::min(vAddr.size(), i + 1000));
+                pto->PushMessage(NetMsgType::ADDR, vAddrMsg);
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage(NetMsgType::ADDR, vAddr);
-            // we only send the big addr message once
-            if (pto->vAddrToSend.capacity() > 40)
-                pto->vAddrToSend.shrink_to_fit();
         }
 
+        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
+        if (!lockMain)
+            return true;
+
         CNodeState &state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -7338,6 +8186,17 @@ bool SendMessages(CNode* pto)
             pto->PushMessage(NetMsgType::REJECT, (string)NetMsgType::BLOCK, reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
         state.rejects.clear();
 
+        //
+        // Message: shortinvsalt
+        //
+        if ((nLocalServices & NODE_SHORTINV) && (pto->nServices & NODE_SHORTINV) && pto->fSuccessfullyConnected) {
+            uint64_t nSalt = GetShortInvSalt(state);
+            if (pto->nShortInvSaltSent != nSalt) {
+                pto->nShortInvSaltSent = nSalt;
+                pto->PushMessage(NetMsgType::SHORTINVSALT, nSalt);
+            }
+        }
+
         // Start block sync
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
@@ -7446,8 +8305,8 @@ bool SendMessages(CNode* pto)
                     //TODO: Shouldn't need to reload block from disk, but requires refactor
                     CBlock block;
                     assert(ReadBlockFromDisk(block, pBestIndex, consensusParams));
-                    CBlockHeaderAndShortTxIDs cmpctblock(block);
-                    pto->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+                    CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
+                    pto->PushMessageWithFlag(state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
                     state.pindexBestHeaderSent = pBestIndex;
                 } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
@@ -7501,14 +8360,19 @@ bool SendMessages(CNode* pto)
             LOCK(pto->cs_inventory);
             vInv.reserve(std::max<size_t>(pto->vInventoryBlockToSend.size(), INVENTORY_BROADCAST_MAX));
 
-            // Add blocks
+            // Add blocks. New tips are announced in their own messages in the
+            // block queue, ahead of the rate limited transaction inventory.
             BOOST_FOREACH(const uint256& hash, pto->vInventoryBlockToSend) {
                 vInv.push_back(CInv(MSG_BLOCK, hash));
                 if (vInv.size() == MAX_INV_SZ) {
-                    pto->PushMessage(NetMsgType::INV, vInv);
+                    pto->PushMessageWithClass(SEND_CLASS_BLOCK, 0, NetMsgType::INV, vInv);
                     vInv.clear();
                 }
             }
+            if (!vInv.empty()) {
+                pto->PushMessageWithClass(SEND_CLASS_BLOCK, 0, NetMsgType::INV, vInv);
+                vInv.clear();
+            }
             pto->vInventoryBlockToSend.clear();
 
             // Check whether periodic sends should happen
@@ -7560,6 +8424,10 @@ bool SendMessages(CNode* pto)
 
             // Determine transactions to relay
             if (fSendTrickle) {
+                // Peers that both signal NODE_SHORTINV get the announcements as a batch
+                // of short IDs, once they told us the salt to key them with
+                bool fShortInv = (nLocalServices & NODE_SHORTINV) && (pto->nServices & NODE_SHORTINV) && pto->nShortInvSalt != 0;
+                vector<uint256> vInvShort;
                 // Produce a vector with all candidates for sending
                 vector<std::set<uint256>::iterator> vInvTx;
                 vInvTx.reserve(pto->setInventoryTxToSend.size());
@@ -7601,7 +8469,10 @@ bool SendMessages(CNode* pto)
                     }
                     if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
                     // Send
-                    vInv.push_back(CInv(MSG_TX, hash));
+                    if (fShortInv)
+                        vInvShort.push_back(hash);
+                    else
+                        vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
                     {
                         // Expire old relay messages
@@ -7622,6 +8493,8 @@ bool SendMessages(CNode* pto)
                     }
                     pto->filterInventoryKnown.insert(hash);
                 }
+                if (!vInvShort.empty())
+                    PushShortInv(pto, vInvShort, vInv);
             }
         }
         if (!vInv.empty())
@@ -7635,6 +8508,7 @@ bool SendMessages(CNode* pto)
             // should only happen during initial block download.
             LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
             pto->fDisconnect = true;
+            state.nStalls++;
         }
         // In case there is a block that has been in flight from this peer for 2 + 0.5 * N times the block interval
         // (with N the number of peers from which we're downloading validated blocks), disconnect due to timeout.
@@ -7649,6 +8523,7 @@ bool SendMessages(CNode* pto)
             
                 LogPrintf("Timeout downloading block %s from peer=%d, disconnecting\n", queuedBlock.hash.ToString(), pto->id);
                 pto->fDisconnect = true;
+                state.nStalls++;
             }
         }
 
@@ -7656,10 +8531,11 @@ bool SendMessages(CNode* pto)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nMaxInFlight = GetBlocksInTransitLimit(&state);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nMaxInFlight) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), nMaxInFlight - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 if (State(pto->GetId())->fHaveWitness || !IsWitnessEnabled(pindex->pprev, consensusParams)) {
                     uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
@@ -7745,10 +8621,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
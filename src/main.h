@@ -85,8 +85,26 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Maximum number of threads loading block inputs before they are connected */
+static const int MAX_PREFETCH_THREADS = 32;
+/** -prefetchthreads default; the lookups wait on disk rather than the CPU */
+static const int DEFAULT_PREFETCH_THREADS = 8;
+/** Default for -backgroundflush */
+static const bool DEFAULT_BACKGROUND_FLUSH = false;
+/** Number of blocks that can be requested at any given time from a single peer, until its delivery rate is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the per-peer limit once it follows the peer's measured delivery rate */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 4;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER = 64;
+/** Time (in microseconds) a peer should need to deliver all blocks in flight from it. Fast peers
+ *  get enough requests to stay busy, slow ones few enough not to hold up the download window. */
+static const int64_t BLOCK_DOWNLOAD_QUEUE_TIME = 4 * 1000000;
+/** Proof-of-stake headers whose kernel could not be checked that we download past the last
+ *  block whose stake we did check (see CountUncheckedStakeHeaders). Such headers cost us
+ *  nothing to accept, so this bounds what a peer sending made-up ones makes us download. */
+static const int MAX_UNCHECKED_STAKE_HEADERS = 128;
+/** Blocks more than this far below our tip are served behind relay traffic, as historic blocks */
+static const int HISTORIC_BLOCK_DEPTH = 10;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -135,6 +153,9 @@ static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 
 static const bool DEFAULT_TXINDEX = true;
 
+/** Default for -blockindexsnapshot, loading the block index from the snapshot written at shutdown */
+static const bool DEFAULT_BLOCKINDEX_SNAPSHOT = true;
+
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
@@ -178,6 +199,7 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
 extern bool fAddressIndex;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
@@ -232,7 +254,6 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
 
 /** 
@@ -264,6 +285,8 @@ bool InitBlockIndex(const CChainParams& chainparams);
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Capture the flushed block index in a snapshot the next start can load instead of the database */
+bool WriteBlockIndexSnapshot();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /**
@@ -272,8 +295,10 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   pto             The node which we are sending messages to.
  */
 bool SendMessages(CNode* pto);
-/** Run an instance of the script checking thread */
+/** Run an instance of the script checking thread, which also prechecks block transactions */
 void ThreadScriptCheck();
+/** Run an instance of the thread looking up the inputs of blocks about to be connected */
+void ThreadPrefetch();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -287,7 +312,6 @@ std::string GetWarnings(const std::string& strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, const Consensus::Params& params, uint256 &hashBlock, bool fAllowSlow = false);
 
-uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 
 /** Find the best known block, and make it the tip of the block chain */
 bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams, const CBlock* pblock = NULL);
@@ -539,69 +563,6 @@ struct CAddressUnspentValue {
 };
 
 
-struct CAddressIndexKey {
-    unsigned int type;
-    uint160 hashBytes;
-    int blockHeight;
-    unsigned int txindex;
-    uint256 txhash;
-    size_t index;
-    bool spending;
-
-    size_t GetSerializeSize(int nType, int nVersion) const {
-        return 66;
-    }
-    template<typename Stream>
-   void Serialize(Stream& s, int nType, int nVersion) const {
-        ser_writedata8(s, type);
-        hashBytes.Serialize(s, nType, nVersion);
-        // Heights are stored big-endian for key sorting in LevelDB
-        ser_writedata32be(s, blockHeight);
-        ser_writedata32be(s, txindex);
-        txhash.Serialize(s, nType, nVersion);
-        ser_writedata32(s, index);
-        char f = spending;
-        ser_writedata8(s, f);
-    }
-    template<typename Stream>
-    void Unserialize(Stream& s, int nType, int nVersion) {
-        type = ser_readdata8(s);
-        hashBytes.Unserialize(s, nType, nVersion);
-        blockHeight = ser_readdata32be(s);
-        txindex = ser_readdata32be(s);
-        txhash.Unserialize(s, nType, nVersion);
-        index = ser_readdata32(s);
-        char f = ser_readdata8(s);
-        spending = f;
-    }
-
-    CAddressIndexKey(unsigned int addressType, uint160 addressHash, int height, int blockindex,
-                     uint256 txid, size_t indexValue, bool isSpending) {
-        type = addressType;
-        hashBytes = addressHash;
-        blockHeight = height;
-        txindex = blockindex;
-        txhash = txid;
-        index = indexValue;
-        spending = isSpending;
-    }
-
-    CAddressIndexKey() {
-        SetNull();
-    }
-
-    void SetNull() {
-        type = 0;
-        hashBytes.SetNull();
-        blockHeight = 0;
-        txindex = 0;
-        txhash.SetNull();
-        index = 0;
-        spending = false;
-    }
-
-};
-
 struct CAddressIndexIteratorHeightKey {
     unsigned int type;
     uint160 hashBytes;
@@ -715,10 +676,14 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. Transactions whose scripts passed with the same flags before
+ * skip the script checks; cacheFullScriptStore records a pass, and otherwise the entry is released.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, std::vector<CScriptCheck> *pvChecks = NULL);
+
+/** Allocate the script execution cache as sized by -maxsigcachesize; must be called before CheckInputs */
+void InitScriptExecutionCache();
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -836,6 +801,8 @@ bool ReadFromDisk(CTransaction& tx, CDiskTxPos& txindex, CBlockTreeDB& txdb, COu
 
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state,const Consensus::Params& consensusParams,  bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig=true);
+/** Check that a proof-of-stake block is signed by the key of its coinstake (vtx[1]), and a proof-of-work block is not signed */
+bool CheckBlockSignature(const CBlock& block);
 bool SignBlock(CBlock& block, CWallet& wallet, CAmount& nFees);
 
 
@@ -845,17 +812,26 @@ bool SignBlock(CBlock& block, CWallet& wallet, CAmount& nFees);
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, CBlockIndex* pindexPrev, int64_t nAdjustedTime);
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex *pindexPrev);
 
+/** The address and spent index records a block changed, announced once it is on or off the tip */
+struct CBlockIndexUpdates
+{
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressDeltas;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpent;
+};
+
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
- *  can fail if those validity checks fail (among other reasons). */
+ *  can fail if those validity checks fail (among other reasons).
+ *  With -addrindex, the index records written are returned in pupdates if provided. */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins,
-                  const CChainParams& chainparams, bool fJustCheck = false);
+                  const CChainParams& chainparams, bool fJustCheck = false, CBlockIndexUpdates* pupdates = NULL);
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified.
+ *  With -addrindex, the index records erased are returned in pupdates if provided. */
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, CBlockIndexUpdates* pupdates = NULL);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
@@ -895,6 +871,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** The view pcoinsTip writes to, which may flush it in the background (protected by cs_main) */
+extern CCoinsViewBackgroundWriter *pcoinsWriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
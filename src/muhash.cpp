@@ -0,0 +1,166 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+#include "uint256.h"
+
+#include <string.h>
+
+/** 2^3072 - MAX_PRIME_DIFF is the modulus */
+static const Num3072::limb_t MAX_PRIME_DIFF = 1103717;
+static const Num3072::limb_t LIMB_MAX = ~(Num3072::limb_t)0;
+
+Num3072::Num3072()
+{
+    memset(limbs, 0, sizeof(limbs));
+    limbs[0] = 1;
+}
+
+void Num3072::SetBytes(const unsigned char* data)
+{
+    memset(limbs, 0, sizeof(limbs));
+    for (size_t i = 0; i < BYTE_SIZE; i++)
+        limbs[i / sizeof(limb_t)] |= (limb_t)data[i] << (8 * (i % sizeof(limb_t)));
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::GetBytes(unsigned char* data) const
+{
+    for (size_t i = 0; i < BYTE_SIZE; i++)
+        data[i] = limbs[i / sizeof(limb_t)] >> (8 * (i % sizeof(limb_t)));
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= LIMB_MAX - MAX_PRIME_DIFF)
+        return false;
+    for (size_t i = 1; i < LIMBS; i++) {
+        if (limbs[i] != LIMB_MAX)
+            return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the modulus is adding MAX_PRIME_DIFF and dropping the carry out of the top limb
+    double_limb_t cur = MAX_PRIME_DIFF;
+    for (size_t i = 0; i < LIMBS && cur; i++) {
+        cur += limbs[i];
+        limbs[i] = (limb_t)cur;
+        cur >>= LIMB_BITS;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Full product, 2 * LIMBS limbs
+    limb_t t[2 * LIMBS];
+    memset(t, 0, sizeof(t));
+    for (size_t i = 0; i < LIMBS; i++) {
+        limb_t carry = 0;
+        for (size_t j = 0; j < LIMBS; j++) {
+            double_limb_t cur = (double_limb_t)limbs[i] * a.limbs[j] + t[i + j] + carry;
+            t[i + j] = (limb_t)cur;
+            carry = cur >> LIMB_BITS;
+        }
+        t[i + LIMBS] = carry;
+    }
+
+    // As 2^3072 is MAX_PRIME_DIFF modulo the prime, the high half is folded
+    // into the low half after multiplying it by MAX_PRIME_DIFF
+    limb_t carry = 0;
+    for (size_t i = 0; i < LIMBS; i++) {
+        double_limb_t cur = (double_limb_t)t[i + LIMBS] * MAX_PRIME_DIFF + t[i] + carry;
+        limbs[i] = (limb_t)cur;
+        carry = cur >> LIMB_BITS;
+    }
+    // The same for what carried out of the top limb; this only carries out
+    // again if the low limbs were close to 2^3072, leaving a small result
+    while (carry) {
+        double_limb_t cur = (double_limb_t)carry * MAX_PRIME_DIFF;
+        for (size_t i = 0; i < LIMBS && cur; i++) {
+            cur += limbs[i];
+            limbs[i] = (limb_t)cur;
+            cur >>= LIMB_BITS;
+        }
+        carry = cur;
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat: a^(p - 2) is the inverse of a. All limbs of p - 2 are ones
+    // except for the lowest.
+    Num3072 result;
+    for (int nLimb = LIMBS - 1; nLimb >= 0; nLimb--) {
+        limb_t nExponent = nLimb == 0 ? LIMB_MAX - MAX_PRIME_DIFF - 1 : LIMB_MAX;
+        for (int nBit = LIMB_BITS - 1; nBit >= 0; nBit--) {
+            Num3072 square(result);
+            result.Multiply(square);
+            if ((nExponent >> nBit) & 1)
+                result.Multiply(*this);
+        }
+    }
+    return result;
+}
+
+bool operator==(const Num3072& a, const Num3072& b)
+{
+    return memcmp(a.limbs, b.limbs, sizeof(a.limbs)) == 0;
+}
+
+Num3072 MuHash3072::ToNum3072(const std::vector<unsigned char>& data)
+{
+    // Expand the SHA256 of the element to 3072 bits with SHA512 in counter mode
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(begin_ptr(data), data.size()).Finalize(hash);
+    unsigned char buf[Num3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++)
+        CSHA512().Write(hash, sizeof(hash)).Write(&i, 1).Finalize(buf + i * CSHA512::OUTPUT_SIZE);
+    Num3072 num;
+    num.SetBytes(buf);
+    return num;
+}
+
+MuHash3072& MuHash3072::Insert(const std::vector<unsigned char>& data)
+{
+    numerator.Multiply(ToNum3072(data));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const std::vector<unsigned char>& data)
+{
+    denominator.Multiply(ToNum3072(data));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& other)
+{
+    numerator.Multiply(other.denominator);
+    denominator.Multiply(other.numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(uint256& out) const
+{
+    Num3072 result(numerator);
+    result.Multiply(denominator.GetInverse());
+    unsigned char buf[Num3072::BYTE_SIZE];
+    result.GetBytes(buf);
+    CSHA256().Write(buf, sizeof(buf)).Finalize(out.begin());
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include "serialize.h"
+
+#include <stdint.h>
+#include <vector>
+
+class uint256;
+
+/** An integer modulo the prime 2^3072 - 1103717, stored as limbs, least significant first */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+#endif
+    static const int LIMB_BITS = sizeof(limb_t) * 8;
+    static const size_t LIMBS = 3072 / LIMB_BITS;
+    static const size_t BYTE_SIZE = 384;
+
+    limb_t limbs[LIMBS];
+
+    //! Construct the number one
+    Num3072();
+
+    //! Set from BYTE_SIZE little-endian bytes, reducing modulo the prime
+    void SetBytes(const unsigned char* data);
+    //! Write BYTE_SIZE little-endian bytes
+    void GetBytes(unsigned char* data) const;
+
+    void Multiply(const Num3072& a);
+    Num3072 GetInverse() const;
+
+    bool IsOverflow() const;
+    void FullReduce();
+
+    friend bool operator==(const Num3072& a, const Num3072& b);
+};
+
+/**
+ * A hash of a set of byte strings that does not depend on the order in which
+ * they were added, and supports removing them again (MuHash). Each element is
+ * expanded to a number modulo a 3072 bit prime; the set hash is the product of
+ * those numbers. Removals are collected in a separate product so that the
+ * expensive division only happens in Finalize.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const std::vector<unsigned char>& data);
+
+public:
+    //! The hash of the empty set
+    MuHash3072() {}
+
+    MuHash3072& Insert(const std::vector<unsigned char>& data);
+    MuHash3072& Remove(const std::vector<unsigned char>& data);
+
+    //! Add or remove all elements of another set
+    MuHash3072& operator*=(const MuHash3072& other);
+    MuHash3072& operator/=(const MuHash3072& other);
+
+    //! SHA256 of the little-endian encoding of numerator / denominator
+    void Finalize(uint256& out) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        unsigned char buf[Num3072::BYTE_SIZE];
+        Num3072* nums[2] = {&numerator, &denominator};
+        for (int i = 0; i < 2; i++) {
+            if (!ser_action.ForRead())
+                nums[i]->GetBytes(buf);
+            READWRITE(FLATDATA(buf));
+            if (ser_action.ForRead())
+                nums[i]->SetBytes(buf);
+        }
+    }
+};
+
+#endif // BITCOIN_MUHASH_H
@@ -18,6 +18,7 @@
 #include "hash.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
+#include "socketevents.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
 
@@ -89,6 +90,7 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
@@ -96,6 +98,66 @@ std::vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
 limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
+/** Readiness notification for -socketevents=epoll. Nodes are registered edge-triggered,
+ *  so the socket handler keeps the ones it has not drained yet in these sets. */
+static CSocketEvents socketEvents;
+static std::set<CNode*> setNodesRecvReady;
+static std::set<CNode*> setNodesSendReady;
+
+/** Payloads grow by at most this much beyond the bytes received so far */
+static const unsigned int RECV_BUFFER_STEP = 256 * 1024;
+
+/**
+ * Payload buffers of large received messages, kept for reuse once the
+ * message has been processed. Without this every block would cost a
+ * multi-megabyte allocation, and a cleanse of it when freed.
+ */
+class CRecvBufferPool
+{
+private:
+    /** Smaller buffers are not worth keeping */
+    static const size_t MIN_BUFFER_SIZE = 256 * 1024;
+    /** Enough for the blocks in flight from a handful of peers */
+    static const size_t MAX_BUFFERS = 8;
+
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree;
+
+public:
+    /**
+     * Swap a free buffer with room for nSize bytes into vch, left empty.
+     * Nothing is allocated, so a peer announcing a large payload it never
+     * sends costs no memory.
+     */
+    bool Get(CSerializeData& vch, size_t nSize)
+    {
+        LOCK(cs);
+        for (size_t i = 0; i < vFree.size(); i++) {
+            if (vFree[i].capacity() >= nSize) {
+                vch.swap(vFree[i]);
+                vFree.erase(vFree.begin() + i);
+                vch.clear();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Take vch back, or let it be freed if it is too small or the pool is full */
+    void Put(CSerializeData& vch)
+    {
+        if (vch.capacity() < MIN_BUFFER_SIZE)
+            return;
+        LOCK(cs);
+        if (vFree.size() < MAX_BUFFERS) {
+            vFree.push_back(CSerializeData());
+            vFree.back().swap(vch);
+        }
+    }
+};
+
+static CRecvBufferPool recvBufferPool;
+
 static std::deque<std::string> vOneShots;
 CCriticalSection cs_vOneShots;
 
@@ -106,12 +168,36 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+
+int nMessageHandlers = DEFAULT_MESSAGE_HANDLERS;
+
+/** Peers waiting for a message handler. A peer is queued at most once and is
+ *  handled by one thread at a time, so every peer with work gets a turn before
+ *  any peer gets a second one. */
+static std::deque<CNode*> vHandlerQueue;
+static boost::mutex mutexHandlerQueue;
+static boost::condition_variable condHandlerQueue;
 
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+/** Give a peer a turn on the message handlers. The queue holds a reference to it. */
+void ScheduleMessageHandler(CNode* pnode)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexHandlerQueue);
+        if (pnode->fHandlerScheduled) {
+            // Queued or being handled: make sure it gets another turn
+            pnode->fHandlerRescheduled = true;
+            return;
+        }
+        pnode->fHandlerScheduled = true;
+        vHandlerQueue.push_back(pnode->AddRef());
+    }
+    condHandlerQueue.notify_one();
+}
+
 void AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -332,6 +418,14 @@ uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
 uint64_t CNode::nMaxOutboundTimeframe = 60*60*24; //1 day
 uint64_t CNode::nMaxOutboundCycleStartTime = 0;
 
+CTokenBucket CNode::sendBucketTotal;
+CTokenBucket CNode::sendBucketHistoric;
+int64_t CNode::nMaxPeerUploadRate = 0;
+
+uint64_t CNode::nShortInvSent = 0;
+uint64_t CNode::nShortInvFallback = 0;
+int64_t CNode::nShortInvBytesSaved = 0;
+
 CNode* FindNode(const CNetAddr& ip)
 {
     LOCK(cs_vNodes);
@@ -378,6 +472,36 @@ CNode* FindNode(const NodeId nodeid)
     return NULL;
 }
 
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode)
+{
+    if (strMode == "select") {
+        mode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+    if (strMode == "epoll" && CSocketEvents::IsSupported()) {
+        mode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+    return false;
+}
+
+// select() can only watch descriptors below FD_SETSIZE
+static bool IsUsableSocket(SOCKET hSocket)
+{
+    return nSocketEventsMode != SOCKETEVENTS_SELECT || IsSelectableSocket(hSocket);
+}
+
+// Register a new node's socket with the socket events, if they are in use
+static void WatchNodeSocket(CNode* pnode)
+{
+    if (nSocketEventsMode != SOCKETEVENTS_EPOLL)
+        return;
+    if (!socketEvents.Add(pnode->hSocket, pnode, true)) {
+        LogPrintf("socket events: cannot watch socket of peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+        pnode->fDisconnect = true;
+    }
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure)
 {
     if (pszDest == NULL) {
@@ -404,7 +528,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsUsableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -439,6 +563,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            WatchNodeSocket(pnode);
         }
 
         pnode->nServicesExpected = ServiceFlags(addrConnect.nServices & nRelevantServices);
@@ -713,6 +838,11 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(mapSendBytesPerMsgCmd);
+    X(fSendThrottled);
+    for (int i = 0; i < SEND_CLASS_MAX; i++) {
+        stats.mapSendBytesPerClass[GetSendClassName(i)] = nSendBytesPerClass[i];
+        stats.mapSendQueuedPerClass[GetSendClassName(i)] = nSendSizePerClass[i];
+    }
     X(nRecvBytes);
     X(mapRecvBytesPerMsgCmd);
     X(fWhitelisted);
@@ -768,24 +898,52 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete()) {
-
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
-
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
+        if (msg.complete())
+            MessageComplete(msg);
     }
 
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvDirectBuffer(unsigned int& nSize)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+    return vRecvMsg.back().GetDirectBuffer(nSize);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedDirect(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.ReadDirect(nBytes);
+    if (msg.complete())
+        MessageComplete(msg);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::MessageComplete(CNetMessage& msg)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = GetTimeMicros();
+    ScheduleMessageHandler(this);
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData vch;
+    vRecv.swap(vch);
+    recvBufferPool.Put(vch);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -811,6 +969,20 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
+    // Block payloads are large, so the socket receives them straight into
+    // vRecv, reusing a pooled buffer if one is free. The buffer still only
+    // grows with the data that actually arrives, so a header announcing a
+    // large payload does not cost memory by itself.
+    if (hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH) {
+        std::string strCommand = hdr.GetCommand();
+        if (strCommand == NetMsgType::BLOCK || strCommand == NetMsgType::CMPCTBLOCK || strCommand == NetMsgType::BLOCKTXN) {
+            CSerializeData vch;
+            if (recvBufferPool.Get(vch, hdr.nMessageSize))
+                vRecv.swap(vch);
+            fDirect = true;
+        }
+    }
+
     // switch state to reading message data
     in_data = true;
 
@@ -824,7 +996,7 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + RECV_BUFFER_STEP));
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -833,6 +1005,19 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     return nCopy;
 }
 
+char* CNetMessage::GetDirectBuffer(unsigned int& nSize)
+{
+    // Only once payload bytes have arrived through readData, and only as far
+    // ahead of them as readData would allocate
+    if (!fDirect || !in_data || complete() || nDataPos == 0)
+        return NULL;
+    if (vRecv.size() <= nDataPos)
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + RECV_BUFFER_STEP));
+    nSize = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+
 
 
 
@@ -840,28 +1025,146 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+int GetDefaultSendClass(const char* pszCommand)
+{
+    if (strcmp(pszCommand, NetMsgType::BLOCK) == 0 || strcmp(pszCommand, NetMsgType::CMPCTBLOCK) == 0 ||
+        strcmp(pszCommand, NetMsgType::BLOCKTXN) == 0 || strcmp(pszCommand, NetMsgType::MERKLEBLOCK) == 0)
+        return SEND_CLASS_BLOCK;
+    if (strcmp(pszCommand, NetMsgType::INV) == 0 || strcmp(pszCommand, NetMsgType::TX) == 0)
+        return SEND_CLASS_TX;
+    if (strcmp(pszCommand, NetMsgType::ADDR) == 0)
+        return SEND_CLASS_ADDR;
+    return SEND_CLASS_CONTROL;
+}
+
+int GetInvSendClass(const std::vector<CInv>& vInv)
+{
+    BOOST_FOREACH(const CInv& inv, vInv) {
+        int nType = inv.type & MSG_TYPE_MASK;
+        if (nType == MSG_BLOCK || nType == MSG_FILTERED_BLOCK || nType == MSG_CMPCT_BLOCK)
+            return SEND_CLASS_BLOCK;
+    }
+    return SEND_CLASS_TX;
+}
+
+const char* GetSendClassName(int nSendClass)
+{
+    switch (nSendClass) {
+    case SEND_CLASS_CONTROL: return "control";
+    case SEND_CLASS_BLOCK: return "block";
+    case SEND_CLASS_TX: return "tx";
+    case SEND_CLASS_ADDR: return "addr";
+    case SEND_CLASS_HISTORIC_BLOCK: return "historic_block";
+    default: return "unknown";
+    }
+}
+
+void CTokenBucket::SetRate(int64_t nRateIn)
+{
+    nRate = std::max(nRateIn, (int64_t)0);
+    nTokens = 0;
+    nLastRefill = 0;
+}
+
+int64_t CTokenBucket::Available(int64_t nNowMicros)
+{
+    if (nRate == 0)
+        return std::numeric_limits<int64_t>::max();
+
+    // Hold at most one second of traffic, but always enough for a full quantum
+    const int64_t nBurst = std::max(nRate, SEND_QUANTUM);
+    if (nLastRefill == 0 || nNowMicros - nLastRefill >= 1000000) {
+        nTokens = std::min(nTokens + nBurst, nBurst);
+        nLastRefill = nNowMicros;
+    } else if (nNowMicros > nLastRefill) {
+        int64_t nNew = (nNowMicros - nLastRefill) * nRate / 1000000;
+        if (nNew > 0) {
+            nTokens = std::min(nTokens + nNew, nBurst);
+            nLastRefill += nNew * 1000000 / nRate;
+        }
+    }
+    return nTokens;
+}
+
+void CTokenBucket::Consume(int64_t nBytes)
+{
+    if (nRate == 0)
+        return;
+    // Unthrottled traffic charged to the bucket holds back throttled traffic
+    // for at most another second
+    nTokens = std::max(nTokens - nBytes, -std::max(nRate, SEND_QUANTUM));
+}
 
+// Chooses what to send next: the message already on the wire, otherwise the
+// front of the first queue the rate limits allow. Once a message has started
+// it is finished at full speed whenever a higher class is waiting behind it.
 // requires LOCK(cs_vSend)
-void SocketSendData(CNode *pnode)
+static int GetNextSendClass(CNode *pnode, int64_t nNow, int64_t& nAllowance)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    if (pnode->nSendClass >= 0) {
+        nAllowance = pnode->GetSendAllowance(pnode->nSendClass, nNow);
+        for (int nClass = 0; nClass < pnode->nSendClass; nClass++)
+            if (!pnode->vSendMsg[nClass].empty())
+                nAllowance = std::numeric_limits<int64_t>::max();
+        return pnode->nSendClass;
+    }
+    for (int nClass = 0; nClass < SEND_CLASS_MAX; nClass++) {
+        if (pnode->vSendMsg[nClass].empty())
+            continue;
+        nAllowance = pnode->GetSendAllowance(nClass, nNow);
+        if (nAllowance > 0)
+            return nClass;
+    }
+    nAllowance = 0;
+    return -1;
+}
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+// Returns whether the rate limits held back data the socket could have taken
+// requires LOCK(cs_vSend)
+bool SocketSendData(CNode *pnode)
+{
+    const int64_t nNow = GetTimeMicros();
+    // Rate-limited traffic is handed out in quanta, so one busy peer cannot take
+    // the whole budget of a pass
+    int64_t nQuantum = SEND_QUANTUM;
+    pnode->fSendThrottled = false;
+
+    while (pnode->nSendSize > 0) {
+        int64_t nAllowance;
+        int nClass = GetNextSendClass(pnode, nNow, nAllowance);
+        // The allowance can be negative when unthrottled traffic overdrew the
+        // buckets, including for a message that is already partly sent
+        if (nClass < 0 || nAllowance <= 0 || (nAllowance != std::numeric_limits<int64_t>::max() && nQuantum <= 0)) {
+            pnode->fSendThrottled = true;
+            break;
+        }
+        if (nAllowance != std::numeric_limits<int64_t>::max())
+            nAllowance = std::min(nAllowance, nQuantum);
+
+        const CSerializeData &data = pnode->vSendMsg[nClass].front();
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        size_t nLen = std::min((uint64_t)(data.size() - pnode->nSendOffset), (uint64_t)nAllowance);
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nLen, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
+            pnode->nSendBytesPerClass[nClass] += nBytes;
             pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
+            pnode->ConsumeSendAllowance(nClass, nBytes);
+            if (nAllowance != std::numeric_limits<int64_t>::max())
+                nQuantum -= nBytes;
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
+                pnode->nSendSizePerClass[nClass] -= data.size();
+                pnode->nSendClass = -1;
+                pnode->vSendMsg[nClass].pop_front();
             } else {
-                // could not send full message; stop sending more
-                break;
+                pnode->nSendClass = nClass;
+                // could not send as much as allowed; the socket is full
+                if ((size_t)nBytes < nLen)
+                    break;
             }
         } else {
             if (nBytes < 0) {
@@ -878,11 +1181,11 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->nSendSize == 0) {
         assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
+        assert(pnode->nSendClass == -1);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    return pnode->fSendThrottled;
 }
 
 static std::list<CNode*> vNodesDisconnected;
@@ -1059,7 +1362,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsUsableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1101,6 +1404,379 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        WatchNodeSocket(pnode);
+    }
+}
+
+// Whether a node's receive buffer has room for more data. Requires cs_vRecvMsg.
+static bool CanReceiveMore(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+// Receive once from a node's socket. Requires cs_vRecvMsg. Returns true if the
+// whole buffer was filled, so more data may be waiting in the socket.
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    // The rest of a block payload goes straight into its message buffer
+    unsigned int nDirect = 0;
+    char* pchDirect = pnode->GetRecvDirectBuffer(nDirect);
+    unsigned int nWant = pchDirect ? nDirect : sizeof(pchBuf);
+    int nBytes = recv(pnode->hSocket, pchDirect ? pchDirect : pchBuf, nWant, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchDirect)
+            pnode->ReceivedDirect(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)nWant && pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+static void SocketEventsSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                // A peer held back by the upload rate limits is retried after a shorter timeout
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && pnode->nSendSize > 0) {
+                    if (!pnode->fSendThrottled) {
+                        FD_SET(pnode->hSocket, &fdsetSend);
+                        continue;
+                    }
+                    timeout.tv_usec = 10000;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && CanReceiveMore(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+        {
+            AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service each socket
+    //
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        boost::this_thread::interruption_point();
+
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode);
+        }
+
+        //
+        // Send
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && (FD_ISSET(pnode->hSocket, &fdsetSend) || (pnode->fSendThrottled && pnode->nSendSize > 0)))
+                SocketSendData(pnode);
+        }
+
+        //
+        // Inactivity checking
+        //
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
+// Same policy as SocketEventsSelect(), but only looks at the sockets epoll
+// reported, so the cost of an iteration does not grow with idle peers.
+static void SocketEventsEpoll()
+{
+    // A node that filled the whole receive buffer may have more data waiting
+    static bool fRecvPending = false;
+    // A node held back by the upload rate limits gets no new edge and is retried soon
+    static bool fSendPending = false;
+    static int64_t nLastInactivityCheck = 0;
+
+    std::vector<CSocketEvents::Event> vEvents;
+    int nEvents = socketEvents.Wait(vEvents, fRecvPending ? 0 : (fSendPending ? 10 : 50));
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0)
+    {
+        LogPrintf("socket events wait error %s\n", NetworkErrorString(WSAGetLastError()));
+        MilliSleep(50);
+    }
+
+    BOOST_FOREACH(const CSocketEvents::Event& event, vEvents)
+    {
+        const ListenSocket* pListenSocket = NULL;
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            if (event.ptr == &hListenSocket)
+                pListenSocket = &hListenSocket;
+        if (pListenSocket)
+        {
+            // Listen sockets are level-triggered: one connection per event is enough
+            AcceptConnection(*pListenSocket);
+            continue;
+        }
+
+        CNode* pnode = (CNode*)event.ptr;
+        if (event.flags & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR))
+            setNodesRecvReady.insert(pnode);
+        if (event.flags & SOCKET_EVENT_SEND)
+            setNodesSendReady.insert(pnode);
+    }
+
+    // Messages queued by other threads may have been held back too
+    if (CNode::IsUploadRateLimited())
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fSendThrottled)
+                setNodesSendReady.insert(pnode);
+    }
+
+    //
+    // Send
+    //
+    // A writable node is done once its queue is drained or send() would block;
+    // in the latter case the next edge adds it back. One held back by the rate
+    // limits stays ready.
+    fSendPending = false;
+    for (std::set<CNode*>::iterator it = setNodesSendReady.begin(); it != setNodesSendReady.end(); )
+    {
+        CNode* pnode = *it;
+        if (pnode->hSocket != INVALID_SOCKET)
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend)
+            {
+                it++;
+                continue;
+            }
+            if (pnode->nSendSize > 0 && SocketSendData(pnode))
+            {
+                fSendPending = true;
+                it++;
+                continue;
+            }
+        }
+        setNodesSendReady.erase(it++);
+    }
+
+    //
+    // Receive
+    //
+    fRecvPending = false;
+    for (std::set<CNode*>::iterator it = setNodesRecvReady.begin(); it != setNodesRecvReady.end(); )
+    {
+        boost::this_thread::interruption_point();
+
+        CNode* pnode = *it;
+        if (pnode->hSocket == INVALID_SOCKET)
+        {
+            setNodesRecvReady.erase(it++);
+            continue;
+        }
+
+        // As with select(), drain the send queue before receiving more, and leave
+        // the data in the socket while the receive buffer is full. The node stays
+        // ready until recv() would block.
+        bool fMore = false;
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend || (pnode->nSendSize > 0 && !pnode->fSendThrottled))
+            {
+                it++;
+                continue;
+            }
+        }
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv || !CanReceiveMore(pnode))
+            {
+                it++;
+                continue;
+            }
+            fMore = SocketRecvData(pnode);
+        }
+
+        if (fMore)
+        {
+            fRecvPending = true;
+            it++;
+        }
+        else
+            setNodesRecvReady.erase(it++);
+    }
+
+    //
+    // Inactivity checking
+    //
+    int64_t nNow = GetTime();
+    if (nNow != nLastInactivityCheck)
+    {
+        nLastInactivityCheck = nNow;
+        std::vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->hSocket != INVALID_SOCKET)
+                InactivityCheck(pnode);
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
     }
 }
 
@@ -1123,10 +1799,19 @@ void ThreadSocketHandler()
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    setNodesRecvReady.erase(pnode);
+                    setNodesSendReady.erase(pnode);
 
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
 
+                    // remember how responsive the peer was for the next time we pick outbound peers
+                    if (!pnode->fInbound && pnode->nMinPingUsecTime != std::numeric_limits<int64_t>::max()) {
+                        CAddrPerf sample;
+                        sample.nPingUsec = pnode->nMinPingUsecTime;
+                        addrman.UpdatePerformance(pnode->addr, sample);
+                    }
+
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
 
@@ -1172,202 +1857,10 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
-
-        //
-        // Accept new connections
-        //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
-        {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
-            }
-        }
-
-        //
-        // Service each socket
-        //
-        std::vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
-
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
-        }
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsEpoll();
+        else
+            SocketEventsSelect();
     }
 }
 
@@ -1823,27 +2316,47 @@ bool OpenNetworkConnection(const CAddress& addrConnect, bool fCountFailure, CSem
 
 void ThreadMessageHandler()
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
+    // Regular turns for every peer, so SendMessages can send pings, trickle
+    // inventory and time out block downloads even if the peer is quiet
     while (true)
     {
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
             vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
-            }
         }
 
-        bool fSleep = true;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (!pnode->fDisconnect)
+                ScheduleMessageHandler(pnode);
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+
+        MilliSleep(100);
+    }
+}
+
+void ThreadMessageWorker()
+{
+    while (true)
+    {
+        CNode* pnode;
         {
-            if (pnode->fDisconnect)
-                continue;
+            boost::unique_lock<boost::mutex> lock(mutexHandlerQueue);
+            while (vHandlerQueue.empty())
+                condHandlerQueue.wait(lock);
+            pnode = vHandlerQueue.front();
+            vHandlerQueue.pop_front();
+            pnode->fHandlerRescheduled = false;
+        }
 
+        // One turn: at most one message (or one batch of getdata replies)
+        bool fMoreWork = false;
+        if (!pnode->fDisconnect)
+        {
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1853,12 +2366,13 @@ void ThreadMessageHandler()
                         pnode->CloseSocketDisconnect();
 
                     if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+                        fMoreWork = !pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete());
+                }
+                else
+                {
+                    // The socket thread is filling the receive buffer: don't
+                    // hold up a worker, try again after the other peers
+                    fMoreWork = true;
                 }
             }
             boost::this_thread::interruption_point();
@@ -1872,14 +2386,22 @@ void ThreadMessageHandler()
             boost::this_thread::interruption_point();
         }
 
+        // Back to the end of the queue if there is more to do, so that a
+        // peer flooding us cannot starve the others
+        bool fRequeued = false;
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            boost::unique_lock<boost::mutex> lock(mutexHandlerQueue);
+            if (!pnode->fDisconnect && (fMoreWork || pnode->fHandlerRescheduled)) {
+                vHandlerQueue.push_back(pnode);
+                fRequeued = true;
+            } else {
+                pnode->fHandlerScheduled = false;
+            }
         }
-
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        if (fRequeued)
+            condHandlerQueue.notify_one();
+        else
+            pnode->Release();
     }
 }
 
@@ -1910,7 +2432,7 @@ bool BindListenPort(const CService &addrBind, std::string& strError, bool fWhite
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (!IsUsableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -2096,6 +2618,29 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+    {
+        if (socketEvents.Open())
+        {
+            BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket)
+                if (!socketEvents.Add(hListenSocket.socket, &hListenSocket, false))
+                    LogPrintf("socket events: cannot watch listening socket: %s\n", NetworkErrorString(WSAGetLastError()));
+        }
+        else
+        {
+            LogPrintf("socket events: epoll unavailable (%s), falling back to select()\n", NetworkErrorString(WSAGetLastError()));
+            nSocketEventsMode = SOCKETEVENTS_SELECT;
+            // The connection limit was only fitted to FD_SETSIZE for select()
+            // at startup; sockets that do not fit would be refused anyway
+            int nSelectMaxConnections = std::max((int)(FD_SETSIZE - vhListenSocket.size() - MIN_CORE_FILEDESCRIPTORS), 0);
+            if (nMaxConnections > nSelectMaxConnections) {
+                LogPrintf("Reducing -maxconnections from %d to %d, because of select() limitations\n", nMaxConnections, nSelectMaxConnections);
+                nMaxConnections = nSelectMaxConnections;
+            }
+        }
+    }
+    LogPrintf("Using %s for socket events\n", nSocketEventsMode == SOCKETEVENTS_EPOLL ? "epoll" : "select");
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -2106,7 +2651,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
+    LogPrintf("Using %d message handler threads\n", nMessageHandlers);
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2152,6 +2700,7 @@ public:
             delete pnode;
         vNodes.clear();
         vNodesDisconnected.clear();
+        vHandlerQueue.clear();
         vhListenSocket.clear();
         delete semOutbound;
         semOutbound = NULL;
@@ -2200,6 +2749,38 @@ void CNode::RecordBytesSent(uint64_t bytes)
     nMaxOutboundTotalBytesSentInCycle += bytes;
 }
 
+void CNode::RecordShortInvSent(uint64_t nAnnouncements, int64_t nBytesSaved)
+{
+    LOCK(cs_totalBytesSent);
+    nShortInvSent += nAnnouncements;
+    nShortInvBytesSaved += nBytesSaved;
+}
+
+void CNode::RecordShortInvFallback(uint64_t nAnnouncements, int64_t nBytesLost)
+{
+    LOCK(cs_totalBytesSent);
+    nShortInvFallback += nAnnouncements;
+    nShortInvBytesSaved -= nBytesLost;
+}
+
+uint64_t CNode::GetShortInvSent()
+{
+    LOCK(cs_totalBytesSent);
+    return nShortInvSent;
+}
+
+uint64_t CNode::GetShortInvFallback()
+{
+    LOCK(cs_totalBytesSent);
+    return nShortInvFallback;
+}
+
+int64_t CNode::GetShortInvBytesSaved()
+{
+    LOCK(cs_totalBytesSent);
+    return nShortInvBytesSaved;
+}
+
 void CNode::SetMaxOutboundTarget(uint64_t limit)
 {
     LOCK(cs_totalBytesSent);
@@ -2210,6 +2791,51 @@ void CNode::SetMaxOutboundTarget(uint64_t limit)
         LogPrintf("Max outbound target is very small (%s bytes) and will be overshot. Recommended minimum is %s bytes.\n", nMaxOutboundLimit, recommendedMinimum);
 }
 
+void CNode::SetMaxUploadRates(int64_t nTotal, int64_t nPeer, int64_t nHistoric)
+{
+    {
+        LOCK(cs_totalBytesSent);
+        sendBucketTotal.SetRate(nTotal);
+        sendBucketHistoric.SetRate(nHistoric);
+        nMaxPeerUploadRate = std::max(nPeer, (int64_t)0);
+    }
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        LOCK(pnode->cs_vSend);
+        pnode->sendBucket.SetRate(nPeer);
+    }
+}
+
+bool CNode::IsUploadRateLimited()
+{
+    LOCK(cs_totalBytesSent);
+    return sendBucketTotal.GetRate() > 0 || sendBucketHistoric.GetRate() > 0 || nMaxPeerUploadRate > 0;
+}
+
+int64_t CNode::GetSendAllowance(int nSendClassIn, int64_t nNowMicros)
+{
+    if (nSendClassIn < SEND_CLASS_TX)
+        return std::numeric_limits<int64_t>::max();
+
+    int64_t nAllowance = sendBucket.Available(nNowMicros);
+    LOCK(cs_totalBytesSent);
+    nAllowance = std::min(nAllowance, sendBucketTotal.Available(nNowMicros));
+    if (nSendClassIn == SEND_CLASS_HISTORIC_BLOCK)
+        nAllowance = std::min(nAllowance, sendBucketHistoric.Available(nNowMicros));
+    return nAllowance;
+}
+
+void CNode::ConsumeSendAllowance(int nSendClassIn, int64_t nBytes)
+{
+    // Control and tip traffic is never held back, but still uses up the budget
+    sendBucket.Consume(nBytes);
+    LOCK(cs_totalBytesSent);
+    sendBucketTotal.Consume(nBytes);
+    if (nSendClassIn == SEND_CLASS_HISTORIC_BLOCK)
+        sendBucketHistoric.Consume(nBytes);
+}
+
 uint64_t CNode::GetMaxOutboundTarget()
 {
     LOCK(cs_totalBytesSent);
@@ -2463,12 +3089,27 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fSuccessfullyConnected = false;
     fDisconnect = false;
     nRefCount = 0;
+    fHandlerScheduled = false;
+    fHandlerRescheduled = false;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendClass = -1;
+    fSendThrottled = false;
+    for (int i = 0; i < SEND_CLASS_MAX; i++) {
+        nSendSizePerClass[i] = 0;
+        nSendBytesPerClass[i] = 0;
+    }
+    {
+        LOCK(cs_totalBytesSent);
+        sendBucket.SetRate(nMaxPeerUploadRate);
+    }
     hashContinue = uint256();
     nStartingHeight = -1;
     filterInventoryKnown.reset();
     fSendMempool = false;
+    nShortInvBatch = 0;
+    nShortInvSalt = 0;
+    nShortInvSaltSent = 0;
     fGetAddr = false;
     nNextLocalAddrSend = 0;
     nNextAddrSend = 0;
@@ -2571,6 +3212,11 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
 }
 
 void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
+{
+    EndMessage(pszCommand, GetDefaultSendClass(pszCommand));
+}
+
+void CNode::EndMessage(const char* pszCommand, int nSendClassIn) UNLOCK_FUNCTION(cs_vSend)
 {
     // The -*messagestest options are intentionally not documented in the help message,
     // since they are only used during development to debug the networking code and are
@@ -2605,12 +3251,16 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
+    assert(nSendClassIn >= 0 && nSendClassIn < SEND_CLASS_MAX);
+    bool fQueueEmpty = nSendSize == 0;
+    std::deque<CSerializeData>::iterator it = vSendMsg[nSendClassIn].insert(vSendMsg[nSendClassIn].end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
+    nSendSizePerClass[nSendClassIn] += (*it).size();
 
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    // If write queue empty, attempt "optimistic write"; likewise when only the
+    // rate limits held it back, as this message may be allowed to go ahead
+    if (fQueueEmpty || fSendThrottled)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
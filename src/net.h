@@ -67,6 +67,31 @@ static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
+/** The default for -maxuploadrate (in KB/s). 0 = Unlimited */
+static const unsigned int DEFAULT_MAX_UPLOAD_RATE = 0;
+/** The default for -maxpeeruploadrate (in KB/s). 0 = Unlimited */
+static const unsigned int DEFAULT_MAX_PEER_UPLOAD_RATE = 0;
+/** The default for -maxhistoricuploadrate (in KB/s). 0 = Unlimited */
+static const unsigned int DEFAULT_MAX_HISTORIC_UPLOAD_RATE = 0;
+/** Default for -shortinv */
+static const bool DEFAULT_SHORTINV = true;
+/** Number of recent shortinv batches a peer may still ask the full hashes for */
+static const unsigned int MAX_SHORTINV_BATCHES = 4;
+/** Seconds before we hand peers a new salt for the shortinv batches they send us */
+static const int64_t SHORTINV_SALT_INTERVAL = 10 * 60;
+/** Bytes of rate-limited traffic a peer may send per pass of the socket handler, so peers share the limit */
+static const int64_t SEND_QUANTUM = 64 * 1000;
+
+/** -socketevents default */
+#ifdef HAVE_SYS_EPOLL_H
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
+/** -msghandlers default: number of threads processing peer messages */
+static const int DEFAULT_MESSAGE_HANDLERS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLERS = 16;
 
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
@@ -82,6 +107,64 @@ unsigned int SendBufferSize();
 
 typedef int NodeId;
 
+/** How the socket handler thread waits for socket readiness */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode);
+
+#ifdef WIN32
+// Win32 LevelDB doesn't use filedescriptors, and the ones used for
+// accessing block files don't count towards the fd_set size limit
+// anyway.
+#define MIN_CORE_FILEDESCRIPTORS 0
+#else
+#define MIN_CORE_FILEDESCRIPTORS 150
+#endif
+
+/**
+ * Classes of outgoing messages, each with its own send queue per peer. Queues
+ * are served in this order; the classes from SEND_CLASS_TX on are bulk traffic
+ * that is subject to the upload rate limits, the ones before it only count
+ * against them.
+ */
+enum SendClass {
+    SEND_CLASS_CONTROL = 0,    //!< Handshake, pings, headers, requests and anything unclassified
+    SEND_CLASS_BLOCK,          //!< Blocks near our tip, cmpctblock and blocktxn
+    SEND_CLASS_TX,             //!< Transaction inventory and transactions
+    SEND_CLASS_ADDR,           //!< Address relay
+    SEND_CLASS_HISTORIC_BLOCK, //!< Blocks served to peers that are catching up
+    SEND_CLASS_MAX
+};
+
+/** The class a message is sent with unless its sender chooses one */
+int GetDefaultSendClass(const char* pszCommand);
+/** The class of an inv message: any block in it makes it block traffic */
+int GetInvSendClass(const std::vector<CInv>& vInv);
+const char* GetSendClassName(int nSendClass);
+
+/** Byte-rate limiter holding up to one second worth of tokens */
+class CTokenBucket
+{
+private:
+    int64_t nRate; //!< bytes per second, 0 = unlimited
+    int64_t nTokens;
+    int64_t nLastRefill; //!< microseconds
+
+public:
+    CTokenBucket() : nRate(0), nTokens(0), nLastRefill(0) {}
+
+    void SetRate(int64_t nRateIn);
+    int64_t GetRate() const { return nRate; }
+
+    //! Bytes that may be sent now; negative after the bucket was overdrawn
+    int64_t Available(int64_t nNowMicros);
+    //! Take nBytes, running into at most one burst of debt
+    void Consume(int64_t nBytes);
+};
+
 void AddOneShot(const std::string& strDest);
 void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
@@ -95,7 +178,7 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
-void SocketSendData(CNode *pnode);
+bool SocketSendData(CNode *pnode);
 
 struct CombinerAll
 {
@@ -163,6 +246,10 @@ extern CAddrMan addrman;
 
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Socket readiness mechanism (-socketevents), fixed before the first socket is created */
+extern SocketEventsMode nSocketEventsMode;
+/** Number of message handler threads (-msghandlers) */
+extern int nMessageHandlers;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -206,6 +293,9 @@ public:
     
     uint64_t nSendBytes;
     mapMsgCmdSize mapSendBytesPerMsgCmd;
+    mapMsgCmdSize mapSendBytesPerClass;
+    mapMsgCmdSize mapSendQueuedPerClass;
+    bool fSendThrottled;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
     bool fWhitelisted;
@@ -221,6 +311,7 @@ public:
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
+    bool fDirect;                   // payload may be received straight into vRecv
 
     CDataStream hdrbuf;             // partially received header
     CMessageHeader hdr;             // complete header
@@ -234,10 +325,14 @@ public:
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
+        fDirect = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
+    CNetMessage(CNetMessage&&) = default;
+    CNetMessage& operator=(CNetMessage&&) = default;
+    ~CNetMessage();
 
     bool complete() const
     {
@@ -254,6 +349,13 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Unfilled part of a block payload buffer, which recv() can write to
+     *  directly. The buffer grows in the same capped steps as readData, and
+     *  only once some payload has arrived. NULL if there is none. */
+    char* GetDirectBuffer(unsigned int& nSize);
+    /** Account for nBytes written to the buffer returned by GetDirectBuffer */
+    void ReadDirect(unsigned int nBytes) { nDataPos += nBytes; }
 };
 
 
@@ -328,9 +430,14 @@ public:
     SOCKET hSocket;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendOffset; // offset inside the first message of vSendMsg[nSendClass] already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeData> vSendMsg[SEND_CLASS_MAX]; // one queue per SendClass
+    int nSendClass; // queue whose first message is partially sent, -1 if none
+    std::atomic<bool> fSendThrottled; // the last send stopped on a rate limit rather than a full socket; read without cs_vSend
+    size_t nSendSizePerClass[SEND_CLASS_MAX];
+    uint64_t nSendBytesPerClass[SEND_CLASS_MAX];
+    CTokenBucket sendBucket; // this peer's share of bulk traffic
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -368,7 +475,12 @@ public:
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
-    int nRefCount;
+    std::atomic<int> nRefCount;
+    // Message handler scheduling, protected by the message handler queue lock:
+    // whether the peer is queued or being processed, and whether it was
+    // scheduled again in the meantime
+    bool fHandlerScheduled;
+    bool fHandlerRescheduled;
     NodeId id;
 
     const uint64_t nKeyedNetGroup;
@@ -394,11 +506,17 @@ protected:
     // Basic fuzz-testing
     void Fuzz(int nChance); // modifies ssSend
 
+    // requires LOCK(cs_vRecvMsg)
+    void MessageComplete(CNetMessage& msg);
+
 public:
     uint256 hashContinue;
     int nStartingHeight;
 
     // flood relay
+    // Other peers' message handlers relay addresses to this peer, so
+    // vAddrToSend and addrKnown are protected by cs_vAddrToSend
+    CCriticalSection cs_vAddrToSend;
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
@@ -424,6 +542,15 @@ public:
     std::vector<uint256> vBlockHashesToAnnounce;
     // Used for BIP35 mempool sending, also protected by cs_inventory
     bool fSendMempool;
+    // Recent shortinv batches by sequence number, so the peer can ask for the
+    // full hashes. Also protected by cs_inventory
+    std::deque<std::pair<uint32_t, std::vector<uint256> > > vShortInvSent;
+    uint32_t nShortInvBatch;
+    // Salt the peer keys our shortinv batches with, 0 until it sent one.
+    // Also protected by cs_inventory
+    uint64_t nShortInvSalt;
+    // Salt we last sent the peer, 0 if none. Protected by cs_main
+    uint64_t nShortInvSaltSent;
 
     // Last time a "MEMPOOL" request was serviced.
     std::atomic<int64_t> timeLastMempoolReq;
@@ -465,6 +592,16 @@ private:
     static uint64_t nMaxOutboundLimit;
     static uint64_t nMaxOutboundTimeframe;
 
+    // shortinv relay stats, protected by cs_totalBytesSent
+    static uint64_t nShortInvSent;
+    static uint64_t nShortInvFallback;
+    static int64_t nShortInvBytesSaved;
+
+    // upload rate limits of the send scheduler, protected by cs_totalBytesSent
+    static CTokenBucket sendBucketTotal;
+    static CTokenBucket sendBucketHistoric;
+    static int64_t nMaxPeerUploadRate;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -494,6 +631,11 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    char* GetRecvDirectBuffer(unsigned int& nSize);
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedDirect(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -517,6 +659,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -525,6 +668,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -571,6 +715,7 @@ public:
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend);
+    void EndMessage(const char* pszCommand, int nSendClass) UNLOCK_FUNCTION(cs_vSend);
 
     void PushVersion();
 
@@ -589,6 +734,15 @@ public:
         }
     }
 
+    /** Send an inv or getdata message; invs that announce blocks are queued as blocks. */
+    void PushMessage(const char* pszCommand, const std::vector<CInv>& vInv)
+    {
+        int nSendClass = GetDefaultSendClass(pszCommand);
+        if (nSendClass == SEND_CLASS_TX)
+            nSendClass = GetInvSendClass(vInv);
+        PushMessageWithClass(nSendClass, 0, pszCommand, vInv);
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -622,6 +776,23 @@ public:
         }
     }
 
+    /** Send a message containing a1, serialized with flag flag, in send queue nSendClass. */
+    template<typename T1>
+    void PushMessageWithClass(int nSendClass, int flag, const char* pszCommand, const T1& a1)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            WithOrVersion(&ssSend, flag) << a1;
+            EndMessage(pszCommand, nSendClass);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
@@ -796,6 +967,14 @@ public:
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 
+    //!record transactions announced by short ID and the bytes that saved over inv entries
+    static void RecordShortInvSent(uint64_t nAnnouncements, int64_t nBytesSaved);
+    //!record announcements sent again as inv entries because the peer could not match them
+    static void RecordShortInvFallback(uint64_t nAnnouncements, int64_t nBytesLost);
+    static uint64_t GetShortInvSent();
+    static uint64_t GetShortInvFallback();
+    static int64_t GetShortInvBytesSaved();
+
     //!set the max outbound target in bytes
     static void SetMaxOutboundTarget(uint64_t limit);
     static uint64_t GetMaxOutboundTarget();
@@ -816,6 +995,15 @@ public:
     //!response the time in second left in the current max outbound cycle
     // in case of no limit, it will always response 0
     static uint64_t GetMaxOutboundTimeLeftInCycle();
+
+    //!set the upload rate limits in bytes per second, 0 = unlimited
+    static void SetMaxUploadRates(int64_t nTotal, int64_t nPeer, int64_t nHistoric);
+    static bool IsUploadRateLimited();
+
+    //!bytes of nSendClass this node may send now, requires cs_vSend
+    int64_t GetSendAllowance(int nSendClassIn, int64_t nNowMicros);
+    //!charge sent bytes to the rate limits, requires cs_vSend
+    void ConsumeSendAllowance(int nSendClassIn, int64_t nBytes);
 };
 
 
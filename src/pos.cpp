@@ -67,7 +67,7 @@ static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedBy
         // compute the selection hash by hashing its proof-hash and the
         // previous proof-of-stake modifier
         CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
+        ss << pindex->pcold->hashProof << nStakeModifierPrev;
         uint256 hashSelection = Hash(ss.begin(), ss.end());
         // the selection hash is divided by 2**32 so that proof-of-stake block
         // is always favored over proof-of-work block. this is to preserve
@@ -199,7 +199,7 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
         return uint256();  // genesis block's modifier is 0
 
     CDataStream ss(SER_GETHASH, 0);
-    ss << kernel << pindexPrev->bnStakeModifierV2;
+    ss << kernel << pindexPrev->pcold->bnStakeModifierV2;
     return Hash(ss.begin(), ss.end());
 }
 
@@ -225,9 +225,9 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -235,21 +235,20 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
     arith_uint256 bnWeight = arith_uint256(nValueIn);
     bnTarget *= bnWeight;
 
     targetProofOfStake = ArithToUint256(bnTarget);
 
     uint64_t nStakeModifier = pindexPrev->nStakeModifier;
-    uint256 bnStakeModifierV2 = pindexPrev->bnStakeModifierV2;
+    uint256 bnStakeModifierV2 = pindexPrev->pcold->bnStakeModifierV2;
     int nStakeModifierHeight = pindexPrev->nHeight;
     int64_t nStakeModifierTime = pindexPrev->nTime;
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
     ss << bnStakeModifierV2;
-    ss << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -260,7 +259,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -276,7 +275,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -285,7 +284,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
 
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlockHeader& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
 }
 
 // Check kernel hash target and coinstake signature
@@ -323,6 +322,87 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, CValidationState& state, const C
     return true;
 }
 
+bool CheckProofOfStakeHeader(CBlockIndex* pindexPrev, CValidationState& state, const CBlockHeader& header, bool& fKernelChecked)
+{
+    AssertLockHeld(cs_main);
+    fKernelChecked = false;
+
+    const COutPoint prevout = header.PrevoutStake();
+
+    // A header on our tip must stake an unspent output. Spent ones are still
+    // looked up for headers on our chain near the tip; anything else can't be
+    // placed without the block and is left to the block check.
+    const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+    const bool fUnspent = coins && coins->IsAvailable(prevout.n);
+    if (!fUnspent)
+    {
+        if (pindexPrev == chainActive.Tip())
+            return state.DoS(100, error("CheckProofOfStakeHeader() : staked output %s spent or not in chain", prevout.ToString()));
+        if (!chainActive.Contains(pindexPrev) || chainActive.Height() - pindexPrev->nHeight > MAX_STAKE_HEADER_CHECK_DEPTH)
+            return true;
+    }
+
+    // The kernel hashes the staked transaction's time, which the UTXO set
+    // does not keep. Like CheckProofOfStake, take the transaction from the
+    // transaction index, the only source of it; without the index the kernel
+    // is left to the block check.
+    if (!fTxIndex)
+        return true;
+
+    CTransaction txPrev;
+    CDiskTxPos txindex;
+    if (!ReadFromDisk(txPrev, txindex, *pblocktree, prevout))
+    {
+        if (fUnspent)
+            return error("CheckProofOfStakeHeader() : staked output %s missing from the transaction index", prevout.ToString());
+        return state.DoS(100, error("CheckProofOfStakeHeader() : staked output %s not in chain", prevout.ToString()));
+    }
+    if (prevout.n >= txPrev.vout.size())
+        return state.DoS(100, error("CheckProofOfStakeHeader() : staked output %s not in chain", prevout.ToString()));
+
+    // Find the block that confirmed it. Outputs confirmed in blocks we don't
+    // have yet are checked with the block; FindNextBlocksToDownload limits how
+    // far such headers are fetched ahead.
+    const CBlockIndex* pindexFrom = NULL;
+    if (fUnspent)
+    {
+        pindexFrom = chainActive[coins->nHeight];
+    }
+    else
+    {
+        CBlockHeader block;
+        if (!ReadFromDisk(block, txindex.nFile, txindex.nPos))
+            return error("CheckProofOfStakeHeader() : read block failed");
+
+        BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+        if (mi != mapBlockIndex.end())
+            pindexFrom = mi->second;
+    }
+    if (pindexFrom == NULL)
+        return true;
+
+    if (pindexPrev->GetAncestor(pindexFrom->nHeight) != pindexFrom)
+    {
+        // A transaction is confirmed once in a chain, so a header on our chain
+        // cannot stake it from another block. On a fork it may be confirmed again.
+        if (chainActive.Contains(pindexPrev) && chainActive.Contains(pindexFrom))
+            return state.DoS(100, error("CheckProofOfStakeHeader() : staked output %s not confirmed before the header", prevout.ToString()));
+        return true;
+    }
+
+    // Min age requirement
+    int nDepth = pindexPrev->nHeight - pindexFrom->nHeight;
+    if (nDepth < nStakeMinConfirmations - 1)
+        return state.DoS(100, error("CheckProofOfStakeHeader() : tried to stake at depth %d", nDepth + 1));
+
+    uint256 hashProofOfStake, targetProofOfStake;
+    if (!CheckStakeKernelHashV2(pindexPrev, header.nBits, pindexFrom->GetBlockTime(), txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, header.StakeTime(), hashProofOfStake, targetProofOfStake, false))
+        return state.DoS(1, error("CheckProofOfStakeHeader() : INFO: check kernel failed on header %s, hashProof=%s", header.GetHash().ToString(), hashProofOfStake.ToString()));
+
+    fKernelChecked = true;
+    return true;
+}
+
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx)
 {
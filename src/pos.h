@@ -31,6 +31,21 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBl
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(CBlockIndex* pindexPrev, CValidationState& state, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
 
+// Headers building on a block deeper than this below our tip only read the
+// transaction index for a staked output that has been spent
+static const int MAX_STAKE_HEADER_CHECK_DEPTH = 20;
+
+// Check the kernel of a proof-of-stake header whose block we may not have yet
+// The staked output is looked up in the UTXO set, and the staked transaction,
+// which gives the kernel its time, in the transaction index. Each checked
+// header costs a transaction index lookup and a transaction read, plus a
+// header read for spent outputs, all under cs_main. Headers staking an output
+// we can't place in their chain, or checked without the transaction index,
+// pass with fKernelChecked false and are left to the block check; the
+// download of their blocks is bounded by MAX_UNCHECKED_STAKE_HEADERS.
+// Requires cs_main.
+bool CheckProofOfStakeHeader(CBlockIndex* pindexPrev, CValidationState& state, const CBlockHeader& header, bool& fKernelChecked);
+
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
 
@@ -39,6 +39,9 @@ const char *SENDCMPCT="sendcmpct";
 const char *CMPCTBLOCK="cmpctblock";
 const char *GETBLOCKTXN="getblocktxn";
 const char *BLOCKTXN="blocktxn";
+const char *SHORTINV="shortinv";
+const char *GETSHORTINV="getshortinv";
+const char *SHORTINVSALT="shortinvsalt";
 };
 
 /** All known message types. Keep this in the same order as the list of
@@ -71,6 +74,9 @@ const static std::string allNetMessageTypes[] = {
     NetMsgType::CMPCTBLOCK,
     NetMsgType::GETBLOCKTXN,
     NetMsgType::BLOCKTXN,
+    NetMsgType::SHORTINV,
+    NetMsgType::GETSHORTINV,
+    NetMsgType::SHORTINVSALT,
 };
 const static std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes+ARRAYLEN(allNetMessageTypes));
 
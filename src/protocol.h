@@ -243,6 +243,25 @@ extern const char *GETBLOCKTXN;
  * @since protocol version 70014 as described by BIP 152
  */
 extern const char *BLOCKTXN;
+/**
+ * Contains a CShortInv.
+ * Announces transactions by 6-byte short IDs instead of inv entries.
+ * Only sent between peers that both signal NODE_SHORTINV.
+ */
+extern const char *SHORTINV;
+/**
+ * Contains a CShortInvRequest.
+ * Peer should respond with an "inv" for the transactions at the given
+ * positions of the "shortinv" batch.
+ */
+extern const char *GETSHORTINV;
+/**
+ * Contains a uint64_t salt.
+ * The peer should key the short IDs of the "shortinv" batches it sends us
+ * with this salt, and not send any before it has one. Sent again whenever
+ * the salt changes.
+ */
+extern const char *SHORTINVSALT;
 };
 
 /* Get a vector of all valid message types (see above) */
@@ -267,6 +286,10 @@ enum ServiceFlags : uint64_t {
     // Indicates that a node can be asked for blocks and transactions including
     // witness data.
     NODE_WITNESS = (1 << 3),
+    // NODE_SHORTINV means the node announces transactions to, and accepts
+    // announcements from, other NODE_SHORTINV peers as batches of short IDs.
+    // This is an ATB extension and uses a bit from the experimental range.
+    NODE_SHORTINV = (1 << 24),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
@@ -0,0 +1,216 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "responsecache.h"
+
+#include "chain.h"
+#include "main.h"
+#include "memusage.h"
+
+#include <univalue.h>
+
+#include <limits>
+
+CResponseCache* pResponseCache = NULL;
+
+/** Heap memory held by a UniValue and its children */
+static size_t UniValueUsage(const UniValue& value)
+{
+    size_t nUsage = memusage::MallocUsage(value.getValStr().size());
+    if (value.isObject()) {
+        std::vector<std::string> keys = value.getKeys();
+        nUsage += memusage::MallocUsage(keys.size() * sizeof(std::string));
+        for (size_t i = 0; i < keys.size(); i++)
+            nUsage += memusage::MallocUsage(keys[i].size());
+    }
+    nUsage += memusage::MallocUsage(value.size() * sizeof(UniValue));
+    for (size_t i = 0; i < value.size(); i++)
+        nUsage += UniValueUsage(value[i]);
+    return nUsage;
+}
+
+CResponseCache::Entry::Entry(const Key& keyIn, const uint256& hashBlockIn, std::string&& dataIn, std::shared_ptr<const UniValue>&& valueIn) :
+    key(keyIn), hashBlock(hashBlockIn), data(std::move(dataIn)), value(std::move(valueIn)), nLastUsed(0)
+{
+    // List node, hash map node, block index node and the response itself
+    nUsage = memusage::MallocUsage(sizeof(Entry) + 2 * sizeof(void*)) +
+             memusage::MallocUsage(sizeof(std::pair<const Key, EntryList::iterator>) + sizeof(void*)) +
+             memusage::MallocUsage(sizeof(memusage::stl_tree_node<BlockEntryMap::value_type>)) +
+             memusage::MallocUsage(data.size());
+    if (value)
+        nUsage += memusage::DynamicUsage(value) + UniValueUsage(*value);
+}
+
+CResponseCache::CResponseCache(size_t nMaxBytesIn, int nMinDepthIn) : nBytes(0), nClock(0), nMaxBytes(nMaxBytesIn), nMinDepth(nMinDepthIn)
+{
+}
+
+bool CResponseCache::IsCacheable(const CBlockIndex* pindex) const
+{
+    AssertLockHeld(cs_main);
+    if (!pindex || !chainActive.Contains(pindex))
+        return false;
+    return chainActive.Height() - pindex->nHeight + 1 >= nMinDepth;
+}
+
+void CResponseCache::EraseEntry(Shard& shard, EntryList::iterator it)
+{
+    nBytes -= it->Usage();
+    shard.map.erase(it->key);
+    std::pair<BlockEntryMap::iterator, BlockEntryMap::iterator> range = shard.mapByBlock.equal_range(it->hashBlock);
+    for (BlockEntryMap::iterator bi = range.first; bi != range.second; ++bi) {
+        if (bi->second == it) {
+            shard.mapByBlock.erase(bi);
+            break;
+        }
+    }
+    shard.lru.erase(it);
+}
+
+bool CResponseCache::EvictOldest()
+{
+    // Each shard's oldest entry is at the end of its list; compare those
+    Shard* pOldest = NULL;
+    uint64_t nOldest = std::numeric_limits<uint64_t>::max();
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        Shard& shard = shards[i];
+        LOCK(shard.cs);
+        if (!shard.lru.empty() && shard.lru.back().nLastUsed < nOldest) {
+            nOldest = shard.lru.back().nLastUsed;
+            pOldest = &shard;
+        }
+    }
+    if (!pOldest)
+        return false;
+
+    // Another thread may have used or evicted it meanwhile, in which case the
+    // shard's new oldest entry goes instead
+    LOCK(pOldest->cs);
+    if (!pOldest->lru.empty()) {
+        EraseEntry(*pOldest, --pOldest->lru.end());
+        pOldest->nEvictions++;
+    }
+    return true;
+}
+
+CResponseCache::Entry* CResponseCache::Find(Shard& shard, const Key& key)
+{
+    AssertLockHeld(shard.cs);
+    EntryMap::iterator mi = shard.map.find(key);
+    if (mi == shard.map.end()) {
+        shard.nMisses++;
+        return NULL;
+    }
+    shard.nHits++;
+    mi->second->nLastUsed = nClock++;
+    shard.lru.splice(shard.lru.begin(), shard.lru, mi->second);
+    return &*mi->second;
+}
+
+bool CResponseCache::Get(const uint256& hash, ResponseCacheKind kind, std::string& data, uint256* hashBlock)
+{
+    Shard& shard = GetShard(hash);
+    LOCK(shard.cs);
+    const Entry* entry = Find(shard, Key(hash, kind));
+    if (!entry)
+        return false;
+    data = entry->data;
+    if (hashBlock)
+        *hashBlock = entry->hashBlock;
+    return true;
+}
+
+bool CResponseCache::Get(const uint256& hash, ResponseCacheKind kind, std::shared_ptr<const UniValue>& value)
+{
+    Shard& shard = GetShard(hash);
+    LOCK(shard.cs);
+    const Entry* entry = Find(shard, Key(hash, kind));
+    if (!entry || !entry->value)
+        return false;
+    value = entry->value;
+    return true;
+}
+
+void CResponseCache::Put(const uint256& hash, ResponseCacheKind kind, const uint256& hashBlock, std::string data)
+{
+    Insert(Entry(Key(hash, kind), hashBlock, std::move(data), std::shared_ptr<const UniValue>()));
+}
+
+void CResponseCache::Put(const uint256& hash, ResponseCacheKind kind, const uint256& hashBlock, std::shared_ptr<const UniValue> value)
+{
+    Insert(Entry(Key(hash, kind), hashBlock, std::string(), std::move(value)));
+}
+
+void CResponseCache::Insert(Entry&& entry)
+{
+    Shard& shard = GetShard(entry.key.hash);
+    {
+        LOCK(shard.cs);
+        EntryMap::iterator mi = shard.map.find(entry.key);
+        if (mi != shard.map.end())
+            EraseEntry(shard, mi->second);
+
+        size_t nUsage = entry.Usage();
+        if (nUsage > nMaxBytes)
+            return;
+        entry.nLastUsed = nClock++;
+        shard.lru.push_front(std::move(entry));
+        const Entry& inserted = shard.lru.front();
+        shard.map.insert(std::make_pair(inserted.key, shard.lru.begin()));
+        shard.mapByBlock.insert(std::make_pair(inserted.hashBlock, shard.lru.begin()));
+        nBytes += nUsage;
+    }
+
+    // Evicting takes the shard locks one at a time, so it runs after this
+    // shard's lock is released. The new entry is the most recently used, so
+    // it is only evicted if the cache holds nothing else.
+    while (nBytes > nMaxBytes && EvictOldest()) {}
+}
+
+void CResponseCache::EraseBlock(const uint256& hashBlock)
+{
+    // The block's own responses are all in its shard, but its transactions
+    // are spread over the shards by txid
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        Shard& shard = shards[i];
+        LOCK(shard.cs);
+        BlockEntryMap::iterator bi = shard.mapByBlock.lower_bound(hashBlock);
+        while (bi != shard.mapByBlock.end() && bi->first == hashBlock) {
+            EntryList::iterator it = bi->second;
+            nBytes -= it->Usage();
+            shard.map.erase(it->key);
+            shard.lru.erase(it);
+            shard.mapByBlock.erase(bi++);
+        }
+    }
+}
+
+void CResponseCache::Clear()
+{
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        Shard& shard = shards[i];
+        LOCK(shard.cs);
+        for (EntryList::const_iterator it = shard.lru.begin(); it != shard.lru.end(); ++it)
+            nBytes -= it->Usage();
+        shard.map.clear();
+        shard.mapByBlock.clear();
+        shard.lru.clear();
+    }
+}
+
+CResponseCacheStats CResponseCache::GetStats()
+{
+    CResponseCacheStats stats;
+    stats.nMaxBytes = nMaxBytes;
+    stats.nBytes = nBytes;
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        Shard& shard = shards[i];
+        LOCK(shard.cs);
+        stats.nEntries += shard.map.size();
+        stats.nHits += shard.nHits;
+        stats.nMisses += shard.nMisses;
+        stats.nEvictions += shard.nEvictions;
+    }
+    return stats;
+}
@@ -0,0 +1,157 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RESPONSECACHE_H
+#define BITCOIN_RESPONSECACHE_H
+
+#include "sync.h"
+#include "uint256.h"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/unordered_map.hpp>
+
+class CBlockIndex;
+class UniValue;
+
+/** Default size of the RPC/REST response cache in megabytes */
+static const unsigned int DEFAULT_RESPONSE_CACHE_SIZE = 32;
+/** Default number of confirmations a block needs before responses about it are cached */
+static const int DEFAULT_RESPONSE_CACHE_DEPTH = 10;
+
+/** Format of a cached response */
+enum ResponseCacheKind {
+    RESPONSE_BLOCK_BIN,            //!< Serialized block
+    RESPONSE_BLOCK_HEX,            //!< Hex encoded serialized block
+    RESPONSE_BLOCK_JSON,           //!< Chain independent part of the block object
+    RESPONSE_BLOCK_JSON_TXDETAILS, //!< Same, with decoded transactions
+    RESPONSE_TX_BIN,               //!< Serialized transaction
+};
+
+struct CResponseCacheStats
+{
+    uint64_t nEntries;
+    uint64_t nBytes;
+    uint64_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvictions;
+
+    CResponseCacheStats() : nEntries(0), nBytes(0), nMaxBytes(0), nHits(0), nMisses(0), nEvictions(0) {}
+};
+
+/**
+ * Size-bounded cache of RPC and REST responses about blocks and transactions
+ * that can no longer change. Serialized formats are kept as strings, JSON
+ * objects as shared immutable UniValues, which callers copy to add what
+ * depends on the active chain.
+ *
+ * Entries are keyed by (hash, kind) and remember the hash of the block they
+ * belong to, so all of them can be dropped when that block is disconnected.
+ * The cache is split in shards, each an LRU list with its own lock, so
+ * concurrent RPC workers rarely contend. The memory budget is shared by all
+ * shards: any response that fits in the whole budget is admitted, even a
+ * verbose block several times larger than a shard's share, and room is made
+ * by evicting the least recently used entry across all shards. Each shard
+ * also indexes its entries by block, so dropping a block looks up its
+ * entries instead of scanning the cache.
+ *
+ * Put() does not check what is safe to store: callers check IsCacheable()
+ * under cs_main first.
+ */
+class CResponseCache
+{
+private:
+    static const unsigned int SHARDS = 16;
+
+    struct Key
+    {
+        uint256 hash;
+        ResponseCacheKind kind;
+
+        Key(const uint256& hashIn, ResponseCacheKind kindIn) : hash(hashIn), kind(kindIn) {}
+        bool operator==(const Key& other) const { return kind == other.kind && hash == other.hash; }
+    };
+
+    struct KeyHasher
+    {
+        size_t operator()(const Key& key) const { return key.hash.GetCheapHash() ^ (size_t)key.kind; }
+    };
+
+    struct Entry
+    {
+        Key key;
+        uint256 hashBlock;
+        std::string data;
+        std::shared_ptr<const UniValue> value;
+        size_t nUsage;      //!< Memory usage, computed once as walking a large object is slow
+        uint64_t nLastUsed; //!< Value of nClock when last stored or looked up
+
+        Entry(const Key& keyIn, const uint256& hashBlockIn, std::string&& dataIn, std::shared_ptr<const UniValue>&& valueIn);
+        size_t Usage() const { return nUsage; }
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef boost::unordered_map<Key, EntryList::iterator, KeyHasher> EntryMap;
+    typedef std::multimap<uint256, EntryList::iterator> BlockEntryMap;
+
+    struct Shard
+    {
+        CCriticalSection cs;
+        EntryList lru; //!< Most recently used first
+        EntryMap map;
+        BlockEntryMap mapByBlock; //!< The entries of each block
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nEvictions;
+
+        Shard() : nHits(0), nMisses(0), nEvictions(0) {}
+    };
+
+    Shard shards[SHARDS];
+    std::atomic<size_t> nBytes;    //!< Memory usage of the entries of all shards
+    std::atomic<uint64_t> nClock;  //!< Ticks on every store and lookup, to order entries by last use
+    size_t nMaxBytes;
+    int nMinDepth;
+
+    Shard& GetShard(const uint256& hash) { return shards[hash.GetCheapHash() % SHARDS]; }
+    void EraseEntry(Shard& shard, EntryList::iterator it);
+    /** Find an entry and mark it used, counting the hit or miss. Requires shard.cs. */
+    Entry* Find(Shard& shard, const Key& key);
+    void Insert(Entry&& entry);
+    /** Evict the least recently used entry of all shards. Returns false if the cache is empty. */
+    bool EvictOldest();
+
+public:
+    CResponseCache(size_t nMaxBytes, int nMinDepthIn);
+
+    /** Whether responses about a block may be cached: it is in the active chain
+     * and has at least nMinDepth confirmations. Requires cs_main.
+     */
+    bool IsCacheable(const CBlockIndex* pindex) const;
+
+    /** Look up a response. On success also returns the hash of the block it belongs to. */
+    bool Get(const uint256& hash, ResponseCacheKind kind, std::string& data, uint256* hashBlock = NULL);
+    /** Look up a JSON response, sharing the cached object */
+    bool Get(const uint256& hash, ResponseCacheKind kind, std::shared_ptr<const UniValue>& value);
+    /** Store a response about an object in block hashBlock, evicting least recently used ones as needed */
+    void Put(const uint256& hash, ResponseCacheKind kind, const uint256& hashBlock, std::string data);
+    void Put(const uint256& hash, ResponseCacheKind kind, const uint256& hashBlock, std::shared_ptr<const UniValue> value);
+    /** Drop every response belonging to a block */
+    void EraseBlock(const uint256& hashBlock);
+    /** Drop all responses */
+    void Clear();
+
+    CResponseCacheStats GetStats();
+};
+
+/** Global response cache, NULL if disabled (-rpccachesize=0) */
+extern CResponseCache* pResponseCache;
+
+#endif // BITCOIN_RESPONSECACHE_H
@@ -3,12 +3,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "base58.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "main.h"
 #include "httpserver.h"
+#include "responsecache.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
@@ -58,12 +60,56 @@ struct CCoin {
     }
 };
 
+/** Unspent output of an address, as returned by /rest/address/<address>/utxos */
+struct CAddressUtxo {
+    uint256 txhash;
+    uint32_t nIndex;
+    CAmount nSatoshis;
+    int32_t nHeight;
+    CScript script;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txhash);
+        READWRITE(nIndex);
+        READWRITE(nSatoshis);
+        READWRITE(nHeight);
+        READWRITE(*(CScriptBase*)(&script));
+    }
+};
+
+/** Balance change of an address, as returned by /rest/address/<address>/deltas */
+struct CAddressDelta {
+    uint256 txhash;
+    uint32_t nIndex;
+    CAmount nSatoshis;
+    int32_t nHeight;
+    uint32_t nBlockIndex;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txhash);
+        READWRITE(nIndex);
+        READWRITE(nSatoshis);
+        READWRITE(nHeight);
+        READWRITE(nBlockIndex);
+    }
+};
+
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
 extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
 extern UniValue mempoolInfoToJSON();
 extern UniValue mempoolToJSON(bool fVerbose = false);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
+extern bool GetBlockResponse(const CBlockIndex* pblockindex, ResponseCacheKind kind, std::string& strResponse);
+extern bool GetTransactionResponse(const uint256& hash, CTransaction& tx, std::string& strTx, uint256& hashBlock);
 
 static bool RESTERR(HTTPRequest* req, enum HTTPStatusCode status, string message)
 {
@@ -213,44 +259,51 @@ static bool rest_block(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
-    CBlock block;
-    CBlockIndex* pblockindex = NULL;
+    ResponseCacheKind kind;
+    switch (rf) {
+    case RF_BINARY:
+        kind = RESPONSE_BLOCK_BIN;
+        break;
+    case RF_HEX:
+        kind = RESPONSE_BLOCK_HEX;
+        break;
+    case RF_JSON:
+        kind = showTxDetails ? RESPONSE_BLOCK_JSON_TXDETAILS : RESPONSE_BLOCK_JSON;
+        break;
+    default:
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+
+    std::string strResponse;
     {
         LOCK(cs_main);
         if (mapBlockIndex.count(hash) == 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
 
-        pblockindex = mapBlockIndex[hash];
+        CBlockIndex* pblockindex = mapBlockIndex[hash];
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        if (!GetBlockResponse(pblockindex, kind, strResponse))
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
-        string binaryBlock = ssBlock.str();
         req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryBlock);
+        req->WriteReply(HTTP_OK, strResponse);
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        req->WriteReply(HTTP_OK, strResponse + "\n");
         return true;
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, strResponse + "\n");
         return true;
     }
 
@@ -363,23 +416,20 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
     CTransaction tx;
+    std::string strTx;
     uint256 hashBlock = uint256();
-    if (!GetTransaction(hash, tx, Params().GetConsensus(), hashBlock, true))
+    if (!GetTransactionResponse(hash, tx, strTx, hashBlock))
         return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
 
-    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-    ssTx << tx;
-
     switch (rf) {
     case RF_BINARY: {
-        string binaryTx = ssTx.str();
         req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryTx);
+        req->WriteReply(HTTP_OK, strTx);
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssTx.begin(), ssTx.end()) + "\n";
+        string strHex = HexStr(strTx.begin(), strTx.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
         req->WriteReply(HTTP_OK, strHex);
         return true;
@@ -403,6 +453,169 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool AddressUtxoHeightSort(const std::pair<CAddressUnspentKey, CAddressUnspentValue>& a,
+                                  const std::pair<CAddressUnspentKey, CAddressUnspentValue>& b)
+{
+    return a.second.blockHeight < b.second.blockHeight;
+}
+
+/**
+ * Address index queries: /rest/address/<address>/<utxos|txids|balance|deltas>.<bin|hex|json>
+ * txids and deltas optionally take a block height range as /<start>/<end>.
+ *
+ * The JSON formats are those of the corresponding getaddress* RPCs. The
+ * binary formats are built straight from the index records without going
+ * through UniValue; all start with the chain height and tip hash at the
+ * start of the query, followed by:
+ * - utxos: vector of (txid, output index, satoshis, height, script), by height
+ * - txids: vector of txids, in index order
+ * - balance: balance and total received, in satoshis
+ * - deltas: vector of (txid, input/output index, satoshis, height, index in block)
+ */
+static bool rest_address(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    vector<string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+
+    if (path.size() != 2 && path.size() != 4)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Use /rest/address/<address>/<utxos|txids|balance|deltas>[/<start>/<end>].<ext>.");
+
+    const std::string& strAddress = path[0];
+    const std::string& strQuery = path[1];
+    uint160 hashBytes;
+    int type = 0;
+    if (!CBitcoinAddress(strAddress).GetIndexKey(hashBytes, type))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid address: " + strAddress);
+
+    int start = 0;
+    int end = 0;
+    if (path.size() == 4) {
+        if (strQuery != "txids" && strQuery != "deltas")
+            return RESTERR(req, HTTP_BAD_REQUEST, "Height range only supported for txids and deltas");
+        if (!ParseInt32(path[2], &start) || !ParseInt32(path[3], &end) || start <= 0 || end < start)
+            return RESTERR(req, HTTP_BAD_REQUEST, "Invalid height range: " + path[2] + "/" + path[3]);
+    }
+
+    if (strQuery != "utxos" && strQuery != "txids" && strQuery != "balance" && strQuery != "deltas")
+        return RESTERR(req, HTTP_NOT_FOUND, "Unknown address query: " + strQuery);
+
+    int nHeight;
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        nHeight = chainActive.Height();
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+
+    // The index scan runs without cs_main, like the getaddress* RPCs, so a
+    // heavy address never holds up block validation or message handling.
+    // Records of blocks connected during the scan may be included.
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    if (strQuery == "utxos") {
+        if (!GetAddressUnspent(hashBytes, type, unspentOutputs))
+            return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), AddressUtxoHeightSort);
+    } else {
+        if (!GetAddressIndex(hashBytes, type, addressIndex, start, end))
+            return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+    }
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        CDataStream ssResponse(SER_NETWORK, PROTOCOL_VERSION);
+        ssResponse << nHeight << hashTip;
+
+        if (strQuery == "utxos") {
+            std::vector<CAddressUtxo> utxos;
+            utxos.reserve(unspentOutputs.size());
+            for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = unspentOutputs.begin(); it != unspentOutputs.end(); it++) {
+                CAddressUtxo utxo;
+                utxo.txhash = it->first.txhash;
+                utxo.nIndex = it->first.index;
+                utxo.nSatoshis = it->second.satoshis;
+                utxo.nHeight = it->second.blockHeight;
+                utxo.script = it->second.script;
+                utxos.push_back(utxo);
+            }
+            ssResponse << utxos;
+        } else if (strQuery == "txids") {
+            std::vector<uint256> txids;
+            std::set<std::pair<int, uint256> > setSeen;
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+                if (setSeen.insert(std::make_pair(it->first.blockHeight, it->first.txhash)).second)
+                    txids.push_back(it->first.txhash);
+            }
+            ssResponse << txids;
+        } else if (strQuery == "balance") {
+            CAmount balance = 0;
+            CAmount received = 0;
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+                if (it->second > 0)
+                    received += it->second;
+                balance += it->second;
+            }
+            ssResponse << balance << received;
+        } else {
+            std::vector<CAddressDelta> deltas;
+            deltas.reserve(addressIndex.size());
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+                CAddressDelta delta;
+                delta.txhash = it->first.txhash;
+                delta.nIndex = it->first.index;
+                delta.nSatoshis = it->second;
+                delta.nHeight = it->first.blockHeight;
+                delta.nBlockIndex = it->first.txindex;
+                deltas.push_back(delta);
+            }
+            ssResponse << deltas;
+        }
+
+        if (rf == RF_BINARY) {
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, ssResponse.str());
+        } else {
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK, HexStr(ssResponse.begin(), ssResponse.end()) + "\n");
+        }
+        return true;
+    }
+
+    case RF_JSON: {
+        UniValue result;
+        try {
+            if (strQuery == "utxos")
+                result = AddressUtxosToJSON(unspentOutputs);
+            else if (strQuery == "txids")
+                result = AddressTxidsToJSON(addressIndex, false);
+            else if (strQuery == "balance")
+                result = AddressBalanceToJSON(addressIndex);
+            else
+                result = AddressDeltasToJSON(addressIndex);
+        } catch (const UniValue& objError) {
+            return RESTERR(req, HTTP_NOT_FOUND, find_value(objError, "message").get_str());
+        }
+
+        string strJSON = result.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -602,21 +815,23 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 static const struct {
     const char* prefix;
     bool (*handler)(HTTPRequest* req, const std::string& strReq);
+    HTTPWorkClass cls;
 } uri_prefixes[] = {
-      {"/rest/tx/", rest_tx},
-      {"/rest/block/notxdetails/", rest_block_notxdetails},
-      {"/rest/block/", rest_block_extended},
-      {"/rest/chaininfo", rest_chaininfo},
-      {"/rest/mempool/info", rest_mempool_info},
-      {"/rest/mempool/contents", rest_mempool_contents},
-      {"/rest/headers/", rest_headers},
-      {"/rest/getutxos", rest_getutxos},
+      {"/rest/tx/", rest_tx, HTTP_WORK_NORMAL},
+      {"/rest/block/notxdetails/", rest_block_notxdetails, HTTP_WORK_NORMAL},
+      {"/rest/block/", rest_block_extended, HTTP_WORK_NORMAL},
+      {"/rest/chaininfo", rest_chaininfo, HTTP_WORK_HIGH},
+      {"/rest/mempool/info", rest_mempool_info, HTTP_WORK_HIGH},
+      {"/rest/mempool/contents", rest_mempool_contents, HTTP_WORK_LOW},
+      {"/rest/headers/", rest_headers, HTTP_WORK_NORMAL},
+      {"/rest/getutxos", rest_getutxos, HTTP_WORK_NORMAL},
+      {"/rest/address/", rest_address, HTTP_WORK_LOW},
 };
 
 bool StartREST()
 {
     for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
-        RegisterHTTPHandler(uri_prefixes[i].prefix, false, uri_prefixes[i].handler);
+        RegisterHTTPHandler(uri_prefixes[i].prefix, false, uri_prefixes[i].handler, uri_prefixes[i].cls);
     return true;
 }
 
@@ -12,6 +12,7 @@
 #include "main.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
+#include "responsecache.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
@@ -88,7 +89,7 @@ double GetPoWMHashPS()
             pindexPrevWork = pindex;
         }
 
-        pindex = pindex->pnext;
+        pindex = pindex->pcold->pnext;
     }
 
     return GetDifficulty() * 4294.967296 / nTargetSpacingWork;
@@ -142,10 +143,10 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", blockindex->nVersion));
     result.push_back(Pair("versionHex", strprintf("%08x", blockindex->nVersion)));
-    result.push_back(Pair("merkleroot", blockindex->hashMerkleRoot.GetHex()));
+    result.push_back(Pair("merkleroot", blockindex->pcold->hashMerkleRoot.GetHex()));
     result.push_back(Pair("time", (int64_t)blockindex->nTime));
     result.push_back(Pair("mediantime", (int64_t)blockindex->GetMedianTimePast()));
-    result.push_back(Pair("nonce", (uint64_t)blockindex->nNonce));
+    result.push_back(Pair("nonce", (uint64_t)blockindex->pcold->nNonce));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
@@ -158,24 +159,31 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
 		
     
     result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->hashProof.GetHex()));
+    result.push_back(Pair("proofhash", blockindex->pcold->hashProof.GetHex()));
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", strprintf("%016x", blockindex->nStakeModifier)));
-    result.push_back(Pair("modifierv2", blockindex->bnStakeModifierV2.GetHex()));
+    result.push_back(Pair("modifierv2", blockindex->pcold->bnStakeModifierV2.GetHex()));
     
 
     return result;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+/**
+ * The JSON block object. With fChainState false the fields that depend on the
+ * active chain, confirmations and nextblockhash, are left out, so the object
+ * can be cached; AddBlockChainState adds them to a copy.
+ */
+static UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails, bool fChainState)
 {
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
-    int confirmations = -1;
-    // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
+    if (fChainState) {
+        int confirmations = -1;
+        // Only report confirmations if the block is on the main chain
+        if (chainActive.Contains(blockindex))
+            confirmations = chainActive.Height() - blockindex->nHeight + 1;
+        result.push_back(Pair("confirmations", confirmations));
+    }
     result.push_back(Pair("strippedsize", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS)));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("weight", (int)::GetBlockWeight(block)));
@@ -205,24 +213,118 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
-    if (pnext)
-        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
-		
-    
+    if (fChainState) {
+        CBlockIndex *pnext = chainActive.Next(blockindex);
+        if (pnext)
+            result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
+    }
+
     result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->hashProof.GetHex()));
+    result.push_back(Pair("proofhash", blockindex->pcold->hashProof.GetHex()));
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", strprintf("%016x", blockindex->nStakeModifier)));
-    result.push_back(Pair("modifierv2", blockindex->bnStakeModifierV2.GetHex()));
+    result.push_back(Pair("modifierv2", blockindex->pcold->bnStakeModifierV2.GetHex()));
 
     if (block.IsProofOfStake())
-        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));	
-    
-	
+        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
+
     return result;
 }
 
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    return blockToJSON(block, blockindex, txDetails, true);
+}
+
+/**
+ * Copy a block object built without confirmations and nextblockhash, adding
+ * them where blockToJSON puts them: right after the hash, and before flags.
+ */
+static UniValue AddBlockChainState(const CBlockIndex* blockindex, const UniValue& obj)
+{
+    int confirmations = -1;
+    if (chainActive.Contains(blockindex))
+        confirmations = chainActive.Height() - blockindex->nHeight + 1;
+    CBlockIndex *pnext = chainActive.Next(blockindex);
+
+    UniValue result(UniValue::VOBJ);
+    std::vector<std::string> keys = obj.getKeys();
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] == "flags" && pnext)
+            result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
+        result.push_back(Pair(keys[i], obj[i]));
+        if (keys[i] == "hash")
+            result.push_back(Pair("confirmations", confirmations));
+    }
+    return result;
+}
+
+/**
+ * Render a block serialized or as hex. Blocks buried deep enough are served
+ * from and stored in the response cache, so they are not read from disk and
+ * serialized again.
+ */
+static bool GetBlockResponseText(const CBlockIndex* pblockindex, ResponseCacheKind kind, std::string& strResponse)
+{
+    assert(kind == RESPONSE_BLOCK_BIN || kind == RESPONSE_BLOCK_HEX);
+    const uint256 hash = pblockindex->GetBlockHash();
+    if (pResponseCache && pResponseCache->Get(hash, kind, strResponse))
+        return true;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        return false;
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    strResponse = kind == RESPONSE_BLOCK_BIN ? ssBlock.str() : HexStr(ssBlock.begin(), ssBlock.end());
+
+    if (pResponseCache && pResponseCache->IsCacheable(pblockindex))
+        pResponseCache->Put(hash, kind, hash, strResponse);
+    return true;
+}
+
+/**
+ * The block object, with confirmations and nextblockhash. The chain
+ * independent rest is served from and stored in the response cache for
+ * blocks buried deep enough. Requires cs_main.
+ */
+static bool GetBlockObject(const CBlockIndex* pblockindex, bool txDetails, UniValue& result)
+{
+    AssertLockHeld(cs_main);
+    const uint256 hash = pblockindex->GetBlockHash();
+    const ResponseCacheKind kind = txDetails ? RESPONSE_BLOCK_JSON_TXDETAILS : RESPONSE_BLOCK_JSON;
+    std::shared_ptr<const UniValue> obj;
+    if (!pResponseCache || !pResponseCache->Get(hash, kind, obj)) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+            return false;
+        obj = std::make_shared<const UniValue>(blockToJSON(block, pblockindex, txDetails, false));
+        if (pResponseCache && pResponseCache->IsCacheable(pblockindex))
+            pResponseCache->Put(hash, kind, hash, obj);
+    }
+    result = AddBlockChainState(pblockindex, *obj);
+    return true;
+}
+
+/**
+ * A block in one of the RESPONSE_BLOCK_* formats, using the response cache.
+ * JSON objects are written out with confirmations and nextblockhash.
+ * Requires cs_main.
+ */
+bool GetBlockResponse(const CBlockIndex* pblockindex, ResponseCacheKind kind, std::string& strResponse)
+{
+    AssertLockHeld(cs_main);
+    if (kind == RESPONSE_BLOCK_JSON || kind == RESPONSE_BLOCK_JSON_TXDETAILS) {
+        UniValue result;
+        if (!GetBlockObject(pblockindex, kind == RESPONSE_BLOCK_JSON_TXDETAILS, result))
+            return false;
+        strResponse = result.write();
+        return true;
+    }
+    return GetBlockResponseText(pblockindex, kind, strResponse);
+}
+
 UniValue getblockcount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -694,78 +796,22 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
-
-    if (!fVerbose)
-    {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
+    if (!fVerbose) {
+        std::string strHex;
+        if (!GetBlockResponse(pblockindex, RESPONSE_BLOCK_HEX, strHex))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
         return strHex;
     }
 
-    return blockToJSON(block, pblockindex);
-}
-
-struct CCoinsStats
-{
-    int nHeight;
-    uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nSerializedSize;
-    uint256 hashSerialized;
-    CAmount nTotalAmount;
-
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
-};
-
-//! Calculate statistics about the unspent transaction output set
-static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
-{
-    boost::scoped_ptr<CCoinsViewCursor> pcursor(view->Cursor());
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
-    {
-        LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
-    }
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
-            }
-            stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
-        } else {
-            return error("%s: unable to read value", __func__);
-        }
-        pcursor->Next();
-    }
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
-    return true;
+    UniValue result;
+    if (!GetBlockObject(pblockindex, false, result))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    return result;
 }
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
@@ -774,16 +820,17 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
         throw runtime_error(
             "gettxoutsetinfo\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "The statistics are kept up to date as blocks are connected, so this call is fast and does not flush the coins cache.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
-            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"disk_size\": n,         (numeric) Estimated size of the coin records in the database: the sum of their key and value sizes, before compression\n"
+            "  \"bytes_serialized\": n,  (numeric) Deprecated alias of disk_size, to be removed in a later release\n"
+            "  \"muhash\": \"hash\",      (string) Order-independent MuHash3072 hash of the unspent outputs\n"
+            "  \"total_amount\": x.xxx   (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
@@ -792,15 +839,21 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 
     UniValue ret(UniValue::VOBJ);
 
+    LOCK(cs_main);
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (GetUTXOStats(pcoinsTip, stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
+    if (pcoinsTip->GetStats(stats)) {
+        BlockMap::const_iterator it = mapBlockIndex.find(stats.hashBlock);
+        if (it == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Best block of the coin database not found in the block index");
+        uint256 hashMuHash;
+        stats.muhash.Finalize(hashMuHash);
+        ret.push_back(Pair("height", (int64_t)it->second->nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+        ret.push_back(Pair("disk_size", (int64_t)stats.nSerializedSize));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("muhash", hashMuHash.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
@@ -1177,7 +1230,18 @@ UniValue mempoolInfoToJSON()
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    TxMempoolUsage usage = mempool.GetMemoryUsage();
+    ret.push_back(Pair("usage", (int64_t) usage.Total()));
+    UniValue breakdown(UniValue::VOBJ);
+    breakdown.push_back(Pair("nodes", (int64_t) usage.nNodes));
+    breakdown.push_back(Pair("transactions", (int64_t) usage.nTransactions));
+    breakdown.push_back(Pair("links", (int64_t) usage.nLinks));
+    breakdown.push_back(Pair("addressindex", (int64_t) usage.nAddressIndex));
+    breakdown.push_back(Pair("spentindex", (int64_t) usage.nSpentIndex));
+    breakdown.push_back(Pair("other", (int64_t) usage.nOther));
+    breakdown.push_back(Pair("poolfree", (int64_t) usage.nPoolFree));
+    breakdown.push_back(Pair("fixed", (int64_t) usage.nFixed));
+    ret.push_back(Pair("usagebreakdown", breakdown));
     size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
     ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
@@ -1196,6 +1260,16 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx,               (numeric) Current tx count\n"
             "  \"bytes\": xxxxx,              (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
+            "  \"usagebreakdown\": {          (json object) Memory usage by what it is used for\n"
+            "    \"nodes\": xxxxx,            (numeric) Pooled nodes of the transaction, link, spend and spent index maps\n"
+            "    \"transactions\": xxxxx,     (numeric) Transactions\n"
+            "    \"links\": xxxxx,            (numeric) Lists of in-mempool parents and children\n"
+            "    \"addressindex\": xxxxx,     (numeric) Address index\n"
+            "    \"spentindex\": xxxxx,       (numeric) Spent index, besides its nodes\n"
+            "    \"other\": xxxxx,            (numeric) Prioritisation deltas and the witness hash list\n"
+            "    \"poolfree\": xxxxx,         (numeric) Node pool memory free for reuse\n"
+            "    \"fixed\": xxxxx             (numeric) Memory the empty mempool uses already, not included in usage\n"
+            "  },\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
             "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
             "}\n"
@@ -1207,6 +1281,42 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getresponsecacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getresponsecacheinfo\n"
+            "\nReturns details on the cache of block and transaction RPC/REST responses.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,      (boolean) Whether the cache is enabled (see -rpccachesize)\n"
+            "  \"entries\": xxxxx,           (numeric) Number of cached responses\n"
+            "  \"usage\": xxxxx,             (numeric) Total memory usage of the cache\n"
+            "  \"maxusage\": xxxxx,          (numeric) Maximum memory usage of the cache\n"
+            "  \"hits\": xxxxx,              (numeric) Number of lookups served from the cache\n"
+            "  \"misses\": xxxxx,            (numeric) Number of lookups not found in the cache\n"
+            "  \"evictions\": xxxxx          (numeric) Number of responses evicted to stay within maxusage\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getresponsecacheinfo", "")
+            + HelpExampleRpc("getresponsecacheinfo", "")
+        );
+
+    CResponseCacheStats stats;
+    if (pResponseCache)
+        stats = pResponseCache->GetStats();
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("enabled", pResponseCache != NULL));
+    ret.push_back(Pair("entries", stats.nEntries));
+    ret.push_back(Pair("usage", stats.nBytes));
+    ret.push_back(Pair("maxusage", stats.nMaxBytes));
+    ret.push_back(Pair("hits", stats.nHits));
+    ret.push_back(Pair("misses", stats.nMisses));
+    ret.push_back(Pair("evictions", stats.nEvictions));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1298,6 +1408,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "getresponsecacheinfo",   &getresponsecacheinfo,   true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
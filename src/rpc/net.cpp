@@ -119,6 +119,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       \"addr\": n,             (numeric) The total bytes received aggregated by message type\n"
             "       ...\n"
             "    }\n"
+            "    \"bytessent_per_class\": {\n"
+            "       \"block\": n,            (numeric) The total bytes sent aggregated by send class\n"
+            "       ...                      (control, block, tx, addr, historic_block)\n"
+            "    }\n"
+            "    \"sendqueue_per_class\": {\n"
+            "       \"block\": n,            (numeric) The bytes queued for sending aggregated by send class\n"
+            "       ...\n"
+            "    }\n"
+            "    \"sendthrottled\": true|false, (boolean) Whether the upload rate limits are holding back data to this peer\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -189,6 +198,17 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
 
+        UniValue sendPerClass(UniValue::VOBJ);
+        BOOST_FOREACH(const mapMsgCmdSize::value_type &i, stats.mapSendBytesPerClass)
+            sendPerClass.push_back(Pair(i.first, i.second));
+        obj.push_back(Pair("bytessent_per_class", sendPerClass));
+
+        UniValue queuedPerClass(UniValue::VOBJ);
+        BOOST_FOREACH(const mapMsgCmdSize::value_type &i, stats.mapSendQueuedPerClass)
+            queuedPerClass.push_back(Pair(i.first, i.second));
+        obj.push_back(Pair("sendqueue_per_class", queuedPerClass));
+        obj.push_back(Pair("sendthrottled", stats.fSendThrottled));
+
         ret.push_back(obj);
     }
 
@@ -353,6 +373,12 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
             "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
             "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"txannouncements\":\n"
+            "  {\n"
+            "    \"shortids_sent\": n,                     (numeric) Transactions announced to peers as short IDs\n"
+            "    \"fallback_sent\": n,                     (numeric) Short IDs peers could not resolve and got as a full inv\n"
+            "    \"bytes_saved\": n                        (numeric) Bytes saved over announcing the same transactions with inv\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -373,6 +399,12 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
     outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
     obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    UniValue txAnnouncements(UniValue::VOBJ);
+    txAnnouncements.push_back(Pair("shortids_sent", CNode::GetShortInvSent()));
+    txAnnouncements.push_back(Pair("fallback_sent", CNode::GetShortInvFallback()));
+    txAnnouncements.push_back(Pair("bytes_saved", CNode::GetShortInvBytesSaved()));
+    obj.push_back(Pair("txannouncements", txAnnouncements));
     return obj;
 }
 
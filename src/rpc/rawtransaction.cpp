@@ -15,6 +15,7 @@
 #include "net.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
+#include "responsecache.h"
 #include "rpc/server.h"
 #include "script/script.h"
 #include "script/script_error.h"
@@ -210,6 +211,39 @@ void TxToJSONExpanded(const CTransaction& tx, const uint256 hashBlock, UniValue&
     }
 }
 
+/**
+ * Look up a transaction like GetTransaction, also returning its serialized
+ * form. Transactions in blocks buried deep enough are served from and stored
+ * in the response cache, skipping the transaction index and block file reads.
+ *
+ * The verbose object is not cached: TxToJSONExpanded adds spent index data to
+ * the outputs, which changes whenever one is spent, however deep the
+ * transaction is buried. It is rendered from the cached transaction instead.
+ */
+bool GetTransactionResponse(const uint256& hash, CTransaction& tx, std::string& strTx, uint256& hashBlock)
+{
+    if (pResponseCache && pResponseCache->Get(hash, RESPONSE_TX_BIN, strTx, &hashBlock)) {
+        CDataStream ssTx(strTx.data(), strTx.data() + strTx.size(), SER_NETWORK, PROTOCOL_VERSION);
+        ssTx >> tx;
+        return true;
+    }
+
+    if (!GetTransaction(hash, tx, Params().GetConsensus(), hashBlock, true))
+        return false;
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    strTx = ssTx.str();
+
+    if (pResponseCache && !hashBlock.IsNull()) {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end() && pResponseCache->IsCacheable(mi->second))
+            pResponseCache->Put(hash, RESPONSE_TX_BIN, hashBlock, strTx);
+    }
+    return true;
+}
+
 UniValue getrawtransaction(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -289,6 +323,7 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
         fVerbose = (params[1].get_int() != 0);
 
     CTransaction tx;
+    std::string strTx;
     uint256 hashBlock;
     // if (!GetTransaction(hash, tx, Params().GetConsensus(), hashBlock, true))
     //     throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
@@ -299,7 +334,7 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
 
     {
         LOCK(cs_main);
-        if (!GetTransaction(hash, tx, Params().GetConsensus(), hashBlock, true))
+        if (!GetTransactionResponse(hash, tx, strTx, hashBlock))
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
 
         BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
@@ -319,7 +354,7 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
 
 
 
-    string strHex = EncodeHexTx(tx);
+    string strHex = HexStr(strTx.begin(), strTx.end());
 
     if (!fVerbose)
         return strHex;
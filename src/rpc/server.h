@@ -31,6 +31,9 @@ namespace RPCServer
 
 class CBlockIndex;
 class CNetAddr;
+struct CAddressIndexKey;
+struct CAddressUnspentKey;
+struct CAddressUnspentValue;
 
 /** Wrapper for UniValue::VType, which includes typeAny:
  * Used to denote don't care type. Only used by RPCTypeCheckObj */
@@ -185,6 +188,15 @@ extern CAmount AmountFromValue(const UniValue& value);
 extern UniValue ValueFromAmount(const CAmount& amount);
 extern double GetDifficulty(const CBlockIndex* blockindex = NULL);
 
+/**
+ * Address index results in the getaddress* RPC formats, shared with the
+ * REST interface.
+ */
+extern UniValue AddressUtxosToJSON(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs);
+extern UniValue AddressTxidsToJSON(const std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, bool fSortByHeight);
+extern UniValue AddressBalanceToJSON(const std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex);
+extern UniValue AddressDeltasToJSON(const std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex);
+
 extern double GetPoWMHashPS();
 extern double GetPoSKernelPS();
 
@@ -0,0 +1,48 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "shortinv.h"
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "streams.h"
+#include "version.h"
+
+CShortInv::CShortInv(uint64_t nonceIn, const std::vector<uint256>& vHashes) :
+        nonce(nonceIn), nBatch(0), shortids(vHashes.size()) {
+    FillShortIDSelector();
+    for (size_t i = 0; i < vHashes.size(); i++)
+        shortids[i] = GetShortID(vHashes[i]);
+}
+
+void CShortInv::FillShortIDSelector() const {
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 shortidhash;
+    hasher.Finalize(shortidhash.begin());
+    shortidk0 = shortidhash.GetUint64(0);
+    shortidk1 = shortidhash.GetUint64(1);
+}
+
+uint64_t CShortInv::GetShortID(const uint256& txhash) const {
+    static_assert(SHORTIDS_LENGTH == 6, "shortids calculation assumes 6-byte shortids");
+    return SipHashUint256(shortidk0, shortidk1, txhash) & 0xffffffffffffL;
+}
+
+CShortInvIndex::CShortInvIndex(uint64_t nSalt) : keys(nSalt, std::vector<uint256>()) {}
+
+void CShortInvIndex::Add(const uint256& txhash) {
+    std::pair<std::unordered_map<uint64_t, uint256>::iterator, bool> ret = mapShortIDs.insert(std::make_pair(keys.GetShortID(txhash), txhash));
+    if (!ret.second && ret.first->second != txhash)
+        ret.first->second.SetNull();
+}
+
+const uint256* CShortInvIndex::Find(uint64_t shortid) const {
+    std::unordered_map<uint64_t, uint256>::const_iterator it = mapShortIDs.find(shortid);
+    if (it == mapShortIDs.end() || it->second.IsNull())
+        return NULL;
+    return &it->second;
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SHORTINV_H
+#define BITCOIN_SHORTINV_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A "shortinv" message: one trickle interval worth of transaction
+ * announcements to a peer, each as a 6-byte short ID instead of a 36-byte inv
+ * entry. The short IDs are keyed by the salt the receiver sent us in a
+ * "shortinvsalt" message, so it can resolve them from a standing index.
+ */
+class CShortInv {
+private:
+    mutable uint64_t shortidk0, shortidk1;
+
+    void FillShortIDSelector() const;
+
+public:
+    static const int SHORTIDS_LENGTH = 6;
+
+    uint64_t nonce; //!< the receiver's salt
+    uint32_t nBatch; //!< sequence number the receiver asks for full hashes by
+    std::vector<uint64_t> shortids;
+
+    // Dummy for deserialization
+    CShortInv() : nonce(0), nBatch(0) {}
+
+    CShortInv(uint64_t nonceIn, const std::vector<uint256>& vHashes);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nonce);
+        READWRITE(nBatch);
+
+        uint64_t shortids_size = (uint64_t)shortids.size();
+        READWRITE(COMPACTSIZE(shortids_size));
+        if (ser_action.ForRead()) {
+            size_t i = 0;
+            while (shortids.size() < shortids_size) {
+                shortids.resize(std::min((uint64_t)(1000 + shortids.size()), shortids_size));
+                for (; i < shortids.size(); i++) {
+                    uint32_t lsb = 0; uint16_t msb = 0;
+                    READWRITE(lsb);
+                    READWRITE(msb);
+                    shortids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+                    static_assert(SHORTIDS_LENGTH == 6, "shortids serialization assumes 6-byte shortids");
+                }
+            }
+        } else {
+            for (size_t i = 0; i < shortids.size(); i++) {
+                uint32_t lsb = shortids[i] & 0xffffffff;
+                uint16_t msb = (shortids[i] >> 32) & 0xffff;
+                READWRITE(lsb);
+                READWRITE(msb);
+            }
+        }
+
+        if (ser_action.ForRead())
+            FillShortIDSelector();
+    }
+};
+
+/** A "getshortinv" message: the positions in a shortinv batch the receiver could not match */
+class CShortInvRequest {
+public:
+    uint32_t nBatch;
+    std::vector<uint16_t> indexes;
+
+    CShortInvRequest() : nBatch(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nBatch);
+        uint64_t indexes_size = (uint64_t)indexes.size();
+        READWRITE(COMPACTSIZE(indexes_size));
+        if (ser_action.ForRead()) {
+            size_t i = 0;
+            while (indexes.size() < indexes_size) {
+                indexes.resize(std::min((uint64_t)(1000 + indexes.size()), indexes_size));
+                for (; i < indexes.size(); i++) {
+                    uint64_t index = 0;
+                    READWRITE(COMPACTSIZE(index));
+                    if (index > std::numeric_limits<uint16_t>::max())
+                        throw std::ios_base::failure("index overflowed 16 bits");
+                    indexes[i] = index;
+                }
+            }
+
+            uint16_t offset = 0;
+            for (size_t i = 0; i < indexes.size(); i++) {
+                if (uint64_t(indexes[i]) + uint64_t(offset) > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("indexes overflowed 16 bits");
+                indexes[i] = indexes[i] + offset;
+                offset = indexes[i] + 1;
+            }
+        } else {
+            for (size_t i = 0; i < indexes.size(); i++) {
+                uint64_t index = indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1));
+                READWRITE(COMPACTSIZE(index));
+            }
+        }
+    }
+};
+
+/**
+ * Short IDs of the transactions we hold, under the salt we hand out to a peer.
+ * A shortinv batch then resolves with one lookup per short ID, instead of
+ * hashing every transaction we hold for each batch. A short ID shared by two
+ * transactions resolves to neither.
+ */
+class CShortInvIndex {
+private:
+    CShortInv keys;
+    std::unordered_map<uint64_t, uint256> mapShortIDs; //!< null hash on a collision
+
+public:
+    explicit CShortInvIndex(uint64_t nSalt);
+
+    uint64_t GetSalt() const { return keys.nonce; }
+    void Add(const uint256& txhash);
+    /** The transaction with this short ID, or NULL if there is none or several */
+    const uint256* Find(uint64_t shortid) const;
+    size_t size() const { return mapShortIDs.size(); }
+};
+
+#endif // BITCOIN_SHORTINV_H
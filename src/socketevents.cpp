@@ -0,0 +1,101 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include <errno.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+/** Maximum number of events fetched by one Wait() */
+static const int MAX_SOCKET_EVENTS = 256;
+
+CSocketEvents::CSocketEvents() : hEvents(-1)
+{
+}
+
+CSocketEvents::~CSocketEvents()
+{
+    Close();
+}
+
+bool CSocketEvents::IsSupported()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CSocketEvents::Open()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEvents == -1)
+        hEvents = epoll_create1(EPOLL_CLOEXEC);
+#endif
+    return hEvents != -1;
+}
+
+void CSocketEvents::Close()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEvents != -1)
+        close(hEvents);
+#endif
+    hEvents = -1;
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void* ptr, bool fEdgeTriggered)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    if (fEdgeTriggered)
+        event.events |= EPOLLET;
+    event.data.ptr = ptr;
+    return epoll_ctl(hEvents, EPOLL_CTL_ADD, hSocket, &event) == 0;
+#else
+    return false;
+#endif
+}
+
+bool CSocketEvents::Remove(SOCKET hSocket)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    // Kernels before 2.6.9 require a non-null event even though it is ignored
+    struct epoll_event event;
+    return epoll_ctl(hEvents, EPOLL_CTL_DEL, hSocket, &event) == 0;
+#else
+    return false;
+#endif
+}
+
+int CSocketEvents::Wait(std::vector<Event>& vEvents, int nTimeout)
+{
+    vEvents.clear();
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(hEvents, events, MAX_SOCKET_EVENTS, nTimeout);
+    if (nEvents < 0)
+        return errno == EINTR ? 0 : -1;
+
+    vEvents.resize(nEvents);
+    for (int i = 0; i < nEvents; i++) {
+        vEvents[i].ptr = events[i].data.ptr;
+        vEvents[i].flags = 0;
+        if (events[i].events & EPOLLIN)
+            vEvents[i].flags |= SOCKET_EVENT_RECV;
+        if (events[i].events & EPOLLOUT)
+            vEvents[i].flags |= SOCKET_EVENT_SEND;
+        if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            vEvents[i].flags |= SOCKET_EVENT_ERR;
+    }
+    return nEvents;
+#else
+    return -1;
+#endif
+}
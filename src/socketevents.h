@@ -0,0 +1,64 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <vector>
+
+/** Readiness of a socket reported by CSocketEvents::Wait */
+enum SocketEventFlags {
+    SOCKET_EVENT_RECV = (1U << 0),
+    SOCKET_EVENT_SEND = (1U << 1),
+    SOCKET_EVENT_ERR  = (1U << 2),
+};
+
+/**
+ * Socket readiness notification through epoll, on platforms that have it.
+ *
+ * Sockets are registered once, with a pointer that Wait() hands back when
+ * they become ready. Unlike select(), the cost of a Wait() depends on the
+ * number of ready sockets rather than the number of registered ones, and
+ * descriptors are not limited to FD_SETSIZE.
+ *
+ * Edge-triggered registrations only report changes: the caller has to
+ * remember that a socket is readable (writable) until recv() (send())
+ * would block.
+ */
+class CSocketEvents
+{
+public:
+    struct Event
+    {
+        void* ptr;
+        unsigned int flags;
+    };
+
+    CSocketEvents();
+    ~CSocketEvents();
+
+    /** Whether this platform supports socket events */
+    static bool IsSupported();
+
+    bool Open();
+    void Close();
+    bool IsOpen() const { return hEvents != -1; }
+
+    /** Watch a socket for receive and send readiness */
+    bool Add(SOCKET hSocket, void* ptr, bool fEdgeTriggered);
+    /** Stop watching a socket. Closing the socket has the same effect. */
+    bool Remove(SOCKET hSocket);
+    /** Wait up to nTimeout milliseconds for events. Returns the number of events, or -1 on error. */
+    int Wait(std::vector<Event>& vEvents, int nTimeout);
+
+private:
+    int hEvents;
+
+    CSocketEvents(const CSocketEvents&);
+    CSocketEvents& operator=(const CSocketEvents&);
+};
+
+#endif // BITCOIN_SOCKETEVENTS_H
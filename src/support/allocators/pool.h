@@ -0,0 +1,259 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <algorithm>
+#include <assert.h>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <vector>
+
+/**
+ * Memory for the nodes of node based containers such as std::map and
+ * boost::multi_index_container. Blocks are cut from large chunks, and freed
+ * blocks go on a free list for their size, to be handed out again. A node so
+ * costs its size rounded up to ALIGN_BYTES, without the bookkeeping malloc
+ * adds to every allocation, and many small nodes do not fragment the heap.
+ *
+ * Requests larger than MAX_BLOCK_SIZE_BYTES or with a stricter alignment than
+ * ALIGN_BYTES, such as hash table bucket arrays, are passed on to operator new.
+ * Chunks in which every block is free are returned to the system once enough
+ * memory has been freed since the last time this was done, so the memory held
+ * follows the number of nodes in use, plus what is left free in chunks that
+ * are still partly used.
+ *
+ * Not thread safe; the containers sharing a resource need a common lock.
+ */
+template <std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+class PoolResource
+{
+    static_assert(ALIGN_BYTES > 0 && (ALIGN_BYTES & (ALIGN_BYTES - 1)) == 0, "ALIGN_BYTES must be a power of two");
+    static_assert(ALIGN_BYTES >= sizeof(void*), "ALIGN_BYTES must fit a free list pointer");
+    static_assert(ALIGN_BYTES <= alignof(std::max_align_t), "chunks are only aligned for std::max_align_t");
+    static_assert(MAX_BLOCK_SIZE_BYTES % ALIGN_BYTES == 0, "MAX_BLOCK_SIZE_BYTES must be a multiple of ALIGN_BYTES");
+
+private:
+    //! A free block, pointing to the next free block of the same size
+    struct ListNode
+    {
+        ListNode* next;
+    };
+
+    const size_t nChunkSizeBytes;
+    std::vector<char*> vChunks;
+    //! Free lists by block size, in units of ALIGN_BYTES
+    ListNode* freeLists[MAX_BLOCK_SIZE_BYTES / ALIGN_BYTES + 1];
+    //! Part of the newest chunk that was never handed out
+    char* pChunkFree;
+    char* pChunkEnd;
+    //! Bytes in blocks that are handed out
+    size_t nBlockBytesUsed;
+    //! Bytes requested from operator new
+    size_t nLargeBytesUsed;
+    //! Lowest number of free chunk bytes since chunks were last released
+    size_t nFreeBytesLow;
+
+    static size_t BlockUnits(size_t nBytes)
+    {
+        return nBytes == 0 ? 1 : (nBytes + ALIGN_BYTES - 1) / ALIGN_BYTES;
+    }
+
+    static bool FitsBlock(size_t nBytes, size_t nAlignment)
+    {
+        return nBytes <= MAX_BLOCK_SIZE_BYTES && nAlignment <= ALIGN_BYTES;
+    }
+
+    void PushFree(void* p, size_t nUnits)
+    {
+        ListNode* node = new (p) ListNode;
+        node->next = freeLists[nUnits];
+        freeLists[nUnits] = node;
+    }
+
+    void AllocateChunk()
+    {
+        // The rest of the current chunk is too small for the request, but can
+        // still serve smaller ones
+        size_t nRemaining = pChunkEnd - pChunkFree;
+        if (nRemaining > 0)
+            PushFree(pChunkFree, nRemaining / ALIGN_BYTES);
+        pChunkFree = static_cast<char*>(::operator new(nChunkSizeBytes));
+        pChunkEnd = pChunkFree + nChunkSizeBytes;
+        vChunks.push_back(pChunkFree);
+        // A new chunk is not memory that was freed
+        nFreeBytesLow += nChunkSizeBytes;
+    }
+
+    size_t FreeChunkBytes() const
+    {
+        return vChunks.size() * nChunkSizeBytes - nBlockBytesUsed;
+    }
+
+    //! Index of the chunk holding p, with vChunks sorted
+    size_t ChunkIndex(const void* p) const
+    {
+        std::vector<char*>::const_iterator it = std::upper_bound(vChunks.begin(), vChunks.end(), static_cast<char*>(const_cast<void*>(p)), std::less<char*>());
+        assert(it != vChunks.begin());
+        return it - vChunks.begin() - 1;
+    }
+
+public:
+    explicit PoolResource(size_t nChunkSizeBytesIn = 256 * 1024) :
+        nChunkSizeBytes(nChunkSizeBytesIn), pChunkFree(NULL), pChunkEnd(NULL), nBlockBytesUsed(0), nLargeBytesUsed(0), nFreeBytesLow(0)
+    {
+        assert(nChunkSizeBytes >= MAX_BLOCK_SIZE_BYTES && nChunkSizeBytes % ALIGN_BYTES == 0);
+        for (size_t i = 0; i <= MAX_BLOCK_SIZE_BYTES / ALIGN_BYTES; i++)
+            freeLists[i] = NULL;
+    }
+
+    ~PoolResource()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+    }
+
+    PoolResource(const PoolResource&) = delete;
+    PoolResource& operator=(const PoolResource&) = delete;
+
+    void* Allocate(size_t nBytes, size_t nAlignment)
+    {
+        if (!FitsBlock(nBytes, nAlignment)) {
+            void* p = ::operator new(nBytes);
+            nLargeBytesUsed += nBytes;
+            return p;
+        }
+        size_t nUnits = BlockUnits(nBytes);
+        void* p;
+        if (freeLists[nUnits] != NULL) {
+            p = freeLists[nUnits];
+            freeLists[nUnits] = freeLists[nUnits]->next;
+        } else {
+            if ((size_t)(pChunkEnd - pChunkFree) < nUnits * ALIGN_BYTES)
+                AllocateChunk();
+            p = pChunkFree;
+            pChunkFree += nUnits * ALIGN_BYTES;
+        }
+        nBlockBytesUsed += nUnits * ALIGN_BYTES;
+        nFreeBytesLow = std::min(nFreeBytesLow, FreeChunkBytes());
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes, size_t nAlignment)
+    {
+        if (!FitsBlock(nBytes, nAlignment)) {
+            ::operator delete(p);
+            nLargeBytesUsed -= nBytes;
+            return;
+        }
+        size_t nUnits = BlockUnits(nBytes);
+        PushFree(p, nUnits);
+        nBlockBytesUsed -= nUnits * ALIGN_BYTES;
+        // Look for empty chunks only after a chunk's worth, and half of what
+        // is still in use, has been freed, so that the cost of the search is
+        // spread over the deallocations that made it worthwhile
+        if (FreeChunkBytes() - nFreeBytesLow >= std::max(nChunkSizeBytes, nBlockBytesUsed / 2))
+            ReleaseFreeChunks();
+    }
+
+    /** Return the chunks in which no block is handed out to the system. */
+    void ReleaseFreeChunks()
+    {
+        std::sort(vChunks.begin(), vChunks.end(), std::less<char*>());
+        std::vector<size_t> vFreeBytes(vChunks.size(), 0);
+        if (pChunkFree != pChunkEnd)
+            vFreeBytes[ChunkIndex(pChunkFree)] += pChunkEnd - pChunkFree;
+        for (size_t i = 0; i <= MAX_BLOCK_SIZE_BYTES / ALIGN_BYTES; i++) {
+            for (ListNode* node = freeLists[i]; node != NULL; node = node->next)
+                vFreeBytes[ChunkIndex(node)] += i * ALIGN_BYTES;
+        }
+
+        bool fAnyEmpty = false;
+        for (size_t i = 0; i < vChunks.size(); i++)
+            fAnyEmpty |= vFreeBytes[i] == nChunkSizeBytes;
+        if (fAnyEmpty) {
+            // Unlink the blocks of empty chunks before the chunks go away
+            for (size_t i = 0; i <= MAX_BLOCK_SIZE_BYTES / ALIGN_BYTES; i++) {
+                ListNode** pnode = &freeLists[i];
+                while (*pnode != NULL) {
+                    if (vFreeBytes[ChunkIndex(*pnode)] == nChunkSizeBytes)
+                        *pnode = (*pnode)->next;
+                    else
+                        pnode = &(*pnode)->next;
+                }
+            }
+            if (pChunkFree != pChunkEnd && vFreeBytes[ChunkIndex(pChunkFree)] == nChunkSizeBytes)
+                pChunkFree = pChunkEnd = NULL;
+
+            size_t nKept = 0;
+            for (size_t i = 0; i < vChunks.size(); i++) {
+                if (vFreeBytes[i] == nChunkSizeBytes)
+                    ::operator delete(vChunks[i]);
+                else
+                    vChunks[nKept++] = vChunks[i];
+            }
+            vChunks.resize(nKept);
+        }
+        nFreeBytesLow = FreeChunkBytes();
+    }
+
+    //! Memory handed out, rounded up to whole blocks
+    size_t UsedBytes() const { return nBlockBytesUsed + nLargeBytesUsed; }
+    //! Memory held, including free space in chunks not yet released
+    size_t ReservedBytes() const { return vChunks.size() * nChunkSizeBytes + nLargeBytesUsed; }
+    size_t NumChunks() const { return vChunks.size(); }
+    size_t ChunkSizeBytes() const { return nChunkSizeBytes; }
+};
+
+/** Allocator drawing from a PoolResource, which must outlive every container using it */
+template <typename T, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    explicit PoolAllocator(ResourceType* resourceIn) : resource(resourceIn) {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) : resource(other.Resource()) {}
+
+    T* allocate(size_t n)
+    {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+            throw std::bad_alloc();
+        return static_cast<T*>(resource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        resource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    ResourceType* Resource() const { return resource; }
+
+private:
+    ResourceType* resource;
+};
+
+template <typename T, typename U, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator==(const PoolAllocator<T, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return a.Resource() == b.Resource();
+}
+
+template <typename T, typename U, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator!=(const PoolAllocator<T, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -8,6 +8,7 @@
 
 #include "hash.h"
 #include "random.h"
+#include "streams.h"
 
 using namespace std;
 
@@ -518,4 +519,73 @@ BOOST_AUTO_TEST_CASE(caddrinfo_get_new_bucket)
     //  than 64 buckets.
     BOOST_CHECK(buckets.size() > 64);
 }
+
+BOOST_AUTO_TEST_CASE(addrman_performance)
+{
+    CAddrManTest addrman;
+    addrman.MakeDeterministic();
+
+    int64_t nNow = GetAdjustedTime();
+    CNetAddr source = CNetAddr("252.2.2.2");
+    CService addr1 = CService("250.1.1.1", 8333);
+    CService addr2 = CService("250.2.1.1", 8333);
+    CService addr3 = CService("250.3.1.1", 8333);
+    addrman.Add(CAddress(addr1, NODE_NONE), source);
+    addrman.Add(CAddress(addr2, NODE_NONE), source);
+    addrman.Add(CAddress(addr3, NODE_NONE), source);
+    addrman.Good(addr2);
+
+    // A fast peer and one that stalled and fell behind.
+    CAddrPerf fast;
+    fast.nPingUsec = 50 * 1000;
+    fast.nBlockBytesPerSec = 2 * 1000 * 1000;
+    fast.nTipLag = 0;
+    addrman.UpdatePerformance(addr1, fast, nNow);
+    CAddrPerf slow;
+    slow.nPingUsec = 2 * 1000 * 1000;
+    slow.nStalls = 2;
+    slow.nTipLag = 100;
+    addrman.UpdatePerformance(addr2, slow, nNow);
+    // A sample for another port of the same IP is not merged.
+    addrman.UpdatePerformance(CService("250.3.1.1", 8334), slow, nNow);
+
+    CAddrInfo* info1 = addrman.Find(addr1);
+    CAddrInfo* info2 = addrman.Find(addr2);
+    CAddrInfo* info3 = addrman.Find(addr3);
+    BOOST_CHECK(info3->GetPerf().IsNull());
+    BOOST_CHECK(info1->GetPerf().GetChanceFactor(nNow) > 1.0);
+    BOOST_CHECK(info2->GetPerf().GetChanceFactor(nNow) < 1.0);
+    BOOST_CHECK_EQUAL(info3->GetPerf().GetChanceFactor(nNow), 1.0);
+    // Measurements older than the horizon no longer count.
+    BOOST_CHECK_EQUAL(info2->GetPerf().GetChanceFactor(nNow + (ADDRMAN_PERF_HORIZON_DAYS + 1) * 24 * 60 * 60), 1.0);
+
+    // Samples are smoothed, and a clean session forgives a stall.
+    CAddrPerf clean;
+    clean.nPingUsec = 1000 * 1000;
+    clean.nBlockBytesPerSec = 100 * 1000;
+    addrman.UpdatePerformance(addr2, clean, nNow);
+    info2 = addrman.Find(addr2);
+    BOOST_CHECK_EQUAL(info2->GetPerf().nPingUsec, (2 * 1000 * 1000 * 3 + 1000 * 1000) / 4);
+    BOOST_CHECK_EQUAL(info2->GetPerf().nBlockBytesPerSec, 100 * 1000);
+    BOOST_CHECK_EQUAL(info2->GetPerf().nStalls, 1);
+    BOOST_CHECK_EQUAL(info2->GetPerf().nTipLag, 100);
+
+    // The measurements survive a round trip through peers.dat, for new and tried entries.
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+    CAddrManTest addrman2;
+    ssPeers >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), 3);
+    CAddrInfo* info1b = addrman2.Find(addr1);
+    CAddrInfo* info2b = addrman2.Find(addr2);
+    CAddrInfo* info3b = addrman2.Find(addr3);
+    BOOST_CHECK_EQUAL(info1b->GetPerf().nPingUsec, fast.nPingUsec);
+    BOOST_CHECK_EQUAL(info1b->GetPerf().nBlockBytesPerSec, fast.nBlockBytesPerSec);
+    BOOST_CHECK_EQUAL(info1b->GetPerf().nLastUpdate, nNow);
+    BOOST_CHECK_EQUAL(info2b->GetPerf().nPingUsec, info2->GetPerf().nPingUsec);
+    BOOST_CHECK_EQUAL(info2b->GetPerf().nStalls, 1);
+    BOOST_CHECK_EQUAL(info2b->GetPerf().nTipLag, 100);
+    BOOST_CHECK(info3b->GetPerf().IsNull());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
@@ -5,7 +5,9 @@
 #include "blockencodings.h"
 #include "consensus/merkle.h"
 #include "chainparams.h"
+#include "key.h"
 #include "random.h"
+#include "script/script.h"
 
 #include "test/test_bitcoin.h"
 
@@ -64,7 +66,7 @@ BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
 
     // Do a simple ShortTxIDs RT
     {
-        CBlockHeaderAndShortTxIDs shortIDs(block);
+        CBlockHeaderAndShortTxIDs shortIDs(block, true);
 
         CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
         stream << shortIDs;
@@ -116,7 +118,7 @@ public:
         stream >> *this;
     }
     TestHeaderAndShortIDs(const CBlock& block) :
-        TestHeaderAndShortIDs(CBlockHeaderAndShortTxIDs(block)) {}
+        TestHeaderAndShortIDs(CBlockHeaderAndShortTxIDs(block, true)) {}
 
     uint64_t GetShortID(const uint256& txhash) const {
         CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
@@ -267,7 +269,7 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
 
     // Test simple header round-trip with only coinbase
     {
-        CBlockHeaderAndShortTxIDs shortIDs(block);
+        CBlockHeaderAndShortTxIDs shortIDs(block, true);
 
         CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
         stream << shortIDs;
@@ -289,6 +291,117 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     }
 }
 
+static CBlock BuildProofOfStakeBlockTestCase(const CKey& key) {
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].SetEmpty();
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.nTime = 1470000000;
+
+    CMutableTransaction txCoinStake;
+    txCoinStake.nTime = block.nTime;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout.hash = GetRandHash();
+    txCoinStake.vin[0].prevout.n = 0;
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1].nValue = 42;
+    txCoinStake.vout[1].scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    block.vtx[1] = txCoinStake;
+
+    tx.vin.resize(10);
+    tx.vout[0].nValue = 42;
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    bool mutated;
+    block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
+    assert(!mutated);
+    assert(block.IsProofOfStake());
+    bool fSigned = key.Sign(block.GetHash(), block.vchBlockSig);
+    assert(fSigned);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(ProofOfStakeRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CKey key;
+    key.MakeNewKey(true);
+    CBlock block(BuildProofOfStakeBlockTestCase(key));
+
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(block.vtx[2]));
+
+    // The coinstake is prefilled next to the coinbase and the block signature travels in the header
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block, true);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+        BOOST_CHECK(shortIDs2.header.IsProofOfStake());
+        BOOST_CHECK(shortIDs2.header.PrevoutStake() == block.PrevoutStake());
+        BOOST_CHECK(shortIDs2.header.vchBlockSig == block.vchBlockSig);
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(partialBlock.IsTxAvailable(1));
+        BOOST_CHECK(partialBlock.IsTxAvailable(2));
+
+        CBlock block2;
+        std::vector<CTransaction> vtx_missing;
+        BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+        BOOST_CHECK(block2.IsProofOfStake());
+        BOOST_CHECK(block2.vchBlockSig == block.vchBlockSig);
+    }
+
+    // A header that does not match its coinstake is rejected before any transactions are requested
+    {
+        TestHeaderAndShortIDs shortIDs(block);
+        shortIDs.header.prevoutStake.n = 1;
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_INVALID);
+    }
+
+    // As is one whose signature was not made by the staker
+    {
+        TestHeaderAndShortIDs shortIDs(block);
+        BOOST_CHECK(key.Sign(GetRandHash(), shortIDs.header.vchBlockSig));
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_INVALID);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
     BlockTransactionsRequest req1;
     req1.blockhash = GetRandHash();
@@ -0,0 +1,125 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "blockindexsnapshot.h"
+#include "chain.h"
+#include "clientversion.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockindexsnapshot_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockindexsnapshot_roundtrip)
+{
+    // A chain of 200 blocks with a one block fork at height 100
+    const int nLength = 200;
+    std::vector<uint256> vHash(nLength + 1);
+    std::vector<CBlockIndex> vBlock(nLength + 1);
+    std::vector<const CBlockIndex*> vIndex;
+    for (int i = 0; i <= nLength; i++) {
+        CBlockIndex& block = vBlock[i];
+        vHash[i] = GetRandHash();
+        block.phashBlock = &vHash[i];
+        block.pprev = i == 0 ? NULL : (i == nLength ? &vBlock[99] : &vBlock[i - 1]);
+        block.nHeight = block.pprev ? block.pprev->nHeight + 1 : 0;
+        block.BuildSkip();
+        block.nChainWork = (block.pprev ? block.pprev->nChainWork : 0) + i + 1;
+        block.nFile = i / 50;
+        block.nDataPos = i * 1000;
+        block.nUndoPos = i * 100;
+        block.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+        block.nTx = i + 1;
+        block.nVersion = 7;
+        block.nTime = 1000000 + i;
+        block.nBits = 0x1d00ffff;
+        block.pcold->nNonce = i * 3;
+        block.pcold->hashMerkleRoot = GetRandHash();
+        block.pcold->hashProof = GetRandHash();
+        if (i % 2) {
+            block.SetProofOfStake();
+            block.pcold->prevoutStake = COutPoint(GetRandHash(), i);
+            block.pcold->nStakeTime = block.nTime;
+            block.pcold->vchBlockSig.assign(i % 72, (unsigned char)i);
+            // Memory only, neither the snapshot nor the database keep it
+            block.SetStakeCheckedOnHeader();
+        }
+        block.nStakeModifier = i * 7;
+        block.pcold->bnStakeModifierV2 = GetRandHash();
+    }
+    // Sorted by height, as the node writes them
+    for (int nHeight = 0; nHeight < nLength; nHeight++) {
+        vIndex.push_back(&vBlock[nHeight]);
+        if (nHeight == 100)
+            vIndex.push_back(&vBlock[nLength]);
+    }
+
+    boost::filesystem::path path = pathTemp / "indexsnapshot.dat";
+    uint256 hashBest = vHash[nLength - 1];
+    BOOST_CHECK(CBlockIndexSnapshot::Write(path, vIndex, 42, hashBest));
+    BOOST_CHECK(!boost::filesystem::exists(path.string() + ".new"));
+
+    CBlockIndexSnapshot snapshot;
+    BOOST_CHECK(snapshot.Open(path));
+    BOOST_CHECK_EQUAL(snapshot.GetNonce(), 42U);
+    BOOST_CHECK(snapshot.GetBestBlock() == hashBest);
+    BOOST_CHECK_EQUAL(snapshot.size(), vIndex.size());
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        const CBlockIndex* pindex = vIndex[i];
+        const BlockIndexSnapshotRecord& rec = snapshot[i];
+        BOOST_CHECK(memcmp(rec.hashBlock, pindex->GetBlockHash().begin(), 32) == 0);
+        BOOST_CHECK(memcmp(rec.hashMerkleRoot, pindex->pcold->hashMerkleRoot.begin(), 32) == 0);
+        BOOST_CHECK(memcmp(rec.nChainWork, ArithToUint256(pindex->nChainWork).begin(), 32) == 0);
+        BOOST_CHECK(rec.nPrev == -1 ? pindex->pprev == NULL : vIndex[rec.nPrev] == pindex->pprev);
+        BOOST_CHECK(rec.nSkip == -1 ? pindex->pskip == NULL : vIndex[rec.nSkip] == pindex->pskip);
+        BOOST_CHECK(rec.nPrev < (int64_t)i && rec.nSkip < (int64_t)i);
+        BOOST_CHECK_EQUAL(rec.nHeight, pindex->nHeight);
+        BOOST_CHECK_EQUAL(rec.nFile, pindex->nFile);
+        BOOST_CHECK_EQUAL(rec.nDataPos, pindex->nDataPos);
+        BOOST_CHECK_EQUAL(rec.nStatus, pindex->nStatus);
+        BOOST_CHECK_EQUAL(rec.nTx, pindex->nTx);
+        BOOST_CHECK_EQUAL(rec.nTime, pindex->nTime);
+        BOOST_CHECK_EQUAL(rec.nFlags, pindex->nFlags & ~CBlockIndex::BLOCK_STAKE_CHECKED);
+        BOOST_CHECK_EQUAL(rec.nStakeModifier, pindex->nStakeModifier);
+        BOOST_CHECK_EQUAL(rec.nPrevoutStakeN, pindex->pcold->prevoutStake.n);
+        BOOST_CHECK_EQUAL(rec.nStakeTime, pindex->pcold->nStakeTime);
+        BOOST_CHECK(memcmp(rec.hashPrevoutStake, pindex->pcold->prevoutStake.hash.begin(), 32) == 0);
+        BOOST_CHECK(memcmp(rec.bnStakeModifierV2, pindex->pcold->bnStakeModifierV2.begin(), 32) == 0);
+        std::vector<unsigned char> vchSig;
+        BOOST_CHECK(snapshot.GetBlockSig(rec, vchSig));
+        BOOST_CHECK(vchSig == pindex->pcold->vchBlockSig);
+
+        // Loading the record gives back the entry as the database stores it
+        CBlockIndex loaded;
+        loaded.pprev = pindex->pprev;
+        BOOST_CHECK(snapshot.GetBlockIndex(rec, loaded));
+        CDataStream ssExpected(SER_DISK, CLIENT_VERSION);
+        CDataStream ssLoaded(SER_DISK, CLIENT_VERSION);
+        ssExpected << CDiskBlockIndex(pindex);
+        ssLoaded << CDiskBlockIndex(&loaded);
+        BOOST_CHECK(ssLoaded.str() == ssExpected.str());
+        BOOST_CHECK(loaded.pcold->hashProof == pindex->pcold->hashProof);
+        BOOST_CHECK(loaded.pcold->vchBlockSig == pindex->pcold->vchBlockSig);
+        BOOST_CHECK(loaded.nChainWork == pindex->nChainWork);
+        BOOST_CHECK(!loaded.StakeCheckedOnHeader());
+    }
+    snapshot.Close();
+
+    // A truncated file is rejected
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 1);
+    BOOST_CHECK(!snapshot.Open(path));
+
+    // Entries must come after their parents
+    std::vector<const CBlockIndex*> vUnsorted(vIndex.rbegin(), vIndex.rend());
+    BOOST_CHECK(!CBlockIndexSnapshot::Write(path, vUnsorted, 42, hashBest));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,126 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+static std::atomic<int> nChecksRun(0);
+
+/** Counts its executions; fails if fFail is set */
+struct CCountingCheck
+{
+    bool fFail;
+
+    CCountingCheck(bool fFailIn = false) : fFail(fFailIn) {}
+
+    bool operator()()
+    {
+        nChecksRun++;
+        return !fFail;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(fFail, check.fFail);
+    }
+};
+
+typedef CCheckQueue<CCountingCheck> CCountingQueue;
+
+static void StartWorkers(CCountingQueue& queue, boost::thread_group& threadGroup, int nThreads)
+{
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CCountingQueue::Thread, &queue));
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_run)
+{
+    CCountingQueue queue(16);
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 3);
+
+    seed_insecure_rand(true);
+    for (int nRound = 0; nRound < 20; nRound++) {
+        nChecksRun = 0;
+        int nAdded = 0;
+        {
+            CCheckQueueControl<CCountingCheck> control(&queue);
+            // Batches of all sizes, as transactions have any number of inputs
+            for (int i = 0; i < 50; i++) {
+                std::vector<CCountingCheck> vChecks(insecure_rand() % 100);
+                nAdded += vChecks.size();
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK_EQUAL(nChecksRun.load(), nAdded);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCountingQueue queue(16);
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 3);
+
+    for (int nFail = 0; nFail < 1000; nFail += 97) {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        for (int i = 0; i < 1000; i += 10) {
+            std::vector<CCountingCheck> vChecks(10);
+            if (nFail >= i && nFail < i + 10)
+                vChecks[nFail - i].fFail = true;
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(!control.Wait());
+    }
+
+    // The failure does not carry over to the next use
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_more_threads_than_queues)
+{
+    // Workers beyond the number of queues share them
+    CCountingQueue queue(4, 2);
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 5);
+
+    nChecksRun = 0;
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        for (int i = 0; i < 100; i++) {
+            std::vector<CCountingCheck> vChecks(i);
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+    }
+    BOOST_CHECK_EQUAL(nChecksRun.load(), 99 * 100 / 2);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,8 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
+#include "checkqueue.h"
 #include "coins.h"
 #include "random.h"
 #include "script/standard.h"
@@ -10,11 +12,15 @@
 #include "test/test_bitcoin.h"
 #include "main.h"
 #include "consensus/validation.h"
+#include "txdb.h"
 
+#include <algorithm>
 #include <vector>
 #include <map>
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 namespace
 {
@@ -46,7 +52,7 @@ public:
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsStats* pstatsDelta)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
@@ -73,7 +79,7 @@ public:
     void SelfTest() const
     {
         // Manually recompute the dynamic usage of the whole data, and compare it.
-        size_t ret = memusage::DynamicUsage(cacheCoins);
+        size_t ret = memusage::DynamicUsage(cacheCoins) + memusage::DynamicUsage(vDirty);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
             ret += it->second.coins.DynamicMemoryUsage();
         }
@@ -415,4 +421,542 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+// CCoinsViewDB with access to the raw records
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    //! Number of GetCoins calls, including those of BatchWrite
+    mutable int nGetCoins;
+
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true), nGetCoins(0) {}
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const
+    {
+        nGetCoins++;
+        return CCoinsViewDB::GetCoins(txid, coins);
+    }
+
+    //! Check the maintained statistics against those from scanning all outputs
+    void CheckStats()
+    {
+        CCoinsStats statsKept;
+        BOOST_CHECK(GetStats(statsKept));
+        fStatsValid = false;
+        BOOST_CHECK(ComputeStats());
+        BOOST_CHECK_EQUAL(statsKept.nTransactions, stats.nTransactions);
+        BOOST_CHECK_EQUAL(statsKept.nTransactionOutputs, stats.nTransactionOutputs);
+        BOOST_CHECK_EQUAL(statsKept.nSerializedSize, stats.nSerializedSize);
+        BOOST_CHECK_EQUAL(statsKept.nTotalAmount, stats.nTotalAmount);
+        uint256 hashKept, hashScanned;
+        statsKept.muhash.Finalize(hashKept);
+        stats.muhash.Finalize(hashScanned);
+        BOOST_CHECK(hashKept == hashScanned);
+    }
+
+    int CountRecords(char chKey)
+    {
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        int nRecords = 0;
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            std::pair<char, uint256> key;
+            if (pcursor->GetKey(key) && key.first == chKey)
+                nRecords++;
+        }
+        return nRecords;
+    }
+};
+
+// Replace the coins of txid in view, accounting for the change in the
+// statistics as ConnectBlock and DisconnectBlock do
+static void WriteCoins(CCoinsViewCache& view, const uint256& txid, const CCoins& coins)
+{
+    CCoinsStats delta;
+    {
+        CCoinsModifier modifier = view.ModifyCoins(txid);
+        delta.UpdateCoins(txid, *modifier, coins);
+        *modifier = coins;
+    }
+    view.AddStatsDelta(delta);
+}
+
+static bool SpendOutput(CCoinsViewCache& view, const uint256& txid, unsigned int n)
+{
+    CCoins coins(*view.AccessCoins(txid));
+    bool fSpent = coins.Spend(n);
+    WriteCoins(view, txid, coins);
+    return fSpent;
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_stats)
+{
+    CCoinsViewDBTest db;
+
+    // A coinstake with its second and last output unspent
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(5);
+    tx.vout[0].SetEmpty();
+    for (unsigned int i = 1; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = i * COIN;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    CCoins coins(tx, 1000);
+    BOOST_CHECK(coins.IsCoinStake());
+    coins.Spend(0);
+    coins.Spend(2);
+    coins.Spend(3);
+    uint256 txid = tx.GetHash();
+    CCoinsViewCache cache(&db);
+    WriteCoins(cache, txid, coins);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(db.CountRecords('c'), 1);
+    CCoins coinsRead;
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK_EQUAL(stats.nTransactions, 1U);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, 2U);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, 5 * COIN);
+    db.CheckStats();
+
+    // Outputs coming back and others being spent in one change
+    {
+        CCoins coinsNew(*cache.AccessCoins(txid));
+        coinsNew.vout = tx.vout;
+        coinsNew.Spend(0);
+        coinsNew.Spend(3);
+        WriteCoins(cache, txid, coinsNew);
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead.IsCoinStake());
+    BOOST_CHECK_EQUAL(coinsRead.nHeight, 1000);
+    BOOST_CHECK(!coinsRead.IsAvailable(0) && coinsRead.IsAvailable(1) && coinsRead.IsAvailable(2) && !coinsRead.IsAvailable(3) && coinsRead.IsAvailable(4));
+    db.CheckStats();
+
+    CMutableTransaction tx2;
+    tx2.vout.resize(1);
+    tx2.vout[0].nValue = COIN;
+    WriteCoins(cache, tx2.GetHash(), CCoins(tx2, 1001));
+    BOOST_CHECK(cache.Flush());
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    int nTransactions = 0;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        uint256 key;
+        BOOST_CHECK(pcursor->GetKey(key) && pcursor->GetValue(coinsRead));
+        BOOST_CHECK(key == txid || key == tx2.GetHash());
+        BOOST_CHECK(db.GetCoins(key, coins) && coins == coinsRead);
+        nTransactions++;
+    }
+    BOOST_CHECK_EQUAL(nTransactions, 2);
+    db.CheckStats();
+
+    // Spending every output erases the record of the transaction
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        SpendOutput(cache, txid, i);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(db.HaveCoins(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(db.CountRecords('c'), 1);
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK_EQUAL(stats.nTransactions, 1U);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, COIN);
+    db.CheckStats();
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch)
+{
+    CCoinsViewDBTest db;
+    std::vector<uint256> vTxid;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 100; i++) {
+            CMutableTransaction tx;
+            tx.vout.resize(1 + i % 3);
+            for (unsigned int j = 0; j < tx.vout.size(); j++)
+                tx.vout[j].nValue = i;
+            tx.nTime = i;
+            *cache.ModifyNewCoins(tx.GetHash(), false) = CCoins(tx, i);
+            vTxid.push_back(tx.GetHash());
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewCache cache(&db);
+    CCoins coins;
+    BOOST_CHECK(cache.GetCoins(vTxid[0], coins));
+    // Duplicates and unknown txids are allowed
+    std::vector<uint256> vPrefetch(vTxid);
+    vPrefetch.push_back(vTxid[1]);
+    vPrefetch.push_back(GetRandHash());
+    CCheckQueue<CCoinsPrefetch> queue(8);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCoinsPrefetch>::Thread, &queue));
+    cache.Prefetch(vPrefetch, &queue);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), vTxid.size());
+    BOOST_CHECK(!cache.HaveCoinsInCache(vPrefetch.back()));
+    for (int i = 0; i < 100; i++) {
+        BOOST_CHECK(cache.HaveCoinsInCache(vTxid[i]));
+        const CCoins* pcoins = cache.AccessCoins(vTxid[i]);
+        BOOST_CHECK(pcoins && pcoins->nHeight == i && pcoins->vout.size() == (size_t)(1 + i % 3) && pcoins->vout[0].nValue == i);
+    }
+    size_t nUsage = cache.DynamicMemoryUsage();
+    cache.Prefetch(vTxid, &queue);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), nUsage);
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    // Without a queue the lookups are done by the calling thread
+    CCoinsViewCache cacheSerial(&db);
+    cacheSerial.Prefetch(vTxid, NULL);
+    BOOST_CHECK_EQUAL(cacheSerial.GetCacheSize(), vTxid.size());
+    BOOST_CHECK(cacheSerial.AccessCoins(vTxid[99])->nHeight == 99);
+
+    // Batched lookups of sorted txids, some unknown, find what single lookups find
+    std::vector<uint256> vSorted(vTxid);
+    for (int i = 0; i < 20; i++)
+        vSorted.push_back(GetRandHash());
+    std::sort(vSorted.begin(), vSorted.end());
+    std::vector<CCoins> vCoins(vSorted.size());
+    std::vector<char> vFound(vSorted.size());
+    db.GetCoinsBatch(&vSorted[0], vSorted.size(), &vCoins[0], &vFound[0]);
+    for (size_t i = 0; i < vSorted.size(); i++) {
+        CCoins coinsSingle;
+        BOOST_CHECK_EQUAL((bool)vFound[i], db.GetCoins(vSorted[i], coinsSingle));
+        BOOST_CHECK(vCoins[i] == coinsSingle);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_sync_resident)
+{
+    CCoinsViewDBTest db;
+    CCoinsViewCache cache(&db);
+    CMutableTransaction tx;
+    tx.vout.resize(3);
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        tx.vout[i].nValue = (i + 1) * COIN;
+    uint256 txid = tx.GetHash();
+    WriteCoins(cache, txid, CCoins(tx, 1));
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Sync());
+
+    // The written entry stays cached, unmodified, and is read from the cache
+    BOOST_CHECK(cache.HaveCoinsInCache(txid));
+    int nGetCoins = db.nGetCoins;
+    BOOST_CHECK(cache.AccessCoins(txid)->IsAvailable(0));
+    BOOST_CHECK_EQUAL(db.nGetCoins, nGetCoins);
+    BOOST_CHECK(cache.Sync());
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins) && coins.IsAvailable(0));
+
+    // Later changes to the resident entry are still written, by Sync and Flush
+    BOOST_CHECK(SpendOutput(cache, txid, 0));
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(cache.HaveCoinsInCache(txid));
+    BOOST_CHECK(db.GetCoins(txid, coins) && !coins.IsAvailable(0) && coins.IsAvailable(1));
+    BOOST_CHECK(SpendOutput(cache, txid, 1));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0);
+    BOOST_CHECK(db.GetCoins(txid, coins) && !coins.IsAvailable(1) && coins.IsAvailable(2));
+    BOOST_CHECK(db.GetBestBlock() == cache.GetBestBlock());
+    db.CheckStats();
+}
+
+BOOST_AUTO_TEST_CASE(coins_sync_background)
+{
+    CCoinsViewDBTest db;
+    CCoinsViewBackgroundWriter writer(&db, true);
+    CCoinsViewCache cache(&writer);
+
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vout.resize(2);
+        tx.vout[0].nValue = tx.vout[1].nValue = i + 1;
+        tx.nTime = i;
+        WriteCoins(cache, tx.GetHash(), CCoins(tx, i));
+        vTxid.push_back(tx.GetHash());
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+    // Lookups are served from the entries in flight
+    BOOST_CHECK(writer.HaveCoins(vTxid[0]));
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK(!writer.IsWriting());
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+
+    // Only the modified entries are written; they stay cached unless spent
+    BOOST_CHECK(cache.AccessCoins(vTxid[0]));
+    SpendOutput(cache, vTxid[1], 0);
+    BOOST_CHECK(SpendOutput(cache, vTxid[2], 0));
+    BOOST_CHECK(SpendOutput(cache, vTxid[2], 1));
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2);
+    BOOST_CHECK(cache.HaveCoinsInCache(vTxid[0]));
+    BOOST_CHECK(cache.HaveCoinsInCache(vTxid[1]));
+    BOOST_CHECK(!cache.HaveCoinsInCache(vTxid[2]));
+    BOOST_CHECK(!cache.AccessCoins(vTxid[1])->IsAvailable(0));
+    CCoins coins;
+    BOOST_CHECK(writer.GetCoins(vTxid[1], coins) && !coins.IsAvailable(0) && coins.IsAvailable(1));
+    BOOST_CHECK(!writer.HaveCoins(vTxid[2]));
+    // Batched lookups take the entries in flight and pass the others on
+    std::vector<uint256> vSorted(vTxid);
+    vSorted.push_back(GetRandHash());
+    std::sort(vSorted.begin(), vSorted.end());
+    std::vector<CCoins> vCoins(vSorted.size());
+    std::vector<char> vFound(vSorted.size());
+    writer.GetCoinsBatch(&vSorted[0], vSorted.size(), &vCoins[0], &vFound[0]);
+    for (size_t i = 0; i < vSorted.size(); i++) {
+        CCoins coinsSingle;
+        BOOST_CHECK_EQUAL((bool)vFound[i], writer.GetCoins(vSorted[i], coinsSingle));
+        BOOST_CHECK(vCoins[i] == coinsSingle);
+    }
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK(db.GetBestBlock() == cache.GetBestBlock());
+    BOOST_CHECK(db.GetCoins(vTxid[1], coins) && !coins.IsAvailable(0) && coins.IsAvailable(1));
+    BOOST_CHECK(!db.HaveCoins(vTxid[2]));
+    db.CheckStats();
+
+    // Nothing to write, and the entries written before are now unmodified
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2);
+    cache.Uncache(vTxid[1]);
+    BOOST_CHECK(!cache.HaveCoinsInCache(vTxid[1]));
+}
+
+BOOST_AUTO_TEST_CASE(coins_stats_delta)
+{
+    CCoinsViewDBTest db;
+    CMutableTransaction tx;
+    tx.vout.resize(4);
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = (i + 1) * COIN;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    uint256 txid = tx.GetHash();
+    {
+        CCoinsViewCache cache(&db);
+        WriteCoins(cache, txid, CCoins(tx, 100));
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoinsStats statsBefore;
+    BOOST_CHECK(db.GetStats(statsBefore));
+
+    // Blocks change the coins in a child view, as ConnectBlock does, and
+    // their deltas travel with the coins, so the database keeps its
+    // statistics without reading the stored coins back
+    CCoinsViewCache tip(&db);
+    BOOST_CHECK(tip.HaveCoins(txid));
+    {
+        CCoinsViewCache view(&tip);
+        SpendOutput(view, txid, 1);
+        BOOST_CHECK(view.Flush());
+    }
+    {
+        // The spent output comes back, as when the block is disconnected
+        CCoinsViewCache view(&tip);
+        CCoins coins(*view.AccessCoins(txid));
+        coins.vout[1] = tx.vout[1];
+        coins.Spend(0);
+        WriteCoins(view, txid, coins);
+        BOOST_CHECK(view.Flush());
+    }
+    CCoinsStats statsTip;
+    BOOST_CHECK(tip.GetStats(statsTip));
+    BOOST_CHECK_EQUAL(statsTip.nTransactionOutputs, statsBefore.nTransactionOutputs - 1);
+    BOOST_CHECK_EQUAL(statsTip.nTotalAmount, statsBefore.nTotalAmount - COIN);
+    int nGetCoins = db.nGetCoins;
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK_EQUAL(db.nGetCoins, nGetCoins);
+    CCoins coinsRead;
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(!coinsRead.IsAvailable(0) && coinsRead.IsAvailable(1) && coinsRead.IsAvailable(2) && coinsRead.IsAvailable(3));
+    db.CheckStats();
+
+    // Spending every output and restoring the transaction with its metadata
+    // leaves the statistics as they were
+    BOOST_CHECK(db.GetStats(statsBefore));
+    CCoins coinsSaved(coinsRead);
+    {
+        CCoinsViewCache view(&tip);
+        WriteCoins(view, txid, CCoins());
+        BOOST_CHECK(view.Flush());
+    }
+    BOOST_CHECK(!tip.HaveCoins(txid));
+    {
+        CCoinsViewCache view(&tip);
+        WriteCoins(view, txid, coinsSaved);
+        BOOST_CHECK(view.Flush());
+    }
+    BOOST_CHECK(tip.Flush());
+    CCoinsStats statsAfter;
+    BOOST_CHECK(db.GetStats(statsAfter));
+    BOOST_CHECK_EQUAL(statsAfter.nTransactions, statsBefore.nTransactions);
+    BOOST_CHECK_EQUAL(statsAfter.nTransactionOutputs, statsBefore.nTransactionOutputs);
+    BOOST_CHECK(db.GetCoins(txid, coinsRead) && coinsRead == coinsSaved);
+    db.CheckStats();
+
+    // Entries written without a delta leave the statistics unknown: the tip
+    // stops reporting them, and the database drops them once it gets the
+    // entries, until they are computed again
+    CCoinsMap mapCoins;
+    CCoinsCacheEntry& entry = mapCoins[txid];
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(tip.BatchWrite(mapCoins, tip.GetBestBlock(), NULL));
+    BOOST_CHECK(!tip.GetStats(statsAfter));
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(!db.GetStats(statsAfter));
+    BOOST_CHECK(!tip.GetStats(statsAfter));
+    BOOST_CHECK(db.ComputeStats());
+    BOOST_CHECK(tip.GetStats(statsAfter));
+    BOOST_CHECK_EQUAL(statsAfter.nTransactions, 0U);
+    BOOST_CHECK_EQUAL(db.CountRecords('c'), 0);
+    db.CheckStats();
+}
+
+static void CheckStatsEqual(const CCoinsStats& a, const CCoinsStats& b)
+{
+    BOOST_CHECK(a.hashBlock == b.hashBlock);
+    BOOST_CHECK_EQUAL(a.nTransactions, b.nTransactions);
+    BOOST_CHECK_EQUAL(a.nTransactionOutputs, b.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(a.nSerializedSize, b.nSerializedSize);
+    BOOST_CHECK_EQUAL(a.nTotalAmount, b.nTotalAmount);
+    uint256 hashA, hashB;
+    a.muhash.Finalize(hashA);
+    b.muhash.Finalize(hashB);
+    BOOST_CHECK(hashA == hashB);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_stats)
+{
+    CCoinsViewDBTest db;
+    CCoinsViewCache tip(&db);
+    std::vector<uint256> vTxid;
+    for (int nRound = 0; nRound < 40; nRound++) {
+        // Blocks change the coins in a child view, as ConnectBlock does
+        CCoinsViewCache view(&tip);
+        CMutableTransaction tx;
+        tx.nTime = 1470000000 + nRound;
+        tx.vout.resize(1 + insecure_rand() % 4);
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            tx.vout[i].nValue = (1 + insecure_rand() % 100) * COIN;
+            tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+        }
+        WriteCoins(view, tx.GetHash(), CCoins(tx, nRound));
+        vTxid.push_back(tx.GetHash());
+        for (int nSpend = 0; nSpend < 3; nSpend++) {
+            const uint256& txid = vTxid[insecure_rand() % vTxid.size()];
+            if (txid != tx.GetHash() && insecure_rand() % 3 == 0)
+                tip.Uncache(txid);
+            const CCoins* coins = view.AccessCoins(txid);
+            if (coins && !coins->vout.empty())
+                SpendOutput(view, txid, insecure_rand() % coins->vout.size());
+        }
+        uint256 hashBlock = GetRandHash();
+        view.SetBestBlock(hashBlock);
+        BOOST_CHECK(view.Flush());
+
+        // The tip counts the changes before they are written
+        CCoinsStats statsTip;
+        BOOST_CHECK(tip.GetStats(statsTip));
+        BOOST_CHECK(statsTip.hashBlock == hashBlock);
+        if (nRound % 5 == 4) {
+            BOOST_CHECK(nRound % 2 ? tip.Sync() : tip.Flush());
+            CCoinsStats statsDB;
+            BOOST_CHECK(db.GetStats(statsDB));
+            CheckStatsEqual(statsTip, statsDB);
+            db.CheckStats();
+            BOOST_CHECK(tip.GetStats(statsTip));
+            CheckStatsEqual(statsTip, statsDB);
+        }
+    }
+}
+
+// Statistics from scanning every record of view
+static CCoinsStats ScanStats(const CCoinsView& view)
+{
+    CCoinsStats stats;
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(view.Cursor());
+    for (; pcursor->Valid(); pcursor->Next()) {
+        uint256 txid;
+        CCoins coins;
+        BOOST_CHECK(pcursor->GetKey(txid) && pcursor->GetValue(coins));
+        stats.UpdateCoins(txid, CCoins(), coins);
+    }
+    stats.hashBlock = view.GetBestBlock();
+    return stats;
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_stats_connect_disconnect, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CCoinsStats statsBefore;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(pcoinsTip->GetStats(statsBefore));
+    }
+
+    // A block spending a coinbase, and one of the new outputs in the same block
+    std::vector<CMutableTransaction> spends(2);
+    spends[0].nTime = spends[1].nTime = coinbaseTxns[0].nTime;
+    spends[0].vin.resize(1);
+    spends[0].vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    spends[0].vout.resize(2);
+    spends[0].vout[0].nValue = spends[0].vout[1].nValue = 11*CENT;
+    spends[0].vout[0].scriptPubKey = spends[0].vout[1].scriptPubKey = scriptPubKey;
+    spends[1].vin.resize(1);
+    spends[1].vout.resize(1);
+    spends[1].vout[0].nValue = 10*CENT;
+    spends[1].vout[0].scriptPubKey = scriptPubKey;
+    for (int i = 0; i < 2; i++) {
+        if (i == 1)
+            spends[1].vin[0].prevout = COutPoint(spends[0].GetHash(), 0);
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, spends[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spends[i].vin[0].scriptSig << vchSig;
+    }
+    CBlock block = CreateAndProcessBlock(spends, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    // ConnectBlock accounted for the block before anything was written
+    CCoinsStats statsConnected;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(pcoinsTip->GetStats(statsConnected));
+    }
+    BOOST_CHECK(statsConnected.hashBlock == block.GetHash());
+    BOOST_CHECK_EQUAL(statsConnected.nTotalAmount, statsBefore.nTotalAmount - coinbaseTxns[0].vout[0].nValue + 21*CENT + block.vtx[0].GetValueOut());
+    FlushStateToDisk();
+    CheckStatsEqual(statsConnected, ScanStats(*pcoinsdbview));
+
+    // DisconnectBlock takes it back out
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+    }
+    CValidationState state;
+    BOOST_CHECK(ActivateBestChain(state, Params()));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.hashPrevBlock);
+    CCoinsStats statsDisconnected;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(pcoinsTip->GetStats(statsDisconnected));
+    }
+    CheckStatsEqual(statsDisconnected, statsBefore);
+    FlushStateToDisk();
+    CheckStatsEqual(statsDisconnected, ScanStats(*pcoinsdbview));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,118 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+/** Uses the words of the element itself, like the signature cache */
+class CTestHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, CTestHasher> CTestCache;
+
+static std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> v(n);
+    for (size_t i = 0; i < n; i++) {
+        for (int j = 0; j < 8; j++) {
+            uint32_t r = insecure_rand();
+            memcpy(v[i].begin() + 4 * j, &r, 4);
+        }
+    }
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_contains)
+{
+    seed_insecure_rand(true);
+    CTestCache cache;
+    BOOST_CHECK_EQUAL(cache.setup_bytes(1), 2);
+    BOOST_CHECK_EQUAL(cache.setup_bytes(1 << 16), (1 << 16) / sizeof(uint256));
+
+    // Half a table fits without losing anything
+    std::vector<uint256> vIn = RandomHashes(1 << 10);
+    for (size_t i = 0; i < vIn.size(); i++)
+        cache.insert(vIn[i]);
+    for (size_t i = 0; i < vIn.size(); i++)
+        BOOST_CHECK(cache.contains(vIn[i], false));
+    std::vector<uint256> vOut = RandomHashes(1 << 10);
+    for (size_t i = 0; i < vOut.size(); i++)
+        BOOST_CHECK(!cache.contains(vOut[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_disabled)
+{
+    // A zero size, as from -maxsigcachesize=0, stores nothing
+    CTestCache cache;
+    BOOST_CHECK_EQUAL(cache.setup_bytes(0), 0);
+    std::vector<uint256> v = RandomHashes(16);
+    for (size_t i = 0; i < v.size(); i++)
+        cache.insert(v[i]);
+    for (size_t i = 0; i < v.size(); i++)
+        BOOST_CHECK(!cache.contains(v[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase)
+{
+    seed_insecure_rand(true);
+    CTestCache cache;
+    uint32_t nSize = cache.setup(1 << 12);
+    std::vector<uint256> vFirst = RandomHashes(nSize / 2);
+    for (size_t i = 0; i < vFirst.size(); i++)
+        cache.insert(vFirst[i]);
+    // Erased elements stay findable until their slots are reused
+    for (size_t i = 0; i < vFirst.size(); i++)
+        BOOST_CHECK(cache.contains(vFirst[i], true));
+    for (size_t i = 0; i < vFirst.size(); i++)
+        BOOST_CHECK(cache.contains(vFirst[i], false));
+
+    // Filling the table again only needs the erased slots
+    std::vector<uint256> vSecond = RandomHashes(nSize / 2);
+    for (size_t i = 0; i < vSecond.size(); i++)
+        cache.insert(vSecond[i]);
+    for (size_t i = 0; i < vSecond.size(); i++)
+        BOOST_CHECK(cache.contains(vSecond[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_generations)
+{
+    seed_insecure_rand(true);
+    CTestCache cache;
+    uint32_t nSize = cache.setup(1 << 12);
+
+    // Keep inserting well past the table size; the newest elements survive
+    std::vector<uint256> vAll = RandomHashes(nSize * 4);
+    for (size_t i = 0; i < vAll.size(); i++)
+        cache.insert(vAll[i]);
+    size_t nRecent = nSize / 4;
+    size_t nFound = 0;
+    for (size_t i = vAll.size() - nRecent; i < vAll.size(); i++)
+        nFound += cache.contains(vAll[i], false);
+    BOOST_CHECK_EQUAL(nFound, nRecent);
+    // While the oldest are gone
+    nFound = 0;
+    for (size_t i = 0; i < nRecent; i++)
+        nFound += cache.contains(vAll[i], false);
+    BOOST_CHECK_EQUAL(nFound, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,187 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "httpworkqueue.h"
+#include "tinyformat.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(httpworkqueue_tests, BasicTestingSetup)
+
+/** Records the order in which work items start, and holds back blocking items until released */
+class CWorkLog
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::vector<std::string> vStarted;
+    bool fReleased;
+
+public:
+    CWorkLog() : fReleased(false) {}
+
+    void Start(const std::string& name)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        vStarted.push_back(name);
+        cond.notify_all();
+    }
+    void WaitRelease()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fReleased)
+            cond.wait(lock);
+    }
+    void Release()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fReleased = true;
+        cond.notify_all();
+    }
+    /** Wait until n items have started and return their names in start order */
+    std::vector<std::string> WaitStarted(size_t n)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (vStarted.size() < n)
+            cond.wait(lock);
+        return vStarted;
+    }
+};
+
+class CTestWorkItem
+{
+private:
+    CWorkLog& log;
+    std::string name;
+    bool fBlock;
+
+public:
+    CTestWorkItem(CWorkLog& log, const std::string& name, bool fBlock = false) : log(log), name(name), fBlock(fBlock) {}
+    void operator()()
+    {
+        log.Start(name);
+        if (fBlock)
+            log.WaitRelease();
+    }
+};
+
+typedef WorkQueue<CTestWorkItem> CTestWorkQueue;
+
+static void StartWorkers(CTestWorkQueue& queue, boost::thread_group& threadGroup, int nThreads)
+{
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CTestWorkQueue::Run, &queue));
+}
+
+static void StopWorkers(CTestWorkQueue& queue, boost::thread_group& threadGroup)
+{
+    queue.Interrupt();
+    queue.WaitExit();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(workqueue_weighted_order)
+{
+    CWorkLog log;
+    CTestWorkQueue queue(16);
+    queue.SetWeight(HTTP_WORK_HIGH, 2);
+    queue.SetWeight(HTTP_WORK_NORMAL, 1);
+    queue.SetWeight(HTTP_WORK_LOW, 1);
+
+    // Fill all classes before any worker runs, lowest priority first
+    const char* prefix[HTTP_WORK_CLASS_COUNT] = {"H", "N", "L"};
+    for (int c = HTTP_WORK_CLASS_COUNT - 1; c >= 0; c--)
+        for (int i = 0; i < 4; i++)
+            BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, strprintf("%s%d", prefix[c], i)), (HTTPWorkClass)c, "client"));
+    BOOST_CHECK_EQUAL(queue.Depth(), 12U);
+
+    // A single worker makes the order deterministic: each round serves
+    // classes by priority, as many items as their weight, FIFO within a class.
+    // Once a class runs dry the remaining ones share the rounds.
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 1);
+    std::vector<std::string> vStarted = log.WaitStarted(12);
+    StopWorkers(queue, threadGroup);
+
+    const char* expected[] = {"H0", "H1", "N0", "L0", "H2", "H3", "N1", "L1", "N2", "L2", "N3", "L3"};
+    BOOST_CHECK_EQUAL_COLLECTIONS(vStarted.begin(), vStarted.end(), expected, expected + 12);
+    BOOST_CHECK_EQUAL(queue.Depth(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(workqueue_depth_limit)
+{
+    CWorkLog log;
+    CTestWorkQueue queue(2);
+
+    // The depth limit applies per class
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "N0"), HTTP_WORK_NORMAL, "client"));
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "N1"), HTTP_WORK_NORMAL, "client"));
+    CTestWorkItem* rejected = new CTestWorkItem(log, "N2");
+    BOOST_CHECK(!queue.Enqueue(rejected, HTTP_WORK_NORMAL, "client"));
+    delete rejected;
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "H0"), HTTP_WORK_HIGH, "client"));
+    BOOST_CHECK_EQUAL(queue.Depth(), 3U);
+
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 1);
+    log.WaitStarted(3);
+    StopWorkers(queue, threadGroup);
+    BOOST_CHECK_EQUAL(queue.Depth(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(workqueue_client_limit)
+{
+    CWorkLog log;
+    CTestWorkQueue queue(16);
+    queue.SetMaxPerClient(1);
+
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 2);
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "A0", true), HTTP_WORK_NORMAL, "a"));
+    log.WaitStarted(1);
+
+    // While A0 runs, the next item of client a is skipped in favour of client b
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "A1"), HTTP_WORK_NORMAL, "a"));
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "B0"), HTTP_WORK_NORMAL, "b"));
+    std::vector<std::string> vStarted = log.WaitStarted(2);
+    BOOST_CHECK_EQUAL(vStarted[1], "B0");
+    BOOST_CHECK_EQUAL(queue.Depth(), 1U);
+
+    // Finishing A0 lets A1 start
+    log.Release();
+    vStarted = log.WaitStarted(3);
+    BOOST_CHECK_EQUAL(vStarted[2], "A1");
+    StopWorkers(queue, threadGroup);
+}
+
+BOOST_AUTO_TEST_CASE(workqueue_class_limit)
+{
+    CWorkLog log;
+    CTestWorkQueue queue(16);
+    queue.SetMaxRunning(HTTP_WORK_LOW, 1);
+
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 2);
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "L0", true), HTTP_WORK_LOW, "a"));
+    log.WaitStarted(1);
+
+    // A second low item must wait for the first, but does not hold back the
+    // other classes: the idle worker stays available for them
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "L1"), HTTP_WORK_LOW, "b"));
+    BOOST_CHECK(queue.Enqueue(new CTestWorkItem(log, "N0"), HTTP_WORK_NORMAL, "c"));
+    std::vector<std::string> vStarted = log.WaitStarted(2);
+    BOOST_CHECK_EQUAL(vStarted[1], "N0");
+    BOOST_CHECK_EQUAL(queue.Depth(), 1U);
+
+    log.Release();
+    vStarted = log.WaitStarted(3);
+    BOOST_CHECK_EQUAL(vStarted[2], "L1");
+    StopWorkers(queue, threadGroup);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
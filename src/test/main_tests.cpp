@@ -10,6 +10,11 @@
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
+// Tests these internal-to-main.cpp methods:
+extern int64_t AverageBlockDeliveryTime(int64_t nAvgBlockDeliveryTime, int64_t nDeliveryTime);
+extern int BlocksInTransitForDeliveryTime(int64_t nAvgBlockDeliveryTime);
+extern int CountUncheckedStakeHeaders(const CBlockIndex* pindex, int nMax);
+
 BOOST_FIXTURE_TEST_SUITE(main_tests, TestingSetup)
 
 static void TestBlockSubsidyHalvings(const Consensus::Params& consensusParams)
@@ -56,6 +61,65 @@ BOOST_AUTO_TEST_CASE(block_subsidy_test)
 //     BOOST_CHECK_EQUAL(nSum, 2099999997690000ULL);
 // }
 
+BOOST_AUTO_TEST_CASE(block_delivery_time_average)
+{
+    // The first measurement is taken as is, later ones move the average by an eighth
+    BOOST_CHECK_EQUAL(AverageBlockDeliveryTime(0, 80000), 80000);
+    BOOST_CHECK_EQUAL(AverageBlockDeliveryTime(80000, 160000), 90000);
+    BOOST_CHECK_EQUAL(AverageBlockDeliveryTime(80000, 80000), 80000);
+
+    // A single slow block does not throw off a fast peer
+    int64_t nAvg = 0;
+    for (int i = 0; i < 20; i++)
+        nAvg = AverageBlockDeliveryTime(nAvg, 100000);
+    nAvg = AverageBlockDeliveryTime(nAvg, 2000000);
+    BOOST_CHECK_EQUAL(nAvg, 337500);
+
+    // and the average converges on the peer's new rate
+    for (int i = 0; i < 100; i++)
+        nAvg = AverageBlockDeliveryTime(nAvg, 1000000);
+    BOOST_CHECK(nAvg > 990000 && nAvg <= 1000000);
+}
+
+BOOST_AUTO_TEST_CASE(blocks_in_transit_limit)
+{
+    // Unmeasured peers get the fixed limit
+    BOOST_CHECK_EQUAL(BlocksInTransitForDeliveryTime(0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Otherwise enough blocks to keep the peer busy for BLOCK_DOWNLOAD_QUEUE_TIME
+    BOOST_CHECK_EQUAL(BlocksInTransitForDeliveryTime(BLOCK_DOWNLOAD_QUEUE_TIME / 10), 10);
+    BOOST_CHECK_EQUAL(BlocksInTransitForDeliveryTime(BLOCK_DOWNLOAD_QUEUE_TIME / 10 + 1), 9);
+
+    // within bounds
+    BOOST_CHECK_EQUAL(BlocksInTransitForDeliveryTime(1), MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    BOOST_CHECK_EQUAL(BlocksInTransitForDeliveryTime(BLOCK_DOWNLOAD_QUEUE_TIME / MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER), MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    BOOST_CHECK_EQUAL(BlocksInTransitForDeliveryTime(BLOCK_DOWNLOAD_QUEUE_TIME), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(BlocksInTransitForDeliveryTime(60 * BLOCK_DOWNLOAD_QUEUE_TIME), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(unchecked_stake_headers)
+{
+    // A proof-of-work genesis, then proof-of-stake headers. The stake of the
+    // fourth was checked on the header, the sixth block was accepted.
+    std::vector<CBlockIndex> blocks(10);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i].nHeight = i;
+        blocks[i].pprev = i ? &blocks[i - 1] : NULL;
+        if (i)
+            blocks[i].SetProofOfStake();
+    }
+    blocks[3].SetStakeCheckedOnHeader();
+    blocks[5].RaiseValidity(BLOCK_VALID_TRANSACTIONS);
+
+    LOCK(cs_main);
+    BOOST_CHECK_EQUAL(CountUncheckedStakeHeaders(&blocks[9], MAX_UNCHECKED_STAKE_HEADERS), 4);
+    BOOST_CHECK_EQUAL(CountUncheckedStakeHeaders(&blocks[9], 2), 2);
+    BOOST_CHECK_EQUAL(CountUncheckedStakeHeaders(&blocks[5], MAX_UNCHECKED_STAKE_HEADERS), 0);
+    BOOST_CHECK_EQUAL(CountUncheckedStakeHeaders(&blocks[4], MAX_UNCHECKED_STAKE_HEADERS), 1);
+    BOOST_CHECK_EQUAL(CountUncheckedStakeHeaders(&blocks[3], MAX_UNCHECKED_STAKE_HEADERS), 0);
+    BOOST_CHECK_EQUAL(CountUncheckedStakeHeaders(&blocks[2], MAX_UNCHECKED_STAKE_HEADERS), 2);
+}
+
 bool ReturnFalse() { return false; }
 bool ReturnTrue() { return true; }
 
@@ -5,6 +5,7 @@
 #include "policy/policy.h"
 #include "txmempool.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #include "test/test_bitcoin.h"
 
@@ -578,4 +579,309 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAddressIndexTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+
+    uint160 hashA = uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    uint160 hashB = uint160(ParseHex("14131211100f0e0d0c0b0a090807060504030201"));
+    CScript scriptA = CScript() << OP_DUP << OP_HASH160 << ToByteVector(hashA) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptB = CScript() << OP_HASH160 << ToByteVector(hashB) << OP_EQUAL;
+
+    // Coin paying to A that the mempool transaction spends
+    uint256 hashPrev = uint256S("01");
+    {
+        CCoinsModifier coins = view.ModifyCoins(hashPrev);
+        coins->vout.resize(1);
+        coins->vout[0] = CTxOut(10 * COIN, scriptA);
+    }
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vout.resize(2);
+    tx.vout[0] = CTxOut(6 * COIN, scriptA);
+    tx.vout[1] = CTxOut(4 * COIN, scriptB);
+    pool.addUnchecked(tx.GetHash(), entry.Time(100).FromTx(tx));
+    pool.addAddressIndex(entry.Time(100).FromTx(tx), view);
+
+    std::vector<std::pair<uint160, int> > addresses;
+    addresses.push_back(std::make_pair(hashA, 1));
+    addresses.push_back(std::make_pair(hashB, 2));
+    addresses.push_back(std::make_pair(hashB, 1));
+
+    std::vector<CMempoolAddressDeltaSnapshot> snapshots;
+    BOOST_CHECK(pool.getAddressIndexSnapshots(addresses, snapshots));
+    BOOST_CHECK_EQUAL(snapshots.size(), 2);
+    BOOST_CHECK_EQUAL(snapshots[0]->size(), 2);
+    BOOST_CHECK_EQUAL(snapshots[1]->size(), 1);
+
+    // Deltas of A are sorted: the output comes before the spend
+    BOOST_CHECK_EQUAL((*snapshots[0])[0].second.amount, 6 * COIN);
+    BOOST_CHECK_EQUAL((*snapshots[0])[1].second.amount, -10 * COIN);
+    BOOST_CHECK((*snapshots[0])[1].second.prevhash == hashPrev);
+    BOOST_CHECK_EQUAL((*snapshots[1])[0].second.amount, 4 * COIN);
+
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > results;
+    BOOST_CHECK(pool.getAddressIndex(addresses, results));
+    BOOST_CHECK_EQUAL(results.size(), 3);
+
+    // Removing the transaction clears the index but leaves existing snapshots intact
+    std::list<CTransaction> removed;
+    pool.removeRecursive(tx, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+
+    std::vector<CMempoolAddressDeltaSnapshot> after;
+    BOOST_CHECK(pool.getAddressIndexSnapshots(addresses, after));
+    BOOST_CHECK(after.empty());
+    BOOST_CHECK_EQUAL(snapshots[0]->size(), 2);
+    BOOST_CHECK_EQUAL(snapshots[1]->size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolUsageTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    CScript script = CScript() << OP_HASH160 << ToByteVector(uint160()) << OP_EQUAL;
+
+    uint256 hashPrev = uint256S("01");
+    {
+        CCoinsModifier coins = view.ModifyCoins(hashPrev);
+        coins->vout.resize(1);
+        coins->vout[0] = CTxOut(10 * COIN, script);
+    }
+
+    CMutableTransaction parent;
+    parent.vin.resize(1);
+    parent.vin[0].prevout = COutPoint(hashPrev, 0);
+    parent.vout.resize(1);
+    parent.vout[0] = CTxOut(9 * COIN, script);
+    CMutableTransaction child;
+    child.vin.resize(1);
+    child.vin[0].prevout = COutPoint(parent.GetHash(), 0);
+    child.vout.resize(1);
+    child.vout[0] = CTxOut(8 * COIN, script);
+
+    TxMempoolUsage empty = pool.GetMemoryUsage();
+    BOOST_CHECK_EQUAL(empty.Total(), pool.DynamicMemoryUsage());
+
+    pool.addUnchecked(parent.GetHash(), entry.FromTx(parent));
+    pool.addAddressIndex(entry.FromTx(parent), view);
+    pool.addSpentIndex(entry.FromTx(parent), view);
+    pool.addUnchecked(child.GetHash(), entry.FromTx(child));
+
+    // Every part of the pool is accounted for, and only the parts in use
+    TxMempoolUsage usage = pool.GetMemoryUsage();
+    BOOST_CHECK_EQUAL(usage.Total(), pool.DynamicMemoryUsage());
+    BOOST_CHECK(usage.nNodes > empty.nNodes);
+    BOOST_CHECK(usage.nTransactions > empty.nTransactions);
+    BOOST_CHECK(usage.nLinks > empty.nLinks);
+    BOOST_CHECK(usage.nAddressIndex > empty.nAddressIndex);
+    BOOST_CHECK(usage.nSpentIndex > empty.nSpentIndex);
+
+    // Removing the transactions gives all of it back
+    std::list<CTransaction> removed;
+    pool.removeRecursive(parent, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    usage = pool.GetMemoryUsage();
+    BOOST_CHECK_EQUAL(usage.nNodes, empty.nNodes);
+    BOOST_CHECK_EQUAL(usage.nTransactions, empty.nTransactions);
+    BOOST_CHECK_EQUAL(usage.nLinks, empty.nLinks);
+    BOOST_CHECK_EQUAL(usage.nAddressIndex, empty.nAddressIndex);
+    BOOST_CHECK_EQUAL(usage.nSpentIndex, empty.nSpentIndex);
+    BOOST_CHECK_EQUAL(usage.nPoolFree, empty.nPoolFree);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLinksShrinkTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction parent;
+    parent.vin.resize(1);
+    parent.vin[0].scriptSig = CScript() << OP_1;
+    parent.vout.resize(8);
+    for (unsigned int i = 0; i < parent.vout.size(); i++)
+        parent.vout[i] = CTxOut(COIN, CScript() << OP_1);
+    pool.addUnchecked(parent.GetHash(), entry.FromTx(parent));
+
+    std::vector<CMutableTransaction> children(parent.vout.size());
+    size_t nLinksTwoChildren = 0;
+    for (unsigned int i = 0; i < children.size(); i++) {
+        children[i].vin.resize(1);
+        children[i].vin[0].prevout = COutPoint(parent.GetHash(), i);
+        children[i].vout.resize(1);
+        children[i].vout[0] = CTxOut(COIN / 2, CScript() << OP_1);
+        pool.addUnchecked(children[i].GetHash(), entry.FromTx(children[i]));
+        if (i == 1)
+            nLinksTwoChildren = pool.GetMemoryUsage().nLinks;
+    }
+
+    // Once the parent keeps one child, its list gives back the room of the others
+    std::list<CTransaction> removed;
+    for (unsigned int i = 1; i < children.size(); i++)
+        pool.removeRecursive(children[i], removed);
+    BOOST_CHECK_EQUAL(removed.size(), children.size() - 1);
+    BOOST_CHECK(pool.GetMemoryUsage().nLinks < nLinksTwoChildren);
+}
+
+/** Records the index updates the mempool announces */
+class CIndexUpdateRecorder : public CValidationInterface
+{
+public:
+    std::vector<IndexUpdateSource> vAddressSources;
+    std::vector<size_t> vAddressCounts;
+    std::vector<IndexUpdateSource> vSpentSources;
+
+    void AddressIndexUpdated(const CBlockIndex *pindex, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vDeltas, IndexUpdateSource source)
+    {
+        vAddressSources.push_back(source);
+        vAddressCounts.push_back(vDeltas.size());
+    }
+    void SpentIndexUpdated(const CBlockIndex *pindex, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vSpent, IndexUpdateSource source)
+    {
+        vSpentSources.push_back(source);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(MempoolIndexRemovalTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    CScript script = CScript() << OP_HASH160 << ToByteVector(uint160()) << OP_EQUAL;
+
+    uint256 hashPrev = uint256S("01");
+    {
+        CCoinsModifier coins = view.ModifyCoins(hashPrev);
+        coins->vout.resize(1);
+        coins->vout[0] = CTxOut(10 * COIN, script);
+    }
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vout.resize(1);
+    tx.vout[0] = CTxOut(9 * COIN, script);
+
+    CIndexUpdateRecorder recorder;
+    RegisterValidationInterface(&recorder);
+
+    // An expired transaction is announced with its spend and its output
+    pool.addUnchecked(tx.GetHash(), entry.Time(100).FromTx(tx));
+    pool.addAddressIndex(entry.Time(100).FromTx(tx), view);
+    pool.addSpentIndex(entry.Time(100).FromTx(tx), view);
+    BOOST_CHECK_EQUAL(pool.Expire(101), 1);
+    BOOST_CHECK_EQUAL(recorder.vAddressSources.size(), 1);
+    BOOST_CHECK_EQUAL(recorder.vAddressSources[0], INDEX_UPDATE_REMOVED_EXPIRY);
+    BOOST_CHECK_EQUAL(recorder.vAddressCounts[0], 2);
+    BOOST_CHECK_EQUAL(recorder.vSpentSources.size(), 1);
+    BOOST_CHECK_EQUAL(recorder.vSpentSources[0], INDEX_UPDATE_REMOVED_EXPIRY);
+    CSpentIndexKey key(hashPrev, 0);
+    CSpentIndexValue value;
+    BOOST_CHECK(!pool.getSpentIndex(key, value));
+
+    // A mined transaction is left to the block's own announcement
+    pool.addUnchecked(tx.GetHash(), entry.Time(100).FromTx(tx));
+    pool.addAddressIndex(entry.Time(100).FromTx(tx), view);
+    pool.addSpentIndex(entry.Time(100).FromTx(tx), view);
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(recorder.vAddressSources.size(), 1);
+    BOOST_CHECK_EQUAL(recorder.vSpentSources.size(), 1);
+    BOOST_CHECK(!pool.getSpentIndex(key, value));
+
+    UnregisterValidationInterface(&recorder);
+}
+
+static CMutableTransaction SpendingTx(const std::vector<COutPoint>& prevouts, int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(prevouts.size());
+    for (unsigned int i = 0; i < prevouts.size(); i++) {
+        tx.vin[i].prevout = prevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_11;
+    }
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = COIN;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolUpdateFromBlockTest)
+{
+    // txA and txB are from a disconnected block, and txC, txD and txE spend
+    // them in the mempool; txE is a descendant of txA in two ways:
+    // txA -> txB -> txD -> txE and txA -> txC -> txE
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.Fee(1000LL);
+
+    std::vector<COutPoint> prevouts(1, COutPoint(uint256S("01"), 0));
+    CMutableTransaction txA = SpendingTx(prevouts, 2);
+    prevouts[0] = COutPoint(txA.GetHash(), 0);
+    CMutableTransaction txB = SpendingTx(prevouts, 2);
+    prevouts[0] = COutPoint(txA.GetHash(), 1);
+    CMutableTransaction txC = SpendingTx(prevouts, 1);
+    prevouts[0] = COutPoint(txB.GetHash(), 1);
+    CMutableTransaction txD = SpendingTx(prevouts, 1);
+    prevouts[0] = COutPoint(txC.GetHash(), 0);
+    prevouts.push_back(COutPoint(txD.GetHash(), 0));
+    CMutableTransaction txE = SpendingTx(prevouts, 1);
+
+    pool.addUnchecked(txC.GetHash(), entry.FromTx(txC, &pool));
+    pool.addUnchecked(txD.GetHash(), entry.FromTx(txD, &pool));
+    pool.addUnchecked(txE.GetHash(), entry.FromTx(txE, &pool));
+    pool.addUnchecked(txA.GetHash(), entry.FromTx(txA, &pool));
+    pool.addUnchecked(txB.GetHash(), entry.FromTx(txB, &pool));
+    std::vector<uint256> vHashUpdate;
+    vHashUpdate.push_back(txA.GetHash());
+    vHashUpdate.push_back(txB.GetHash());
+    pool.UpdateTransactionsFromBlock(vHashUpdate);
+
+    uint64_t nSizeAll = GetVirtualTransactionSize(txA) + GetVirtualTransactionSize(txB) + GetVirtualTransactionSize(txC) +
+                        GetVirtualTransactionSize(txD) + GetVirtualTransactionSize(txE);
+    CTxMemPool::txiter itA = pool.mapTx.find(txA.GetHash());
+    CTxMemPool::txiter itB = pool.mapTx.find(txB.GetHash());
+    CTxMemPool::txiter itC = pool.mapTx.find(txC.GetHash());
+    CTxMemPool::txiter itD = pool.mapTx.find(txD.GetHash());
+    CTxMemPool::txiter itE = pool.mapTx.find(txE.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itA).size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itB).size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(itE).size(), 2);
+
+    // Every descendant is counted once
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 5);
+    BOOST_CHECK_EQUAL(itA->GetSizeWithDescendants(), nSizeAll);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 5000);
+    BOOST_CHECK_EQUAL(itB->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itC->GetCountWithDescendants(), 2);
+
+    // ... and so is every ancestor
+    BOOST_CHECK_EQUAL(itC->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itE->GetCountWithAncestors(), 5);
+    BOOST_CHECK_EQUAL(itE->GetSizeWithAncestors(), nSizeAll);
+    BOOST_CHECK_EQUAL(itE->GetModFeesWithAncestors(), 5000);
+    BOOST_CHECK_EQUAL(itE->GetSigOpCostWithAncestors(), 5 * 4);
+
+    CTxMemPool::setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*itE, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 4);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*itE, setAncestors, 4, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,96 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+#include "crypto/sha256.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(muhash_tests, BasicTestingSetup)
+
+static uint256 HashOf(const Num3072& num)
+{
+    unsigned char buf[Num3072::BYTE_SIZE];
+    num.GetBytes(buf);
+    uint256 hash;
+    CSHA256().Write(buf, sizeof(buf)).Finalize(hash.begin());
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(num3072_arithmetic)
+{
+    unsigned char a[Num3072::BYTE_SIZE];
+    unsigned char b[Num3072::BYTE_SIZE];
+    for (size_t i = 0; i < sizeof(a); i++)
+        a[i] = i;
+    memset(b, 0xff, sizeof(b));
+
+    // 2^3072 - 1 is reduced to 1103716
+    Num3072 x, y, reduced;
+    x.SetBytes(a);
+    y.SetBytes(b);
+    memset(b, 0, sizeof(b));
+    b[0] = 0x64;
+    b[1] = 0xd7;
+    b[2] = 0x10;
+    reduced.SetBytes(b);
+    BOOST_CHECK(y == reduced);
+
+    Num3072 product(x);
+    product.Multiply(y);
+    BOOST_CHECK_EQUAL(HashOf(product).GetHex(), "34be6fc4df51c21584d4132059e24b251de1c7a8123303431d7efa151565582b");
+    Num3072 inverse = x.GetInverse();
+    BOOST_CHECK_EQUAL(HashOf(inverse).GetHex(), "5af73a64efda28bd63d2c8b4f2143e05dc0e0835534772c4ccf22c4e73eab020");
+    inverse.Multiply(x);
+    BOOST_CHECK(inverse == Num3072());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_set)
+{
+    std::vector<unsigned char> e1(1, 1), e2(1, 2), e3(1, 3);
+    uint256 hash;
+    MuHash3072().Finalize(hash);
+    BOOST_CHECK_EQUAL(hash.GetHex(), "dd5ad2a105c2d29495f577245c357409002329b9f4d6182c0af3dc2f462555c8");
+
+    MuHash3072 h1;
+    h1.Insert(e1).Insert(e2);
+    h1.Finalize(hash);
+    BOOST_CHECK_EQUAL(hash.GetHex(), "96a61af052f9bccb3d9a24f975f1d7d38ecf99657c1f4f1f6422de7d0f0d499a");
+
+    // The order of insertions and removals does not matter
+    MuHash3072 h2;
+    h2.Remove(e3).Insert(e2).Insert(e3).Insert(e1);
+    uint256 hash2;
+    h2.Finalize(hash2);
+    BOOST_CHECK(hash == hash2);
+    h2.Remove(e3).Finalize(hash2);
+    BOOST_CHECK_EQUAL(hash2.GetHex(), "771d2dd5ff974abf698e379454ce77670cd10a787a018bd074e5c2c7c8afcada");
+
+    // Combining sets
+    MuHash3072 h3;
+    h3.Insert(e1);
+    MuHash3072 h4;
+    h4.Insert(e2).Insert(e3);
+    h3 *= h4;
+    h3 /= MuHash3072().Insert(e3);
+    h3.Finalize(hash2);
+    BOOST_CHECK(hash == hash2);
+
+    // Serialization keeps the removals apart
+    CDataStream ss(SER_DISK, 0);
+    ss << h2;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * Num3072::BYTE_SIZE);
+    MuHash3072 h5;
+    ss >> h5;
+    h5.Insert(e3).Finalize(hash2);
+    BOOST_CHECK(hash == hash2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "serialize.h"
 #include "streams.h"
 #include "net.h"
+#include "shortinv.h"
 #include "chainparams.h"
 
 using namespace std;
@@ -67,6 +68,10 @@ CDataStream AddrmanToStream(CAddrManSerializationMock& addrman)
     return CDataStream(vchData, SER_DISK, CLIENT_VERSION);
 }
 
+// Message handler scheduling, internal to net.cpp
+extern void ScheduleMessageHandler(CNode* pnode);
+extern void ThreadMessageWorker();
+
 BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
 
 BOOST_AUTO_TEST_CASE(caddrdb_read)
@@ -142,4 +147,308 @@ BOOST_AUTO_TEST_CASE(caddrdb_read_corrupted)
     BOOST_CHECK(addrman2.size() == 0);
 }
 
+static void ReadMessageHeader(CNetMessage& msg, const char* pszCommand, unsigned int nSize)
+{
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << CMessageHeader(Params().MessageStart(), pszCommand, nSize);
+    BOOST_CHECK_EQUAL(msg.readHeader(&ssHeader[0], ssHeader.size()), (int)ssHeader.size());
+    BOOST_CHECK(msg.in_data);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_direct_buffer)
+{
+    const unsigned int nSize = 300 * 1000;
+    std::vector<char> vPayload(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vPayload[i] = (char)i;
+
+    // A block header alone gives no buffer to receive into
+    CNetMessage msgBlock(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    ReadMessageHeader(msgBlock, NetMsgType::BLOCK, nSize);
+    unsigned int nDirect = 0;
+    BOOST_CHECK(msgBlock.GetDirectBuffer(nDirect) == NULL);
+
+    // Once payload arrives, the buffer grows in steps ahead of it
+    BOOST_CHECK_EQUAL(msgBlock.readData(&vPayload[0], 1000), 1000);
+    char* pch = msgBlock.GetDirectBuffer(nDirect);
+    BOOST_REQUIRE(pch != NULL);
+    BOOST_CHECK_EQUAL(nDirect, 256 * 1024);
+    memcpy(pch, &vPayload[1000], nDirect);
+    msgBlock.ReadDirect(nDirect);
+    unsigned int nPos = 1000 + nDirect;
+    pch = msgBlock.GetDirectBuffer(nDirect);
+    BOOST_REQUIRE(pch != NULL);
+    BOOST_CHECK_EQUAL(nDirect, nSize - nPos);
+    memcpy(pch, &vPayload[nPos], nDirect);
+    msgBlock.ReadDirect(nDirect);
+    BOOST_CHECK(msgBlock.complete());
+    BOOST_CHECK(msgBlock.GetDirectBuffer(nDirect) == NULL);
+    BOOST_CHECK(std::equal(vPayload.begin(), vPayload.end(), msgBlock.vRecv.begin()));
+
+    // Other payloads grow with the data, so they cannot be received into directly
+    CNetMessage msgInv(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    ReadMessageHeader(msgInv, NetMsgType::INV, nSize);
+    BOOST_CHECK(msgInv.GetDirectBuffer(nDirect) == NULL);
+    BOOST_CHECK_EQUAL(msgInv.readData(&vPayload[0], nSize), (int)nSize);
+    BOOST_CHECK(msgInv.complete());
+    BOOST_CHECK(std::equal(vPayload.begin(), vPayload.end(), msgInv.vRecv.begin()));
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_block_header_no_prealloc)
+{
+    // A peer announcing the largest block it may send, and sending nothing
+    // more, does not make us allocate for it
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    ReadMessageHeader(msg, NetMsgType::BLOCK, MAX_PROTOCOL_MESSAGE_LENGTH);
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), 0);
+    unsigned int nDirect = 0;
+    BOOST_CHECK(msg.GetDirectBuffer(nDirect) == NULL);
+
+    // Nor does a trickle of payload
+    char ch = 0;
+    BOOST_CHECK_EQUAL(msg.readData(&ch, 1), 1);
+    BOOST_CHECK(msg.vRecv.size() <= 1 + 256 * 1024);
+    BOOST_REQUIRE(msg.GetDirectBuffer(nDirect) != NULL);
+    BOOST_CHECK(nDirect <= 256 * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(send_token_bucket)
+{
+    CTokenBucket bucket;
+    BOOST_CHECK_EQUAL(bucket.Available(1000000), std::numeric_limits<int64_t>::max());
+
+    // Starts with a full second of tokens, at least a quantum
+    bucket.SetRate(200 * 1000);
+    int64_t nNow = 1000000;
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 200 * 1000);
+    bucket.Consume(150 * 1000);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 50 * 1000);
+
+    // Refills at the rate and never beyond one second of traffic
+    nNow += 100 * 1000;
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 70 * 1000);
+    nNow += 5 * 1000000;
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 200 * 1000);
+
+    // Overdrawing holds back traffic until the debt is repaid
+    bucket.Consume(300 * 1000);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), -100 * 1000);
+    nNow += 500 * 1000;
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 0);
+
+    // ... but at most one burst of it
+    bucket.Consume(1000 * 1000);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), -200 * 1000);
+
+    bucket.SetRate(1000);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), SEND_QUANTUM);
+}
+
+BOOST_AUTO_TEST_CASE(send_overdrawn_bucket)
+{
+    CAddress addr(CService("127.0.0.1", 0), NODE_NONE);
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.sendBucket.SetRate(SEND_QUANTUM);
+    node.sendBucket.Available(GetTimeMicros());
+    node.sendBucket.Consume(3 * SEND_QUANTUM);
+    BOOST_CHECK(node.sendBucket.Available(GetTimeMicros()) < 0);
+
+    // Transaction traffic waits for the debt to be repaid instead of being
+    // sent, which would fail on the invalid socket and disconnect the peer
+    std::vector<CInv> vInv(1, CInv(MSG_TX, GetRandHash()));
+    node.PushMessage(NetMsgType::INV, vInv);
+    BOOST_CHECK(node.fSendThrottled);
+    BOOST_CHECK(!node.fDisconnect);
+    BOOST_CHECK_EQUAL(node.nSendSizePerClass[SEND_CLASS_TX], node.nSendSize);
+    BOOST_CHECK(node.nSendSize > 0);
+
+    // Likewise for a message that is already partly on the wire
+    {
+        LOCK(node.cs_vSend);
+        node.nSendClass = SEND_CLASS_TX;
+        BOOST_CHECK(SocketSendData(&node));
+        BOOST_CHECK(!node.fDisconnect);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(send_class_defaults)
+{
+    BOOST_CHECK_EQUAL(GetDefaultSendClass(NetMsgType::VERSION), SEND_CLASS_CONTROL);
+    BOOST_CHECK_EQUAL(GetDefaultSendClass(NetMsgType::HEADERS), SEND_CLASS_CONTROL);
+    BOOST_CHECK_EQUAL(GetDefaultSendClass(NetMsgType::CMPCTBLOCK), SEND_CLASS_BLOCK);
+    BOOST_CHECK_EQUAL(GetDefaultSendClass(NetMsgType::BLOCK), SEND_CLASS_BLOCK);
+    BOOST_CHECK_EQUAL(GetDefaultSendClass(NetMsgType::INV), SEND_CLASS_TX);
+    BOOST_CHECK_EQUAL(GetDefaultSendClass(NetMsgType::TX), SEND_CLASS_TX);
+    BOOST_CHECK_EQUAL(GetDefaultSendClass(NetMsgType::ADDR), SEND_CLASS_ADDR);
+    BOOST_CHECK_EQUAL(std::string(GetSendClassName(SEND_CLASS_HISTORIC_BLOCK)), "historic_block");
+}
+
+BOOST_AUTO_TEST_CASE(send_class_block_inv)
+{
+    std::vector<CInv> vInv(1, CInv(MSG_TX, GetRandHash()));
+    BOOST_CHECK_EQUAL(GetInvSendClass(vInv), SEND_CLASS_TX);
+    vInv.push_back(CInv(MSG_WITNESS_BLOCK, GetRandHash()));
+    BOOST_CHECK_EQUAL(GetInvSendClass(vInv), SEND_CLASS_BLOCK);
+    BOOST_CHECK_EQUAL(GetInvSendClass(std::vector<CInv>(1, CInv(MSG_CMPCT_BLOCK, GetRandHash()))), SEND_CLASS_BLOCK);
+
+    // An inv mixing transactions and a block is queued as block traffic,
+    // not behind the rate limited transaction relay
+    CAddress addr(CService("127.0.0.1", 0), NODE_NONE);
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.PushMessage(NetMsgType::INV, vInv);
+    BOOST_CHECK(node.nSendSize > 0);
+    BOOST_CHECK_EQUAL(node.nSendSizePerClass[SEND_CLASS_BLOCK], node.nSendSize);
+    BOOST_CHECK_EQUAL(node.nSendSizePerClass[SEND_CLASS_TX], 0);
+}
+
+BOOST_AUTO_TEST_CASE(shortinv_roundtrip)
+{
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 20; i++)
+        vHashes.push_back(GetRandHash());
+
+    CShortInv shortinv(GetRand(std::numeric_limits<uint64_t>::max()), vHashes);
+    shortinv.nBatch = 7;
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortinv;
+    // salt, batch number, compact size and 6 bytes per announcement
+    BOOST_CHECK_EQUAL(stream.size(), 8 + 4 + 1 + 6 * vHashes.size());
+
+    CShortInv shortinv2;
+    stream >> shortinv2;
+    BOOST_CHECK_EQUAL(shortinv2.nonce, shortinv.nonce);
+    BOOST_CHECK_EQUAL(shortinv2.nBatch, shortinv.nBatch);
+    BOOST_CHECK(shortinv2.shortids == shortinv.shortids);
+    // The receiver derives the same short IDs from the nonce alone
+    for (size_t i = 0; i < vHashes.size(); i++)
+        BOOST_CHECK_EQUAL(shortinv2.GetShortID(vHashes[i]), shortinv.shortids[i]);
+
+    CShortInvRequest req;
+    req.nBatch = shortinv.nBatch;
+    req.indexes.push_back(0);
+    req.indexes.push_back(3);
+    req.indexes.push_back(19);
+    stream << req;
+    CShortInvRequest req2;
+    stream >> req2;
+    BOOST_CHECK_EQUAL(req2.nBatch, req.nBatch);
+    BOOST_CHECK(req2.indexes == req.indexes);
+}
+
+BOOST_AUTO_TEST_CASE(shortinv_index)
+{
+    CShortInvIndex index(GetRand(std::numeric_limits<uint64_t>::max()));
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 1000; i++) {
+        vHashes.push_back(GetRandHash());
+        index.Add(vHashes.back());
+    }
+    // Adding a transaction again does not count as a collision
+    index.Add(vHashes[0]);
+    BOOST_CHECK_EQUAL(index.size(), vHashes.size());
+
+    // A batch keyed by the index's salt resolves by lookup
+    CShortInv shortinv(index.GetSalt(), vHashes);
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        const uint256* phash = index.Find(shortinv.shortids[i]);
+        BOOST_REQUIRE(phash != NULL);
+        BOOST_CHECK(*phash == vHashes[i]);
+    }
+    CShortInv unknown(index.GetSalt(), std::vector<uint256>(1, GetRandHash()));
+    BOOST_CHECK(index.Find(unknown.shortids[0]) == NULL);
+
+    // Under another salt the short IDs do not resolve
+    CShortInv other(index.GetSalt() + 1, vHashes);
+    size_t nFound = 0;
+    for (size_t i = 0; i < vHashes.size(); i++)
+        if (index.Find(other.shortids[i]) != NULL && *index.Find(other.shortids[i]) == vHashes[i])
+            nFound++;
+    BOOST_CHECK_EQUAL(nFound, 0);
+}
+
+static boost::mutex mutexTurns;
+static std::vector<NodeId> vTurns;
+static CNode* pnodeRescheduleOnce = NULL;
+
+static bool RecordTurn(CNode* pnode)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexTurns);
+        vTurns.push_back(pnode->GetId());
+    }
+    // As if the socket thread completed another message during the turn
+    if (pnode == pnodeRescheduleOnce) {
+        pnodeRescheduleOnce = NULL;
+        ScheduleMessageHandler(pnode);
+    }
+    return true;
+}
+
+// Turns taken once nTurns are in, after giving the workers time for any extra ones
+static std::vector<NodeId> WaitForTurns(size_t nTurns)
+{
+    for (int i = 0; i < 500; i++) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexTurns);
+            if (vTurns.size() >= nTurns)
+                break;
+        }
+        MilliSleep(10);
+    }
+    MilliSleep(50);
+    boost::unique_lock<boost::mutex> lock(mutexTurns);
+    std::vector<NodeId> vRet;
+    vRet.swap(vTurns);
+    return vRet;
+}
+
+BOOST_AUTO_TEST_CASE(message_handler_scheduling)
+{
+    GetNodeSignals().ProcessMessages.connect(&RecordTurn);
+    CNode nodeA(INVALID_SOCKET, CAddress(CService("10.0.0.1", 8333), NODE_NONE), "", true);
+    CNode nodeB(INVALID_SOCKET, CAddress(CService("10.0.0.2", 8333), NODE_NONE), "", true);
+    CNode nodeC(INVALID_SOCKET, CAddress(CService("10.0.0.3", 8333), NODE_NONE), "", true);
+    const NodeId a = nodeA.GetId(), b = nodeB.GetId(), c = nodeC.GetId();
+    std::vector<NodeId> vExpected;
+
+    // A peer scheduled again while it waits in the queue gets one turn
+    ScheduleMessageHandler(&nodeA);
+    ScheduleMessageHandler(&nodeA);
+    ScheduleMessageHandler(&nodeB);
+    ScheduleMessageHandler(&nodeC);
+    BOOST_CHECK_EQUAL(nodeA.GetRefCount(), 1);
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(&ThreadMessageWorker);
+    vExpected = {a, b, c};
+    BOOST_CHECK(WaitForTurns(3) == vExpected);
+
+    // One scheduled during its turn gets another, after the peers waiting
+    pnodeRescheduleOnce = &nodeA;
+    ScheduleMessageHandler(&nodeA);
+    ScheduleMessageHandler(&nodeB);
+    vExpected = {a, b, a};
+    BOOST_CHECK(WaitForTurns(3) == vExpected);
+
+    // A peer whose receive buffer is busy does not hold up the worker, and
+    // gets its turn once the buffer is free
+    {
+        LOCK(nodeA.cs_vRecvMsg);
+        ScheduleMessageHandler(&nodeA);
+        ScheduleMessageHandler(&nodeB);
+        vExpected = {b};
+        BOOST_CHECK(WaitForTurns(1) == vExpected);
+    }
+    vExpected = {a};
+    BOOST_CHECK(WaitForTurns(1) == vExpected);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    GetNodeSignals().ProcessMessages.disconnect(&RecordTurn);
+
+    // The queue let go of every peer
+    BOOST_CHECK_EQUAL(nodeA.GetRefCount(), 0);
+    BOOST_CHECK_EQUAL(nodeB.GetRefCount(), 0);
+    BOOST_CHECK_EQUAL(nodeC.GetRefCount(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,132 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "support/allocators/pool.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pool_tests, BasicTestingSetup)
+
+typedef PoolResource<128, 8> CTestResource;
+
+BOOST_AUTO_TEST_CASE(pool_reuse)
+{
+    CTestResource resource(1024);
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 0);
+
+    // Sizes are rounded up to the alignment
+    void* a = resource.Allocate(20, 8);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 24);
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 1);
+    BOOST_CHECK_EQUAL(((uintptr_t)a) % 8, 0);
+
+    // A freed block is handed out again for the same size
+    resource.Deallocate(a, 20, 8);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 0);
+    void* b = resource.Allocate(24, 8);
+    BOOST_CHECK(a == b);
+    void* c = resource.Allocate(24, 8);
+    BOOST_CHECK(b != c);
+    resource.Deallocate(b, 24, 8);
+    resource.Deallocate(c, 24, 8);
+
+    // Chunks are added as needed
+    for (int i = 0; i < 100; i++)
+        resource.Allocate(64, 8);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 6400);
+    BOOST_CHECK(resource.NumChunks() >= 7);
+    BOOST_CHECK_EQUAL(resource.ReservedBytes(), resource.NumChunks() * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(pool_large_allocations)
+{
+    CTestResource resource(1024);
+
+    // Blocks larger than the maximum, or aligned more strictly, are not pooled
+    void* a = resource.Allocate(129, 8);
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 0);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 129);
+    BOOST_CHECK_EQUAL(resource.ReservedBytes(), 129);
+    void* b = resource.Allocate(32, 16);
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 0);
+    resource.Deallocate(a, 129, 8);
+    resource.Deallocate(b, 32, 16);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(pool_release)
+{
+    CTestResource resource(1024);
+    std::vector<void*> blocks;
+    for (int i = 0; i < 160; i++)
+        blocks.push_back(resource.Allocate(64, 8));
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 10);
+
+    // Chunks that still hold a block are kept
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (i % 16 != 0)
+            resource.Deallocate(blocks[i], 64, 8);
+    }
+    resource.ReleaseFreeChunks();
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 10);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 10 * 64);
+
+    for (size_t i = 0; i < 128; i += 16)
+        resource.Deallocate(blocks[i], 64, 8);
+    resource.ReleaseFreeChunks();
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 2);
+    BOOST_CHECK_EQUAL(resource.ReservedBytes(), 2 * 1024);
+
+    // Free blocks of the chunks that are kept are handed out again
+    for (int i = 0; i < 30; i++)
+        resource.Allocate(64, 8);
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 2);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 32 * 64);
+    resource.Allocate(64, 8);
+    BOOST_CHECK_EQUAL(resource.NumChunks(), 3);
+
+    // Emptied chunks are returned as blocks are freed
+    CTestResource resource2(1024);
+    blocks.clear();
+    for (int i = 0; i < 160; i++)
+        blocks.push_back(resource2.Allocate(64, 8));
+    for (size_t i = 0; i < blocks.size(); i++)
+        resource2.Deallocate(blocks[i], 64, 8);
+    BOOST_CHECK_EQUAL(resource2.UsedBytes(), 0);
+    BOOST_CHECK(resource2.NumChunks() <= 1);
+}
+
+BOOST_AUTO_TEST_CASE(pool_map)
+{
+    typedef PoolAllocator<std::pair<const int, int64_t>, 128, 8> CTestAllocator;
+    CTestResource resource;
+    {
+        CTestAllocator alloc(&resource);
+        std::map<int, int64_t, std::less<int>, CTestAllocator> m(alloc);
+        for (int i = 0; i < 1000; i++)
+            m[i] = i;
+        BOOST_CHECK(resource.UsedBytes() >= 1000 * (sizeof(int) + sizeof(int64_t)));
+        size_t nUsed = resource.UsedBytes();
+        for (int i = 0; i < 500; i++)
+            m.erase(i);
+        BOOST_CHECK_EQUAL(resource.UsedBytes(), nUsed / 2);
+
+        // Nodes are taken from the free lists before the chunk grows
+        size_t nReserved = resource.ReservedBytes();
+        for (int i = 0; i < 500; i++)
+            m[i] = i;
+        BOOST_CHECK_EQUAL(resource.UsedBytes(), nUsed);
+        BOOST_CHECK_EQUAL(resource.ReservedBytes(), nReserved);
+        for (int i = 0; i < 1000; i++)
+            BOOST_CHECK_EQUAL(m[i], i);
+    }
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
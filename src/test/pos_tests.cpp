@@ -0,0 +1,159 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "pos.h"
+#include "random.h"
+#include "script/standard.h"
+#include "test/test_bitcoin.h"
+#include "timedata.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(pos_tests)
+
+static CBlockHeader StakeHeader(const CBlockIndex* pindexPrev, const COutPoint& prevout, uint32_t nBits)
+{
+    CBlockHeader header;
+    header.hashPrevBlock = pindexPrev->GetBlockHash();
+    header.nBits = nBits;
+    header.fStake = true;
+    header.prevoutStake = prevout;
+    header.nStakeTime = (GetAdjustedTime() + 3600) & ~STAKE_TIMESTAMP_MASK;
+    header.nTime = header.nStakeTime;
+    return header;
+}
+
+BOOST_FIXTURE_TEST_CASE(stake_header_checks, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    std::vector<CMutableTransaction> noTxns;
+    for (int i = 0; i < 2 * MAX_STAKE_HEADER_CHECK_DEPTH; i++)
+        coinbaseTxns.push_back(CreateAndProcessBlock(noTxns, scriptPubKey).vtx[0]);
+
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    BOOST_CHECK(chainActive.Height() > 2 * MAX_STAKE_HEADER_CHECK_DEPTH);
+    // Any target, times the stake value, is far below the kernel hash
+    const uint32_t nBitsHard = 0x03000001;
+    // and this one, times the value of the oldest coinbase, is just below 2^256
+    const COutPoint prevoutOld(coinbaseTxns[0].GetHash(), 0);
+    arith_uint256 bnEasy = ~arith_uint256();
+    bnEasy /= arith_uint256(coinbaseTxns[0].vout[0].nValue);
+    const uint32_t nBitsEasy = bnEasy.GetCompact();
+    int nDoS = 0;
+    bool fKernelChecked;
+
+    // Staked output that is nowhere in our chain
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexTip, COutPoint(GetRandHash(), 0), nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(pindexTip, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    }
+
+    // Output index past the end of the staked transaction
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexTip, COutPoint(coinbaseTxns[0].GetHash(), coinbaseTxns[0].vout.size()), nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(pindexTip, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    }
+
+    // Staked output confirmed too recently
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexTip, COutPoint(coinbaseTxns.back().GetHash(), 0), nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(pindexTip, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    }
+
+    // Old enough, but the kernel misses the target
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexTip, prevoutOld, nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(pindexTip, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 1);
+    }
+
+    // A kernel that meets the target
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexTip, prevoutOld, nBitsEasy);
+        bool fPassed = false;
+        for (int i = 0; i < 8 && !fPassed; i++) {
+            header.nStakeTime += STAKE_TIMESTAMP_MASK + 1;
+            fPassed = CheckProofOfStakeHeader(pindexTip, state, header, fKernelChecked);
+        }
+        BOOST_CHECK(fPassed && fKernelChecked);
+    }
+
+    // The staked transaction's time comes from the transaction index alone:
+    // without it the kernel is left to the block check, even with the block
+    // on disk
+    bool fTxIndexOld = fTxIndex;
+    fTxIndex = false;
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexTip, prevoutOld, nBitsHard);
+        BOOST_CHECK(CheckProofOfStakeHeader(pindexTip, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsValid() && !fKernelChecked);
+
+        // Spent or unknown outputs are still rejected on the tip
+        header = StakeHeader(pindexTip, COutPoint(GetRandHash(), 0), nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(pindexTip, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    }
+    fTxIndex = fTxIndexOld;
+
+    // Unspent outputs are placed from the UTXO set, so a bad stake is caught on
+    // headers forking off deeper than MAX_STAKE_HEADER_CHECK_DEPTH
+    CBlockIndex* pindexDeep = chainActive[chainActive.Height() - MAX_STAKE_HEADER_CHECK_DEPTH - 1];
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexDeep, prevoutOld, nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(pindexDeep, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 1);
+    }
+
+    // and on headers building on headers whose blocks we don't have
+    uint256 hashAhead = GetRandHash();
+    CBlockIndex indexAhead;
+    indexAhead.phashBlock = &hashAhead;
+    indexAhead.pprev = pindexTip;
+    indexAhead.nHeight = pindexTip->nHeight + 1;
+    indexAhead.BuildSkip();
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(&indexAhead, prevoutOld, nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(&indexAhead, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 1);
+
+        state = CValidationState();
+        header = StakeHeader(&indexAhead, COutPoint(coinbaseTxns.back().GetHash(), 0), nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(&indexAhead, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    }
+
+    // Outputs we can't place are left to the block check, unchecked
+    {
+        CValidationState state;
+        CBlockHeader header = StakeHeader(pindexDeep, COutPoint(GetRandHash(), 0), nBitsHard);
+        BOOST_CHECK(CheckProofOfStakeHeader(pindexDeep, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsValid() && !fKernelChecked);
+
+        header = StakeHeader(&indexAhead, COutPoint(GetRandHash(), 0), nBitsHard);
+        BOOST_CHECK(CheckProofOfStakeHeader(&indexAhead, state, header, fKernelChecked));
+        BOOST_CHECK(state.IsValid() && !fKernelChecked);
+
+        // except near the tip, where the transaction index is read for spent outputs
+        CBlockIndex* pindexNear = chainActive[chainActive.Height() - MAX_STAKE_HEADER_CHECK_DEPTH];
+        header = StakeHeader(pindexNear, COutPoint(GetRandHash(), 0), nBitsHard);
+        BOOST_CHECK(!CheckProofOfStakeHeader(pindexNear, state, header, fKernelChecked));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
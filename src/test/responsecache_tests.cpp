@@ -0,0 +1,139 @@
+// Copyright (c) 2016 The The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "responsecache.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <univalue.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(responsecache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(responsecache_get_put)
+{
+    CResponseCache cache(1 << 20, 1);
+    uint256 hash = GetRandHash();
+    uint256 hashBlock = GetRandHash();
+    std::string data;
+
+    BOOST_CHECK(!cache.Get(hash, RESPONSE_TX_BIN, data));
+    cache.Put(hash, RESPONSE_TX_BIN, hashBlock, "tx");
+
+    // Entries are keyed by both hash and kind
+    BOOST_CHECK(!cache.Get(hash, RESPONSE_BLOCK_BIN, data));
+    uint256 hashBlockOut;
+    BOOST_CHECK(cache.Get(hash, RESPONSE_TX_BIN, data, &hashBlockOut));
+    BOOST_CHECK_EQUAL(data, "tx");
+    BOOST_CHECK(hashBlockOut == hashBlock);
+
+    // Storing again replaces the entry
+    cache.Put(hash, RESPONSE_TX_BIN, hashBlock, "tx2");
+    BOOST_CHECK(cache.Get(hash, RESPONSE_TX_BIN, data));
+    BOOST_CHECK_EQUAL(data, "tx2");
+
+    CResponseCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.nHits, 2U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 2U);
+
+    cache.Clear();
+    BOOST_CHECK(!cache.Get(hash, RESPONSE_TX_BIN, data));
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(responsecache_objects)
+{
+    CResponseCache cache(1 << 20, 1);
+    uint256 hash = GetRandHash();
+    UniValue txs(UniValue::VARR);
+    for (int i = 0; i < 100; i++)
+        txs.push_back(GetRandHash().GetHex());
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("hash", hash.GetHex()));
+    obj.push_back(Pair("tx", txs));
+    std::shared_ptr<const UniValue> value = std::make_shared<const UniValue>(obj);
+
+    cache.Put(hash, RESPONSE_BLOCK_JSON, hash, value);
+
+    // Lookups share the stored object instead of copying it
+    std::shared_ptr<const UniValue> out;
+    BOOST_CHECK(cache.Get(hash, RESPONSE_BLOCK_JSON, out));
+    BOOST_CHECK(out == value);
+    BOOST_CHECK(!cache.Get(hash, RESPONSE_BLOCK_JSON_TXDETAILS, out));
+
+    // The object's children count towards the memory budget
+    BOOST_CHECK(cache.GetStats().nBytes > 100 * 64);
+
+    // It outlives its entry for as long as a caller holds it
+    cache.EraseBlock(hash);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 0U);
+    BOOST_CHECK_EQUAL(out->write(), obj.write());
+}
+
+BOOST_AUTO_TEST_CASE(responsecache_erase_block)
+{
+    CResponseCache cache(1 << 20, 1);
+    uint256 hashBlock1 = GetRandHash();
+    uint256 hashBlock2 = GetRandHash();
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 100; i++) {
+        vHashes.push_back(GetRandHash());
+        cache.Put(vHashes.back(), RESPONSE_TX_BIN, i % 2 ? hashBlock1 : hashBlock2, "tx");
+    }
+    cache.Put(hashBlock1, RESPONSE_BLOCK_JSON, hashBlock1, "{}");
+    // A replaced entry leaves the block's index along with the cache
+    cache.Put(hashBlock1, RESPONSE_BLOCK_JSON, hashBlock1, "{\"hash\":\"\"}");
+
+    cache.EraseBlock(hashBlock1);
+
+    std::string data;
+    BOOST_CHECK(!cache.Get(hashBlock1, RESPONSE_BLOCK_JSON, data));
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(cache.Get(vHashes[i], RESPONSE_TX_BIN, data) == !(i % 2));
+    BOOST_CHECK_EQUAL(cache.GetStats().nEntries, 50U);
+
+    cache.EraseBlock(hashBlock2);
+    BOOST_CHECK_EQUAL(cache.GetStats().nEntries, 0U);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBytes, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(responsecache_eviction)
+{
+    const size_t nMaxBytes = 1 << 20;
+    CResponseCache cache(nMaxBytes, 1);
+    const std::string data(10000, 'x');
+    uint256 hashFirst = GetRandHash();
+    cache.Put(hashFirst, RESPONSE_BLOCK_BIN, hashFirst, data);
+
+    // Fill the cache several times over, keeping the first entry in use
+    std::string out;
+    for (int i = 0; i < 1000; i++) {
+        uint256 hash = GetRandHash();
+        cache.Put(hash, RESPONSE_BLOCK_BIN, hash, data);
+        BOOST_CHECK(cache.Get(hashFirst, RESPONSE_BLOCK_BIN, out));
+    }
+
+    CResponseCacheStats stats = cache.GetStats();
+    BOOST_CHECK(stats.nBytes <= nMaxBytes);
+    BOOST_CHECK(stats.nEvictions > 0);
+    BOOST_CHECK(stats.nEntries < 1000);
+
+    // Responses larger than a shard's share of the budget are stored, making
+    // room in the other shards
+    uint256 hashLarge = GetRandHash();
+    cache.Put(hashLarge, RESPONSE_BLOCK_JSON, hashLarge, std::string(nMaxBytes / 2, 'x'));
+    BOOST_CHECK(cache.Get(hashLarge, RESPONSE_BLOCK_JSON, out));
+    BOOST_CHECK(cache.Get(hashFirst, RESPONSE_BLOCK_BIN, out));
+    BOOST_CHECK(cache.GetStats().nBytes <= nMaxBytes);
+
+    // Responses larger than the whole cache are never stored
+    uint256 hashHuge = GetRandHash();
+    cache.Put(hashHuge, RESPONSE_BLOCK_BIN, hashHuge, std::string(nMaxBytes, 'x'));
+    BOOST_CHECK(!cache.Get(hashHuge, RESPONSE_BLOCK_BIN, out));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
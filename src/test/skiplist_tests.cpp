@@ -100,4 +100,64 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blockindex_arena)
+{
+    CBlockIndexArena arena(100);
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 1000; i++) {
+        CBlockIndex* pindex = arena.Allocate();
+        BOOST_CHECK(pindex->pprev == NULL && pindex->nHeight == 0 && pindex->pcold->vchBlockSig.empty());
+        pindex->nHeight = i;
+        pindex->pprev = i == 0 ? NULL : vIndex.back();
+        pindex->BuildSkip();
+        pindex->pcold->vchBlockSig.assign(i % 80, 1);
+        vIndex.push_back(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.size(), 1000U);
+    BOOST_CHECK(arena.DynamicMemoryUsage() >= 1000 * sizeof(CBlockIndex));
+
+    for (int i = 0; i < 1000; i++) {
+        const CBlockIndex* pindex = vIndex[i];
+        BOOST_CHECK_EQUAL(pindex->nHeight, i);
+        BOOST_CHECK(pindex->pcold->vchBlockSig.size() == (size_t)(i % 80));
+        BOOST_CHECK(vIndex[999]->GetAncestor(i) == pindex);
+        // Entries within a chunk are adjacent
+        if (i % 100)
+            BOOST_CHECK((const char*)pindex - (const char*)vIndex[i - 1] == sizeof(CBlockIndex));
+        // Every entry starts a cache line, and the fields chain walks read share it
+        BOOST_CHECK((size_t)pindex % 64 == 0);
+        BOOST_CHECK((const char*)&pindex->nFile + sizeof(pindex->nFile) - (const char*)pindex <= 32);
+    }
+
+    // Entries are copied and constructed from headers, with their own cold fields
+    CBlockHeader header;
+    header.nTime = 12345;
+    header.nNonce = 678;
+    CBlockIndex* pindexHeader = arena.Allocate(header);
+    BOOST_CHECK_EQUAL(pindexHeader->nTime, 12345U);
+    BOOST_CHECK_EQUAL(pindexHeader->pcold->nNonce, 678U);
+    CBlockIndex* pindexCopy = arena.Allocate(*vIndex[500]);
+    BOOST_CHECK(pindexCopy->pprev == vIndex[499]);
+    BOOST_CHECK(pindexCopy->pcold->vchBlockSig == vIndex[500]->pcold->vchBlockSig);
+    BOOST_CHECK(&*pindexCopy->pcold != &*vIndex[500]->pcold);
+
+    // Copies outside the arena own their cold fields
+    {
+        CBlockIndex indexCopy(*vIndex[79]);
+        BOOST_CHECK_EQUAL(indexCopy.pcold->vchBlockSig.size(), 79U);
+        indexCopy.pcold->vchBlockSig.clear();
+        indexCopy = *vIndex[78];
+        BOOST_CHECK_EQUAL(indexCopy.pcold->vchBlockSig.size(), 78U);
+    }
+    BOOST_CHECK_EQUAL(vIndex[79]->pcold->vchBlockSig.size(), 79U);
+
+    CBlockIndexArena arena2;
+    arena2.swap(arena);
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    BOOST_CHECK_EQUAL(arena2.size(), 1002U);
+    arena2.Clear();
+    BOOST_CHECK_EQUAL(arena2.size(), 0U);
+    BOOST_CHECK_EQUAL(arena2.DynamicMemoryUsage(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
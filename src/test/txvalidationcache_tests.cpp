@@ -83,4 +83,103 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(checkinputs_script_cache, TestChain100Setup)
+{
+    // Transactions whose scripts passed are not checked again with the same flags
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    LOCK(cs_main);
+    CCoinsViewCache view(pcoinsTip);
+    CValidationState state;
+    CTransaction tx(spend);
+    std::vector<CScriptCheck> vChecks;
+    BOOST_CHECK(CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH, false, false, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1);
+
+    // Executing the checks inline caches the result
+    BOOST_CHECK(CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH, false, true, NULL));
+    vChecks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH, false, false, &vChecks));
+    BOOST_CHECK(vChecks.empty());
+
+    // Other flags are checked again
+    BOOST_CHECK(CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, false, false, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1);
+
+    // Failures are not cached
+    spend.vin[0].scriptSig = CScript() << OP_0;
+    CTransaction txBad(spend);
+    BOOST_CHECK(!CheckInputs(txBad, state, view, true, SCRIPT_VERIFY_P2SH, false, true, NULL));
+    vChecks.clear();
+    BOOST_CHECK(CheckInputs(txBad, state, view, true, SCRIPT_VERIFY_P2SH, false, false, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1);
+}
+
+/** A transaction spending output 0 of hashPrev, paying nValue to scriptPubKey and signed by key */
+static CMutableTransaction
+SignedSpend(const CKey& key, const uint256& hashPrev, const CScript& scriptPubKey, CAmount nValue)
+{
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = hashPrev;
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = nValue;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    return spend;
+}
+
+BOOST_FIXTURE_TEST_CASE(connectblock_dependent_transactions, TestChain100Setup)
+{
+    // Transactions spending outputs of the same block are checked after
+    // their parents are connected; the others are checked ahead
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction parent = SignedSpend(coinbaseKey, coinbaseTxns[0].GetHash(), scriptPubKey, 11*CENT);
+    CMutableTransaction child = SignedSpend(coinbaseKey, parent.GetHash(), scriptPubKey, 10*CENT);
+    CMutableTransaction other = SignedSpend(coinbaseKey, coinbaseTxns[1].GetHash(), scriptPubKey, 11*CENT);
+
+    // A child before its parent spends an output that does not exist yet
+    std::vector<CMutableTransaction> txns;
+    txns.push_back(child);
+    txns.push_back(parent);
+    CBlock block = CreateAndProcessBlock(txns, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() != block.GetHash());
+
+    // A second spend of an output is caught even if both spends are checked ahead
+    CMutableTransaction otherAgain = SignedSpend(coinbaseKey, coinbaseTxns[1].GetHash(), scriptPubKey, 10*CENT);
+    txns.clear();
+    txns.push_back(other);
+    txns.push_back(otherAgain);
+    block = CreateAndProcessBlock(txns, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() != block.GetHash());
+
+    txns.clear();
+    txns.push_back(parent);
+    txns.push_back(other);
+    txns.push_back(child);
+    block = CreateAndProcessBlock(txns, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    LOCK(cs_main);
+    BOOST_CHECK(!pcoinsTip->HaveCoins(parent.GetHash()));
+    BOOST_CHECK(pcoinsTip->HaveCoins(child.GetHash()));
+    BOOST_CHECK(pcoinsTip->HaveCoins(other.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
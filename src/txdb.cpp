@@ -7,8 +7,11 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
 #include "main.h"
 
@@ -25,9 +28,11 @@ static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_COINS_STATS = 'U';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_BLOCKINDEX_SNAPSHOT = 'S';
 
 static const char DB_ADDRESSINDEX = 'a';
 
@@ -39,12 +44,31 @@ static const char DB_SPENTINDEX = 'p';
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
 {
+    // A database without any coins starts from empty statistics
+    fStatsValid = db.Read(DB_COINS_STATS, stats);
+    if (!fStatsValid) {
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        pcursor->Seek(DB_COINS);
+        std::pair<char, uint256> key;
+        fStatsValid = !pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_COINS;
+    }
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
     return db.Read(make_pair(DB_COINS, txid), coins);
 }
 
+void CCoinsViewDB::GetCoinsBatch(const uint256 *ptxid, size_t nCount, CCoins *pcoins, char *pfFound) const {
+    // One iterator serves the whole run. As the txids are sorted, each seek
+    // moves forward from the last one.
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    std::pair<char, uint256> key;
+    for (size_t i = 0; i < nCount; i++) {
+        pcursor->Seek(make_pair(DB_COINS, ptxid[i]));
+        pfFound[i] = pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COINS && key.second == ptxid[i] && pcursor->GetValue(pcoins[i]);
+    }
+}
+
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
     return db.Exists(make_pair(DB_COINS, txid));
 }
@@ -56,11 +80,12 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    // mapCoins is only read, so a background writer can keep serving lookups from it
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             if (it->second.coins.IsPruned())
                 batch.Erase(make_pair(DB_COINS, it->first));
@@ -69,14 +94,72 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
+    // Without a delta the statistics can't be kept up to date; dropping them
+    // makes the next start compute them again
+    CCoinsStats statsNew(stats);
+    bool fStatsValidNew = fStatsValid && pstatsDelta;
+    if (fStatsValidNew) {
+        statsNew += *pstatsDelta;
+        batch.Write(DB_COINS_STATS, statsNew);
+    } else if (fStatsValid) {
+        batch.Erase(DB_COINS_STATS);
+    }
+
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    // The best block and the statistics change together for GetStats
+    LOCK(cs_stats);
+    if (!db.WriteBatch(batch))
+        return false;
+    stats = statsNew;
+    fStatsValid = fStatsValidNew;
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &statsOut) const {
+    LOCK(cs_stats);
+    if (!fStatsValid)
+        return false;
+    statsOut = stats;
+    statsOut.hashBlock = GetBestBlock();
+    return true;
+}
+
+bool CCoinsViewDB::ComputeStats() {
+    if (fStatsValid)
+        return true;
+
+    LogPrintf("Computing statistics of the coin database...\n");
+    uiInterface.ShowProgress(_("Computing coin database statistics..."), 0);
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(DB_COINS);
+    CCoinsStats statsNew;
+    std::pair<char, uint256> key;
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COINS) {
+        if (ShutdownRequested()) {
+            // Started over on the next call
+            uiInterface.ShowProgress("", 100);
+            return true;
+        }
+        CCoins coins;
+        if (!pcursor->GetValue(coins))
+            return error("%s: unable to read coins of %s", __func__, key.second.ToString());
+        statsNew.UpdateCoins(key.second, CCoins(), coins);
+        if (statsNew.nTransactions % 10000 == 0)
+            uiInterface.ShowProgress(_("Computing coin database statistics..."), (int)(*key.second.begin() * 100.0 / 256.0 + 0.5));
+        pcursor->Next();
+    }
+    if (!db.Write(DB_COINS_STATS, statsNew))
+        return false;
+    LOCK(cs_stats);
+    stats = statsNew;
+    fStatsValid = true;
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("Computed statistics of %u transactions with %u outputs.\n", (unsigned int)stats.nTransactions, (unsigned int)stats.nTransactionOutputs);
+    return true;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -98,6 +181,18 @@ bool CBlockTreeDB::ReadReindexing(bool &fReindexing) {
     return true;
 }
 
+bool CBlockTreeDB::WriteBlockIndexSnapshotNonce(uint64_t nNonce) {
+    return Write(DB_BLOCKINDEX_SNAPSHOT, nNonce, true);
+}
+
+bool CBlockTreeDB::ReadBlockIndexSnapshotNonce(uint64_t &nNonce) {
+    return Read(DB_BLOCKINDEX_SNAPSHOT, nNonce);
+}
+
+bool CBlockTreeDB::EraseBlockIndexSnapshotNonce() {
+    return Erase(DB_BLOCKINDEX_SNAPSHOT, true);
+}
+
 bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
@@ -356,32 +451,32 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
             if (pcursor->GetValue(diskindex)) {
                 // Construct block index object
                 CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev             = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight           = diskindex.nHeight;
-                pindexNew->nFile             = diskindex.nFile;
-                pindexNew->nDataPos          = diskindex.nDataPos;
-                pindexNew->nUndoPos          = diskindex.nUndoPos;
-                pindexNew->nVersion          = diskindex.nVersion;
-                pindexNew->hashMerkleRoot    = diskindex.hashMerkleRoot;
-                pindexNew->nTime             = diskindex.nTime;
-                pindexNew->nBits             = diskindex.nBits;
-                pindexNew->nNonce            = diskindex.nNonce;
-                pindexNew->nStatus           = diskindex.nStatus;
-                pindexNew->nTx               = diskindex.nTx;
+                pindexNew->pprev                    = insertBlockIndex(diskindex.hashPrev);
+                pindexNew->nHeight                  = diskindex.nHeight;
+                pindexNew->nFile                    = diskindex.nFile;
+                pindexNew->nDataPos                 = diskindex.nDataPos;
+                pindexNew->nUndoPos                 = diskindex.nUndoPos;
+                pindexNew->nVersion                 = diskindex.nVersion;
+                pindexNew->pcold->hashMerkleRoot    = diskindex.pcold->hashMerkleRoot;
+                pindexNew->nTime                    = diskindex.nTime;
+                pindexNew->nBits                    = diskindex.nBits;
+                pindexNew->pcold->nNonce            = diskindex.pcold->nNonce;
+                pindexNew->nStatus                  = diskindex.nStatus;
+                pindexNew->nTx                      = diskindex.nTx;
                 
-                pindexNew->nFlags            = diskindex.nFlags;
-                pindexNew->nStakeModifier    = diskindex.nStakeModifier;
-                pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
-                pindexNew->vchBlockSig       = diskindex.vchBlockSig;
-                pindexNew->prevoutStake      = diskindex.prevoutStake;
-                pindexNew->nStakeTime        = diskindex.nStakeTime;
+                pindexNew->nFlags                   = diskindex.nFlags;
+                pindexNew->nStakeModifier           = diskindex.nStakeModifier;
+                pindexNew->pcold->bnStakeModifierV2 = diskindex.pcold->bnStakeModifierV2;
+                pindexNew->pcold->vchBlockSig       = diskindex.pcold->vchBlockSig;
+                pindexNew->pcold->prevoutStake      = diskindex.pcold->prevoutStake;
+                pindexNew->pcold->nStakeTime        = diskindex.pcold->nStakeTime;
 
                 if (pindexNew->IsProofOfWork() && !CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
                     return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
 
                 // NovaCoin: build setStakeSeen
                 if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+                    setStakeSeen.insert(make_pair(pindexNew->pcold->prevoutStake, pindexNew->pcold->nStakeTime));
                 
 
                 pcursor->Next();
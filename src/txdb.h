@@ -75,14 +75,31 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+    //! Statistics of the outputs in the database, valid unless ComputeStats has yet to compute
+    //! them, or a BatchWrite without a delta dropped them
+    CCoinsStats stats;
+    bool fStatsValid;
+    //! Guards stats and fStatsValid, which a background BatchWrite replaces while GetStats may run
+    mutable CCriticalSection cs_stats;
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    void GetCoinsBatch(const uint256 *ptxid, size_t nCount, CCoins *pcoins, char *pfFound) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Leaves mapCoins unchanged, so a background writer can keep serving lookups from it
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstatsDelta);
     CCoinsViewCursor *Cursor() const;
+    bool GetStats(CCoinsStats &statsOut) const;
+
+    /**
+     * Compute the statistics by scanning all outputs, for databases written
+     * before they were maintained. Stops early if shutdown is requested, and
+     * starts over on the next call.
+     */
+    bool ComputeStats();
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -121,6 +138,9 @@ public:
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
+    bool WriteBlockIndexSnapshotNonce(uint64_t nNonce);
+    bool ReadBlockIndexSnapshotNonce(uint64_t &nNonce);
+    bool EraseBlockIndexSnapshotNonce();
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
@@ -16,6 +16,7 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #include "utiltime.h"
+#include "validationinterface.h"
 #include "version.h"
 
 using namespace std;
@@ -39,6 +40,7 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     assert(inChainInputValue <= nValueIn);
 
     feeDelta = 0;
+    nEpoch = 0;
 
     nCountWithAncestors = 1;
     nSizeWithAncestors = GetTxSize();
@@ -81,45 +83,60 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // Update the given tx for any in-mempool descendants.
 // Assumes that setMemPoolChildren is correct for the given tx and all
 // descendants.
-void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
+void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude, ancestorDeltaMap &ancestorDeltas)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    EpochGuard epoch(*this);
+    vecEntries stageEntries, vecAllDescendants;
+    BOOST_FOREACH(const txiter childEntry, GetMemPoolChildren(updateIt)) {
+        MarkVisited(childEntry);
+        stageEntries.push_back(childEntry);
+    }
 
     while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
+        const txiter cit = stageEntries.back();
+        stageEntries.pop_back();
+        vecAllDescendants.push_back(cit);
+        const vecEntries &setChildren = GetMemPoolChildren(cit);
         BOOST_FOREACH(const txiter childEntry, setChildren) {
+            if (!MarkVisited(childEntry))
+                continue;
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
                 // We've already calculated this one, just add the entries for this set
-                // but don't traverse again.
+                // but don't traverse again. The child itself is from the block and
+                // so excluded.
                 BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (MarkVisited(cacheEntry))
+                        vecAllDescendants.push_back(cacheEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
+            } else {
                 // Schedule for later processing
-                stageEntries.insert(childEntry);
+                stageEntries.push_back(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // vecAllDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
+    vecEntries vecCached;
+    BOOST_FOREACH(txiter cit, vecAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
-            // Update ancestor state for each descendant
-            mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
+            vecCached.push_back(cit);
+            // Update ancestor state for each descendant, once all are known
+            AncestorDelta &delta = ancestorDeltas[cit];
+            delta.nSize += updateIt->GetTxSize();
+            delta.nFee += updateIt->GetModifiedFee();
+            delta.nCount++;
+            delta.nSigOpCost += updateIt->GetSigOpCost();
         }
     }
+    if (!vecCached.empty())
+        cachedDescendants[updateIt].swap(vecCached);
     mapTx.modify(updateIt, update_descendant_state(modifySize, modifyFee, modifyCount));
 }
 
@@ -135,6 +152,8 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
     cacheMap mapMemPoolDescendantsToUpdate;
+    // Ancestor state changes of the descendants, to modify each of them once
+    ancestorDeltaMap mapAncestorDeltas;
 
     // Use a set for lookups into vHashesToUpdate (these entries are already
     // accounted for in the state of their ancestors)
@@ -167,13 +186,19 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
                 UpdateParent(childIter, it, true);
             }
         }
-        UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
+        UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded, mapAncestorDeltas);
+    }
+    BOOST_FOREACH(const ancestorDeltaMap::value_type &delta, mapAncestorDeltas) {
+        mapTx.modify(delta.first, update_ancestor_state(delta.second.nSize, delta.second.nFee, delta.second.nCount, delta.second.nSigOpCost));
     }
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
-    setEntries parentHashes;
+    LOCK(cs);
+    // Ancestors still to be walked; each is staged once, as the epoch marks it
+    vecEntries parentHashes;
+    EpochGuard epoch(*this);
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -182,8 +207,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
+            if (piter != mapTx.end() && MarkVisited(piter)) {
+                parentHashes.push_back(piter);
                 if (parentHashes.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
@@ -195,15 +220,18 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
         parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH(const txiter &piter, parentHashes) {
+            MarkVisited(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
     while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+        txiter stageit = parentHashes.back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
+        parentHashes.pop_back();
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -217,11 +245,11 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
+        const vecEntries & setMemPoolParents = GetMemPoolParents(stageit);
         BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (MarkVisited(phash)) {
+                parentHashes.push_back(phash);
             }
             if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
@@ -235,7 +263,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    vecEntries parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     BOOST_FOREACH(txiter piter, parentIters) {
         UpdateChild(piter, it, add);
@@ -264,7 +292,7 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
+    const vecEntries &setMemPoolChildren = GetMemPoolChildren(it);
     BOOST_FOREACH(txiter updateIt, setMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
@@ -349,9 +377,16 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0),
+    nEpoch(0),
+    fHasEpochGuard(false),
+    mapTx(indexed_transaction_set::ctor_args_list(), NodeAllocator<CTxMemPoolEntry>(&nodeResource)),
+    mapLinks(CompareIteratorByHash(), txlinksMap::allocator_type(&nodeResource)),
+    mapSpent(CSpentIndexKeyCompare(), mapSpentIndex::allocator_type(&nodeResource)),
+    mapNextTx(decltype(mapNextTx)::allocator_type(&nodeResource))
 {
     _clear(); //lock free clear
+    usageEmpty = GetMemoryUsageWithFixed();
 
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -444,18 +479,51 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     totalTxSize += entry.GetTxSize();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
 
-    vTxHashes.emplace_back(hash, newit);
+    vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
 
     return true;
 }
 
-void CTxMemPool::removeUnchecked(txiter it)
+void GetMempoolAddressIndexDeltas(const CMempoolAddressDeltaVector& vMempoolDeltas, std::vector<std::pair<CAddressIndexKey, CAmount> >& vDeltas)
+{
+    vDeltas.reserve(vDeltas.size() + vMempoolDeltas.size());
+    BOOST_FOREACH(const CMempoolAddressDeltaVector::value_type& delta, vMempoolDeltas)
+        vDeltas.push_back(std::make_pair(CAddressIndexKey(delta.first.type, delta.first.addressBytes, -1, 0, delta.first.txhash, delta.first.index, delta.first.spending), delta.second.amount));
+}
+
+static IndexUpdateSource IndexUpdateSourceFromRemoval(MemPoolRemovalReason reason)
+{
+    switch (reason) {
+    case MEMPOOL_REMOVE_CONFLICT: return INDEX_UPDATE_REMOVED_CONFLICT;
+    case MEMPOOL_REMOVE_EXPIRY: return INDEX_UPDATE_REMOVED_EXPIRY;
+    case MEMPOOL_REMOVE_SIZELIMIT: return INDEX_UPDATE_REMOVED_SIZELIMIT;
+    case MEMPOOL_REMOVE_REPLACED: return INDEX_UPDATE_REMOVED_REPLACED;
+    case MEMPOOL_REMOVE_REORG: return INDEX_UPDATE_REMOVED_REORG;
+    default: return INDEX_UPDATE_REMOVED_OTHER;
+    }
+}
+
+void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 {
     const uint256 hash = it->GetTx().GetHash();
     BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
 
+    // A block's transactions are announced with the block itself
+    bool fAnnounce = (reason != MEMPOOL_REMOVE_BLOCK);
+    CMempoolAddressDeltaVector vMempoolDeltas;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpent;
+    removeAddressIndex(hash, fAnnounce ? &vMempoolDeltas : NULL);
+    removeSpentIndex(hash, fAnnounce ? &vSpent : NULL);
+    if (!vMempoolDeltas.empty()) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vDeltas;
+        GetMempoolAddressIndexDeltas(vMempoolDeltas, vDeltas);
+        GetMainSignals().AddressIndexUpdated(NULL, vDeltas, IndexUpdateSourceFromRemoval(reason));
+    }
+    if (!vSpent.empty())
+        GetMainSignals().SpentIndexUpdated(NULL, vSpent, IndexUpdateSourceFromRemoval(reason));
+
     if (vTxHashes.size() > 1) {
         vTxHashes[it->vTxHashesIdx] = std::move(vTxHashes.back());
         vTxHashes[it->vTxHashesIdx].second->vTxHashesIdx = it->vTxHashesIdx;
@@ -467,8 +535,9 @@ void CTxMemPool::removeUnchecked(txiter it)
 
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    txlinksMap::iterator linksiter = mapLinks.find(it);
+    cachedLinksUsage -= memusage::DynamicUsage(linksiter->second.parents) + memusage::DynamicUsage(linksiter->second.children);
+    mapLinks.erase(linksiter);
     mapTx.erase(it);
     nTransactionsUpdated++;
     minerPolicyEstimator->removeTx(hash);
@@ -494,7 +563,7 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
         setDescendants.insert(it);
         stage.erase(it);
 
-        const setEntries &setChildren = GetMemPoolChildren(it);
+        const vecEntries &setChildren = GetMemPoolChildren(it);
         BOOST_FOREACH(const txiter &childiter, setChildren) {
             if (!setDescendants.count(childiter)) {
                 stage.insert(childiter);
@@ -503,7 +572,7 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
     }
 }
 
-void CTxMemPool::removeRecursive(const CTransaction &origTx, std::list<CTransaction>& removed)
+void CTxMemPool::removeRecursive(const CTransaction &origTx, std::list<CTransaction>& removed, MemPoolRemovalReason reason)
 {
     // Remove transaction from memory pool
     {
@@ -533,7 +602,7 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, std::list<CTransact
         BOOST_FOREACH(txiter it, setAllRemoves) {
             removed.push_back(it->GetTx());
         }
-        RemoveStaged(setAllRemoves, false);
+        RemoveStaged(setAllRemoves, false, reason);
     }
 }
 
@@ -569,7 +638,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
     }
     BOOST_FOREACH(const CTransaction& tx, transactionsToRemove) {
         list<CTransaction> removed;
-        removeRecursive(tx, removed);
+        removeRecursive(tx, removed, MEMPOOL_REMOVE_REORG);
     }
 }
 
@@ -584,7 +653,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
             const CTransaction &txConflict = *it->second;
             if (txConflict != tx)
             {
-                removeRecursive(txConflict, removed);
+                removeRecursive(txConflict, removed, MEMPOOL_REMOVE_CONFLICT);
                 ClearPrioritisation(txConflict.GetHash());
             }
         }
@@ -613,13 +682,10 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         if (it != mapTx.end()) {
             setEntries stage;
             stage.insert(it);
-            RemoveStaged(stage, true);
+            RemoveStaged(stage, true, MEMPOOL_REMOVE_BLOCK);
         }
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
-        removeAddressIndex(tx.GetHash());
-        removeSpentIndex(tx.GetHash());
-
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
@@ -632,8 +698,15 @@ void CTxMemPool::_clear()
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapAddress.clear();
+    mapAddressInserted.clear();
+    mapSpent.clear();
+    mapSpentInserted.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
+    cachedLinksUsage = 0;
+    cachedAddressUsage = 0;
+    cachedSpentUsage = 0;
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
@@ -658,6 +731,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     uint64_t checkTotal = 0;
     uint64_t innerUsage = 0;
+    uint64_t linksUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
@@ -671,7 +745,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         txlinksMap::const_iterator linksiter = mapLinks.find(it);
         assert(linksiter != mapLinks.end());
         const TxLinks &links = linksiter->second;
-        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        linksUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
         bool fDependsWait = false;
         setEntries setParentCheck;
         int64_t parentSizes = 0;
@@ -698,7 +772,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(vecEntries(setParentCheck.begin(), setParentCheck.end()) == GetMemPoolParents(it));
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -731,7 +805,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(vecEntries(setChildrenCheck.begin(), setChildrenCheck.end()) == GetMemPoolChildren(it));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -740,7 +814,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
-            assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, NULL));
+            assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, false, NULL));
             UpdateCoins(tx, mempoolDuplicate, 1000000);
         }
     }
@@ -754,7 +828,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove++;
             assert(stepsSinceLastRemove < waitingOnDependants.size());
         } else {
-            assert(CheckInputs(entry->GetTx(), state, mempoolDuplicate, false, 0, false, NULL));
+            assert(CheckInputs(entry->GetTx(), state, mempoolDuplicate, false, 0, false, false, NULL));
             UpdateCoins(entry->GetTx(), mempoolDuplicate, 1000000);
             stepsSinceLastRemove = 0;
         }
@@ -769,6 +843,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+    assert(linksUsage == cachedLinksUsage);
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
@@ -984,16 +1059,46 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
-    LOCK(cs);
-    // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return GetMemoryUsage().Total();
 }
 
-void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants) {
+TxMempoolUsage CTxMemPool::GetMemoryUsage() const {
+    LOCK(cs);
+    // What the empty pool uses already is reported on its own, as evicting
+    // transactions does not give it back
+    TxMempoolUsage usage = GetMemoryUsageWithFixed();
+    usage.nNodes -= std::min(usage.nNodes, usageEmpty.nNodes);
+    usage.nTransactions -= std::min(usage.nTransactions, usageEmpty.nTransactions);
+    usage.nLinks -= std::min(usage.nLinks, usageEmpty.nLinks);
+    usage.nAddressIndex -= std::min(usage.nAddressIndex, usageEmpty.nAddressIndex);
+    usage.nSpentIndex -= std::min(usage.nSpentIndex, usageEmpty.nSpentIndex);
+    usage.nOther -= std::min(usage.nOther, usageEmpty.nOther);
+    usage.nPoolFree -= std::min(usage.nPoolFree, usageEmpty.nPoolFree);
+    usage.nFixed = usageEmpty.Total();
+    return usage;
+}
+
+TxMempoolUsage CTxMemPool::GetMemoryUsageWithFixed() const {
+    LOCK(cs);
+    TxMempoolUsage usage;
+    // The nodes of mapTx, mapLinks, mapNextTx and mapSpent are counted with
+    // the pool memory that is free but not yet given back, as it is held all
+    // the same.
+    usage.nNodes = nodeResource.UsedBytes();
+    usage.nPoolFree = nodeResource.ReservedBytes() - nodeResource.UsedBytes();
+    usage.nTransactions = cachedInnerUsage;
+    usage.nLinks = cachedLinksUsage;
+    usage.nAddressIndex = memusage::DynamicUsage(mapAddress) + memusage::DynamicUsage(mapAddressInserted) + cachedAddressUsage;
+    usage.nSpentIndex = memusage::DynamicUsage(mapSpentInserted) + cachedSpentUsage;
+    usage.nOther = memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxHashes);
+    return usage;
+}
+
+void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
     BOOST_FOREACH(const txiter& it, stage) {
-        removeUnchecked(it);
+        removeUnchecked(it, reason);
     }
 }
 
@@ -1009,15 +1114,47 @@ int CTxMemPool::Expire(int64_t time) {
     BOOST_FOREACH(txiter removeit, toremove) {
         CalculateDescendants(removeit, stage);
     }
-    RemoveStaged(stage, false);
+    RemoveStaged(stage, false, MEMPOOL_REMOVE_EXPIRY);
     return stage.size();
 }
 
-void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
+namespace {
+struct CompareAddressDelta
+{
+    CMempoolAddressDeltaKeyCompare compare;
+
+    bool operator()(const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& a,
+                    const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& b) const {
+        return compare(a.first, b.first);
+    }
+    bool operator()(const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& a,
+                    const CMempoolAddressDeltaKey& b) const {
+        return compare(a.first, b);
+    }
+};
+} // anon namespace
+
+CMempoolAddressDeltaVector& CTxMemPool::GetAddressDeltasForWrite(const addressKey& key)
+{
+    AssertLockHeld(cs);
+    std::shared_ptr<CMempoolAddressDeltaVector>& deltas = mapAddress[key];
+    if (!deltas) {
+        deltas = std::make_shared<CMempoolAddressDeltaVector>();
+        cachedAddressUsage += memusage::DynamicUsage(deltas);
+    } else if (deltas.use_count() > 1) {
+        // Somebody holds a snapshot; leave it alone and change a copy
+        cachedAddressUsage -= memusage::DynamicUsage(*deltas);
+        deltas = std::make_shared<CMempoolAddressDeltaVector>(*deltas);
+        cachedAddressUsage += memusage::DynamicUsage(*deltas);
+    }
+    return *deltas;
+}
+
+void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, CMempoolAddressDeltaVector *pdeltas)
 {
     LOCK(cs);
     const CTransaction& tx = entry.GetTx();
-    std::vector<CMempoolAddressDeltaKey> inserted;
+    CMempoolAddressDeltaVector deltas;
 
     uint256 txhash = tx.GetHash();
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
@@ -1027,20 +1164,17 @@ void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewC
             std::vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
             CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, j, 1);
             CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(std::make_pair(key, delta));
-            inserted.push_back(key);
+            deltas.push_back(std::make_pair(key, delta));
         } else if (prevout.scriptPubKey.IsPayToPubkeyHash()) {
             std::vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
             CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, j, 1);
             CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(std::make_pair(key, delta));
-            inserted.push_back(key);
+            deltas.push_back(std::make_pair(key, delta));
         } else if (prevout.scriptPubKey.IsPayToPubkey()) {
             std::vector<unsigned char> hashBytes(prevout.scriptPubKey.begin() + 1, prevout.scriptPubKey.end() - 1);
             CMempoolAddressDeltaKey key(1, uint160(Hash160(hashBytes)), txhash, j, 1);
             CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(std::make_pair(key, delta));
-            inserted.push_back(key);
+            deltas.push_back(std::make_pair(key, delta));
         }
     }
 
@@ -1049,56 +1183,106 @@ void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewC
         if (out.scriptPubKey.IsPayToScriptHash()) {
             std::vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
             CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(std::make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
+            deltas.push_back(std::make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
         } else if (out.scriptPubKey.IsPayToPubkeyHash()) {
             std::vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-            std::pair<addressDeltaMap::iterator,bool> ret;
             CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(std::make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
+            deltas.push_back(std::make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
         }  else if (out.scriptPubKey.IsPayToPubkey()) {
             std::vector<unsigned char> hashBytes(out.scriptPubKey.begin() + 1, out.scriptPubKey.end() - 1);
             CMempoolAddressDeltaKey key(1, uint160(Hash160(hashBytes)), txhash, k, 0);
-            mapAddress.insert(std::make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
+            deltas.push_back(std::make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
         }
     }
 
-    mapAddressInserted.insert(std::make_pair(txhash, inserted));
+    if (pdeltas)
+        *pdeltas = deltas;
+
+    if (deltas.empty())
+        return;
+
+    // Group the deltas by address so every address vector is touched once
+    std::sort(deltas.begin(), deltas.end(), CompareAddressDelta());
+
+    std::vector<addressKey> inserted;
+    CMempoolAddressDeltaVector::const_iterator it = deltas.begin();
+    while (it != deltas.end()) {
+        addressKey address(it->first.addressBytes, it->first.type);
+        CMempoolAddressDeltaVector::const_iterator end = it;
+        while (end != deltas.end() && end->first.addressBytes == address.first && end->first.type == address.second)
+            end++;
+
+        CMempoolAddressDeltaVector& vec = GetAddressDeltasForWrite(address);
+        cachedAddressUsage -= memusage::DynamicUsage(vec);
+        CMempoolAddressDeltaVector::iterator pos = std::lower_bound(vec.begin(), vec.end(), *it, CompareAddressDelta());
+        vec.insert(pos, it, end);
+        cachedAddressUsage += memusage::DynamicUsage(vec);
+        inserted.push_back(address);
+        it = end;
+    }
+
+    if (mapAddressInserted.insert(std::make_pair(txhash, inserted)).second)
+        cachedAddressUsage += memusage::DynamicUsage(inserted);
+}
+
+bool CTxMemPool::getAddressIndexSnapshots(const std::vector<std::pair<uint160, int> > &addresses,
+                                          std::vector<CMempoolAddressDeltaSnapshot> &snapshots)
+{
+    LOCK(cs);
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+        addressDeltaMap::const_iterator ait = mapAddress.find(*it);
+        if (ait != mapAddress.end())
+            snapshots.push_back(ait->second);
+    }
+    return true;
 }
 
 bool CTxMemPool::getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                                  std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results)
 {
-    LOCK(cs);
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        addressDeltaMap::iterator ait = mapAddress.lower_bound(CMempoolAddressDeltaKey((*it).second, (*it).first));
-        while (ait != mapAddress.end() && (*ait).first.addressBytes == (*it).first && (*ait).first.type == (*it).second) {
-            results.push_back(*ait);
-            ait++;
-        }
+    std::vector<CMempoolAddressDeltaSnapshot> snapshots;
+    if (!getAddressIndexSnapshots(addresses, snapshots))
+        return false;
+
+    BOOST_FOREACH(const CMempoolAddressDeltaSnapshot& snapshot, snapshots) {
+        results.insert(results.end(), snapshot->begin(), snapshot->end());
     }
     return true;
 }
 
-bool CTxMemPool::removeAddressIndex(const uint256 txhash)
+bool CTxMemPool::removeAddressIndex(const uint256 txhash, CMempoolAddressDeltaVector *pdeltas)
 {
     LOCK(cs);
     addressDeltaMapInserted::iterator it = mapAddressInserted.find(txhash);
 
     if (it != mapAddressInserted.end()) {
-        std::vector<CMempoolAddressDeltaKey> keys = (*it).second;
-        for (std::vector<CMempoolAddressDeltaKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
-            mapAddress.erase(*mit);
+        BOOST_FOREACH(const addressKey& address, it->second) {
+            CMempoolAddressDeltaVector& vec = GetAddressDeltasForWrite(address);
+            cachedAddressUsage -= memusage::DynamicUsage(vec);
+            // Deltas of one transaction are adjacent, as they sort by txhash first
+            CMempoolAddressDeltaKey first(address.second, address.first, txhash, 0, 0);
+            CMempoolAddressDeltaVector::iterator begin = std::lower_bound(vec.begin(), vec.end(), first, CompareAddressDelta());
+            CMempoolAddressDeltaVector::iterator end = begin;
+            while (end != vec.end() && end->first.txhash == txhash)
+                end++;
+            if (pdeltas)
+                pdeltas->insert(pdeltas->end(), begin, end);
+            vec.erase(begin, end);
+            if (vec.empty()) {
+                cachedAddressUsage -= memusage::DynamicUsage(mapAddress[address]);
+                mapAddress.erase(address);
+            } else {
+                cachedAddressUsage += memusage::DynamicUsage(vec);
+            }
         }
+        cachedAddressUsage -= memusage::DynamicUsage(it->second);
         mapAddressInserted.erase(it);
     }
 
     return true;
 }
 
-void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
+void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > *pspent)
 {
     LOCK(cs);
 
@@ -1132,9 +1316,12 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
 
         mapSpent.insert(std::make_pair(key, value));
         inserted.push_back(key);
+        if (pspent)
+            pspent->push_back(std::make_pair(key, value));
     }
 
-    mapSpentInserted.insert(std::make_pair(txhash, inserted));
+    if (mapSpentInserted.insert(std::make_pair(txhash, inserted)).second)
+        cachedSpentUsage += memusage::DynamicUsage(inserted);
 }
 
 bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
@@ -1150,7 +1337,7 @@ bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     return false;
 }
 
-bool CTxMemPool::removeSpentIndex(const uint256 txhash)
+bool CTxMemPool::removeSpentIndex(const uint256 txhash, std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > *pspent)
 {
     LOCK(cs);
     mapSpentIndexInserted::iterator it = mapSpentInserted.find(txhash);
@@ -1158,8 +1345,14 @@ bool CTxMemPool::removeSpentIndex(const uint256 txhash)
     if (it != mapSpentInserted.end()) {
         std::vector<CSpentIndexKey> keys = (*it).second;
         for (std::vector<CSpentIndexKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
+            if (pspent) {
+                mapSpentIndex::iterator sit = mapSpent.find(*mit);
+                if (sit != mapSpent.end())
+                    pspent->push_back(*sit);
+            }
             mapSpent.erase(*mit);
         }
+        cachedSpentUsage -= memusage::DynamicUsage(it->second);
         mapSpentInserted.erase(it);
     }
 
@@ -1176,27 +1369,51 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
     return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::UpdateLink(vecEntries &links, txiter it, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    vecEntries::iterator pos = std::lower_bound(links.begin(), links.end(), it, CompareIteratorByHash());
+    bool fFound = pos != links.end() && *pos == it;
+    if (add == fFound)
+        return;
+    cachedLinksUsage -= memusage::DynamicUsage(links);
+    if (add)
+        links.insert(pos, it);
+    else if (links.size() == 1)
+        vecEntries().swap(links);
+    else {
+        links.erase(pos);
+        // Give back capacity once it is mostly unused, leaving room to grow
+        // again so that adding and removing one link does not reallocate
+        if (links.size() * 4 <= links.capacity())
+            vecEntries(links.begin(), links.end()).swap(links);
     }
+    cachedLinksUsage += memusage::DynamicUsage(links);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLink(mapLinks[entry].children, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLink(mapLinks[entry].parents, parent, add);
+}
+
+CTxMemPool::EpochGuard::EpochGuard(const CTxMemPool& poolIn) : pool(poolIn)
+{
+    AssertLockHeld(pool.cs);
+    assert(!pool.fHasEpochGuard);
+    ++pool.nEpoch;
+    pool.fHasEpochGuard = true;
+}
+
+CTxMemPool::EpochGuard::~EpochGuard()
+{
+    pool.fHasEpochGuard = false;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1204,7 +1421,7 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
     return it->second.parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1271,7 +1488,7 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
             BOOST_FOREACH(txiter it, stage)
                 txn.push_back(it->GetTx());
         }
-        RemoveStaged(stage, false);
+        RemoveStaged(stage, false, MEMPOOL_REMOVE_SIZELIMIT);
         if (pvNoSpendsRemaining) {
             BOOST_FOREACH(const CTransaction& tx, txn) {
                 BOOST_FOREACH(const CTxIn& txin, tx.vin) {
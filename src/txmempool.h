@@ -12,18 +12,23 @@
 
 #include "amount.h"
 #include "coins.h"
+#include "crypto/common.h"
 #include "indirectmap.h"
 #include "primitives/transaction.h"
+#include "support/allocators/pool.h"
 #include "sync.h"
 
 #undef foreach
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include <boost/unordered_map.hpp>
 
 class CAutoFile;
 class CBlockIndex;
 
+struct CAddressIndexKey;
+
 inline double AllowFreeThreshold()
 {
     return COIN * 144 / 250;
@@ -137,6 +142,19 @@ struct CMempoolAddressDeltaKeyCompare
     }
 };
 
+/** Mempool address index deltas of a single address, sorted by CMempoolAddressDeltaKeyCompare */
+typedef std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > CMempoolAddressDeltaVector;
+
+/**
+ * Read-only view of the deltas of an address. It is shared with the mempool
+ * until the next change to that address, which copies the vector instead of
+ * modifying it, so it can be used after the mempool lock is released.
+ */
+typedef std::shared_ptr<const CMempoolAddressDeltaVector> CMempoolAddressDeltaSnapshot;
+
+/** Convert mempool address deltas to address index records, with height -1 like mempool spent index entries */
+void GetMempoolAddressIndexDeltas(const CMempoolAddressDeltaVector& vMempoolDeltas, std::vector<std::pair<CAddressIndexKey, CAmount> >& vDeltas);
+
 /** \class CTxMemPoolEntry
  *
  * CTxMemPoolEntry stores data about the correponding transaction, as well
@@ -234,6 +252,7 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpoch; //!< Last mempool traversal that visited this entry, see CTxMemPool::MarkVisited
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -393,6 +412,17 @@ struct ancestor_score {};
 
 class CBlockPolicyEstimator;
 
+/** Reason why a transaction was removed from the mempool */
+enum MemPoolRemovalReason {
+    MEMPOOL_REMOVE_UNKNOWN = 0, //! Manually removed or unknown reason
+    MEMPOOL_REMOVE_EXPIRY,      //! Expired from mempool
+    MEMPOOL_REMOVE_SIZELIMIT,   //! Removed in size limiting
+    MEMPOOL_REMOVE_REORG,       //! Removed for reorganization
+    MEMPOOL_REMOVE_BLOCK,       //! Removed for block
+    MEMPOOL_REMOVE_CONFLICT,    //! Removed for conflict with in-block transaction
+    MEMPOOL_REMOVE_REPLACED,    //! Removed for replacement
+};
+
 /**
  * Information about a mempool transaction.
  */
@@ -408,6 +438,25 @@ struct TxMempoolInfo
     CFeeRate feeRate;
 };
 
+/**
+ * Memory used by the mempool, by what it is used for.
+ */
+struct TxMempoolUsage
+{
+    size_t nNodes;        //!< Pooled nodes of the transaction, link, spend and spent index maps
+    size_t nTransactions; //!< Transactions and their entries' own allocations
+    size_t nLinks;        //!< Lists of in-mempool parents and children
+    size_t nAddressIndex; //!< Address index deltas
+    size_t nSpentIndex;   //!< Spent index, besides its nodes
+    size_t nOther;        //!< Prioritisation deltas and the witness hash list
+    size_t nPoolFree;     //!< Node pool memory that is free, but held for reuse
+    size_t nFixed;        //!< Used by the empty pool already, such as container headers; not part of Total()
+
+    TxMempoolUsage() : nNodes(0), nTransactions(0), nLinks(0), nAddressIndex(0), nSpentIndex(0), nOther(0), nPoolFree(0), nFixed(0) {}
+
+    size_t Total() const { return nNodes + nTransactions + nLinks + nAddressIndex + nSpentIndex + nOther + nPoolFree; }
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -494,6 +543,9 @@ private:
 
     uint64_t totalTxSize;      //!< sum of all mempool tx' byte sizes
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    uint64_t cachedLinksUsage; //!< sum of dynamic memory usage of the parent and child lists in mapLinks
+    uint64_t cachedAddressUsage; //!< sum of dynamic memory usage of the address index elements
+    uint64_t cachedSpentUsage; //!< sum of dynamic memory usage of the spent index elements, besides the pooled nodes
 
     CFeeRate minReasonableRelayFee;
 
@@ -501,12 +553,24 @@ private:
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
+    mutable uint64_t nEpoch;      //!< Current traversal, see MarkVisited
+    mutable bool fHasEpochGuard;  //!< Whether a traversal is in progress
+
     void trackPackageRemoved(const CFeeRate& rate);
 
 public:
 
     static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
 
+    /** Nodes up to 512 bytes, which covers those of mapTx, come from the pool */
+    typedef PoolResource<512, 8> NodeResource;
+    template <typename T> using NodeAllocator = PoolAllocator<T, 512, 8>;
+
+private:
+    //! Memory for the nodes of mapTx, mapLinks, mapNextTx and mapSpent; declared first so it outlives them
+    NodeResource nodeResource;
+
+public:
     typedef boost::multi_index_container<
         CTxMemPoolEntry,
         boost::multi_index::indexed_by<
@@ -536,14 +600,15 @@ public:
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByAncestorFee
             >
-        >
+        >,
+        NodeAllocator<CTxMemPoolEntry>
     > indexed_transaction_set;
 
     mutable CCriticalSection cs;
     indexed_transaction_set mapTx;
 
     typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
-    std::vector<std::pair<uint256, txiter> > vTxHashes; //!< All tx hashes/entries in mapTx, in random order
+    std::vector<std::pair<uint256, txiter> > vTxHashes; //!< All tx witness hashes/entries in mapTx, in random order
 
     struct CompareIteratorByHash {
         bool operator()(const txiter &a, const txiter &b) const {
@@ -551,28 +616,76 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    /** Direct parents or children, sorted by CompareIteratorByHash. There are
+     *  rarely more than a few, so a vector is both smaller and faster than a set. */
+    typedef std::vector<txiter> vecEntries;
+
+    const vecEntries & GetMemPoolParents(txiter entry) const;
+    const vecEntries & GetMemPoolChildren(txiter entry) const;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
+    /** Starts a traversal of the mempool, in which MarkVisited tells whether an
+     *  entry was seen before, without building a set of the entries seen.
+     *  Requires cs; traversals do not nest. */
+    class EpochGuard
+    {
+        const CTxMemPool& pool;
+    public:
+        EpochGuard(const CTxMemPool& poolIn);
+        ~EpochGuard();
+    };
+
+    /** Marks the entry as visited by the current traversal. Returns false if it already was. */
+    bool MarkVisited(txiter it) const
+    {
+        assert(fHasEpochGuard);
+        if (it->nEpoch == nEpoch)
+            return false;
+        it->nEpoch = nEpoch;
+        return true;
+    }
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, vecEntries, CompareIteratorByHash> cacheMap;
+
+    /** Changes to the ancestor state of an entry, summed up to modify it once */
+    struct AncestorDelta
+    {
+        int64_t nSize;
+        CAmount nFee;
+        int64_t nCount;
+        int64_t nSigOpCost;
+
+        AncestorDelta() : nSize(0), nFee(0), nCount(0), nSigOpCost(0) {}
+    };
+    typedef std::map<txiter, AncestorDelta, CompareIteratorByHash> ancestorDeltaMap;
 
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        vecEntries parents;
+        vecEntries children;
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash, NodeAllocator<std::pair<const txiter, TxLinks> > > txlinksMap;
     txlinksMap mapLinks;
 
-    typedef std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> addressDeltaMap;
+    typedef std::pair<uint160, int> addressKey;
+
+    struct AddressKeyHasher
+    {
+        size_t operator()(const addressKey& key) const { return ReadLE64(key.first.begin()) ^ (size_t)key.second; }
+    };
+
+    /** Deltas per (address hash, type). Vectors that may be referenced by a
+     *  snapshot are copied before they are changed. */
+    typedef boost::unordered_map<addressKey, std::shared_ptr<CMempoolAddressDeltaVector>, AddressKeyHasher> addressDeltaMap;
     addressDeltaMap mapAddress;
 
-    typedef std::map<uint256, std::vector<CMempoolAddressDeltaKey> > addressDeltaMapInserted;
-	
+    /** Addresses touched by each transaction in the address index */
+    typedef std::map<uint256, std::vector<addressKey> > addressDeltaMapInserted;
     addressDeltaMapInserted mapAddressInserted;
 
-    typedef std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpentIndex;
+    /** Get the deltas of an address for modification, unsharing them from any snapshot */
+    CMempoolAddressDeltaVector& GetAddressDeltasForWrite(const addressKey& key);
+
+    typedef std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare, NodeAllocator<std::pair<const CSpentIndexKey, CSpentIndexValue> > > mapSpentIndex;
     mapSpentIndex mapSpent;
 
     typedef std::map<uint256, std::vector<CSpentIndexKey> > mapSpentIndexInserted;
@@ -580,11 +693,13 @@ private:
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
+    /** Add it to or remove it from a sorted parent or child list */
+    void UpdateLink(vecEntries &links, txiter it, bool add);
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
-    indirectmap<COutPoint, const CTransaction*> mapNextTx;
+    indirectmap<COutPoint, const CTransaction*, NodeAllocator<std::pair<const COutPoint* const, const CTransaction*> > > mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
     /** Create a new CTxMemPool.
@@ -611,17 +726,22 @@ public:
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate = true);
 
-    void addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
+    void addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, CMempoolAddressDeltaVector *pdeltas = NULL);
     bool getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                          std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results);
-    bool removeAddressIndex(const uint256 txhash);
+    /** Get a snapshot of the deltas of each address that has any, holding cs only for the lookups */
+    bool getAddressIndexSnapshots(const std::vector<std::pair<uint160, int> > &addresses,
+                                  std::vector<CMempoolAddressDeltaSnapshot> &snapshots);
+    /** Remove the address deltas of a transaction, appending them to pdeltas if given */
+    bool removeAddressIndex(const uint256 txhash, CMempoolAddressDeltaVector *pdeltas = NULL);
 
 	
-    void addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
+    void addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > *pspent = NULL);
     bool getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
-    bool removeSpentIndex(const uint256 txhash);
+    /** Remove the spent index entries of a transaction, appending them to pspent if given */
+    bool removeSpentIndex(const uint256 txhash, std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > *pspent = NULL);
 
-    void removeRecursive(const CTransaction &tx, std::list<CTransaction>& removed);
+    void removeRecursive(const CTransaction &tx, std::list<CTransaction>& removed, MemPoolRemovalReason reason = MEMPOOL_REMOVE_UNKNOWN);
     void removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
@@ -651,8 +771,9 @@ public:
      *  in a block.
      *  Set updateDescendants to true when removing a tx that was in a block, so
      *  that any in-mempool descendants have their ancestor state updated.
+     *  The reason is passed on to removeUnchecked.
      */
-    void RemoveStaged(setEntries &stage, bool updateDescendants);
+    void RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason = MEMPOOL_REMOVE_UNKNOWN);
 
     /** When adding transactions from a disconnected block back to the mempool,
      *  new mempool entries may have children in the mempool (which is generally
@@ -744,8 +865,14 @@ public:
     bool ReadFeeEstimates(CAutoFile& filein);
 
     size_t DynamicMemoryUsage() const;
+    TxMempoolUsage GetMemoryUsage() const;
 
 private:
+    /** Memory used by the empty pool, which no eviction frees; left out of GetMemoryUsage() totals */
+    TxMempoolUsage usageEmpty;
+
+    TxMempoolUsage GetMemoryUsageWithFixed() const;
+
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
      *  the descendants for a single transaction that has been added to the
      *  mempool but may have child transactions in the mempool, eg during a
@@ -758,10 +885,15 @@ private:
      *  cachedDescendants will be updated with the descendants of the transaction
      *  being updated, so that future invocations don't need to walk the
      *  same transaction again, if encountered in another transaction chain.
+     *
+     *  The ancestor state of the descendants is not modified, but added to
+     *  ancestorDeltas, so that the caller modifies each descendant once for
+     *  all the transactions of a block.
      */
     void UpdateForDescendants(txiter updateIt,
             cacheMap &cachedDescendants,
-            const std::set<uint256> &setExclude);
+            const std::set<uint256> &setExclude,
+            ancestorDeltaMap &ancestorDeltas);
     /** Update ancestors of hash to add/remove it as a descendant transaction. */
     void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
     /** Set ancestor state for an entry */
@@ -780,8 +912,11 @@ private:
      *  given transaction that is removed, so we can't remove intermediate
      *  transactions in a chain before we've updated all the state for the
      *  removal.
+     *  Unless the transaction was included in a block, whose connection is
+     *  announced on its own, the removal of its address and spent index
+     *  records is announced with the reason.
      */
-    void removeUnchecked(txiter entry);
+    void removeUnchecked(txiter entry, MemPoolRemovalReason reason = MEMPOOL_REMOVE_UNKNOWN);
 };
 
 /** 
@@ -5,6 +5,10 @@
 
 #include "validationinterface.h"
 
+#include "coins.h"
+
+#include <boost/bind.hpp>
+
 static CMainSignals g_signals;
 
 CMainSignals& GetMainSignals()
@@ -22,9 +26,13 @@ void RegisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.BlockChecked.connect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
     g_signals.ScriptForMining.connect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
     g_signals.BlockFound.connect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
+    g_signals.AddressIndexUpdated.connect(boost::bind(&CValidationInterface::AddressIndexUpdated, pwalletIn, _1, _2, _3));
+    g_signals.SpentIndexUpdated.connect(boost::bind(&CValidationInterface::SpentIndexUpdated, pwalletIn, _1, _2, _3));
 }
 
 void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
+    g_signals.SpentIndexUpdated.disconnect(boost::bind(&CValidationInterface::SpentIndexUpdated, pwalletIn, _1, _2, _3));
+    g_signals.AddressIndexUpdated.disconnect(boost::bind(&CValidationInterface::AddressIndexUpdated, pwalletIn, _1, _2, _3));
     g_signals.BlockFound.disconnect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
     g_signals.ScriptForMining.disconnect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
     g_signals.BlockChecked.disconnect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
@@ -37,6 +45,8 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
 }
 
 void UnregisterAllValidationInterfaces() {
+    g_signals.SpentIndexUpdated.disconnect_all_slots();
+    g_signals.AddressIndexUpdated.disconnect_all_slots();
     g_signals.BlockFound.disconnect_all_slots();
     g_signals.ScriptForMining.disconnect_all_slots();
     g_signals.BlockChecked.disconnect_all_slots();
@@ -6,19 +6,41 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include "amount.h"
+
+#include <utility>
+#include <vector>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/shared_ptr.hpp>
 
+struct CAddressIndexKey;
 class CBlock;
 class CBlockIndex;
 struct CBlockLocator;
 class CBlockIndex;
 class CReserveScript;
+struct CSpentIndexKey;
+struct CSpentIndexValue;
 class CTransaction;
 class CValidationInterface;
 class CValidationState;
 class uint256;
 
+/** What changed the address and spent index records of a notification */
+enum IndexUpdateSource {
+    INDEX_UPDATE_MEMPOOL = 0,           //! A transaction entered the mempool
+    INDEX_UPDATE_CONNECT = 1,           //! A block was connected
+    INDEX_UPDATE_DISCONNECT = 2,        //! A block was disconnected
+    // A transaction left the mempool without being mined, for the reason given
+    INDEX_UPDATE_REMOVED_CONFLICT = 3,  //! It conflicted with a block transaction
+    INDEX_UPDATE_REMOVED_EXPIRY = 4,    //! It expired
+    INDEX_UPDATE_REMOVED_SIZELIMIT = 5, //! It was evicted to limit the mempool size
+    INDEX_UPDATE_REMOVED_REPLACED = 6,  //! It was replaced
+    INDEX_UPDATE_REMOVED_REORG = 7,     //! It is no longer valid after a reorganization
+    INDEX_UPDATE_REMOVED_OTHER = 8,     //! Any other reason
+};
+
 // These functions dispatch to one or all registered wallets
 
 /** Register a wallet to receive updates from core */
@@ -41,6 +63,8 @@ protected:
     virtual void BlockChecked(const CBlock&, const CValidationState&) {}
     virtual void GetScriptForMining(boost::shared_ptr<CReserveScript>&) {};
     virtual void ResetRequestCount(const uint256 &hash) {};
+    virtual void AddressIndexUpdated(const CBlockIndex *pindex, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vDeltas, IndexUpdateSource source) {}
+    virtual void SpentIndexUpdated(const CBlockIndex *pindex, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vSpent, IndexUpdateSource source) {}
     friend void ::RegisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterAllValidationInterfaces();
@@ -65,6 +89,14 @@ struct CMainSignals {
     boost::signals2::signal<void (boost::shared_ptr<CReserveScript>&)> ScriptForMining;
     /** Notifies listeners that a block has been successfully mined */
     boost::signals2::signal<void (const uint256 &)> BlockFound;
+    /** Notifies listeners of the address index deltas of a block once it is connected to or
+     *  disconnected from the tip, or of a transaction that entered or left the mempool
+     *  (pindex is NULL). */
+    boost::signals2::signal<void (const CBlockIndex *, const std::vector<std::pair<CAddressIndexKey, CAmount> > &, IndexUpdateSource)> AddressIndexUpdated;
+    /** Notifies listeners of the outputs spent by a block once it is connected to or
+     *  disconnected from the tip, or by a transaction that entered or left the mempool
+     *  (pindex is NULL). */
+    boost::signals2::signal<void (const CBlockIndex *, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &, IndexUpdateSource)> SpentIndexUpdated;
 };
 
 CMainSignals& GetMainSignals();
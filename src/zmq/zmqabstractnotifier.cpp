@@ -20,3 +20,13 @@ bool CZMQAbstractNotifier::NotifyTransaction(const CTransaction &/*transaction*/
 {
     return true;
 }
+
+bool CZMQAbstractNotifier::NotifyAddressDeltas(const CBlockIndex * /*pindex*/, const std::vector<std::pair<CAddressIndexKey, CAmount> > &/*vDeltas*/, IndexUpdateSource /*source*/)
+{
+    return true;
+}
+
+bool CZMQAbstractNotifier::NotifySpent(const CBlockIndex * /*pindex*/, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &/*vSpent*/, IndexUpdateSource /*source*/)
+{
+    return true;
+}
@@ -6,8 +6,16 @@
 #define BITCOIN_ZMQ_ZMQABSTRACTNOTIFIER_H
 
 #include "zmqconfig.h"
+#include "amount.h"
+#include "validationinterface.h"
 
+#include <utility>
+#include <vector>
+
+struct CAddressIndexKey;
 class CBlockIndex;
+struct CSpentIndexKey;
+struct CSpentIndexValue;
 class CZMQAbstractNotifier;
 
 typedef CZMQAbstractNotifier* (*CZMQNotifierFactory)();
@@ -34,6 +42,8 @@ public:
 
     virtual bool NotifyBlock(const CBlockIndex *pindex);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    virtual bool NotifyAddressDeltas(const CBlockIndex *pindex, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vDeltas, IndexUpdateSource source);
+    virtual bool NotifySpent(const CBlockIndex *pindex, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vSpent, IndexUpdateSource source);
 
 protected:
     void *psocket;
@@ -26,6 +26,8 @@ protected:
     // CValidationInterface
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, const CBlock* pblock);
     void UpdatedBlockTip(const CBlockIndex *pindex);
+    void AddressIndexUpdated(const CBlockIndex *pindex, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vDeltas, IndexUpdateSource source);
+    void SpentIndexUpdated(const CBlockIndex *pindex, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vSpent, IndexUpdateSource source);
 
 private:
     CZMQNotificationInterface();
@@ -13,6 +13,8 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_ADDRESSDELTA = "addressdelta";
+static const char *MSG_SPENT     = "spent";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -189,3 +191,56 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+// Common header of the addressdelta and spent bodies, starting with the IndexUpdateSource
+static void WriteIndexEventHeader(CDataStream &ss, const CBlockIndex *pindex, IndexUpdateSource source, size_t nRecords)
+{
+    ss << (uint8_t)source;
+    ss << (int32_t)(pindex ? pindex->nHeight : -1);
+    ss << (pindex ? pindex->GetBlockHash() : uint256());
+    ss << (uint32_t)nRecords;
+}
+
+bool CZMQPublishAddressDeltaNotifier::NotifyAddressDeltas(const CBlockIndex *pindex, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vDeltas, IndexUpdateSource source)
+{
+    if (vDeltas.empty())
+        return true;
+
+    LogPrint("zmq", "zmq: Publish addressdelta %s (%u deltas)\n", pindex ? pindex->GetBlockHash().GetHex() : "mempool", vDeltas.size());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(45 + vDeltas.size() * 66);
+    WriteIndexEventHeader(ss, pindex, source, vDeltas.size());
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vDeltas.begin(); it != vDeltas.end(); ++it) {
+        const CAddressIndexKey &key = it->first;
+        ss << (uint8_t)key.type;
+        ss << key.hashBytes;
+        ss << key.txhash;
+        ss << (uint32_t)key.index;
+        ss << (uint8_t)key.spending;
+        ss << it->second;
+    }
+    return SendMessage(MSG_ADDRESSDELTA, &(*ss.begin()), ss.size());
+}
+
+bool CZMQPublishSpentNotifier::NotifySpent(const CBlockIndex *pindex, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vSpent, IndexUpdateSource source)
+{
+    if (vSpent.empty())
+        return true;
+
+    LogPrint("zmq", "zmq: Publish spent %s (%u outputs)\n", pindex ? pindex->GetBlockHash().GetHex() : "mempool", vSpent.size());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(45 + vSpent.size() * 101);
+    WriteIndexEventHeader(ss, pindex, source, vSpent.size());
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = vSpent.begin(); it != vSpent.end(); ++it) {
+        // Disconnected blocks carry an empty value: the output is unspent again
+        const CSpentIndexValue &value = it->second;
+        ss << it->first.txid;
+        ss << (uint32_t)it->first.outputIndex;
+        ss << value.txid;
+        ss << (uint32_t)value.inputIndex;
+        ss << value.satoshis;
+        ss << (uint8_t)value.addressType;
+        ss << value.addressHash;
+    }
+    return SendMessage(MSG_SPENT, &(*ss.begin()), ss.size());
+}
@@ -15,6 +15,7 @@ private:
     uint32_t nSequence; //! upcounting per message sequence number
 
 public:
+    CZMQAbstractPublishNotifier() : nSequence(0) { }
 
     /* send zmq multipart message
        parts:
@@ -52,4 +53,16 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+class CZMQPublishAddressDeltaNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyAddressDeltas(const CBlockIndex *pindex, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vDeltas, IndexUpdateSource source);
+};
+
+class CZMQPublishSpentNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifySpent(const CBlockIndex *pindex, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vSpent, IndexUpdateSource source);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H